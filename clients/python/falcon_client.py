@@ -0,0 +1,105 @@
+# Connection helpers for the falcon daemon.
+#
+# The daemon exposes two endpoints:
+#  - a TCP port speaking the framed binary protocol (the daemon runs a
+#    non-blocking thrift server there, which requires the framed transport);
+#  - a unix-domain socket in the .falcon directory of the working directory,
+#    speaking the compact protocol. No TCP handshake, no frame overhead: this
+#    is the endpoint latency-sensitive callers should use.
+#
+# One-shot callers use connect(); long-lived callers (editor save-hooks,
+# status bars) use FalconClient, which keeps one connection open across calls
+# and reconnects transparently when the daemon restarts.
+
+import os
+
+from thrift import Thrift
+from thrift.transport import TSocket
+from thrift.transport import TTransport
+from thrift.protocol import TBinaryProtocol
+from thrift.protocol import TCompactProtocol
+import FalconService
+
+DEFAULT_HOST = "localhost"
+DEFAULT_PORT = 4242
+
+COMMAND_SOCKET = os.path.join(".falcon", "command.sock")
+
+
+def connect(host=DEFAULT_HOST, port=DEFAULT_PORT):
+  """Connect to the falcon daemon, preferring the unix-domain socket of the
+  current working directory over TCP. Throws a Thrift.TException if the
+  daemon is not reachable. Returns (transport, client)."""
+  if os.path.exists(COMMAND_SOCKET):
+    try:
+      transport = TTransport.TBufferedTransport(
+          TSocket.TSocket(unix_socket=COMMAND_SOCKET))
+      client = FalconService.Client(
+          TCompactProtocol.TCompactProtocol(transport))
+      transport.open()
+      return (transport, client)
+    except Thrift.TException:
+      # Stale socket file of a dead daemon: fall back to TCP, which gives
+      # the caller the usual connection-refused behavior.
+      pass
+  transport = TTransport.TFramedTransport(TSocket.TSocket(host, port))
+  client = FalconService.Client(TBinaryProtocol.TBinaryProtocol(transport))
+  transport.open()
+  return (transport, client)
+
+
+class FalconClient(object):
+  """Persistent connection to the daemon.
+
+  Exposes every FalconService method (getStatus, getDirtySources, ...) by
+  delegation. The connection is opened on the first call and kept open; a
+  call that fails at the transport level is retried once on a fresh
+  connection, so a daemon restart costs one failed call, not a wedged
+  client. Service-level exceptions (TargetNotFound, ...) pass through.
+
+  Usable as a context manager:
+
+    with FalconClient() as falcon:
+      print falcon.getStatus()
+  """
+
+  def __init__(self, host=DEFAULT_HOST, port=DEFAULT_PORT):
+    self._host = host
+    self._port = port
+    self._transport = None
+    self._client = None
+
+  def close(self):
+    if self._transport is not None:
+      try:
+        self._transport.close()
+      except Thrift.TException:
+        pass
+      self._transport = None
+      self._client = None
+
+  def _connect(self):
+    if self._client is None:
+      (self._transport, self._client) = connect(self._host, self._port)
+
+  def __getattr__(self, name):
+    if name.startswith('_'):
+      raise AttributeError(name)
+    def call(*args):
+      self._connect()
+      try:
+        return getattr(self._client, name)(*args)
+      except (Thrift.TApplicationException, TTransport.TTransportException,
+              IOError):
+        # The daemon went away; reconnect and retry once.
+        self.close()
+        self._connect()
+        return getattr(self._client, name)(*args)
+    return call
+
+  def __enter__(self):
+    return self
+
+  def __exit__(self, exc_type, exc_value, traceback):
+    self.close()
+    return False
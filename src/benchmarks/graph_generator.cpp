@@ -0,0 +1,84 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "benchmarks/graph_generator.h"
+
+#include "fs.h"
+
+namespace falcon {
+
+static std::string sourcePath(std::size_t i) {
+  return "src/" + std::to_string(i) + ".c";
+}
+
+static std::string objectPath(std::size_t i) {
+  return "obj/" + std::to_string(i) + ".o";
+}
+
+std::string generateGraphJson(GraphGeneratorParams const& params) {
+  std::mt19937 rng(params.seed);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+  std::ostringstream oss;
+  oss << "{\n  \"rules\": [\n";
+
+  std::size_t window = params.fanIn * params.fanOut;
+  if (window == 0) {
+    window = 1;
+  }
+
+  for (std::size_t i = 0; i < params.numRules; ++i) {
+    oss << "    {\n      \"inputs\": [ \"" << sourcePath(i) << "\"";
+    /* The shared inputs model headers: drawn from the most recent outputs,
+     * so every output feeds roughly fanOut consumers. */
+    for (std::size_t k = 1; k < params.fanIn && i > 0; ++k) {
+      std::size_t span = std::min(i, window);
+      std::size_t pick = i - 1 - (rng() % span);
+      oss << ", \"" << objectPath(pick) << "\"";
+    }
+    oss << " ],\n";
+    oss << "      \"outputs\": [ \"" << objectPath(i) << "\" ],\n";
+    if (uniform(rng) < params.depfileDensity) {
+      oss << "      \"depfile\": \"" << objectPath(i) << ".d\",\n";
+    }
+    oss << "      \"cmd\": \"gen " << i << "\"\n    },\n";
+  }
+
+  /* The aggregate rule, so the graph has a single root like a link step. */
+  oss << "    {\n      \"inputs\": [ ";
+  for (std::size_t i = 0; i < params.numRules; ++i) {
+    if (i > 0) {
+      oss << ", ";
+    }
+    oss << "\"" << objectPath(i) << "\"";
+  }
+  oss << " ],\n";
+  oss << "      \"outputs\": [ \"all\" ],\n";
+  oss << "      \"cmd\": \"link\"\n    }\n";
+
+  oss << "  ]\n}\n";
+  return oss.str();
+}
+
+bool createGraphSources(GraphGeneratorParams const& params) {
+  for (std::size_t i = 0; i < params.numRules; ++i) {
+    std::string path = sourcePath(i);
+    if (!fs::createPath(path)) {
+      return false;
+    }
+    std::ofstream ofs(path, std::ios::out | std::ios::trunc);
+    ofs << "/* synthetic source " << i << " */\n";
+    if (!ofs.good()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace falcon
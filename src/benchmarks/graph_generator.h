@@ -0,0 +1,50 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_BENCHMARKS_GRAPH_GENERATOR_H_
+#define FALCON_BENCHMARKS_GRAPH_GENERATOR_H_
+
+#include <cstddef>
+#include <string>
+
+namespace falcon {
+
+/**
+ * Parameters of a synthetic build graph, shaped like a typical compile and
+ * link job: one source and one object file per rule, headers shared between
+ * neighbouring rules, and a final rule aggregating every object.
+ */
+struct GraphGeneratorParams {
+  /** Number of compile rules (the aggregate rule comes on top). */
+  std::size_t numRules;
+  /** Average number of inputs per rule: its own source plus fanIn - 1
+   * inputs shared with other rules. */
+  std::size_t fanIn;
+  /** How widely the shared inputs are reused: each one is drawn from the
+   * fanIn * fanOut most recent outputs. */
+  std::size_t fanOut;
+  /** Fraction of the rules that declare a depfile, in [0, 1]. */
+  double depfileDensity;
+  /** Seed of the generator, so runs are reproducible. */
+  unsigned int seed;
+
+  GraphGeneratorParams()
+      : numRules(10000), fanIn(3), fanOut(2), depfileDensity(0.5),
+        seed(42) {}
+};
+
+/** Generate the JSON graph description, in the format parsed by
+ * GraphParser. */
+std::string generateGraphJson(GraphGeneratorParams const& params);
+
+/** Create the source files the generated graph refers to, relative to the
+ * current directory, so that a dependency scan stats and hashes real
+ * files.
+ * @return false if a file could not be created. */
+bool createGraphSources(GraphGeneratorParams const& params);
+
+} // namespace falcon
+
+#endif // FALCON_BENCHMARKS_GRAPH_GENERATOR_H_
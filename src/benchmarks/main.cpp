@@ -0,0 +1,183 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+/*
+ * Microbenchmarks of the daemon's hot paths, over a synthetic graph (see
+ * graph_generator.h). Each benchmark reports its throughput and the peak
+ * RSS of the process so far, so optimizations land with before/after
+ * numbers:
+ *
+ *   falcon-bench [numRules] [fanIn] [fanOut] [depfileDensity]
+ *
+ * The suite runs in a scratch directory under /tmp with real source files,
+ * so the dependency scan exercises the same stat/hash path as a daemon
+ * startup.
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "benchmarks/graph_generator.h"
+
+#include "build_plan.h"
+#include "cache_fs.h"
+#include "graph.h"
+#include "graph_dependency_scan.h"
+#include "graphparser.h"
+#include "hash_engine.h"
+#include "logging.h"
+
+using namespace falcon;
+
+/** Cache key of the i-th synthetic entry. */
+static std::string entryHash(std::size_t i) {
+  HashEngine engine;
+  std::string key = "entry-" + std::to_string(i);
+  engine.update(key.data(), key.size());
+  HashDigest digest;
+  engine.final(&digest);
+  return digest.toHex();
+}
+
+/** Peak RSS of the process, in MiB. */
+static std::size_t peakRssMb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  /* ru_maxrss is in KiB on Linux. */
+  return static_cast<std::size_t>(usage.ru_maxrss) / 1024;
+}
+
+/** Run the workload, then report "<ops> <unit> in <s>: <ops/sec>". */
+static void benchmark(const char* name, std::size_t ops, const char* unit,
+                      std::function<void()> workload) {
+  auto start = std::chrono::steady_clock::now();
+  workload();
+  double seconds = std::chrono::duration_cast<std::chrono::duration<double>>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::cout << name << ": " << ops << " " << unit << " in " << seconds
+            << "s = " << static_cast<std::size_t>(ops / seconds) << " "
+            << unit << "/s, peak rss " << peakRssMb() << " MiB" << std::endl;
+}
+
+int main(int argc, char** argv) {
+  GraphGeneratorParams params;
+  if (argc > 1) {
+    params.numRules = static_cast<std::size_t>(atoll(argv[1]));
+  }
+  if (argc > 2) {
+    params.fanIn = static_cast<std::size_t>(atoll(argv[2]));
+  }
+  if (argc > 3) {
+    params.fanOut = static_cast<std::size_t>(atoll(argv[3]));
+  }
+  if (argc > 4) {
+    params.depfileDensity = atof(argv[4]);
+  }
+
+  testlogging(argv[0]);
+
+  /* Work in a scratch directory so the scan stats real files and nothing
+   * of the checkout is touched. */
+  char dirTemplate[] = "/tmp/falcon-bench-XXXXXX";
+  char* dir = mkdtemp(dirTemplate);
+  if (dir == nullptr || chdir(dir) != 0) {
+    std::cerr << "could not set up the scratch directory" << std::endl;
+    return 1;
+  }
+  std::cout << "benchmarking in " << dir << " (" << params.numRules
+            << " rules, fan-in " << params.fanIn << ", fan-out "
+            << params.fanOut << ", depfile density "
+            << params.depfileDensity << ")" << std::endl;
+
+  std::string json = generateGraphJson(params);
+  std::string graphFile = std::string(dir) + "/makefile.json";
+  {
+    std::ofstream ofs(graphFile, std::ios::out | std::ios::trunc);
+    ofs << json;
+  }
+  if (!createGraphSources(params)) {
+    std::cerr << "could not create the source files" << std::endl;
+    return 1;
+  }
+
+  /* GraphParser load. */
+  std::unique_ptr<Graph> graph;
+  benchmark("parse", params.numRules, "rules", [&graphFile, &graph]() {
+    GraphParser parser(graphFile);
+    parser.processFile();
+    graph = parser.getGraph();
+  });
+
+  /* Dependency scan: stat and hash every source, compute every rule hash. */
+  benchmark("scan", graph->getNodes().size(), "nodes", [&graph]() {
+    GraphDependencyScan scanner(*graph, nullptr);
+    scanner.scan();
+  });
+
+  /* BuildPlan construction over the dirty rules (everything is dirty: no
+   * output exists yet). */
+  benchmark("plan", graph->getDirtyRules().size(), "rules", [&graph]() {
+    BuildPlan plan(graph->getDirtyRules());
+  });
+
+  /* markDirty propagation: reset the graph clean, then dirty every source
+   * and let the marks propagate through the parent chains. */
+  NodeArray sources;
+  for (auto it = graph->getNodes().begin(); it != graph->getNodes().end();
+       ++it) {
+    if (it->second->isSource()) {
+      sources.push_back(it->second);
+    }
+  }
+  auto& rules = graph->getRules();
+  for (auto it = graph->getNodes().begin(); it != graph->getNodes().end();
+       ++it) {
+    it->second->setState(State::UP_TO_DATE);
+  }
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    (*it)->setState(State::UP_TO_DATE);
+  }
+  benchmark("markDirty", sources.size(), "sources", [&sources]() {
+    for (auto it = sources.begin(); it != sources.end(); ++it) {
+      (*it)->markDirty();
+    }
+  });
+
+  /* CacheFS throughput: store and restore one entry per rule. */
+  {
+    static const std::size_t kEntryBytes = 16 << 10;
+    std::string content(kEntryBytes, 'x');
+    CacheFS cache(std::string(dir) + "/cache");
+    std::vector<std::string> hashes;
+    hashes.reserve(params.numRules);
+    for (std::size_t i = 0; i < params.numRules; ++i) {
+      hashes.push_back(entryHash(i));
+    }
+    benchmark("cache write", params.numRules, "entries",
+              [&cache, &hashes, &content]() {
+      for (auto it = hashes.begin(); it != hashes.end(); ++it) {
+        cache.writeEntryBuffer(*it, content);
+      }
+    });
+    std::string restored = std::string(dir) + "/restored";
+    benchmark("cache read", params.numRules, "entries",
+              [&cache, &hashes, &restored]() {
+      for (auto it = hashes.begin(); it != hashes.end(); ++it) {
+        cache.readEntry(*it, restored);
+      }
+    });
+  }
+
+  return 0;
+}
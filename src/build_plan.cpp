@@ -3,21 +3,54 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
 #include <cassert>
 
 #include "build_plan.h"
+#include "build_profiler.h"
+#include "build_tracer.h"
+#include "duration_cache.h"
 #include "logging.h"
 
 namespace falcon {
 
-BuildPlan::BuildPlan(NodeSet& targets) : numStarted_(0) {
+const std::size_t BuildPlan::kNumPriorityLevels;
+
+BuildPlan::BuildPlan(NodeSet& targets)
+  : readyCount_(0)
+  , numStarted_(0)
+  , profiler_(nullptr)
+  , tracer_(nullptr) {
   for (auto it = targets.begin(); it != targets.end(); ++it) {
     addTarget(*it);
   }
 
+  finalize();
+}
+
+BuildPlan::BuildPlan(RuleSet const& dirtyRules)
+  : rules_(dirtyRules)
+  , readyCount_(0)
+  , numStarted_(0)
+  , profiler_(nullptr)
+  , tracer_(nullptr) {
+  finalize();
+}
+
+void BuildPlan::finalize() {
+  buildPriorityLevels();
+
+  /* Now that the plan is complete and the levels are known, queue the rules
+   * that can start right away. */
+  for (auto it = rules_.begin(); it != rules_.end(); ++it) {
+    if ((*it)->ready()) {
+      enqueueReady(*it);
+    }
+  }
+
   /* If the build plan contains rules to build, we should have at least a rule
    * that is ready otherwise there is no starting point. */
-  assert(rules_.empty() || !readyRules_.empty());
+  assert(rules_.empty() || hasWork());
 }
 
 void BuildPlan::addTarget(Node* target) {
@@ -41,11 +74,7 @@ void BuildPlan::addTarget(Node* target) {
   assert(rule->isDirty());
   rules_.insert(rule);
 
-  if (rule->ready()) {
-    /* All the inputs are already built. */
-    assert(readyRules_.find(rule) == readyRules_.end());
-    readyRules_.insert(rule);
-  } else {
+  if (!rule->ready()) {
     /* Traverse the graph to add any other rule that will build the required
      * inputs. */
     auto& inputs = rule->getInputs();
@@ -55,24 +84,114 @@ void BuildPlan::addTarget(Node* target) {
   }
 }
 
+std::uint64_t BuildPlan::computePriority(Rule* rule) {
+  auto itPriority = priorities_.find(rule);
+  if (itPriority != priorities_.end()) {
+    return itPriority->second;
+  }
+
+  /* The longest critical path among the rules of the plan that consume an
+   * output of this rule. The graph is a DAG so the recursion terminates. */
+  std::uint64_t longestDownstream = 0;
+  auto& outputs = rule->getOutputs();
+  for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+    auto& parentRules = (*it)->getParents();
+    for (auto it2 = parentRules.begin(); it2 != parentRules.end(); ++it2) {
+      if (rules_.find(*it2) != rules_.end()) {
+        std::uint64_t p = computePriority(*it2);
+        if (p > longestDownstream) {
+          longestDownstream = p;
+        }
+      }
+    }
+  }
+
+  std::uint64_t duration = 0;
+  if (!rule->isPhony() && !rule->getOutputs().empty()) {
+    duration = getDurationCache().get(rule->getOutputs().front()->getPath());
+  }
+
+  std::uint64_t priority = duration + longestDownstream;
+  priorities_[rule] = priority;
+  return priority;
+}
+
+void BuildPlan::buildPriorityLevels() {
+  /* Rank the rules by decreasing critical path length and spread them evenly
+   * over the priority levels: the rank is exact, the level is the quantized
+   * scheduling key. */
+  std::vector<Rule*> ranked(rules_.begin(), rules_.end());
+  for (auto it = ranked.begin(); it != ranked.end(); ++it) {
+    computePriority(*it);
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [this](Rule* lhs, Rule* rhs) {
+              return priorities_[lhs] > priorities_[rhs];
+            });
+
+  std::size_t numLevels = std::min(kNumPriorityLevels, ranked.size());
+  std::vector<std::size_t> levelSizes(numLevels, 0);
+  entries_.reserve(ranked.size());
+  for (std::size_t rank = 0; rank < ranked.size(); ++rank) {
+    std::size_t level = rank * numLevels / ranked.size();
+    PlanEntry& entry = entries_[ranked[rank]];
+    entry.level = level;
+    levelSizes[level]++;
+  }
+
+  readyQueues_.reserve(numLevels);
+  for (std::size_t level = 0; level < numLevels; ++level) {
+    readyQueues_.push_back(std::unique_ptr<MpmcQueue<Rule*>>(
+        new MpmcQueue<Rule*>(levelSizes[level])));
+  }
+}
+
+void BuildPlan::enqueueReady(Rule* rule) {
+  /* A rule stays ready once it becomes ready, so it is enough to queue it the
+   * first time. notifyRuleBuilt can see the same rule several times, possibly
+   * from several threads, when the rule consumes several freshly built
+   * outputs. */
+  auto it = entries_.find(rule);
+  assert(it != entries_.end());
+  if (!it->second.queued.exchange(true, std::memory_order_acq_rel)) {
+    if (profiler_) {
+      profiler_->ruleReady(rule);
+    }
+    if (tracer_) {
+      tracer_->ruleReady(rule);
+    }
+    bool pushed = readyQueues_[it->second.level]->tryPush(rule);
+    /* The queue is sized for all the rules of its level and each rule is
+     * pushed once: the push can not fail. */
+    assert(pushed);
+    (void)pushed;
+    readyCount_.fetch_add(1, std::memory_order_release);
+  }
+}
+
 Rule* BuildPlan::findWork() {
-  if (readyRules_.empty()) {
+  if (!hasWork()) {
     /* We cannot build any rule. */
     return nullptr;
   }
-  auto itRule = readyRules_.begin();
-  Rule* rule = *itRule;
-  readyRules_.erase(itRule);
-  assert(rule);
-  numStarted_++;
 
-  return rule;
+  /* Drain the most urgent level first. */
+  for (auto it = readyQueues_.begin(); it != readyQueues_.end(); ++it) {
+    Rule* rule = nullptr;
+    if ((*it)->tryPop(&rule)) {
+      assert(rule);
+      readyCount_.fetch_sub(1, std::memory_order_release);
+      numStarted_.fetch_add(1, std::memory_order_release);
+      return rule;
+    }
+  }
+
+  /* Every ready rule was claimed by another thread in the meantime. */
+  return nullptr;
 }
 
 void BuildPlan::notifyRuleBuilt(Rule *rule) {
-  auto itRule = rules_.find(rule);
-  assert(readyRules_.find(rule) == readyRules_.end());
-  assert(itRule != rules_.end());
+  assert(rules_.find(rule) != rules_.end());
 
   /* Traverse the outputs to find any rule that became ready. */
   auto& outputs = rule->getOutputs();
@@ -80,9 +199,9 @@ void BuildPlan::notifyRuleBuilt(Rule *rule) {
     auto& parentRules = (*it)->getParents();
     for (auto it2 = parentRules.begin(); it2 != parentRules.end(); ++it2) {
       Rule *parentRule = *it2;
-      /* If the rule is ready and in the plan, add it to readyRules_. */
+      /* If the rule is ready and in the plan, queue it for findWork. */
       if (parentRule->ready() && rules_.find(parentRule) != rules_.end()) {
-        readyRules_.insert(parentRule);
+        enqueueReady(parentRule);
       }
     }
   }
@@ -6,10 +6,20 @@
 #ifndef FALCON_BUILD_PLAN_H_
 #define FALCON_BUILD_PLAN_H_
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
 #include "graph.h"
+#include "util/mpmc_queue.h"
 
 namespace falcon {
 
+class BuildProfiler;
+class BuildTracer;
+
 /**
  * BuildPlan is a class that maintains a list of rules we are planning to build.
  * It does not know how to build a rule, but it knows how to schedule them for
@@ -19,6 +29,11 @@ namespace falcon {
  * notifyRuleBuilt(). The build plan can then deduce new rules that are ready.
  * This goes on until there are no more rules to build.
  *
+ * Once constructed, a plan can be operated by several threads at once:
+ * findWork and notifyRuleBuilt only touch lock-free ready queues, atomic
+ * counters and read-only plan data, so dispatch and reaper threads never
+ * serialize on a mutex.
+ *
  * Usage:
  *
  * BuildPlan plan({ target1, target2, target3 });
@@ -41,10 +56,37 @@ class BuildPlan {
   BuildPlan(NodeSet& targets);
 
   /**
-   * Find a rule that is ready to be built.
-   * @return Rule that can be built. It is guaranteed that all its inputs are up
-   * to date. Once a rule is returned by findWork, it will be considered
-   * "building" and the user is expected to call notifyRuleBuilt() afterwards.
+   * Construct a build plan over an already known set of dirty rules, without
+   * walking the target closure. Used for build-everything requests: the
+   * graph's incrementally maintained dirty rule set (Graph::getDirtyRules)
+   * is exactly what a closure walk from the roots would collect, so the
+   * construction cost is proportional to the number of dirty rules.
+   */
+  explicit BuildPlan(RuleSet const& dirtyRules);
+
+  /**
+   * Attach a profiler that is told when a rule becomes ready, so that the
+   * queue wait of each rule can be measured. May be null (the default).
+   */
+  void setProfiler(BuildProfiler* profiler) { profiler_ = profiler; }
+
+  /**
+   * Attach a tracer that is told when a rule becomes ready, for the same
+   * reason. May be null (the default). See build_tracer.h.
+   */
+  void setTracer(BuildTracer* tracer) { tracer_ = tracer; }
+
+  /**
+   * Find a rule that is ready to be built. Ready rules are drained in
+   * decreasing critical path order (the sum of recorded durations along the
+   * longest chain of rules depending on them within the plan, see
+   * DurationCache), so that long-pole rules do not end up starting last. The
+   * ordering is quantized into kNumPriorityLevels levels: rules of the same
+   * level come out in FIFO order, which is what makes the queues lock-free.
+   * @return Rule that can be built, or nullptr if no rule is ready right now.
+   * It is guaranteed that all its inputs are up to date. Once a rule is
+   * returned by findWork, it will be considered "building" and the user is
+   * expected to call notifyRuleBuilt() afterwards.
    */
   Rule* findWork();
 
@@ -52,14 +94,18 @@ class BuildPlan {
    * Determine if we are ready to build more rules.
    * @return true if findWork would return a rule that is ready to be built.
    */
-  bool hasWork() const { return !readyRules_.empty(); }
+  bool hasWork() const {
+    return readyCount_.load(std::memory_order_acquire) > 0;
+  }
 
   /**
    * Determine if there are more rules to be built.
    * @return true if all rules have been returned by findWork. If this function
    * returns true, do not call findWork() as it will never return a rule.
    */
-  bool done() const { return numStarted_ == rules_.size(); }
+  bool done() const {
+    return numStarted_.load(std::memory_order_acquire) == rules_.size();
+  }
 
   /**
    * Notify that a rule has been built.
@@ -69,23 +115,82 @@ class BuildPlan {
 
  private:
 
+  /** Number of distinct scheduling priorities. Rules are ranked by critical
+   * path length and spread over this many lock-free FIFO queues. */
+  static const std::size_t kNumPriorityLevels = 64;
+
+  /** Per-rule scheduling data, read-only after the plan is constructed
+   * except for the queued flag. */
+  struct PlanEntry {
+    /** Priority level of the rule, 0 is the most urgent. */
+    std::size_t level;
+    /** Set when the rule has been pushed to its ready queue, so that it is
+     * queued exactly once. */
+    std::atomic<bool> queued;
+
+    PlanEntry() : level(0), queued(false) {}
+  };
+
   /**
    * Add a new target to be built.
    * @param target Target to be built.
    */
   void addTarget(Node* target);
 
-  /** All the rules that we need to build in the plan. */
+  /**
+   * Shared tail of the constructors: assign the priority levels and queue
+   * the rules that are ready right away.
+   */
+  void finalize();
+
+  /**
+   * Compute the critical path length of a rule: its own expected duration
+   * plus the longest critical path among the rules of the plan that consume
+   * its outputs. Memoized in priorities_. Only used while constructing the
+   * plan.
+   */
+  std::uint64_t computePriority(Rule* rule);
+
+  /**
+   * Assign a priority level to every rule of the plan and size the ready
+   * queues.
+   */
+  void buildPriorityLevels();
+
+  /**
+   * Queue a ready rule for findWork, at most once per rule. Thread safe.
+   */
+  void enqueueReady(Rule* rule);
+
+  /** All the rules that we need to build in the plan. Read-only once the
+   * plan is constructed. */
   RuleSet rules_;
 
-  /** Set of rules that are ready to be built, ie all their inputs are up to
-   * date. */
-  RuleSet readyRules_;
+  /** Critical path length of each rule of the plan, in milliseconds. Only
+   * used while constructing the plan. */
+  std::unordered_map<Rule*, std::uint64_t> priorities_;
+
+  /** Scheduling data of each rule of the plan. The map is read-only after
+   * construction; the entries contain the only mutable (atomic) bit. */
+  std::unordered_map<Rule*, PlanEntry> entries_;
+
+  /** One lock-free FIFO of ready rules per priority level. Each queue is
+   * sized for the rules of its level, so tryPush can not fail. */
+  std::vector<std::unique_ptr<MpmcQueue<Rule*>>> readyQueues_;
+
+  /** Number of rules currently sitting in the ready queues. */
+  std::atomic<std::size_t> readyCount_;
 
   /**
    * Number of rules that were returned by findWork().
    */
-  std::size_t numStarted_;
+  std::atomic<std::size_t> numStarted_;
+
+  /** Told when a rule becomes ready, see setProfiler. May be null. */
+  BuildProfiler* profiler_;
+
+  /** Told when a rule becomes ready, see setTracer. May be null. */
+  BuildTracer* tracer_;
 };
 
 } // namespace falcon
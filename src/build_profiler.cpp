@@ -0,0 +1,147 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <algorithm>
+#include <cassert>
+
+#include "build_profiler.h"
+
+namespace falcon {
+
+BuildProfiler::BuildProfiler()
+    : recording_(false), buildId_(0), hasProfile_(false) {}
+
+void BuildProfiler::startBuild(unsigned int buildId) {
+  std::lock_guard<std::mutex> g(mutex_);
+  recording_ = true;
+  buildId_ = buildId;
+  buildStart_ = std::chrono::steady_clock::now();
+  entries_.clear();
+}
+
+void BuildProfiler::ruleReady(Rule* rule) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  Entry& entry = entries_[rule];
+  if (!entry.hasReady) {
+    entry.hasReady = true;
+    entry.ready = now;
+  }
+}
+
+void BuildProfiler::ruleStarted(Rule* rule) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  entries_[rule].start = now;
+}
+
+void BuildProfiler::ruleFinished(Rule* rule, bool cacheHit) {
+  auto now = std::chrono::steady_clock::now();
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  Entry& entry = entries_[rule];
+  entry.end = now;
+  entry.finished = true;
+  entry.cacheHit = cacheHit;
+
+  /* Extend the realized critical path: every producer of this rule's inputs
+   * already completed, so their own path lengths are final. */
+  std::int64_t executionMs =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          entry.end - entry.start).count();
+  std::int64_t longestProducer = 0;
+  auto& inputs = rule->getInputs();
+  for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+    Rule* producer = (*it)->getChild();
+    if (producer == nullptr) {
+      continue;
+    }
+    auto itEntry = entries_.find(producer);
+    if (itEntry != entries_.end() && itEntry->second.finished
+        && itEntry->second.criticalPathMs > longestProducer) {
+      longestProducer = itEntry->second.criticalPathMs;
+      entry.criticalParent = producer;
+    }
+  }
+  entry.criticalPathMs = executionMs + longestProducer;
+}
+
+BuildProfiler::RuleTiming BuildProfiler::makeTiming(Rule* rule,
+                                                    Entry const& entry) const {
+  RuleTiming timing;
+  if (!rule->getOutputs().empty()) {
+    timing.output = rule->getOutputs().front()->getPath();
+  }
+  auto readyTime = entry.hasReady ? entry.ready : buildStart_;
+  timing.queueWaitMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      entry.start - readyTime).count();
+  timing.executionMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      entry.end - entry.start).count();
+  timing.cacheHit = entry.cacheHit;
+  return timing;
+}
+
+void BuildProfiler::endBuild() {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  recording_ = false;
+
+  last_ = Profile();
+  last_.buildId = buildId_;
+  last_.totalTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - buildStart_).count();
+
+  /* The rule the whole build waited for is the end of the realized critical
+   * path; walk the producer chain back from it. */
+  Rule* tail = nullptr;
+  std::int64_t longest = 0;
+  for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+    if (!it->second.finished) {
+      continue;
+    }
+    last_.rules.push_back(makeTiming(it->first, it->second));
+    if (it->second.criticalPathMs >= longest) {
+      longest = it->second.criticalPathMs;
+      tail = it->first;
+    }
+  }
+
+  std::sort(last_.rules.begin(), last_.rules.end(),
+            [](RuleTiming const& lhs, RuleTiming const& rhs) {
+              return lhs.executionMs > rhs.executionMs;
+            });
+
+  for (Rule* rule = tail; rule != nullptr;) {
+    auto it = entries_.find(rule);
+    assert(it != entries_.end());
+    last_.criticalPath.push_back(makeTiming(rule, it->second));
+    rule = it->second.criticalParent;
+  }
+  std::reverse(last_.criticalPath.begin(), last_.criticalPath.end());
+
+  entries_.clear();
+  hasProfile_ = true;
+}
+
+bool BuildProfiler::getLastProfile(Profile* profile) const {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!hasProfile_) {
+    return false;
+  }
+  *profile = last_;
+  return true;
+}
+
+} // namespace falcon
@@ -0,0 +1,124 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_BUILD_PROFILER_H_
+#define FALCON_BUILD_PROFILER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "graph.h"
+
+namespace falcon {
+
+/**
+ * BuildProfiler records where the time of a build went, so that the daemon
+ * can answer "what was slow" without re-running anything under a profiler.
+ *
+ * The builder reports three events per rule: when it became ready (all its
+ * inputs up to date), when its command was spawned and when it completed.
+ * From these the profiler derives the queue wait (ready to spawn) and
+ * execution time of every rule, and the realized critical path of the build:
+ * the chain of rules that actually determined the wall-clock time, computed
+ * from measured times, not from the estimates used for scheduling.
+ *
+ * The per-rule hooks are thread safe: the dispatcher shards and the
+ * post-processing workers all report to the same profiler. The profile of
+ * the last completed build is kept until the next one completes, see
+ * getLastProfile.
+ */
+class BuildProfiler {
+ public:
+  /** Timing of one rule, identified by its first output. */
+  struct RuleTiming {
+    std::string output;
+    /** Time between the rule becoming ready and its command starting. */
+    std::int64_t queueWaitMs;
+    /** Time between the command starting and completing. Near zero for a
+     * cache hit. */
+    std::int64_t executionMs;
+    /** Set if the outputs were restored from the cache instead of built. */
+    bool cacheHit;
+
+    RuleTiming() : queueWaitMs(0), executionMs(0), cacheHit(false) {}
+  };
+
+  /** Complete profile of one build. */
+  struct Profile {
+    unsigned int buildId;
+    std::int64_t totalTimeMs;
+    /** The realized critical path, in execution order. */
+    std::vector<RuleTiming> criticalPath;
+    /** Every rule that completed, by decreasing execution time. */
+    std::vector<RuleTiming> rules;
+
+    Profile() : buildId(0), totalTimeMs(0) {}
+  };
+
+  BuildProfiler();
+
+  /** Start recording a new build, discarding any recording in progress. */
+  void startBuild(unsigned int buildId);
+
+  /** Report that all the inputs of the rule are up to date. Only the first
+   * call per rule counts. */
+  void ruleReady(Rule* rule);
+
+  /** Report that the command of the rule was spawned (or its cache lookup
+   * started, or it was shipped to a peer). */
+  void ruleStarted(Rule* rule);
+
+  /** Report that the rule completed successfully. */
+  void ruleFinished(Rule* rule, bool cacheHit);
+
+  /** Finish the recording and make it available through getLastProfile. */
+  void endBuild();
+
+  /** Copy the profile of the last completed build.
+   * @return false if no build has completed yet. */
+  bool getLastProfile(Profile* profile) const;
+
+ private:
+  struct Entry {
+    std::chrono::steady_clock::time_point ready;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    bool hasReady;
+    bool finished;
+    bool cacheHit;
+    /** Realized critical path ending at this rule: its execution time plus
+     * the longest realized path among the rules that produced its inputs.
+     * Every producer completed before this rule started, so the value is
+     * final when the rule finishes. */
+    std::int64_t criticalPathMs;
+    /** Producer on the longest path, to reconstruct the chain. */
+    Rule* criticalParent;
+
+    Entry()
+        : hasReady(false), finished(false), cacheHit(false),
+          criticalPathMs(0), criticalParent(nullptr) {}
+  };
+
+  RuleTiming makeTiming(Rule* rule, Entry const& entry) const;
+
+  mutable std::mutex mutex_;
+  bool recording_;
+  unsigned int buildId_;
+  std::chrono::steady_clock::time_point buildStart_;
+  std::unordered_map<Rule*, Entry> entries_;
+
+  /** Profile of the last completed build, see endBuild. Only plain data:
+   * it stays valid across graph reloads. */
+  Profile last_;
+  bool hasProfile_;
+};
+
+} // namespace falcon
+
+#endif // FALCON_BUILD_PROFILER_H_
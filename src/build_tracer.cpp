@@ -0,0 +1,256 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <algorithm>
+#include <fstream>
+
+#include "build_tracer.h"
+
+#include "logging.h"
+
+namespace falcon {
+
+/** Tracks above this id are virtual job tracks; below are real threads. */
+static const unsigned int kJobTrackBase = 1000;
+
+BuildTracer::BuildTracer() : recording_(false), buildId_(0) {}
+
+void BuildTracer::setOutputDirectory(std::string const& dir) {
+  directory_ = dir;
+}
+
+void BuildTracer::startBuild(unsigned int buildId) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  recording_ = true;
+  buildId_ = buildId;
+  buildStart_ = now();
+  entries_.clear();
+  rules_.clear();
+  phases_.clear();
+  tracks_.clear();
+}
+
+std::int64_t BuildTracer::sinceStartUs(TimePoint tp) const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      tp - buildStart_).count();
+}
+
+unsigned int BuildTracer::threadTrack() {
+  auto it = tracks_.find(std::this_thread::get_id());
+  if (it != tracks_.end()) {
+    return it->second;
+  }
+  unsigned int track = static_cast<unsigned int>(tracks_.size()) + 1;
+  tracks_[std::this_thread::get_id()] = track;
+  return track;
+}
+
+void BuildTracer::ruleReady(Rule* rule) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  Entry& entry = entries_[rule];
+  if (entry.readyUs < 0) {
+    entry.readyUs = sinceStartUs(now());
+  }
+}
+
+void BuildTracer::ruleStarted(Rule* rule) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  entries_[rule].startUs = sinceStartUs(now());
+}
+
+void BuildTracer::ruleFinished(Rule* rule, bool cacheHit) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  auto it = entries_.find(rule);
+  if (it == entries_.end() || it->second.startUs < 0
+      || rule->getOutputs().empty()) {
+    return;
+  }
+  RuleSpan span;
+  span.output = rule->getOutputs().front()->getPath();
+  span.cat = cacheHit ? "cache" : "rule";
+  span.readyUs = it->second.readyUs;
+  span.startUs = it->second.startUs;
+  span.endUs = sinceStartUs(now());
+  rules_.push_back(std::move(span));
+  entries_.erase(it);
+}
+
+void BuildTracer::span(const char* name, Rule* rule,
+                       TimePoint start, TimePoint end) {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_ || rule->getOutputs().empty()) {
+    return;
+  }
+  PhaseSpan span;
+  span.name = name;
+  span.output = rule->getOutputs().front()->getPath();
+  span.track = threadTrack();
+  span.startUs = sinceStartUs(start);
+  span.durUs = std::chrono::duration_cast<std::chrono::microseconds>(
+      end - start).count();
+  phases_.push_back(std::move(span));
+}
+
+void BuildTracer::endBuild() {
+  if (!enabled()) {
+    return;
+  }
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!recording_) {
+    return;
+  }
+  recording_ = false;
+  writeTrace();
+  entries_.clear();
+  rules_.clear();
+  phases_.clear();
+  tracks_.clear();
+}
+
+/** Escape a string for inclusion in a JSON literal. Paths are mostly plain
+ * but a quote or backslash must not corrupt the file. */
+static std::string escapeJson(std::string const& str) {
+  std::string res;
+  res.reserve(str.size());
+  for (std::size_t i = 0; i < str.size(); ++i) {
+    char c = str[i];
+    if (c == '"' || c == '\\') {
+      res.push_back('\\');
+      res.push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      static const char hex[] = "0123456789abcdef";
+      res.append("\\u00");
+      res.push_back(hex[(c >> 4) & 0xf]);
+      res.push_back(hex[c & 0xf]);
+    } else {
+      res.push_back(c);
+    }
+  }
+  return res;
+}
+
+void BuildTracer::writeTrace() {
+  std::string path = directory_ + "/trace-" + std::to_string(buildId_)
+                   + ".json";
+  std::ofstream ofs(path, std::ios::out | std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "could not write build trace to " << path;
+    return;
+  }
+
+  /* Lay the execution spans out on virtual job tracks: each track holds
+   * non-overlapping spans, so chrome renders one row per concurrently
+   * running rule, like job slots. */
+  std::sort(rules_.begin(), rules_.end(),
+            [](RuleSpan const& a, RuleSpan const& b) {
+              return a.startUs < b.startUs;
+            });
+  std::vector<std::int64_t> trackEnd;
+  std::vector<unsigned int> ruleTrack(rules_.size());
+  for (std::size_t i = 0; i < rules_.size(); ++i) {
+    std::size_t track = 0;
+    for (; track < trackEnd.size(); ++track) {
+      if (trackEnd[track] <= rules_[i].startUs) {
+        break;
+      }
+    }
+    if (track == trackEnd.size()) {
+      trackEnd.push_back(0);
+    }
+    trackEnd[track] = rules_[i].endUs;
+    ruleTrack[i] = kJobTrackBase + static_cast<unsigned int>(track);
+  }
+
+  ofs << "{\"traceEvents\":[\n";
+  bool first = true;
+  auto sep = [&ofs, &first]() {
+    if (!first) {
+      ofs << ",\n";
+    }
+    first = false;
+  };
+
+  /* Name the tracks. */
+  for (std::size_t track = 0; track < trackEnd.size(); ++track) {
+    sep();
+    ofs << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << (kJobTrackBase + track)
+        << ",\"name\":\"thread_name\",\"args\":{\"name\":\"job "
+        << track << "\"}}";
+  }
+  for (auto it = tracks_.begin(); it != tracks_.end(); ++it) {
+    sep();
+    ofs << "{\"ph\":\"M\",\"pid\":1,\"tid\":" << it->second
+        << ",\"name\":\"thread_name\",\"args\":{\"name\":\"thread "
+        << it->second << "\"}}";
+  }
+
+  /* One execution span per rule, plus its queue wait as an async span:
+   * queue waits of concurrent rules overlap arbitrarily, which complete
+   * events on a track cannot express. */
+  for (std::size_t i = 0; i < rules_.size(); ++i) {
+    RuleSpan const& rule = rules_[i];
+    std::string output = escapeJson(rule.output);
+    sep();
+    ofs << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << ruleTrack[i]
+        << ",\"ts\":" << rule.startUs
+        << ",\"dur\":" << (rule.endUs - rule.startUs)
+        << ",\"cat\":\"" << rule.cat
+        << "\",\"name\":\"" << output << "\"}";
+    if (rule.readyUs >= 0 && rule.readyUs < rule.startUs) {
+      sep();
+      ofs << "{\"ph\":\"b\",\"pid\":1,\"tid\":" << ruleTrack[i]
+          << ",\"ts\":" << rule.readyUs
+          << ",\"cat\":\"queue\",\"id\":" << i
+          << ",\"name\":\"" << output << "\"}";
+      sep();
+      ofs << "{\"ph\":\"e\",\"pid\":1,\"tid\":" << ruleTrack[i]
+          << ",\"ts\":" << rule.startUs
+          << ",\"cat\":\"queue\",\"id\":" << i
+          << ",\"name\":\"" << output << "\"}";
+    }
+  }
+
+  for (auto it = phases_.begin(); it != phases_.end(); ++it) {
+    sep();
+    ofs << "{\"ph\":\"X\",\"pid\":1,\"tid\":" << it->track
+        << ",\"ts\":" << it->startUs
+        << ",\"dur\":" << it->durUs
+        << ",\"cat\":\"phase\",\"name\":\"" << it->name
+        << "\",\"args\":{\"output\":\"" << escapeJson(it->output) << "\"}}";
+  }
+
+  ofs << "\n]}\n";
+  if (!ofs.good()) {
+    LOG(ERROR) << "could not write build trace to " << path;
+    return;
+  }
+  LOG(INFO) << "build trace written to " << path;
+}
+
+} // namespace falcon
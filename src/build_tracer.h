@@ -0,0 +1,120 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_BUILD_TRACER_H_
+#define FALCON_BUILD_TRACER_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "graph.h"
+
+namespace falcon {
+
+/**
+ * BuildTracer records a timeline of one build and writes it as a Chrome
+ * trace-event JSON file (load it in chrome://tracing or Perfetto) into the
+ * falcon directory, one file per build id. Where the profiler aggregates
+ * (critical path, slowest rules), the tracer keeps every span, so scheduling
+ * gaps, queue waits and post-processing stalls are visible at a glance.
+ *
+ * Three kinds of events are recorded:
+ *  - one execution span per rule (from command start to completion), laid
+ *    out on virtual "job" tracks so that concurrent rules do not overlap;
+ *  - one queue-wait async span per rule (from ready to started);
+ *  - phase spans (spawn, depfile parse, hash recompute, cache save) on the
+ *    track of the thread that performed them.
+ *
+ * The tracer is disabled until setOutputDirectory is called; every hook is
+ * then thread safe and cheap (a push under a mutex). Disabled, the hooks
+ * are a null check. Toggled by the "trace" configuration option.
+ */
+class BuildTracer {
+ public:
+  typedef std::chrono::steady_clock::time_point TimePoint;
+
+  BuildTracer();
+
+  /** Enable the tracer; trace files are written in the given directory. */
+  void setOutputDirectory(std::string const& dir);
+
+  bool enabled() const { return !directory_.empty(); }
+
+  static TimePoint now() { return std::chrono::steady_clock::now(); }
+
+  /** Start recording a new build, discarding any recording in progress. */
+  void startBuild(unsigned int buildId);
+
+  /* Per-rule hooks, mirroring the profiler's. */
+  void ruleReady(Rule* rule);
+  void ruleStarted(Rule* rule);
+  void ruleFinished(Rule* rule, bool cacheHit);
+
+  /** Record a phase span (eg "depfile parse") on the calling thread's
+   * track. The rule names the span through its first output. */
+  void span(const char* name, Rule* rule, TimePoint start, TimePoint end);
+
+  /** Finish the recording and write the trace file. */
+  void endBuild();
+
+ private:
+  /** Execution span of one rule, placed on a virtual job track when the
+   * file is written. */
+  struct RuleSpan {
+    std::string output;
+    const char* cat;
+    std::int64_t readyUs;
+    std::int64_t startUs;
+    std::int64_t endUs;
+  };
+
+  /** A phase performed synchronously by one thread. */
+  struct PhaseSpan {
+    const char* name;
+    std::string output;
+    unsigned int track;
+    std::int64_t startUs;
+    std::int64_t durUs;
+  };
+
+  struct Entry {
+    std::int64_t readyUs;
+    std::int64_t startUs;
+
+    Entry() : readyUs(-1), startUs(-1) {}
+  };
+
+  /** Microseconds elapsed since the start of the build. */
+  std::int64_t sinceStartUs(TimePoint tp) const;
+
+  /** Small dense id of the calling thread. The caller must hold mutex_. */
+  unsigned int threadTrack();
+
+  /** Serialize the recording to <directory>/trace-<buildId>.json. The
+   * caller must hold mutex_. */
+  void writeTrace();
+
+  std::string directory_;
+
+  mutable std::mutex mutex_;
+  bool recording_;
+  unsigned int buildId_;
+  TimePoint buildStart_;
+
+  std::unordered_map<Rule*, Entry> entries_;
+  std::vector<RuleSpan> rules_;
+  std::vector<PhaseSpan> phases_;
+  std::map<std::thread::id, unsigned int> tracks_;
+};
+
+} // namespace falcon
+
+#endif // FALCON_BUILD_TRACER_H_
@@ -3,77 +3,817 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef FALCON_USE_ZSTD
+# include <zstd.h>
+#endif
 
 #include "cache_fs.h"
 
 #include "fs.h"
 #include "logging.h"
 
+/* Reflink ioctl, not exposed by older kernel headers. */
+#ifndef FICLONE
+# define FICLONE _IOW(0x94, 9, int)
+#endif
+
 namespace falcon {
 
+namespace {
+
+/**
+ * Transfer the content of src to dst at zero space cost when the kernel and
+ * the filesystem allow it. Tries, in order:
+ *  - FICLONE (reflink): shares the extents copy-on-write, safe against
+ *    in-place modification of either side;
+ *  - hardlink: pure metadata, same inode on both sides. The builder breaks
+ *    the link before a command rewrites its outputs (see fs::breakHardlink),
+ *    so the shared inode is never written through.
+ * @return false if neither applies, e.g. src and dst are on different
+ * filesystems.
+ */
+bool linkOrClone(const std::string& src, const std::string& dst) {
+  int srcFd = open(src.c_str(), O_RDONLY);
+  if (srcFd < 0) {
+    return false;
+  }
+
+  struct stat sb;
+  if (fstat(srcFd, &sb) != 0) {
+    close(srcFd);
+    return false;
+  }
+
+  /* Never write through an existing inode: it may be linked somewhere
+   * else. */
+  unlink(dst.c_str());
+
+  int dstFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+                   sb.st_mode & 0777);
+  if (dstFd < 0) {
+    close(srcFd);
+    return false;
+  }
+
+  if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+    close(srcFd);
+    close(dstFd);
+    return true;
+  }
+
+  close(srcFd);
+  close(dstFd);
+  unlink(dst.c_str());
+  return link(src.c_str(), dst.c_str()) == 0;
+}
+
+/**
+ * Transfer the content of src to dst. Tries the zero-space paths of
+ * linkOrClone first, then copy_file_range (in-kernel copy, no userspace
+ * buffer), then a plain read/write copy.
+ */
+bool transferFile(const std::string& src, const std::string& dst) {
+  if (linkOrClone(src, dst)) {
+    return true;
+  }
+
+  int srcFd = open(src.c_str(), O_RDONLY);
+  if (srcFd < 0) {
+    return false;
+  }
+
+  struct stat sb;
+  if (fstat(srcFd, &sb) != 0) {
+    close(srcFd);
+    return false;
+  }
+
+  unlink(dst.c_str());
+  int dstFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+                   sb.st_mode & 0777);
+  if (dstFd < 0) {
+    close(srcFd);
+    return false;
+  }
+
+  bool done = false;
+#ifdef __NR_copy_file_range
+  off_t remaining = sb.st_size;
+  done = true;
+  while (remaining > 0) {
+    ssize_t n = syscall(__NR_copy_file_range, srcFd, nullptr, dstFd, nullptr,
+                        static_cast<size_t>(remaining), 0u);
+    if (n <= 0) {
+      done = false;
+      break;
+    }
+    remaining -= n;
+  }
+#endif
+
+  if (!done) {
+    /* Portable fallback: copy through a userspace buffer. Both offsets must
+     * be rewound: a partial copy_file_range advanced them. */
+    if (lseek(srcFd, 0, SEEK_SET) != 0 || lseek(dstFd, 0, SEEK_SET) != 0
+        || ftruncate(dstFd, 0) != 0) {
+      close(srcFd);
+      close(dstFd);
+      return false;
+    }
+    char buffer[65536];
+    ssize_t n;
+    done = true;
+    while ((n = read(srcFd, buffer, sizeof(buffer))) > 0) {
+      if (write(dstFd, buffer, n) != n) {
+        done = false;
+        break;
+      }
+    }
+    if (n < 0) {
+      done = false;
+    }
+  }
+
+  close(srcFd);
+  close(dstFd);
+  return done;
+}
+
+#ifdef FALCON_USE_ZSTD
+
+const int kCompressionLevel = 3;
+
+/**
+ * Compress src into dst with a streaming pipeline: the file is never held
+ * in memory whole. The zstd frame header makes the entry self-describing.
+ */
+bool compressFile(const std::string& src, const std::string& dst) {
+  std::ifstream ifs(src, std::ios::in | std::ios::binary);
+  std::ofstream ofs(dst, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ifs.is_open() || !ofs.is_open()) {
+    return false;
+  }
+
+  ZSTD_CStream* cs = ZSTD_createCStream();
+  if (cs == nullptr) {
+    return false;
+  }
+  ZSTD_initCStream(cs, kCompressionLevel);
+
+  std::vector<char> inBuffer(ZSTD_CStreamInSize());
+  std::vector<char> outBuffer(ZSTD_CStreamOutSize());
+  bool ok = true;
+
+  while (ok && ifs) {
+    ifs.read(inBuffer.data(), inBuffer.size());
+    ZSTD_inBuffer in = { inBuffer.data(),
+                         static_cast<size_t>(ifs.gcount()), 0 };
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out = { outBuffer.data(), outBuffer.size(), 0 };
+      size_t r = ZSTD_compressStream(cs, &out, &in);
+      if (ZSTD_isError(r)) {
+        LOG(ERROR) << "zstd compression failed: " << ZSTD_getErrorName(r);
+        ok = false;
+        break;
+      }
+      ofs.write(outBuffer.data(), out.pos);
+    }
+  }
+
+  /* Flush the last frame. */
+  size_t remaining;
+  do {
+    ZSTD_outBuffer out = { outBuffer.data(), outBuffer.size(), 0 };
+    remaining = ZSTD_endStream(cs, &out);
+    if (ZSTD_isError(remaining)) {
+      LOG(ERROR) << "zstd compression failed: "
+                 << ZSTD_getErrorName(remaining);
+      ok = false;
+      break;
+    }
+    ofs.write(outBuffer.data(), out.pos);
+  } while (ok && remaining > 0);
+
+  ZSTD_freeCStream(cs);
+  return ok && ofs.good();
+}
+
+/** Decompress src into dst, the reverse of compressFile. */
+bool decompressFile(const std::string& src, const std::string& dst) {
+  std::ifstream ifs(src, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    return false;
+  }
+  /* Never write through an existing inode, see linkOrClone. */
+  unlink(dst.c_str());
+  std::ofstream ofs(dst, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open()) {
+    return false;
+  }
+
+  ZSTD_DStream* ds = ZSTD_createDStream();
+  if (ds == nullptr) {
+    return false;
+  }
+  ZSTD_initDStream(ds);
+
+  std::vector<char> inBuffer(ZSTD_DStreamInSize());
+  std::vector<char> outBuffer(ZSTD_DStreamOutSize());
+  bool ok = true;
+
+  while (ok && ifs) {
+    ifs.read(inBuffer.data(), inBuffer.size());
+    ZSTD_inBuffer in = { inBuffer.data(),
+                         static_cast<size_t>(ifs.gcount()), 0 };
+    while (in.pos < in.size) {
+      ZSTD_outBuffer out = { outBuffer.data(), outBuffer.size(), 0 };
+      size_t r = ZSTD_decompressStream(ds, &out, &in);
+      if (ZSTD_isError(r)) {
+        LOG(ERROR) << "zstd decompression failed: " << ZSTD_getErrorName(r);
+        ok = false;
+        break;
+      }
+      ofs.write(outBuffer.data(), out.pos);
+    }
+  }
+
+  ZSTD_freeDStream(ds);
+  return ok && ofs.good();
+}
+
+#endif // FALCON_USE_ZSTD
+
+/* A packfile record is a small header, the entry hash, then the raw bytes.
+ * The hash makes the pack self-describing: the index can be rebuilt from a
+ * sequential scan if the manifest is lost. */
+const std::size_t kPackHashLenBytes = sizeof(uint16_t);
+const std::size_t kPackSizeBytes = sizeof(uint64_t);
+
+/** Bytes a record occupies in front of its data. */
+std::size_t packHeaderBytes(const std::string& hash) {
+  return kPackSizeBytes + kPackHashLenBytes + hash.size();
+}
+
+} // anonymous namespace
+
+const std::size_t CacheFS::kCompressMinBytes;
+const std::size_t CacheFS::kPackMaxBytes;
+const off_t CacheFS::kCompactMinDeadBytes;
+
+/* Name of the manifest file inside the cache directory. */
+static const char kManifestName[] = "manifest";
+/* Name of the packfile holding the small entries. */
+static const char kPackName[] = "pack";
+
 CacheFS::CacheFS(const std::string& dir)
-    : dir_(dir) {}
+    : dir_(dir)
+    , packFd_(-1)
+    , packSize_(0)
+    , packDeadBytes_(0)
+    , packMap_(nullptr)
+    , packMapSize_(0) {
+  loadIndex();
+}
+
+CacheFS::~CacheFS() {
+  if (packMap_ != nullptr) {
+    munmap(packMap_, packMapSize_);
+  }
+  if (packFd_ >= 0) {
+    close(packFd_);
+  }
+}
+
+std::string CacheFS::manifestPath() const {
+  return dir_ + "/" + kManifestName;
+}
+
+std::string CacheFS::packPath() const {
+  return dir_ + "/" + kPackName;
+}
+
+void CacheFS::loadIndex() {
+  /* No lock: only called from the constructor. */
+
+  /* Load the manifest, if any: it carries the sizes, so files it knows
+   * about do not need to be stat'ed. */
+  std::ifstream ifs(manifestPath());
+  std::string hash;
+  long long size;
+  int compressed;
+  long long lastAccess;
+  long long packOffset;
+  while (ifs >> hash >> size >> compressed >> lastAccess >> packOffset) {
+    index_[hash] = IndexEntry(static_cast<off_t>(size), compressed != 0,
+                              static_cast<std::time_t>(lastAccess),
+                              static_cast<off_t>(packOffset));
+  }
+
+  /* Reconcile against the directory: one readdir, plus one stat per file
+   * the manifest did not know. */
+  DIR* dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    /* No cache directory yet: nothing on disk, forget the manifest. */
+    index_.clear();
+    return;
+  }
+
+  struct stat packSb;
+  if (stat(packPath().c_str(), &packSb) == 0) {
+    packSize_ = packSb.st_size;
+  }
+
+  std::unordered_map<std::string, IndexEntry> onDisk;
+
+  /* Packed entries have no file of their own: carry over the ones the
+   * manifest knows, as long as their record fits in the pack. */
+  off_t packLiveBytes = 0;
+  bool manifestKnowsPack = false;
+  for (auto it = index_.begin(); it != index_.end(); ++it) {
+    if (it->second.packOffset < 0) {
+      continue;
+    }
+    manifestKnowsPack = true;
+    if (it->second.packOffset + it->second.size <= packSize_) {
+      onDisk[it->first] = it->second;
+      packLiveBytes += it->second.size + packHeaderBytes(it->first);
+    }
+  }
+
+  if (!manifestKnowsPack && packSize_ > 0) {
+    /* The manifest was lost but the pack is self-describing: rebuild the
+     * packed entries from a sequential scan. This is only done when the
+     * manifest knows nothing about the pack, so entries evicted from the
+     * index (whose records are merely dead) are not resurrected. */
+    std::ifstream pack(packPath(), std::ios::in | std::ios::binary);
+    uint64_t dataSize;
+    uint16_t hashLen;
+    off_t pos = 0;
+    while (pack.read(reinterpret_cast<char*>(&dataSize), sizeof(dataSize))
+           && pack.read(reinterpret_cast<char*>(&hashLen), sizeof(hashLen))) {
+      std::string recordHash(hashLen, '\0');
+      if (hashLen == 0 || !pack.read(&recordHash[0], hashLen)) {
+        break;
+      }
+      off_t dataOffset = pos + packHeaderBytes(recordHash);
+      if (dataOffset + static_cast<off_t>(dataSize) > packSize_) {
+        /* Truncated trailing record, e.g. a crash mid-append. */
+        break;
+      }
+      onDisk[recordHash] = IndexEntry(dataSize, false, packSb.st_mtime,
+                                      dataOffset);
+      packLiveBytes += dataSize + packHeaderBytes(recordHash);
+      pos = dataOffset + dataSize;
+      pack.seekg(pos);
+    }
+  }
+  packDeadBytes_ = packSize_ > packLiveBytes ? packSize_ - packLiveBytes : 0;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name == "." || name == ".." || name == kManifestName
+        || name == kPackName) {
+      continue;
+    }
+    if (name.size() > 5
+        && name.compare(name.size() - 5, 5, ".part") == 0) {
+      /* Staging leftover of an interrupted remote fetch. */
+      unlink((dir_ + "/" + name).c_str());
+      continue;
+    }
+    bool compressedEntry = false;
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".zst") == 0) {
+      compressedEntry = true;
+      name = name.substr(0, name.size() - 4);
+    }
+    auto it = index_.find(name);
+    if (it != index_.end() && it->second.compressed == compressedEntry) {
+      onDisk[name] = it->second;
+    } else {
+      struct stat sb;
+      std::string path = dir_ + "/" + entry->d_name;
+      if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)) {
+        onDisk[name] = IndexEntry(sb.st_size, compressedEntry, sb.st_mtime);
+      }
+    }
+  }
+  closedir(dir);
+
+  index_.swap(onDisk);
+  DLOG(INFO) << "cache index loaded, " << index_.size() << " entries";
+}
+
+void CacheFS::saveIndex() {
+  std::unordered_map<std::string, IndexEntry> snapshot;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (index_.empty()) {
+      return;
+    }
+    snapshot = index_;
+  }
+
+  /* Write to a temporary file and rename, so a crash never leaves a
+   * truncated manifest. */
+  std::string tmp = manifestPath() + ".tmp";
+  std::ofstream ofs(tmp, std::ios::out | std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "Could not write cache manifest " << tmp;
+    return;
+  }
+  for (auto it = snapshot.begin(); it != snapshot.end(); ++it) {
+    ofs << it->first << ' ' << static_cast<long long>(it->second.size) << ' '
+        << (it->second.compressed ? 1 : 0) << ' '
+        << static_cast<long long>(it->second.lastAccess) << ' '
+        << static_cast<long long>(it->second.packOffset) << '\n';
+  }
+  ofs.close();
+  if (!ofs.good() || rename(tmp.c_str(), manifestPath().c_str()) != 0) {
+    LOG(ERROR) << "Could not write cache manifest " << manifestPath();
+    unlink(tmp.c_str());
+  }
+}
+
+std::string CacheFS::entryPath(const std::string& hash) const {
+  std::string entry = dir_;
+  entry.append("/");
+  entry.append(hash);
+  return entry;
+}
+
+std::string CacheFS::compressedEntryPath(const std::string& hash) const {
+  return entryPath(hash) + ".zst";
+}
+
+bool CacheFS::appendToPack(const std::string& hash, const std::string& path,
+                           off_t size, off_t* offset) {
+  /* Assemble the whole record (header, hash, data) so the append is a
+   * single write. */
+  std::vector<char> record(packHeaderBytes(hash) + size);
+  uint64_t dataSize = size;
+  uint16_t hashLen = hash.size();
+  memcpy(record.data(), &dataSize, kPackSizeBytes);
+  memcpy(record.data() + kPackSizeBytes, &hashLen, kPackHashLenBytes);
+  memcpy(record.data() + kPackSizeBytes + kPackHashLenBytes,
+         hash.data(), hash.size());
+
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs.read(record.data() + packHeaderBytes(hash), size)) {
+    return false;
+  }
+
+  return appendRecord(record, hash, offset);
+}
+
+bool CacheFS::appendToPackBuffer(const std::string& hash,
+                                 const std::string& data, off_t* offset) {
+  std::vector<char> record(packHeaderBytes(hash) + data.size());
+  uint64_t dataSize = data.size();
+  uint16_t hashLen = hash.size();
+  memcpy(record.data(), &dataSize, kPackSizeBytes);
+  memcpy(record.data() + kPackSizeBytes, &hashLen, kPackHashLenBytes);
+  memcpy(record.data() + kPackSizeBytes + kPackHashLenBytes,
+         hash.data(), hash.size());
+  memcpy(record.data() + packHeaderBytes(hash), data.data(), data.size());
+
+  return appendRecord(record, hash, offset);
+}
+
+bool CacheFS::appendRecord(std::vector<char> const& record,
+                           const std::string& hash, off_t* offset) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (packFd_ < 0) {
+    packFd_ = open(packPath().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (packFd_ < 0) {
+      LOG(ERROR) << "Could not open cache packfile " << packPath();
+      return false;
+    }
+  }
+  if (write(packFd_, record.data(), record.size())
+      != static_cast<ssize_t>(record.size())) {
+    LOG(ERROR) << "Could not append to cache packfile " << packPath();
+    return false;
+  }
+  *offset = packSize_ + packHeaderBytes(hash);
+  packSize_ += record.size();
+  return true;
+}
+
+bool CacheFS::ensurePackMapped(off_t end) {
+  if (packMap_ != nullptr && end <= packMapSize_) {
+    return true;
+  }
+  if (end > packSize_) {
+    return false;
+  }
+
+  if (packMap_ != nullptr) {
+    munmap(packMap_, packMapSize_);
+    packMap_ = nullptr;
+    packMapSize_ = 0;
+  }
+
+  int fd = open(packPath().c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  void* map = mmap(NULL, packSize_, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG(ERROR) << "Could not map cache packfile " << packPath();
+    return false;
+  }
+  packMap_ = static_cast<char*>(map);
+  packMapSize_ = packSize_;
+  return true;
+}
+
+bool CacheFS::readFromPack(off_t offset, off_t size,
+                           const std::string& path) {
+  /* Never write through an existing inode, see linkOrClone. */
+  unlink(path.c_str());
+  std::ofstream ofs(path, std::ios::out | std::ios::binary
+                          | std::ios::trunc);
+  if (!ofs.is_open()) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!ensurePackMapped(offset + size)) {
+    return false;
+  }
+  ofs.write(packMap_ + offset, size);
+  return ofs.good();
+}
 
 bool CacheFS::writeEntry(const std::string& hash, const std::string& path) {
   assert(!hash.empty());
 
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (index_.find(hash) != index_.end()) {
+      /* The target is already in cache. */
+      return true;
+    }
+  }
+
   fs::mkdir(dir_);
 
-  std::string output = dir_;
-  output.append("/");
-  output.append(hash);
+  std::string output = entryPath(hash);
 
   struct stat sb;
-  if (stat(output.c_str(), &sb) == 0) {
-    /* The target is already in cache. */
-    return true;
+  if (stat(path.c_str(), &sb) != 0) {
+    LOG(ERROR) << "Could not store " << path << " in cache";
+    return false;
+  }
+  IndexEntry indexEntry(sb.st_size, false, std::time(NULL));
+
+  /* Small entries go to the packfile: no inode of their own, and reads
+   * come out of one mmap'd region. */
+  if (static_cast<std::size_t>(sb.st_size) < kPackMaxBytes) {
+    off_t offset;
+    if (appendToPack(hash, path, sb.st_size, &offset)) {
+      indexEntry.packOffset = offset;
+      std::lock_guard<std::mutex> g(mutex_);
+      index_[hash] = indexEntry;
+      return true;
+    }
+    /* Fall back to a plain file. */
+  }
+
+  /* Reflink or hardlink first: metadata-speed and zero space cost, so there
+   * is nothing to gain from compressing. */
+  bool stored = linkOrClone(path, output);
+
+#ifdef FALCON_USE_ZSTD
+  /* The entry has to be materialized; store it compressed if it is big
+   * enough to be worth the cpu. */
+  if (!stored && static_cast<std::size_t>(sb.st_size) >= kCompressMinBytes) {
+    std::string compressed = compressedEntryPath(hash);
+    if (compressFile(path, compressed)) {
+      stored = true;
+      indexEntry.compressed = true;
+      struct stat csb;
+      if (stat(compressed.c_str(), &csb) == 0) {
+        indexEntry.size = csb.st_size;
+      }
+    } else {
+      unlink(compressed.c_str());
+    }
+  }
+#endif
+
+  if (!stored && !transferFile(path, output)) {
+    LOG(ERROR) << "Could not store " << path << " in cache";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  index_[hash] = indexEntry;
+  return true;
+}
+
+bool CacheFS::writeEntryBuffer(const std::string& hash,
+                               const std::string& data) {
+  assert(!hash.empty());
+
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (index_.find(hash) != index_.end()) {
+      /* The target is already in cache. */
+      return true;
+    }
   }
 
-  /* Copy the target in the cache. */
-  try {
-    std::ifstream ifs(path, std::ios::binary);
-    std::ofstream ofs(output, std::ios::binary);
-    ofs << ifs.rdbuf();
-  } catch (std::ios_base::failure& e) {
-    LOG(ERROR) << "Could not store " << path << " in cache: " << e.what();
+  fs::mkdir(dir_);
+
+  IndexEntry indexEntry(data.size(), false, std::time(NULL));
+
+  /* Small entries go to the packfile, like in writeEntry. */
+  if (data.size() < kPackMaxBytes) {
+    off_t offset;
+    if (appendToPackBuffer(hash, data, &offset)) {
+      indexEntry.packOffset = offset;
+      std::lock_guard<std::mutex> g(mutex_);
+      index_[hash] = indexEntry;
+      return true;
+    }
+    /* Fall back to a plain file. */
+  }
+
+  /* The buffer has no on-disk source to link from, so larger entries are
+   * materialized as plain files. Buffer writes are used for small transient
+   * content (depfiles): compression is not worth it here. */
+  std::string output = entryPath(hash);
+  std::ofstream ofs(output, std::ios::out | std::ios::trunc
+                    | std::ios::binary);
+  if (!ofs.write(data.data(), data.size())) {
+    LOG(ERROR) << "Could not store buffered entry " << hash << " in cache";
+    unlink(output.c_str());
     return false;
   }
+  ofs.close();
 
+  std::lock_guard<std::mutex> g(mutex_);
+  index_[hash] = indexEntry;
   return true;
 }
 
 bool CacheFS::hasEntry(const std::string& hash) {
   assert(!hash.empty());
-  std::string output = dir_;
-  output.append("/");
-  output.append(hash);
+  std::lock_guard<std::mutex> g(mutex_);
+  return index_.find(hash) != index_.end();
+}
+
+void CacheFS::hasEntries(const std::vector<std::string>& hashes,
+                         std::vector<bool>* hits) {
+  hits->assign(hashes.size(), false);
+  std::lock_guard<std::mutex> g(mutex_);
+  for (std::size_t i = 0; i < hashes.size(); ++i) {
+    (*hits)[i] = index_.find(hashes[i]) != index_.end();
+  }
+}
+
+bool CacheFS::readEntryRaw(const std::string& hash, off_t offset,
+                           std::size_t maxBytes, std::string* data,
+                           bool* compressed, bool* eof) {
+  assert(!hash.empty());
+
+  IndexEntry indexEntry;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) {
+      return false;
+    }
+    /* Serving a peer counts as a use. */
+    it->second.lastAccess = std::time(NULL);
+    indexEntry = it->second;
+  }
+  *compressed = indexEntry.compressed;
+
+  if (indexEntry.packOffset >= 0) {
+    /* Packed entries are served straight out of the mapping. */
+    std::lock_guard<std::mutex> g(mutex_);
+    if (!ensurePackMapped(indexEntry.packOffset + indexEntry.size)) {
+      return false;
+    }
+    off_t remaining = offset < indexEntry.size ? indexEntry.size - offset : 0;
+    std::size_t nbRead = std::min(maxBytes,
+                                  static_cast<std::size_t>(remaining));
+    data->assign(packMap_ + indexEntry.packOffset + offset, nbRead);
+    *eof = offset + static_cast<off_t>(nbRead) >= indexEntry.size;
+    return true;
+  }
+
+  std::string entry = *compressed ? compressedEntryPath(hash)
+                                  : entryPath(hash);
+  int fd = open(entry.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Could not open cache entry " << entry;
+    return false;
+  }
+
+  data->resize(maxBytes);
+  ssize_t nbRead = maxBytes > 0 ? pread(fd, &(*data)[0], maxBytes, offset) : 0;
+  if (nbRead < 0) {
+    LOG(ERROR) << "Could not read cache entry " << entry;
+    close(fd);
+    return false;
+  }
+  data->resize(nbRead);
+
   struct stat sb;
-  return stat(output.c_str(), &sb) == 0;
+  *eof = fstat(fd, &sb) == 0 && offset + nbRead >= sb.st_size;
+  close(fd);
+  return true;
 }
 
-bool CacheFS::readEntry(const std::string& hash, const std::string& path) {
+std::string CacheFS::stagingPath(const std::string& hash) const {
+  /* In the cache directory itself, so installEntry can rename into place. */
+  return entryPath(hash) + ".part";
+}
+
+bool CacheFS::installEntry(const std::string& hash,
+                           const std::string& stagedPath, bool compressed) {
   assert(!hash.empty());
-  std::string output = dir_;
-  output.append("/");
-  output.append(hash);
+
+  fs::mkdir(dir_);
 
   struct stat sb;
-  if (stat(output.c_str(), &sb) != 0) {
+  if (stat(stagedPath.c_str(), &sb) != 0) {
+    LOG(ERROR) << "Could not install staged cache entry " << stagedPath;
     return false;
   }
 
-  /* Copy the target from the cache. */
-  try {
-    std::ifstream ifs(output, std::ios::binary);
-    std::ofstream ofs(path, std::ios::binary);
-    ofs << ifs.rdbuf();
-  } catch (std::ios_base::failure& e) {
-    LOG(ERROR) << "Could not retrieve " << path << " in cache: " << e.what();
+  std::string entry = compressed ? compressedEntryPath(hash)
+                                 : entryPath(hash);
+  if (rename(stagedPath.c_str(), entry.c_str()) != 0) {
+    LOG(ERROR) << "Could not install cache entry " << entry;
+    unlink(stagedPath.c_str());
+    return false;
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  index_[hash] = IndexEntry(sb.st_size, compressed, std::time(NULL));
+  return true;
+}
+
+bool CacheFS::readEntry(const std::string& hash, const std::string& path) {
+  assert(!hash.empty());
+
+  IndexEntry entry;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) {
+      return false;
+    }
+    /* Touch the entry so LRU eviction keeps what is actually used. */
+    it->second.lastAccess = std::time(NULL);
+    entry = it->second;
+  }
+
+  bool restored;
+  if (entry.packOffset >= 0) {
+    restored = readFromPack(entry.packOffset, entry.size, path);
+  } else if (entry.compressed) {
+#ifdef FALCON_USE_ZSTD
+    restored = decompressFile(compressedEntryPath(hash), path);
+#else
+    LOG(ERROR) << "Cache entry " << compressedEntryPath(hash) << " is "
+                  "compressed but this build of falcon has no zstd support";
+    return false;
+#endif
+  } else {
+    /* Clone the target from the cache: a branch-switch restore is a metadata
+     * operation, not bulk I/O. */
+    restored = transferFile(entryPath(hash), path);
+  }
+
+  if (!restored) {
+    LOG(ERROR) << "Could not retrieve " << path << " from cache";
+    /* The entry may have been removed behind our back; drop it from the
+     * index so we do not keep promising it. */
+    std::lock_guard<std::mutex> g(mutex_);
+    index_.erase(hash);
     return false;
   }
 
@@ -82,15 +822,27 @@ bool CacheFS::readEntry(const std::string& hash, const std::string& path) {
 
 bool CacheFS::delEntry(const std::string& hash) {
   assert(!hash.empty());
-  std::string entry = dir_;
-  entry.append("/");
-  entry.append(hash);
 
-  struct stat sb;
-  if (stat(entry.c_str(), &sb) != 0) {
-    return true;
+  bool compressed;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto it = index_.find(hash);
+    if (it == index_.end()) {
+      return true;
+    }
+    if (it->second.packOffset >= 0) {
+      /* The record stays in the pack as dead bytes until the next
+       * compaction. */
+      packDeadBytes_ += it->second.size + packHeaderBytes(hash);
+      index_.erase(it);
+      return true;
+    }
+    compressed = it->second.compressed;
+    index_.erase(it);
   }
 
+  std::string entry = compressed ? compressedEntryPath(hash)
+                                 : entryPath(hash);
   if (unlink(entry.c_str()) < 0) {
     LOG(ERROR) << "Could not remove " << entry;
     return false;
@@ -99,4 +851,142 @@ bool CacheFS::delEntry(const std::string& hash) {
   return true;
 }
 
+std::size_t CacheFS::trimToBudget(
+    off_t maxBytes, const std::unordered_set<std::string>& preferred) {
+  struct Victim {
+    std::string hash;
+    off_t size;
+    std::time_t lastAccess;
+    bool preferred;
+    bool compressed;
+    bool packed;
+  };
+
+  std::vector<std::string> paths;
+  std::size_t evicted = 0;
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+
+    off_t total = 0;
+    for (auto it = index_.begin(); it != index_.end(); ++it) {
+      total += it->second.size;
+    }
+    if (total <= maxBytes) {
+      return 0;
+    }
+
+    /* Evict non-preferred entries before entries of the current git ref,
+     * and the least recently used first within each group. */
+    std::vector<Victim> candidates;
+    candidates.reserve(index_.size());
+    for (auto it = index_.begin(); it != index_.end(); ++it) {
+      candidates.push_back({ it->first, it->second.size,
+                             it->second.lastAccess,
+                             preferred.find(it->first) != preferred.end(),
+                             it->second.compressed,
+                             it->second.packOffset >= 0 });
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](Victim const& lhs, Victim const& rhs) {
+                if (lhs.preferred != rhs.preferred) {
+                  return !lhs.preferred;
+                }
+                return lhs.lastAccess < rhs.lastAccess;
+              });
+
+    for (auto it = candidates.begin();
+         it != candidates.end() && total > maxBytes; ++it) {
+      index_.erase(it->hash);
+      if (it->packed) {
+        /* No file to remove: the record becomes dead bytes, reclaimed by
+         * the compaction pass that follows trimming. */
+        packDeadBytes_ += it->size + packHeaderBytes(it->hash);
+      } else {
+        paths.push_back(it->compressed ? compressedEntryPath(it->hash)
+                                       : entryPath(it->hash));
+      }
+      total -= it->size;
+      ++evicted;
+    }
+  }
+
+  /* The entries are already gone from the index, so nobody can be handed
+   * one of these paths while we unlink them. */
+  for (auto it = paths.begin(); it != paths.end(); ++it) {
+    if (unlink(it->c_str()) < 0) {
+      LOG(ERROR) << "Could not remove " << *it;
+    }
+  }
+
+  return evicted;
+}
+
+void CacheFS::compactPack() {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (packDeadBytes_ < kCompactMinDeadBytes) {
+    return;
+  }
+  if (!ensurePackMapped(packSize_)) {
+    return;
+  }
+
+  /* Copy the live records, in their current order, into a fresh pack. */
+  std::string tmp = packPath() + ".tmp";
+  std::ofstream ofs(tmp, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "Could not compact cache packfile " << packPath();
+    return;
+  }
+
+  std::vector<std::pair<std::string, IndexEntry*>> live;
+  for (auto it = index_.begin(); it != index_.end(); ++it) {
+    if (it->second.packOffset >= 0) {
+      live.push_back(std::make_pair(it->first, &it->second));
+    }
+  }
+  std::sort(live.begin(), live.end(),
+            [](std::pair<std::string, IndexEntry*> const& lhs,
+               std::pair<std::string, IndexEntry*> const& rhs) {
+              return lhs.second->packOffset < rhs.second->packOffset;
+            });
+
+  off_t pos = 0;
+  std::vector<off_t> newOffsets(live.size());
+  for (std::size_t i = 0; i < live.size(); ++i) {
+    const std::string& hash = live[i].first;
+    IndexEntry* entry = live[i].second;
+    uint64_t dataSize = entry->size;
+    uint16_t hashLen = hash.size();
+    ofs.write(reinterpret_cast<const char*>(&dataSize), kPackSizeBytes);
+    ofs.write(reinterpret_cast<const char*>(&hashLen), kPackHashLenBytes);
+    ofs.write(hash.data(), hash.size());
+    ofs.write(packMap_ + entry->packOffset, entry->size);
+    newOffsets[i] = pos + packHeaderBytes(hash);
+    pos = newOffsets[i] + entry->size;
+  }
+  ofs.close();
+  if (!ofs.good() || rename(tmp.c_str(), packPath().c_str()) != 0) {
+    LOG(ERROR) << "Could not compact cache packfile " << packPath();
+    unlink(tmp.c_str());
+    return;
+  }
+
+  /* Swap in the new pack: the offsets move, the mapping and the append fd
+   * point at the old inode and must be reopened. */
+  for (std::size_t i = 0; i < live.size(); ++i) {
+    live[i].second->packOffset = newOffsets[i];
+  }
+  munmap(packMap_, packMapSize_);
+  packMap_ = nullptr;
+  packMapSize_ = 0;
+  if (packFd_ >= 0) {
+    close(packFd_);
+    packFd_ = -1;
+  }
+  DLOG(INFO) << "cache packfile compacted: " << packSize_ << " -> " << pos
+             << " bytes";
+  packSize_ = pos;
+  packDeadBytes_ = 0;
+}
+
 } // namespace falcon
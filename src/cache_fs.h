@@ -5,23 +5,65 @@
 #ifndef FALCON_CACHE_FS_H_
 #define FALCON_CACHE_FS_H_
 
+#include <cstddef>
+#include <ctime>
+#include <mutex>
 #include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace falcon {
 
+/**
+ * Content-addressed on-disk store of cache entries.
+ *
+ * The contents of the cache directory are mirrored in an in-memory index
+ * (hash to size and storage form), so existence checks are a hash-map lookup
+ * instead of a stat call: a cold branch switch probes the cache once per
+ * node and used to issue hundreds of thousands of stats. The index is
+ * persisted in a manifest file inside the cache directory (see saveIndex)
+ * and reconciled against a single directory scan at startup, so entries
+ * added or removed behind the daemon's back are picked up with at most one
+ * stat each.
+ *
+ * Entries smaller than kPackMaxBytes (depfiles, stamp files: the majority of
+ * entries by count) are not stored as individual files but appended to a
+ * single append-only packfile, with their offset recorded in the index. This
+ * costs one inode for the lot, keeps the startup directory scan short, and
+ * makes small restores a copy out of a mmap'd region instead of an
+ * open/read/close. Evicting a packed entry only drops it from the index; the
+ * dead bytes are reclaimed by compactPack during idle eviction passes.
+ */
 class CacheFS {
  public:
 
   CacheFS(const std::string& dir);
+  ~CacheFS();
 
   /**
    * Write an entry in the cache.
+   * An entry that cannot be stored by reflink or hardlink (zero space cost)
+   * and is larger than kCompressMinBytes is stored zstd-compressed, under
+   * "<hash>.zst". Compression only runs off the build critical path (saveRule)
+   * and trades idle cpu for a several times bigger effective cache.
    * @param hash of the entry.
    * @param path of the entry.
    * @return true on sucess, false otherwise.
    */
   bool writeEntry(const std::string& hash, const std::string& path);
 
+  /**
+   * Write an entry in the cache from an in-memory buffer, without reading
+   * anything back from disk. Used for content the daemon already holds in
+   * memory (depfiles captured from the scratch directory).
+   * @param hash of the entry.
+   * @param data content of the entry.
+   * @return true on success, false otherwise.
+   */
+  bool writeEntryBuffer(const std::string& hash, const std::string& data);
+
   /**
    * Check if the cache contains an entry.
    * @param hash Hash of the entry.
@@ -29,6 +71,14 @@ class CacheFS {
    */
   bool hasEntry(const std::string& hash);
 
+  /**
+   * Probe a whole batch of hashes in one query, taking the index lock once.
+   * @param hashes Hashes to probe.
+   * @param hits Filled with one flag per hash, in the same order.
+   */
+  void hasEntries(const std::vector<std::string>& hashes,
+                  std::vector<bool>* hits);
+
   /**
    * Query the cache for an entry with the given hash and restore it to the
    * given path.
@@ -38,6 +88,37 @@ class CacheFS {
    */
   bool readEntry(const std::string& hash, const std::string& path);
 
+  /**
+   * Read up to maxBytes of an entry starting at offset, in its stored
+   * (possibly compressed) form. Used to serve the entry to a peer daemon,
+   * which installs the bytes verbatim with installEntry: the stored form is
+   * the wire form, so serving never decompresses.
+   * @param hash Hash of the entry.
+   * @param offset Offset in the stored file.
+   * @param maxBytes Maximum number of bytes to read.
+   * @param data Filled with the bytes read.
+   * @param compressed Set to the storage form of the entry.
+   * @param eof Set if the read reached the end of the entry.
+   * @return true if the entry exists and the read succeeded.
+   */
+  bool readEntryRaw(const std::string& hash, off_t offset,
+                    std::size_t maxBytes, std::string* data,
+                    bool* compressed, bool* eof);
+
+  /**
+   * Path a fetched entry should be staged to while its chunks are being
+   * received, before installEntry moves it into place.
+   */
+  std::string stagingPath(const std::string& hash) const;
+
+  /**
+   * Move a fully staged file into the store under the given hash and index
+   * it. The file must be in the stored form announced by the serving peer.
+   * @return true on success; the staging file is consumed either way.
+   */
+  bool installEntry(const std::string& hash, const std::string& stagedPath,
+                    bool compressed);
+
   /**
    * Remove the given entry from cache.
    * @param hash of the entry.
@@ -45,8 +126,116 @@ class CacheFS {
    */
   bool delEntry(const std::string& hash);
 
+  /**
+   * Persist the in-memory index in the manifest file. Called when the
+   * daemon is idle, like the hash and duration caches.
+   */
+  void saveIndex();
+
+  /**
+   * Evict entries until the total size of the cache fits in maxBytes.
+   * Least-recently-accessed entries go first; entries in the preferred set
+   * are only evicted once every other entry is gone and the cache is still
+   * over budget.
+   * @return Number of entries evicted.
+   */
+  std::size_t trimToBudget(off_t maxBytes,
+                           const std::unordered_set<std::string>& preferred);
+
+  /**
+   * Rewrite the packfile without its dead records, once enough of them have
+   * accumulated. Called during idle eviction passes; a no-op when the pack
+   * is mostly live.
+   */
+  void compactPack();
+
  private:
+  /** Size, storage form and last access time of an indexed entry. */
+  struct IndexEntry {
+    off_t size;
+    bool compressed;
+    /** Last time the entry was written or restored, for LRU eviction. */
+    std::time_t lastAccess;
+    /** Offset of the entry's bytes in the packfile, or -1 when the entry
+     * is stored as its own file. */
+    off_t packOffset;
+
+    IndexEntry()
+        : size(0), compressed(false), lastAccess(0), packOffset(-1) {}
+    IndexEntry(off_t size, bool compressed, std::time_t lastAccess,
+               off_t packOffset = -1)
+        : size(size), compressed(compressed), lastAccess(lastAccess)
+        , packOffset(packOffset) {}
+  };
+
+  /**
+   * Load the manifest and reconcile it against a scan of the cache
+   * directory: manifest entries whose file is gone are dropped, files the
+   * manifest does not know are stat'ed and added.
+   */
+  void loadIndex();
+
+  /** Path of the manifest file. */
+  std::string manifestPath() const;
+
+  /** Path of the plain entry for a hash. */
+  std::string entryPath(const std::string& hash) const;
+  /** Path of the compressed entry for a hash. */
+  std::string compressedEntryPath(const std::string& hash) const;
+
+  /** Path of the packfile. */
+  std::string packPath() const;
+
+  /** Append the content of path (size bytes) to the packfile under the
+   * given hash. Takes mutex_. On success, sets offset to where the bytes
+   * landed. */
+  bool appendToPack(const std::string& hash, const std::string& path,
+                    off_t size, off_t* offset);
+
+  /** Same, from an in-memory buffer. */
+  bool appendToPackBuffer(const std::string& hash, const std::string& data,
+                          off_t* offset);
+
+  /** Append a fully assembled record to the packfile. Takes mutex_. On
+   * success, sets offset to where the data bytes landed. */
+  bool appendRecord(std::vector<char> const& record, const std::string& hash,
+                    off_t* offset);
+
+  /** Restore size bytes at offset in the packfile to the given path.
+   * Takes mutex_. */
+  bool readFromPack(off_t offset, off_t size, const std::string& path);
+
+  /** Make sure the read-only mapping of the packfile covers at least the
+   * first end bytes, remapping if the pack grew. Called with mutex_
+   * held. */
+  bool ensurePackMapped(off_t end);
+
+  /** Entries smaller than this are never worth compressing. */
+  static const std::size_t kCompressMinBytes = 64 * 1024;
+
+  /** Entries smaller than this go to the packfile instead of their own
+   * file. */
+  static const std::size_t kPackMaxBytes = 16 * 1024;
+
+  /** Dead bytes the packfile must accumulate before compactPack rewrites
+   * it. */
+  static const off_t kCompactMinDeadBytes = 1 << 20;
+
   std::string dir_;
+
+  /* Packfile state, guarded by mutex_. The append fd is opened lazily;
+   * the mapping is read-only and remapped when the pack grows past it. */
+  int packFd_;
+  off_t packSize_;
+  off_t packDeadBytes_;
+  char* packMap_;
+  off_t packMapSize_;
+
+  /** In-memory mirror of the cache directory, keyed by entry hash.
+   * Guarded by mutex_: entries are written by the post-processing workers
+   * while the lazy fetch probes. */
+  std::unordered_map<std::string, IndexEntry> index_;
+  std::mutex mutex_;
 };
 
 } // namespace falcon
@@ -16,7 +16,7 @@
 namespace falcon {
 
 CacheGitDirectory::CacheGitDirectory(const std::string& gitRepository,
-                                     CacheFS cacheFs)
+                                     CacheFS& cacheFs)
     : gitRepository_(gitRepository)
     , cacheFs_(cacheFs) { }
 
@@ -65,6 +65,7 @@ bool CacheGitDirectory::isInRef() const {
 }
 
 void CacheGitDirectory::registerNode(const std::string& hash, Node* node) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto itRefMap = gitNodeMap_.find(node);
   if (itRefMap == gitNodeMap_.end()) {
     auto itInserted = gitNodeMap_.insert(std::make_pair(node, RefMap()));
@@ -74,6 +75,7 @@ void CacheGitDirectory::registerNode(const std::string& hash, Node* node) {
 }
 
 void CacheGitDirectory::registerRule(const std::string& hash, Rule* rule) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto itRefMap = gitRuleMap_.find(rule);
   if (itRefMap == gitRuleMap_.end()) {
     auto itInserted = gitRuleMap_.insert(std::make_pair(rule, RefMap()));
@@ -82,6 +84,27 @@ void CacheGitDirectory::registerRule(const std::string& hash, Rule* rule) {
   registerEntryInRefMap(hash, itRefMap->second);
 }
 
+void CacheGitDirectory::getCurrentRefEntries(
+    std::unordered_set<std::string>* hashes) const {
+  if (!isInRef()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = gitNodeMap_.begin(); it != gitNodeMap_.end(); ++it) {
+    auto itEntry = it->second.find(currentGitRef_);
+    if (itEntry != it->second.end()) {
+      hashes->insert(itEntry->second->hash);
+    }
+  }
+  for (auto it = gitRuleMap_.begin(); it != gitRuleMap_.end(); ++it) {
+    auto itEntry = it->second.find(currentGitRef_);
+    if (itEntry != it->second.end()) {
+      hashes->insert(itEntry->second->hash);
+    }
+  }
+}
+
 void CacheGitDirectory::registerEntryInRefMap(const std::string& hash,
                                               RefMap& refMap) {
   assert(isInRef());
@@ -6,8 +6,10 @@
 #ifndef FALCON_CACHE_GIT_DIRECTORY_H_
 # define FALCON_CACHE_GIT_DIRECTORY_H_
 
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "cache_fs.h"
 
@@ -29,7 +31,7 @@ class Rule;
  */
 class CacheGitDirectory {
  public:
-  CacheGitDirectory(const std::string& gitRepository, CacheFS cacheFs);
+  CacheGitDirectory(const std::string& gitRepository, CacheFS& cacheFs);
 
   /** Return true if there is a git repository. */
   bool checkIsGitRepository() const;
@@ -47,6 +49,11 @@ class CacheGitDirectory {
   /** Notify that an entry has been saved in cache for the given rule. */
   void registerRule(const std::string& hash, Rule* rule);
 
+  /** Collect the hashes of the entries registered for the current git ref.
+   * Eviction keeps these for last: they are what a rebuild of the current
+   * branch would hit. */
+  void getCurrentRefEntries(std::unordered_set<std::string>* hashes) const;
+
  private:
   std::string gitRepository_;
 
@@ -71,9 +78,18 @@ class CacheGitDirectory {
   /* Global map of cache entries, key'ed by hash. */
   std::unordered_map<std::string, GitCacheEntry*> gitHashMap_;
 
+  /* Called with mutex_ held. */
   void registerEntryInRefMap(const std::string& hash, RefMap& refMap);
 
-  CacheFS cacheFs_;
+  /* Registrations come concurrently from the build post-processing workers
+   * and the lazy-cache restore pool. updateRef is not guarded: it only runs
+   * between builds, when no restore or save is in flight. */
+  mutable std::mutex mutex_;
+
+  /* The store the entries live in; owned by the cache manager. Held by
+   * reference: CacheFS carries the in-memory index of the cache directory
+   * and there must only be one. */
+  CacheFS& cacheFs_;
 };
 
 } // namespace falcon
@@ -3,8 +3,11 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <fstream>
+#include <functional>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -12,17 +15,26 @@
 #include "cache_manager.h"
 
 #include "exceptions.h"
+#include "stats.h"
 #include "fs.h"
 #include "graph.h"
+#include "hash_engine.h"
 #include "logging.h"
+#include "remote_cache.h"
 
 namespace falcon {
 
+const std::size_t CacheManager::kNumRestoreThreads;
+
 CacheManager::CacheManager(const std::string& workingDirectory,
                            const std::string& falconDir)
     : workingDirectory_(workingDirectory)
-    , cacheFs_(falconDir + "/cache")
-    , gitDirectory_(workingDirectory, cacheFs_) {
+    /* Namespace the cache by hash engine so that binaries built with
+     * different engines never mix up each other's keys. */
+    , cacheFs_(falconDir + "/cache-" + HashEngine::name())
+    , gitDirectory_(workingDirectory, cacheFs_)
+    , pendingSaves_(0)
+    , saveStop_(false) {
 
   /* If we find a git repository, automatically use the CACHE_GIT_REFS
    * policy. */
@@ -31,22 +43,38 @@ CacheManager::CacheManager(const std::string& workingDirectory,
   } else {
     policy_ = Policy::CACHE_EVERYTHING;
   }
+
+  writer_ = std::thread(std::bind(&CacheManager::writerThread, this));
 }
 
-bool CacheManager::saveNode(Node* node) {
-  if (!cacheFs_.writeEntry(node->getHash(), node->getPath())) {
-    LOG(ERROR) << "could not save " << node->getPath() << " in cache";
-    return false;
+CacheManager::~CacheManager() {
+  {
+    std::lock_guard<std::mutex> l(saveMutex_);
+    saveStop_ = true;
   }
+  saveCond_.notify_all();
+  spaceCond_.notify_all();
+  if (writer_.joinable()) {
+    writer_.join();
+  }
+}
 
+void CacheManager::saveNode(Node* node, std::vector<PendingSave>* saves) {
   if (policy_ == Policy::CACHE_GIT_REFS) {
-    gitDirectory_.registerNode(node->getHash(), node);
+    gitDirectory_.registerNode(node->getHash().toHex(), node);
   }
-
-  return true;
+  saves->push_back(PendingSave{node->getHash().toHex(), node->getPath()});
 }
 
 void CacheManager::saveRule(Rule *rule) {
+  doSaveRule(rule, nullptr);
+}
+
+void CacheManager::saveRule(Rule* rule, const std::string& depfileContent) {
+  doSaveRule(rule, &depfileContent);
+}
+
+void CacheManager::doSaveRule(Rule* rule, const std::string* depfileContent) {
   if (rule->isPhony()) {
     return;
   }
@@ -57,35 +85,145 @@ void CacheManager::saveRule(Rule *rule) {
     return;
   }
 
-  /* Save all the outputs. */
+  /* Snapshot the (hash, path) pairs of everything to store. The caller
+   * holds the graph lock; the writer thread only ever sees these plain
+   * strings. */
+  std::vector<PendingSave> saves;
+
   auto& outputs = rule->getOutputs();
   for (auto it = outputs.begin(); it != outputs.end(); it++) {
-    if (!saveNode(*it)) {
-      LOG(ERROR) << "could not save " << (*it)->getPath() << " in cache";
-    }
+    saveNode(*it, &saves);
   }
 
-  /* Save the depfile. */
   if (rule->hasDepfile()) {
-    if (!cacheFs_.writeEntry(rule->getHashDepfile(), rule->getDepfile())) {
-      LOG(ERROR) << "could not save " << rule->getDepfile() << " to "
-        << rule->getHashDepfile() << std::endl;
+    if (depfileContent) {
+      /* The depfile content is already in memory: persist it from there
+       * instead of reading the file back (it may not even exist on disk
+       * anymore). */
+      saves.push_back(PendingSave{rule->getHashDepfile().toHex(),
+                                  rule->getDepfile(), *depfileContent, true});
+    } else {
+      saves.push_back(
+          PendingSave{rule->getHashDepfile().toHex(), rule->getDepfile()});
     }
   }
 
   if (policy_ == Policy::CACHE_GIT_REFS) {
-    gitDirectory_.registerRule(rule->getHashDepfile(), rule);
+    gitDirectory_.registerRule(rule->getHashDepfile().toHex(), rule);
+  }
+
+  enqueueSaves(saves);
+}
+
+void CacheManager::enqueueSaves(std::vector<PendingSave>& saves) {
+  bool enqueued = false;
+  {
+    std::unique_lock<std::mutex> l(saveMutex_);
+    for (auto it = saves.begin(); it != saves.end(); ++it) {
+      /* Back-pressure: if the writer cannot keep up, slow the builder
+       * down instead of accumulating an unbounded backlog of copies. */
+      spaceCond_.wait(l, [this]() {
+        return saveQueue_.size() < kMaxPendingSaves || saveStop_;
+      });
+      if (saveStop_) {
+        break;
+      }
+      saveQueue_.push_back(std::move(*it));
+      ++pendingSaves_;
+      enqueued = true;
+    }
+  }
+  if (enqueued) {
+    saveCond_.notify_one();
+  }
+}
+
+void CacheManager::writerThread() {
+  for (;;) {
+    PendingSave save;
+    {
+      std::unique_lock<std::mutex> l(saveMutex_);
+      saveCond_.wait(l, [this]() { return saveStop_ || !saveQueue_.empty(); });
+      if (saveQueue_.empty()) {
+        /* Stopped and drained. */
+        return;
+      }
+      save = std::move(saveQueue_.front());
+      saveQueue_.pop_front();
+    }
+    /* A producer may be blocked on a full queue. */
+    spaceCond_.notify_all();
+
+    bool written = save.fromBuffer
+        ? cacheFs_.writeEntryBuffer(save.hash, save.content)
+        : cacheFs_.writeEntry(save.hash, save.path);
+    if (!written) {
+      LOG(ERROR) << "could not save " << save.path << " in cache";
+    } else {
+      getStatsRegistry().cacheEntriesSaved.fetch_add(
+          1, std::memory_order_relaxed);
+    }
+
+    {
+      std::lock_guard<std::mutex> l(saveMutex_);
+      --pendingSaves_;
+    }
+    /* Also wakes the threads waiting in waitForPendingSaves. */
+    spaceCond_.notify_all();
   }
 }
 
+void CacheManager::waitForPendingSaves() {
+  std::unique_lock<std::mutex> l(saveMutex_);
+  spaceCond_.wait(l, [this]() { return pendingSaves_ == 0 || saveStop_; });
+}
+
+void CacheManager::setRemoteCache(std::unique_ptr<RemoteCache> remote) {
+  remote_ = std::move(remote);
+}
+
+void CacheManager::hasEntries(const std::vector<std::string>& hashes,
+                              std::vector<bool>* hits) {
+  cacheFs_.hasEntries(hashes, hits);
+  if (!remote_) {
+    return;
+  }
+
+  /* Probe the remote tier for the local misses, in one batched RPC. */
+  std::vector<std::size_t> missing;
+  std::vector<std::string> missingHashes;
+  for (std::size_t i = 0; i < hashes.size(); ++i) {
+    if (!(*hits)[i]) {
+      missing.push_back(i);
+      missingHashes.push_back(hashes[i]);
+    }
+  }
+  if (missing.empty()) {
+    return;
+  }
+
+  std::vector<bool> remoteHits;
+  remote_->hasEntries(missingHashes, &remoteHits);
+  for (std::size_t i = 0; i < missing.size(); ++i) {
+    if (remoteHits[i]) {
+      (*hits)[missing[i]] = true;
+    }
+  }
+}
+
+bool CacheManager::fetchFromRemote(const std::string& hash) {
+  return remote_ && remote_->fetchEntry(hash, cacheFs_);
+}
+
 bool CacheManager::restoreNode(Node* node) {
-  if (!cacheFs_.hasEntry(node->getHash())) {
+  if (!cacheFs_.hasEntry(node->getHash().toHex())
+      && !fetchFromRemote(node->getHash().toHex())) {
     return false;
   }
   if (policy_ == Policy::CACHE_GIT_REFS) {
-    gitDirectory_.registerNode(node->getHash(), node);
+    gitDirectory_.registerNode(node->getHash().toHex(), node);
   }
-  return cacheFs_.readEntry(node->getHash(), node->getPath());
+  return cacheFs_.readEntry(node->getHash().toHex(), node->getPath());
 }
 
 bool CacheManager::restoreRule(Rule *rule) {
@@ -93,33 +231,102 @@ bool CacheManager::restoreRule(Rule *rule) {
     return false;
   }
 
-  /* Check we have all the outputs in cache. */
+  /* Check we have all the outputs in cache. The local misses are probed on
+   * the remote tier in one batch; the rule is only restorable if every
+   * output is somewhere, so nothing is fetched before we know that. */
   auto& outputs = rule->getOutputs();
+  std::vector<std::string> hashes;
+  hashes.reserve(outputs.size());
   for (auto it = outputs.begin(); it != outputs.end(); it++) {
-    if (!cacheFs_.hasEntry((*it)->getHash())) {
+    hashes.push_back((*it)->getHash().toHex());
+  }
+  std::vector<bool> hits;
+  hasEntries(hashes, &hits);
+  for (std::size_t i = 0; i < hashes.size(); ++i) {
+    if (!hits[i]) {
+      return false;
+    }
+  }
+
+  /* Pull the outputs missing locally. */
+  for (std::size_t i = 0; i < hashes.size(); ++i) {
+    if (!cacheFs_.hasEntry(hashes[i]) && !fetchFromRemote(hashes[i])) {
       return false;
     }
+  }
+
+  for (auto it = outputs.begin(); it != outputs.end(); it++) {
     if (policy_ == Policy::CACHE_GIT_REFS) {
-      gitDirectory_.registerNode((*it)->getHash(), *it);
+      gitDirectory_.registerNode((*it)->getHash().toHex(), *it);
     }
   }
 
   if (policy_ == Policy::CACHE_GIT_REFS) {
-    gitDirectory_.registerRule(rule->getHashDepfile(), rule);
+    gitDirectory_.registerRule(rule->getHashDepfile().toHex(), rule);
   }
 
-  /* Retrieve all the outputs. */
-  for (auto it = outputs.begin(); it != outputs.end(); it++) {
-    if (!cacheFs_.readEntry((*it)->getHash(), (*it)->getPath())) {
-      return false;
+  /* Retrieve all the outputs. A wide rule (codegen emitting hundreds of
+   * files) is restored by a small I/O pool so its cache-hit latency scales
+   * with disk bandwidth, not output count; each restore is an independent
+   * copy out of the store. */
+  if (outputs.size() <= 1) {
+    for (auto it = outputs.begin(); it != outputs.end(); it++) {
+      if (!cacheFs_.readEntry((*it)->getHash().toHex(), (*it)->getPath())) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  std::atomic<std::size_t> next(0);
+  std::atomic<bool> restored(true);
+  std::size_t numWorkers = std::min(kNumRestoreThreads, outputs.size());
+  std::vector<std::thread> workers;
+  for (std::size_t i = 0; i < numWorkers; ++i) {
+    workers.push_back(std::thread([this, &next, &restored, &outputs]() {
+      for (;;) {
+        std::size_t i = next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= outputs.size()) {
+          return;
+        }
+        Node* node = outputs[i];
+        if (!cacheFs_.readEntry(node->getHash().toHex(), node->getPath())) {
+          restored.store(false, std::memory_order_relaxed);
+        }
+      }
+    }));
+  }
+  for (auto it = workers.begin(); it != workers.end(); ++it) {
+    it->join();
+  }
+
+  return restored.load();
+}
+
+void CacheManager::trimToBudget(std::size_t budgetMb) {
+  if (budgetMb != 0) {
+    std::unordered_set<std::string> preferred;
+    if (policy_ == Policy::CACHE_GIT_REFS) {
+      gitDirectory_.getCurrentRefEntries(&preferred);
+    }
+
+    std::size_t evicted = cacheFs_.trimToBudget(
+        static_cast<off_t>(budgetMb) * 1024 * 1024, preferred);
+    if (evicted > 0) {
+      LOG(INFO) << "cache over budget, evicted " << evicted << " entries";
     }
   }
 
-  return true;
+  /* Idle moment either way: reclaim the space of dead packfile records. */
+  cacheFs_.compactPack();
 }
 
 bool CacheManager::restoreDepfile(Rule* rule) {
-  return cacheFs_.readEntry(rule->getHashDepfile(), rule->getDepfile());
+  std::string hash = rule->getHashDepfile().toHex();
+  if (!cacheFs_.hasEntry(hash) && !fetchFromRemote(hash)) {
+    return false;
+  }
+  return cacheFs_.readEntry(hash, rule->getDepfile());
 }
 
 } // namespace falcon
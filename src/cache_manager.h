@@ -6,8 +6,14 @@
 #ifndef FALCON_CACHE_MANAGER_H_
 #define FALCON_CACHE_MANAGER_H_
 
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "cache_fs.h"
 #include "cache_git_directory.h"
@@ -16,6 +22,7 @@ namespace falcon {
 
 class Rule;
 class Node;
+class RemoteCache;
 
 class CacheManager {
  public:
@@ -38,6 +45,9 @@ class CacheManager {
   CacheManager(const std::string& workingDirectory,
                const std::string& falconDir);
 
+  /** Drains the pending cache writes before joining the writer thread. */
+  ~CacheManager();
+
   void setPolicy(Policy policy) { policy_ = policy; }
   Policy getPolicy() const { return policy_; }
 
@@ -50,9 +60,31 @@ class CacheManager {
   /**
    * Called after a rule was built. Save all the outputs and the depfile
    * in cache.
+   *
+   * The copies themselves are write-behind: this only snapshots the
+   * (hash, path) pairs and hands them to a background writer thread, so
+   * the builder's completion path never waits on cache I/O. The queue is
+   * bounded: if the writer falls too far behind, this call blocks until
+   * it catches up.
    */
   void saveRule(Rule* rule);
 
+  /**
+   * Same, but the depfile entry is persisted from the given in-memory
+   * content instead of being read back from the depfile path. Used when
+   * depfiles are captured in the scratch directory and never live on the
+   * project disk, see GraphParallelBuilder.
+   */
+  void saveRule(Rule* rule, const std::string& depfileContent);
+
+  /**
+   * Wait until the background writer has committed every enqueued save.
+   * Called when the daemon goes idle, before trimming and persisting the
+   * index, and makes the writer quiescent across builds: an output is
+   * never copied while a later build rewrites it.
+   */
+  void waitForPendingSaves();
+
   /**
    * Try to restore a node from the cache.
    * @param node Node to be restored.
@@ -60,6 +92,45 @@ class CacheManager {
    */
   bool restoreNode(Node* node);
 
+  /**
+   * Attach a remote cache tier. Entries missing from the local store are
+   * looked up there and, when found, pulled into the local store. May be
+   * null: the cache then stays purely local.
+   */
+  void setRemoteCache(std::unique_ptr<RemoteCache> remote);
+
+  /**
+   * Probe the cache for a whole batch of entries in one query: the local
+   * index first, then one batched RPC to the remote tier for the local
+   * misses. Much cheaper than one hasEntry call per node when probing a
+   * frontier of candidates, see LazyCache::fetch.
+   * @param hashes Hashes to probe.
+   * @param hits Filled with one flag per hash, in the same order.
+   */
+  void hasEntries(const std::vector<std::string>& hashes,
+                  std::vector<bool>* hits);
+
+  /**
+   * Probe the local store only, on behalf of a peer daemon using us as its
+   * remote tier. Never consults our own remote tier: a probe must not
+   * cascade through a chain of daemons.
+   */
+  void hasLocalEntries(const std::vector<std::string>& hashes,
+                       std::vector<bool>* hits) {
+    cacheFs_.hasEntries(hashes, hits);
+  }
+
+  /**
+   * Read a chunk of a local entry in its stored form, on behalf of a peer
+   * daemon. See CacheFS::readEntryRaw.
+   */
+  bool readEntryChunk(const std::string& hash, off_t offset,
+                      std::size_t maxBytes, std::string* data,
+                      bool* compressed, bool* eof) {
+    return cacheFs_.readEntryRaw(hash, offset, maxBytes, data, compressed,
+                                 eof);
+  }
+
   /**
    * Try to restore all the outputs of the given rule from the cache.
    * @param rule Rule to be restored.
@@ -76,16 +147,74 @@ class CacheManager {
    */
   bool restoreDepfile(Rule* rule);
 
+  /**
+   * Persist the in-memory index of the cache contents. Called when the
+   * daemon is idle.
+   */
+  void saveIndex() { cacheFs_.saveIndex(); }
+
+  /**
+   * Evict least-recently-used entries until the cache fits in the given
+   * budget. Entries registered for the current git ref are kept for last:
+   * they are what a rebuild of the current branch would hit. Called when
+   * the daemon is idle. A budget of 0 disables eviction.
+   */
+  void trimToBudget(std::size_t budgetMb);
+
  private:
+  /** A cache write waiting for the writer thread: the content of path is
+   * to be stored under hash. The pair is snapshotted at enqueue time so
+   * the writer never reads the graph. When fromBuffer is set the entry is
+   * stored from content instead: path may not exist anymore by the time
+   * the writer runs. */
+  struct PendingSave {
+    std::string hash;
+    std::string path;
+    std::string content;
+    bool fromBuffer;
+  };
+
+  /** Common body of the saveRule overloads. depfileContent may be null. */
+  void doSaveRule(Rule* rule, const std::string* depfileContent);
+
   /**
-   * Save a node in cache.
+   * Register a node with the git directory and snapshot its pending save.
    */
-  bool saveNode(Node* node);
+  void saveNode(Node* node, std::vector<PendingSave>* saves);
+
+  /** Push the saves of one rule to the writer queue, blocking while the
+   * queue is full. */
+  void enqueueSaves(std::vector<PendingSave>& saves);
+
+  /** Body of the background cache writer thread. */
+  void writerThread();
+
+  /** Pull an entry missing locally from the remote tier, if any. */
+  bool fetchFromRemote(const std::string& hash);
 
   Policy policy_;
   std::string workingDirectory_;
   CacheFS cacheFs_;
   CacheGitDirectory gitDirectory_;
+
+  /** Remote cache tier, null when not configured. */
+  std::unique_ptr<RemoteCache> remote_;
+
+  /** Number of threads restoring the outputs of one wide rule, see
+   * restoreRule. */
+  static const std::size_t kNumRestoreThreads = 4;
+
+  /* Write-behind state. saveMutex_ guards the queue and the counters;
+   * saveCond_ wakes the writer, spaceCond_ wakes producers blocked on a
+   * full queue and the threads waiting in waitForPendingSaves. */
+  static const std::size_t kMaxPendingSaves = 256;
+  std::deque<PendingSave> saveQueue_;
+  std::mutex saveMutex_;
+  std::condition_variable saveCond_;
+  std::condition_variable spaceCond_;
+  std::size_t pendingSaves_;
+  bool saveStop_;
+  std::thread writer_;
 };
 
 } // namespace falcon
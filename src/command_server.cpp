@@ -60,10 +60,19 @@ void FalconServiceHandler::getHashOf(std::string& hash,
   daemon_->getHashOf(hash, target);
 }
 
+void FalconServiceHandler::getNodesInfo(std::vector<NodeInfo>& infos,
+                                        const std::vector<std::string>& paths) {
+  daemon_->getNodesInfo(infos, paths);
+}
+
 void FalconServiceHandler::setDirty(const std::string& target) {
   daemon_->setDirty(target);
 }
 
+void FalconServiceHandler::notifyNodesBuilt(const std::set<std::string>& paths) {
+  daemon_->notifyNodesBuilt(paths);
+}
+
 void FalconServiceHandler::shutdown() {
   daemon_->shutdown();
 }
@@ -72,23 +81,91 @@ void FalconServiceHandler::getGraphviz(std::string& str) {
   daemon_->getGraphviz(str);
 }
 
-CommandServer::CommandServer(DaemonInstance* daemon, int port) {
+void FalconServiceHandler::getGraphExport(GraphExportChunk& chunk,
+                                          GraphExportFormat::type format,
+                                          int64_t cursor, int32_t maxBytes) {
+  daemon_->getGraphExport(chunk, format, cursor, maxBytes);
+}
+
+void FalconServiceHandler::executeRule(RemoteRuleResult& result,
+                                       const RemoteRuleRequest& request) {
+  daemon_->executeRule(result, request);
+}
+
+void FalconServiceHandler::prefetchCache() {
+  daemon_->prefetchCache();
+}
+
+void FalconServiceHandler::hasCacheEntries(
+    std::vector<bool>& hits, const std::vector<std::string>& hashes) {
+  daemon_->hasCacheEntries(hits, hashes);
+}
+
+void FalconServiceHandler::getCacheEntry(CacheEntryChunk& chunk,
+                                         const std::string& hash,
+                                         int64_t offset, int32_t maxBytes) {
+  daemon_->getCacheEntry(chunk, hash, offset, maxBytes);
+}
+
+void FalconServiceHandler::getStats(std::map<std::string, int64_t>& stats) {
+  daemon_->getStats(stats);
+}
+
+void FalconServiceHandler::getBuildProfile(BuildProfile& profile,
+                                           int32_t numSlowRules) {
+  daemon_->getBuildProfile(profile, numSlowRules);
+}
+
+CommandServer::CommandServer(DaemonInstance* daemon, int port,
+                             const std::string& unixSocketPath)
+    : unixSocketPath_(unixSocketPath) {
   handler_.reset(new FalconServiceHandler(daemon));
   processor_.reset(new FalconServiceProcessor(handler_));
-  serverTransport_.reset(new TServerSocket(port));
-  transportFactory_.reset(new TBufferedTransportFactory());
   protocolFactory_.reset(new TBinaryProtocolFactory());
 
-  server_.reset(new TThreadedServer(processor_, serverTransport_,
-                                    transportFactory_, protocolFactory_));
+  /* Requests are processed by a small worker pool; the io thread only does
+   * non-blocking socket work. One connection per thread (the previous
+   * TThreadedServer setup) let a wedged client delay everybody else. */
+  threadManager_ = ThreadManager::newSimpleThreadManager(kNumWorkerThreads);
+  threadManager_->threadFactory(
+      boost::shared_ptr<PosixThreadFactory>(new PosixThreadFactory()));
+  threadManager_->start();
+
+  /* Note: TNonblockingServer speaks the framed transport, clients must use
+   * TFramedTransport instead of TBufferedTransport. */
+  server_.reset(new TNonblockingServer(processor_, protocolFactory_, port,
+                                       threadManager_));
+
+  if (!unixSocketPath_.empty()) {
+    /* A previous daemon that died uncleanly leaves its socket file behind
+     * and bind would fail on it. */
+    unlink(unixSocketPath_.c_str());
+    boost::shared_ptr<transport::TServerSocket> socket(
+        new transport::TServerSocket(unixSocketPath_));
+    boost::shared_ptr<transport::TTransportFactory> transportFactory(
+        new transport::TBufferedTransportFactory());
+    boost::shared_ptr<TProtocolFactory> compactFactory(
+        new TCompactProtocolFactory());
+    unixServer_.reset(new TThreadedServer(processor_, socket,
+                                          transportFactory, compactFactory));
+  }
 }
 
 void CommandServer::start() {
+  if (unixServer_) {
+    unixThread_ = std::thread([this] { unixServer_->serve(); });
+  }
   server_->serve();
 }
 
 void CommandServer::stop() {
+  if (unixServer_) {
+    unixServer_->stop();
+    unixThread_.join();
+    unlink(unixSocketPath_.c_str());
+  }
   server_->stop();
+  threadManager_->stop();
 }
 
 } // namespace falcon
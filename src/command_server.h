@@ -8,18 +8,25 @@
 
 #include "FalconService.h"
 
+#include <string>
+#include <thread>
+
+#include <thrift/concurrency/PosixThreadFactory.h>
+#include <thrift/concurrency/ThreadManager.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
 #include <thrift/server/TThreadedServer.h>
-#include <thrift/transport/TServerSocket.h>
 #include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
 
 namespace falcon {
 
 class DaemonInstance;
 
 using namespace ::apache::thrift;
+using namespace ::apache::thrift::concurrency;
 using namespace ::apache::thrift::protocol;
-using namespace ::apache::thrift::transport;
 using namespace ::apache::thrift::server;
 
 class FalconServiceHandler : virtual public FalconServiceIf {
@@ -36,10 +43,23 @@ class FalconServiceHandler : virtual public FalconServiceIf {
   void getInputsOf(std::set<std::string>& inputs, const std::string& target);
   void getOutputsOf(std::set<std::string>& outputs, const std::string& target);
   void getHashOf(std::string& hash, const std::string& target);
+  void getNodesInfo(std::vector<NodeInfo>& infos,
+                    const std::vector<std::string>& paths);
   void setDirty(const std::string& target);
+  void notifyNodesBuilt(const std::set<std::string>& paths);
   void interruptBuild();
   void shutdown();
   void getGraphviz(std::string& str);
+  void getGraphExport(GraphExportChunk& chunk, GraphExportFormat::type format,
+                      int64_t cursor, int32_t maxBytes);
+  void executeRule(RemoteRuleResult& result, const RemoteRuleRequest& request);
+  void prefetchCache();
+  void hasCacheEntries(std::vector<bool>& hits,
+                       const std::vector<std::string>& hashes);
+  void getCacheEntry(CacheEntryChunk& chunk, const std::string& hash,
+                     int64_t offset, int32_t maxBytes);
+  void getStats(std::map<std::string, int64_t>& stats);
+  void getBuildProfile(BuildProfile& profile, int32_t numSlowRules);
 
  private:
   DaemonInstance* daemon_;
@@ -47,17 +67,37 @@ class FalconServiceHandler : virtual public FalconServiceIf {
 
 class CommandServer {
  public:
-  explicit CommandServer(DaemonInstance* daemon, int port);
+  /**
+   * @param daemon         Daemon the requests are forwarded to.
+   * @param port           TCP port of the network API.
+   * @param unixSocketPath Path of the local unix-domain endpoint, speaking
+   *                       the compact protocol. Empty to disable it.
+   */
+  CommandServer(DaemonInstance* daemon, int port,
+                const std::string& unixSocketPath);
   void start();
   void stop();
 
  private:
+  /** Number of worker threads processing requests. The io thread only does
+   * non-blocking socket work, so a slow or wedged client connection cannot
+   * hold up the other falcon invocations. */
+  static const size_t kNumWorkerThreads = 4;
+
   boost::shared_ptr<FalconServiceHandler> handler_;
   boost::shared_ptr<TProcessor> processor_;
-  boost::shared_ptr<TServerTransport> serverTransport_;
-  boost::shared_ptr<TTransportFactory> transportFactory_;
   boost::shared_ptr<TProtocolFactory> protocolFactory_;
-  std::unique_ptr<TThreadedServer> server_;
+  boost::shared_ptr<ThreadManager> threadManager_;
+  std::unique_ptr<TNonblockingServer> server_;
+
+  /* Local endpoint for the CLI and editor integrations: a unix-domain
+   * socket speaking the compact protocol, served by one thread per
+   * connection so a long-lived client keeps its connection open between
+   * calls. Skips TCP and frame overhead; a status query is dominated by
+   * the daemon, not the transport. */
+  std::string unixSocketPath_;
+  std::unique_ptr<TThreadedServer> unixServer_;
+  std::thread unixThread_;
 
   CommandServer(const CommandServer& other) = delete;
   CommandServer& operator=(const CommandServer&) = delete;
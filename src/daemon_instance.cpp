@@ -3,21 +3,35 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
 #include <sstream>
 #include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <thrift/transport/TSocket.h>
 
 #include "daemon_instance.h"
 
 #include "command_server.h"
 #include "exceptions.h"
+#include "fs.h"
 #include "graph_consistency_checker.h"
 #include "graph_hash.h"
+#include "graph_snapshot.h"
+#include "duration_cache.h"
+#include "hash_cache.h"
 #include "graph_parallel_builder.h"
 #include "graph_reloader.h"
 #include "graphparser.h"
 #include "lazy_cache.h"
 #include "logging.h"
-#include "watchman.h"
+#include "posix_subprocess.h"
+#include "state_journal.h"
+#include "stats.h"
 
 using namespace std::placeholders;
 
@@ -27,25 +41,65 @@ DaemonInstance::DaemonInstance(std::unique_ptr<GlobalConfig> gc,
                                std::unique_ptr<CacheManager> cache)
     : buildId_(0)
     , config_(std::move(gc))
-    , watchmanClient_(config_->getWorkingDirectoryPath())
     , isBuilding_(false)
+    , starting_(false)
+    , queueStop_(false)
+    , prefetching_(false)
+    , dirtyStop_(false)
     , streamServer_()
-    , cache_(std::move(cache)) { }
+    , cache_(std::move(cache)) {
+  watcher_ = FileWatcher::create(config_->getWatcherBackend(),
+                                 config_->getWorkingDirectoryPath());
+  if (config_->isTraceEnabled()) {
+    tracer_.setOutputDirectory(config_->getFalconDir());
+  }
+  if (!config_->getRemotePeers().empty()) {
+    remote_.reset(new RemoteExecutor(config_->getRemotePeers(),
+                                     config_->getWorkingDirectoryPath()));
+  }
+}
 
 void DaemonInstance::loadConf(std::unique_ptr<Graph> gp) {
   graph_ = std::move(gp);
+  /* The loaded graph is known acyclic (checked by main, or restored from a
+   * snapshot of a checked graph): seed the maintained topological order so
+   * reloads only re-validate what they change. */
+  topoOrder_.init(*graph_);
 }
 
 void DaemonInstance::start() {
   assert(!commandServer_);
   assert(graph_);
 
-  /* Register all source files to watchman. */
-  try {
-    watchmanClient_.watchGraph(*graph_);
-  } catch (falcon::Exception& e) {
-    LOG(ERROR) << e.getErrorMessage();
-  }
+  /* In-process backends deliver notifications through these callbacks;
+   * watchman keeps going through the "falcon --set-dirty" triggers. */
+  watcher_->setCallbacks(
+      [this](const std::string& path) {
+        try {
+          setDirty(path);
+        } catch (TargetNotFound&) {
+          DLOG(WARNING) << "notification for unknown target " << path;
+        }
+      },
+      [this]() { prefetchCache(); });
+
+  /* Register all source files to the file watcher in the background: the
+   * registration is socket I/O proportional to the graph size, and nothing
+   * below needs it to start serving. A file changing before its
+   * registration lands is missed exactly like it was when the registration
+   * ran inline, ahead of the servers. */
+  watchThread_ = std::thread([this]() {
+    try {
+      watcher_->watchGraph(*graph_);
+      if (cache_->getPolicy() == CacheManager::Policy::CACHE_GIT_REFS) {
+        /* Warm the cache up in the background when the git ref changes, see
+         * prefetchCache. */
+        watcher_->watchGitHead();
+      }
+    } catch (falcon::Exception& e) {
+      LOG(ERROR) << e.getErrorMessage();
+    }
+  });
 
   FALCON_CHECK_GRAPH_CONSISTENCY(graph_.get(), mutex_);
 
@@ -54,12 +108,36 @@ void DaemonInstance::start() {
   std::thread streamServerThread = std::thread(&StreamServer::run,
                                                &streamServer_);
 
+  /* Start the thread that drains the build queue. */
+  queueThread_ = std::thread(&DaemonInstance::buildQueueThread, this);
+
+  /* Start the thread that applies batched dirty marks. */
+  dirtyThread_ = std::thread(&DaemonInstance::dirtyBatchThread, this);
+
   /* Start the server. This will block until the server shuts down. */
   LOG(INFO) << "Starting server...";
-  commandServer_.reset(new CommandServer(this, config_->getNetworkAPIPort()));
+  commandServer_.reset(new CommandServer(this, config_->getNetworkAPIPort(),
+                                         config_->getCommandSocketPath()));
   commandServer_->start();
 
   /* If we reach here, the server was shut down. */
+  {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    queueStop_ = true;
+    buildQueue_.clear();
+  }
+  queueCond_.notify_all();
+  queueThread_.join();
+  {
+    std::lock_guard<std::mutex> g(dirtyMutex_);
+    dirtyStop_ = true;
+  }
+  dirtyCond_.notify_all();
+  dirtyThread_.join();
+  if (prefetchThread_.joinable()) {
+    prefetchThread_.join();
+  }
+  waitForWatcher();
   if (builder_) {
     builder_->wait();
   }
@@ -92,24 +170,103 @@ StartBuildResult::type DaemonInstance::startBuild(
     const std::set<std::string>& targets, int32_t numThreads, bool lazyFetch) {
   assert(graph_);
 
-  if (isBuilding_.load(std::memory_order_acquire)) {
-     return StartBuildResult::BUSY;
+  checkSourcesMissing();
+
+  {
+    /* Report an unknown target right away, even if the request ends up
+     * queued. */
+    shared_lock_guard g(mutex_);
+    for (auto it = targets.begin(); it != targets.end(); ++it) {
+      if (graph_->getNodes().find(getPathTable().find(*it))
+          == graph_->getNodes().end()) {
+        InvalidBuildError e;
+        e.desc = "Unknown target " + *it;
+        throw e;
+      }
+    }
+  }
+
+  QueuedBuild build;
+  build.targets = targets;
+  build.numThreads = numThreads;
+  build.lazyFetch = lazyFetch;
+
+  {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    if (isBuilding_.load(std::memory_order_acquire) || starting_
+        || !buildQueue_.empty()) {
+      /* A build is ongoing: queue the request instead of reporting BUSY.
+       * Merge it into a compatible queued request so that back-to-back
+       * submissions collapse into one build. An empty target set means
+       * "build everything" and absorbs any other set. */
+      for (auto it = buildQueue_.begin(); it != buildQueue_.end(); ++it) {
+        if (it->lazyFetch == lazyFetch) {
+          if (it->targets.empty() || targets.empty()) {
+            it->targets.clear();
+          } else {
+            it->targets.insert(targets.begin(), targets.end());
+          }
+          it->numThreads = std::max(it->numThreads, numThreads);
+          return StartBuildResult::QUEUED;
+        }
+      }
+      buildQueue_.push_back(build);
+      return StartBuildResult::QUEUED;
+    }
+    starting_ = true;
+  }
+
+  try {
+    doStartBuild(build);
+  } catch (...) {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    starting_ = false;
+    throw;
   }
+  {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    starting_ = false;
+  }
+
+  return StartBuildResult::OK;
+}
+
+void DaemonInstance::doStartBuild(QueuedBuild const& build) {
+  /* The builder talks to the watcher when a depfile discovers new
+   * dependencies (and inserts the nodes into the graph). */
+  waitForWatcher();
+
+  /* The build must see every notification received so far: apply whatever
+   * the debounce window is still holding back. */
+  flushDirty();
 
   if (cache_->getPolicy() == CacheManager::Policy::CACHE_GIT_REFS) {
     cache_->gitUpdateRef();
   }
 
-  checkSourcesMissing();
-
   FALCON_CHECK_GRAPH_CONSISTENCY(graph_.get(), mutex_);
 
+  {
+    /* Fast path for no-op builds: the graph maintains its dirty rule set
+     * incrementally, so "nothing to do" is answered in O(1) instead of
+     * walking the whole target closure. */
+    shared_lock_guard g(mutex_);
+    if (graph_->getDirtyRules().empty()) {
+      LOG(INFO) << "Nothing to build.";
+      streamServer_.newBuild(buildId_);
+      streamServer_.endBuild(BuildResult::SUCCEEDED);
+      ++buildId_;
+      return;
+    }
+  }
+
   NodeSet targetsToBuild;
-  if (targets.empty()) {
-    targetsToBuild = graph_->getRoots();
+  if (build.targets.empty()) {
+    auto const& roots = graph_->getRoots();
+    targetsToBuild.insert(roots.begin(), roots.end());
   } else {
-    for (auto it = targets.begin(); it != targets.end(); ++it) {
-      auto itFind = graph_->getNodes().find(*it);
+    for (auto it = build.targets.begin(); it != build.targets.end(); ++it) {
+      auto itFind = graph_->getNodes().find(getPathTable().find(*it));
       if (itFind == graph_->getNodes().end()) {
         InvalidBuildError e;
         e.desc = "Unknown target " + *it;
@@ -120,6 +277,9 @@ StartBuildResult::type DaemonInstance::startBuild(
     }
   }
 
+  int32_t numThreads = build.numThreads;
+  bool lazyFetch = build.lazyFetch;
+
   isBuilding_.store(true, std::memory_order_release);
   streamServer_.newBuild(buildId_);
 
@@ -135,17 +295,109 @@ StartBuildResult::type DaemonInstance::startBuild(
   /* Create a build plan that builds everything. */
   /* TODO: if lazy fetch is disabled, BuildPlan should make sure that any target
    * that was lazy fetched in the past is marked dirty. */
-  plan_.reset(new BuildPlan(targetsToBuild));
+  /* Record the timings of this build, see getBuildProfile. Rules that are
+   * ready before the profiler is attached to the plan are counted as ready
+   * from the start of the build. */
+  profiler_.startBuild(buildId_);
+  tracer_.startBuild(buildId_);
+
+  if (build.targets.empty()) {
+    /* Build-everything request: plan directly over the dirty rules instead
+     * of walking the closure of every root. */
+    lock_guard g(mutex_);
+    plan_.reset(new BuildPlan(graph_->getDirtyRules()));
+  } else {
+    plan_.reset(new BuildPlan(targetsToBuild));
+  }
+  plan_->setProfiler(&profiler_);
+  plan_->setTracer(&tracer_);
 
   auto callback = std::bind(&DaemonInstance::onBuildCompleted, this, _1);
   builder_.reset(
       new GraphParallelBuilder(*graph_, *plan_, cache_.get(), &streamServer_,
-                               &watchmanClient_,
+                               watcher_.get(),
                                config_->getWorkingDirectoryPath(),
-                               numThreads, mutex_, callback));
+                               config_->getScratchDir(),
+                               numThreads, mutex_, remote_.get(), &profiler_,
+                               &tracer_, callback));
   builder_->startBuild();
+}
 
-  return StartBuildResult::OK;
+void DaemonInstance::buildQueueThread() {
+  for (;;) {
+    QueuedBuild build;
+    {
+      std::unique_lock<std::mutex> l(queueMutex_);
+      /* onBuildCompleted signals outside of queueMutex_ (see there), so a
+       * wakeup can race with this predicate check. Re-check on a timeout
+       * instead of waiting forever. */
+      while (!queueStop_
+          && (buildQueue_.empty() || starting_
+              || isBuilding_.load(std::memory_order_acquire))) {
+        queueCond_.wait_for(l, std::chrono::milliseconds(100));
+      }
+      if (queueStop_) {
+        return;
+      }
+      build = buildQueue_.front();
+      buildQueue_.pop_front();
+      starting_ = true;
+    }
+
+    try {
+      doStartBuild(build);
+    } catch (InvalidBuildError& e) {
+      /* The graph may have been reloaded since the request was queued. The
+       * submitter already got QUEUED: all we can do is log. */
+      LOG(ERROR) << "Dropping queued build: " << e.desc;
+    }
+
+    {
+      std::lock_guard<std::mutex> g(queueMutex_);
+      starting_ = false;
+    }
+    /* The build may have failed to start: give the queue another chance. */
+    queueCond_.notify_all();
+  }
+}
+
+/* Push a cross-shard completion notification to every peer daemon, see
+ * graph_partition.h. Runs on a detached thread with its own copies of the
+ * arguments: a slow or dead peer must not hold up this daemon, and a missed
+ * notification only delays the peer until its own watcher or a manual
+ * set-dirty catches up. */
+static void notifyShardPeers(std::vector<std::string> peers,
+                             std::set<std::string> built) {
+  namespace att = ::apache::thrift::transport;
+  namespace atp = ::apache::thrift::protocol;
+
+  for (auto it = peers.begin(); it != peers.end(); ++it) {
+    auto pos = it->rfind(':');
+    if (pos == std::string::npos) {
+      LOG(ERROR) << "invalid shard peer '" << *it << "', expected host:port";
+      continue;
+    }
+    try {
+      boost::shared_ptr<att::TSocket> socket(
+          new att::TSocket(it->substr(0, pos),
+                           atoi(it->substr(pos + 1).c_str())));
+      socket->setConnTimeout(5000);
+      /* The command server is a TNonblockingServer: it speaks the framed
+       * transport. */
+      boost::shared_ptr<att::TTransport> transport(
+          new att::TFramedTransport(socket));
+      boost::shared_ptr<atp::TProtocol> protocol(
+          new atp::TBinaryProtocol(transport));
+      FalconServiceClient client(protocol);
+
+      transport->open();
+      client.notifyNodesBuilt(built);
+      transport->close();
+    } catch (::apache::thrift::TException& e) {
+      LOG(WARNING) << "could not notify shard peer " << *it << ": "
+                   << e.what();
+    }
+  }
 }
 
 void DaemonInstance::onBuildCompleted(BuildResult res) {
@@ -157,7 +409,86 @@ void DaemonInstance::onBuildCompleted(BuildResult res) {
   ++buildId_;
   isBuilding_.store(false, std::memory_order_release);
 
+  /* Seal the timings of this build, see getBuildProfile. */
+  profiler_.endBuild();
+  /* Write the Chrome trace of this build, if tracing is enabled. */
+  tracer_.endBuild();
+
+  {
+    /* Fold the build into the fleet counters, see stats.h. */
+    BuildProfiler::Profile profile;
+    if (profiler_.getLastProfile(&profile)) {
+      std::int64_t queueWaitMs = 0;
+      for (auto it = profile.rules.begin(); it != profile.rules.end(); ++it) {
+        queueWaitMs += it->queueWaitMs;
+      }
+      StatsRegistry& stats = getStatsRegistry();
+      stats.buildsCompleted.fetch_add(1, std::memory_order_relaxed);
+      stats.buildTimeMs.fetch_add(profile.totalTimeMs,
+                                  std::memory_order_relaxed);
+      stats.buildQueueWaitMs.fetch_add(queueWaitMs,
+                                       std::memory_order_relaxed);
+    }
+  }
+
+  /* The daemon is idle again: persist the hashes, rule durations and cache
+   * index learned by this build. */
+  getHashCache().save(config_->getHashCacheFile());
+  getDurationCache().save(config_->getDurationCacheFile());
+  cache_->waitForPendingSaves();
+  cache_->trimToBudget(config_->getCacheSizeMb());
+  cache_->saveIndex();
+  /* Make the states and timestamps of this build durable, see
+   * state_journal.h. */
+  getStateJournal().commit();
+
+  /* Tell the daemons owning the other shards of a partitioned graph what
+   * this build produced, so they re-state our boundary outputs without
+   * waiting for a filesystem event. The artifacts themselves travel through
+   * the shared filesystem or the cache tier. */
+  if (res == BuildResult::SUCCEEDED && !config_->getShardPeers().empty()) {
+    BuildProfiler::Profile profile;
+    if (profiler_.getLastProfile(&profile) && !profile.rules.empty()) {
+      std::set<std::string> built;
+      {
+        /* The profile names the first output of each rule that ran; expand
+         * to every output of those rules. */
+        shared_lock_guard g(mutex_);
+        auto& nodes = graph_->getNodes();
+        for (auto it = profile.rules.begin(); it != profile.rules.end();
+             ++it) {
+          auto node = nodes.find(getPathTable().find(it->output));
+          if (node == nodes.end() || node->second->getChild() == nullptr) {
+            continue;
+          }
+          auto& outputs = node->second->getChild()->getOutputs();
+          for (auto out = outputs.begin(); out != outputs.end(); ++out) {
+            built.insert((*out)->getPath());
+          }
+        }
+      }
+      if (!built.empty()) {
+        std::thread(notifyShardPeers, config_->getShardPeers(),
+                    std::move(built)).detach();
+      }
+    }
+  }
+
+  {
+    /* One bounded slice of the sampling consistency verification, now that
+     * the build left the graph in its settled state. */
+    shared_lock_guard g(mutex_);
+    consistencySampler_.slice(*graph_);
+  }
+
   LOG(INFO) << "Build completed. Status: " << toString(res);
+
+  /* Wake the queue thread so the next queued build starts immediately.
+   * This runs on the builder's thread: it must not take queueMutex_, since
+   * whoever starts the next build destroys this builder, which joins this
+   * thread. The queue thread re-checks its predicate on a timeout, so a
+   * wakeup racing with the predicate check is only delayed, never lost. */
+  queueCond_.notify_all();
 }
 
 FalconStatus::type DaemonInstance::getStatus() {
@@ -171,33 +502,35 @@ void DaemonInstance::interruptBuild() {
   }
 }
 
+/* Both queries walk the materialized dirty node set (see
+ * Graph::getDirtyNodes) instead of the whole graph: an editor polling them
+ * every second holds the lock for a time proportional to what is actually
+ * dirty, not to the graph size. */
 void DaemonInstance::getDirtySources(std::set<std::string>& sources) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
-  NodeSet& src = graph_->getSources();
-  for (auto it = src.begin(); it != src.end(); ++it) {
-    if ((*it)->getState() == State::OUT_OF_DATE) {
+  const NodeSet& dirty = graph_->getDirtyNodes();
+  for (auto it = dirty.begin(); it != dirty.end(); ++it) {
+    if ((*it)->isSource()) {
       sources.insert((*it)->getPath());
     }
   }
 }
 
 void DaemonInstance::getDirtyTargets(std::set<std::string>& targets) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
-  NodeMap& nodes = graph_->getNodes();
-  for (auto it = nodes.begin(); it != nodes.end(); ++it) {
-    if (it->second->getState() == State::OUT_OF_DATE) {
-      targets.insert(it->second->getPath());
-    }
+  const NodeSet& dirty = graph_->getDirtyNodes();
+  for (auto it = dirty.begin(); it != dirty.end(); ++it) {
+    targets.insert((*it)->getPath());
   }
 }
 
 void DaemonInstance::getInputsOf(std::set<std::string>& inputs,
                                  const std::string& target) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
-  auto it = graph_->getNodes().find(target);
+  auto it = graph_->getNodes().find(getPathTable().find(target));
   if (it == graph_->getNodes().end()) {
     throw TargetNotFound();
   }
@@ -213,9 +546,9 @@ void DaemonInstance::getInputsOf(std::set<std::string>& inputs,
 
 void DaemonInstance::getOutputsOf(std::set<std::string>& outputs,
                                   const std::string& target) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
-  auto it = graph_->getNodes().find(target);
+  auto it = graph_->getNodes().find(getPathTable().find(target));
   if (it == graph_->getNodes().end()) {
     throw TargetNotFound();
   }
@@ -230,29 +563,177 @@ void DaemonInstance::getOutputsOf(std::set<std::string>& outputs,
 }
 
 void DaemonInstance::getHashOf(std::string& hash, const std::string& target) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
-  auto it = graph_->getNodes().find(target);
+  auto it = graph_->getNodes().find(getPathTable().find(target));
   if (it == graph_->getNodes().end()) {
     throw TargetNotFound();
   }
 
-  hash = it->second->getHash();
+  hash = it->second->getHash().toHex();
+}
+
+void DaemonInstance::getNodesInfo(std::vector<NodeInfo>& infos,
+                                  const std::vector<std::string>& paths) {
+  shared_lock_guard g(mutex_);
+
+  /* One lock acquisition for the whole batch: tooling querying thousands of
+   * nodes pays the lock and the round trip once instead of per node. */
+  auto& map = graph_->getNodes();
+  infos.reserve(paths.size());
+  for (auto itPath = paths.begin(); itPath != paths.end(); ++itPath) {
+    NodeInfo info;
+    info.path = *itPath;
+    auto it = map.find(getPathTable().find(*itPath));
+    info.found = it != map.end();
+    if (info.found) {
+      Node* node = it->second;
+      info.dirty = node->isDirty();
+      info.hash = node->getHash().toHex();
+      info.timestamp = node->getTimestamp();
+    }
+    infos.push_back(info);
+  }
 }
 
 void DaemonInstance::setDirty(const std::string& target) {
-  lock_guard g(mutex_);
+  getStatsRegistry().watcherNotifications.fetch_add(
+      1, std::memory_order_relaxed);
 
   if (target == config_->getJsonGraphFile()) {
+    /* Apply the queued marks first: they were validated against the graph
+     * that is about to be replaced. */
+    flushDirty();
+    lock_guard g(mutex_);
     reloadGraph();
     falcon::GraphConsistencyChecker checker(graph_.get());
     checker.check();
     return;
   }
 
+  {
+    /* Report an unknown target to the caller right away; the actual marking
+     * is deferred to the batch. */
+    shared_lock_guard g(mutex_);
+    auto& map = graph_->getNodes();
+    if (map.find(getPathTable().find(target)) == map.end()) {
+      throw TargetNotFound();
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> g(dirtyMutex_);
+    if (dirtyPending_.empty()) {
+      dirtyFirstAt_ = std::chrono::steady_clock::now();
+    }
+    dirtyPending_.insert(target);
+  }
+  dirtyCond_.notify_all();
+}
+
+void DaemonInstance::notifyNodesBuilt(const std::set<std::string>& paths) {
+  /* Cross-shard completion notification, see graph_partition.h. Only the
+   * paths this shard consumes are meaningful here: feed them through the
+   * same debounced batch as watcher notifications and drop the rest, so a
+   * producer can broadcast without knowing who consumes what. */
+  for (auto it = paths.begin(); it != paths.end(); ++it) {
+    if (*it == config_->getJsonGraphFile()) {
+      /* Never let a peer trigger the graph-reload path. */
+      continue;
+    }
+    try {
+      setDirty(*it);
+    } catch (TargetNotFound&) {
+      /* Not part of this shard. */
+    }
+  }
+}
+
+void DaemonInstance::dirtyBatchThread() {
+  std::unique_lock<std::mutex> l(dirtyMutex_);
+  while (!dirtyStop_) {
+    if (dirtyPending_.empty()) {
+      /* Idle: keep the sampling consistency scan moving while waiting for
+       * the next notification, one bounded slice per wakeup. */
+      dirtyCond_.wait_for(l, std::chrono::seconds(1));
+      if (!dirtyStop_ && dirtyPending_.empty()
+          && !isBuilding_.load(std::memory_order_acquire)) {
+        l.unlock();
+        {
+          shared_lock_guard g(mutex_);
+          consistencySampler_.slice(*graph_);
+        }
+        l.lock();
+      }
+      continue;
+    }
+
+    /* Debounce: give the burst a chance to settle so a git checkout lands
+     * as one batch. If marks keep arriving, extend the window, but never
+     * hold a mark back longer than kMaxDebounceMs. */
+    std::size_t sizeBefore = dirtyPending_.size();
+    dirtyCond_.wait_for(l, std::chrono::milliseconds(kDebounceMs));
+    if (dirtyStop_) {
+      break;
+    }
+    if (dirtyPending_.size() != sizeBefore
+        && std::chrono::steady_clock::now() - dirtyFirstAt_
+            < std::chrono::milliseconds(kMaxDebounceMs)) {
+      continue;
+    }
+
+    std::set<std::string> batch;
+    batch.swap(dirtyPending_);
+    l.unlock();
+    applyDirtyBatch(batch);
+    {
+      /* Re-verify the freshly touched frontier right away. */
+      shared_lock_guard g(mutex_);
+      consistencySampler_.slice(*graph_);
+    }
+    l.lock();
+  }
+}
+
+void DaemonInstance::flushDirty() {
+  std::set<std::string> batch;
+  {
+    std::lock_guard<std::mutex> g(dirtyMutex_);
+    batch.swap(dirtyPending_);
+  }
+  if (!batch.empty()) {
+    applyDirtyBatch(batch);
+  }
+}
+
+void DaemonInstance::waitForWatcher() {
+  std::lock_guard<std::mutex> g(watchJoinMutex_);
+  if (watchThread_.joinable()) {
+    watchThread_.join();
+  }
+}
+
+void DaemonInstance::applyDirtyBatch(const std::set<std::string>& targets) {
+  /* Recomputing a node hash can re-read a depfile, which registers the
+   * discovered dependencies with the watcher and inserts them into the
+   * graph. */
+  waitForWatcher();
+  lock_guard g(mutex_);
+  DLOG(INFO) << "applying a batch of " << targets.size() << " dirty marks";
+  for (auto it = targets.begin(); it != targets.end(); ++it) {
+    try {
+      applyDirty(*it);
+    } catch (TargetNotFound&) {
+      /* The graph was reloaded after the mark was queued. */
+      DLOG(WARNING) << "dropping dirty mark for unknown target " << *it;
+    }
+  }
+}
+
+void DaemonInstance::applyDirty(const std::string& target) {
   /* Find the target. */
   auto& map = graph_->getNodes();
-  auto it = map.find(target);
+  auto it = map.find(getPathTable().find(target));
   if (it == map.end()) {
     throw TargetNotFound();
   }
@@ -261,6 +742,7 @@ void DaemonInstance::setDirty(const std::string& target) {
   if (!node->isSource() && node->getChild()->isPhony()) {
     /* This is a phony target. */
     node->markDirty();
+    consistencySampler_.touch(node->getPathId());
     return;
   }
 
@@ -293,8 +775,9 @@ void DaemonInstance::setDirty(const std::string& target) {
        * - we just lazy fetched the output from the cache. In that case the
        *   timestamp of the node output should be greater or equal.
        * In either case, don't mark the output dirty. */
-      if (node->getChild()->getTimestamp() >= st.st_mtime
-          || (node->isLazyFetched() && node->getTimestamp() >= st.st_mtime)) {
+      Timestamp mtime = timestampFromStat(st);
+      if (node->getChild()->getTimestamp() >= mtime
+          || (node->isLazyFetched() && node->getTimestamp() >= mtime)) {
         return;
       }
     }
@@ -306,7 +789,7 @@ void DaemonInstance::setDirty(const std::string& target) {
    * - it is a source file and the hash does not change (ie it *really*
    *   changed).
   */
-  if (!node->isSource() || hash::recomputeNodeHash(node, &watchmanClient_,
+  if (!node->isSource() || hash::recomputeNodeHash(node, watcher_.get(),
                                                    *graph_, cache_.get(),
                                                    true, true)) {
     node->markDirty();
@@ -315,13 +798,40 @@ void DaemonInstance::setDirty(const std::string& target) {
     if (!node->isSource()) {
       node->getChild()->setState(State::OUT_OF_DATE);
     }
+    /* The frontier of the propagation is re-verified by the next slice of
+     * the sampling consistency checker. */
+    consistencySampler_.touch(node->getPathId());
   }
 }
 
 void DaemonInstance::shutdown() {
   LOG(INFO) << "Shutting down.";
 
-  watchmanClient_.unwatchGraph(*graph_);
+  /* The snapshot below must reflect every notification received. */
+  flushDirty();
+
+  getHashCache().save(config_->getHashCacheFile());
+  getDurationCache().save(config_->getDurationCacheFile());
+  {
+    /* Refresh the snapshot so the next start sees the post-build states.
+     * Writing the snapshot only reads the graph: a shared lock is enough. */
+    shared_lock_guard g(mutex_);
+    GraphSnapshot::save(config_->getGraphSnapshotFile(), *graph_,
+                        hash::hashFile(config_->getJsonGraphFile()));
+  }
+  /* The startup registration may still be running if the daemon is shut
+   * down right away. */
+  waitForWatcher();
+
+  /* Pair the snapshot with the watchman clock of the same instant, so the
+   * next startup only rescans the files that change from here on. */
+  watcher_->saveClock();
+
+  /* The snapshot above folded in every journaled transition. */
+  getStateJournal().reset();
+  getStateJournal().close();
+
+  watcher_->unwatchGraph(*graph_);
 
   /* Interrupt the current build. */
   interruptBuild();
@@ -332,7 +842,7 @@ void DaemonInstance::shutdown() {
 }
 
 void DaemonInstance::getGraphviz(std::string& str) {
-  lock_guard g(mutex_);
+  shared_lock_guard g(mutex_);
 
   assert(graph_);
   std::ostringstream oss;
@@ -340,7 +850,276 @@ void DaemonInstance::getGraphviz(std::string& str) {
   str = oss.str();
 }
 
+void DaemonInstance::getGraphExport(GraphExportChunk& chunk,
+                                    GraphExportFormat::type format,
+                                    int64_t cursor, int32_t maxBytes) {
+  shared_lock_guard g(mutex_);
+  assert(graph_);
+
+  if (maxBytes <= 0) {
+    maxBytes = 1 << 20;
+  }
+
+  bool graphviz = format == GraphExportFormat::GRAPHVIZ;
+  NodeMap const& nodes = graph_->getNodes();
+  RuleArray const& rules = graph_->getRules();
+
+  /* Items are numbered linearly: 0 is the header, then one item per node,
+   * one per rule, and a final footer. The cursor is the next item to emit,
+   * so the daemon only ever holds one chunk of the export in memory.
+   * Resuming walks the node map up to the cursor, which is cheap next to
+   * formatting a chunk. */
+  int64_t const firstRuleItem = 1 + static_cast<int64_t>(nodes.size());
+  int64_t const footerItem = firstRuleItem + static_cast<int64_t>(rules.size());
+
+  if (cursor < 0) {
+    cursor = 0;
+  }
+  auto itNode = nodes.cbegin();
+  if (cursor > 1) {
+    std::advance(itNode,
+                 std::min(cursor - 1, static_cast<int64_t>(nodes.size())));
+  }
+
+  std::ostringstream oss;
+  while (cursor <= footerItem
+         && static_cast<int64_t>(oss.tellp()) < maxBytes) {
+    if (cursor == 0) {
+      graphviz ? printGraphvizHeader(oss) : printEdgeListHeader(oss);
+    } else if (cursor < firstRuleItem) {
+      graphviz ? printNodeGraphviz(*itNode->second, oss)
+               : printNodeEdgeList(*itNode->second, oss);
+      ++itNode;
+    } else if (cursor < footerItem) {
+      Rule const& rule = *rules[cursor - firstRuleItem];
+      graphviz ? printRuleGraphviz(rule, oss) : printRuleEdgeList(rule, oss);
+    } else if (graphviz) {
+      printGraphvizFooter(oss);
+    }
+    ++cursor;
+  }
+
+  chunk.data = oss.str();
+  chunk.nextCursor = cursor;
+  chunk.eof = cursor > footerItem;
+}
+
+void DaemonInstance::executeRule(RemoteRuleResult& result,
+                                 const RemoteRuleRequest& request) {
+  /* Run a rule on behalf of a peer daemon. The peer holds the same graph and
+   * made sure the inputs are up to date in our tree (identical source trees
+   * in the CI fleet); we only run the command and ship the outputs back. */
+  DLOG(INFO) << "executing rule for a peer: " << request.cmd;
+
+  result.exitCode = -1;
+
+  std::string const& workingDirectory = config_->getWorkingDirectoryPath();
+  for (auto it = request.outputs.begin(); it != request.outputs.end(); ++it) {
+    if (!fs::createPath(*it)) {
+      LOG(ERROR) << "could not create path " << *it;
+      return;
+    }
+  }
+  if (!request.depfile.empty() && !fs::createPath(request.depfile)) {
+    LOG(ERROR) << "could not create path " << request.depfile;
+    return;
+  }
+
+  /* Run the command from the working directory. PosixSubProcess takes the
+   * directory as is, so a path with shell metacharacters cannot break the
+   * command line. Empty argv: the command may need a shell. */
+  BufferStreamConsumer consumer;
+  PosixSubProcess process(request.cmd, std::vector<std::string>(),
+                          workingDirectory, 0, &consumer);
+  process.start();
+
+  /* Drain both streams until EOF; the read ends are non blocking. */
+  while (!process.completed()) {
+    struct pollfd fds[2];
+    nfds_t nfds = 0;
+    if (process.stdoutFd_ >= 0) {
+      fds[nfds].fd = process.stdoutFd_;
+      fds[nfds].events = POLLIN;
+      ++nfds;
+    }
+    if (process.stderrFd_ >= 0) {
+      fds[nfds].fd = process.stderrFd_;
+      fds[nfds].events = POLLIN;
+      ++nfds;
+    }
+    if (poll(fds, nfds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (nfds_t i = 0; i < nfds; ++i) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      fds[i].fd == process.stdoutFd_ ? process.readStdout()
+                                     : process.readStderr();
+    }
+  }
+  process.waitFinished();
+  result.exitCode =
+      process.status() == SubProcessExitStatus::SUCCEEDED ? 0 : 1;
+
+  /* Ship the tail of the output back so a failure can be diagnosed from the
+   * requesting daemon. */
+  static const std::size_t kMaxOutputBytes = 64 << 10;
+  std::string output = consumer.getStdout() + consumer.getStderr();
+  if (output.size() > kMaxOutputBytes) {
+    output.erase(0, output.size() - kMaxOutputBytes);
+  }
+  result.output = std::move(output);
+  if (result.exitCode != 0) {
+    return;
+  }
+
+  /* Ship the produced files back. */
+  auto readBack = [&workingDirectory](std::string const& path,
+                                      std::string* content) {
+    std::string fullPath =
+        path[0] == '/' ? path : workingDirectory + "/" + path;
+    std::ifstream ifs(fullPath, std::ios::in | std::ios::binary);
+    if (!ifs.is_open()) {
+      LOG(ERROR) << "could not read back output " << fullPath;
+      return false;
+    }
+    std::ostringstream oss;
+    oss << ifs.rdbuf();
+    *content = oss.str();
+    return true;
+  };
+  for (auto it = request.outputs.begin(); it != request.outputs.end(); ++it) {
+    if (!readBack(*it, &result.outputFiles[*it])) {
+      result.exitCode = -1;
+      return;
+    }
+  }
+  if (!request.depfile.empty()
+      && !readBack(request.depfile, &result.depfileContent)) {
+    result.exitCode = -1;
+  }
+}
+
+void DaemonInstance::prefetchCache() {
+  {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    if (isBuilding_.load(std::memory_order_acquire) || starting_
+        || !buildQueue_.empty() || prefetching_) {
+      /* A running or queued build restores whatever it needs from the cache
+       * anyway: warming up would only fight it for the graph lock. */
+      DLOG(INFO) << "prefetch request ignored, daemon is busy";
+      return;
+    }
+    prefetching_ = true;
+  }
+
+  /* Run the warm-up in the background so the thrift call returns
+   * immediately: the trigger command should not hang on a large restore. */
+  if (prefetchThread_.joinable()) {
+    prefetchThread_.join();
+  }
+  prefetchThread_ = std::thread(&DaemonInstance::doPrefetch, this);
+}
+
+void DaemonInstance::doPrefetch() {
+  LOG(INFO) << "Git ref changed, warming the cache up.";
+
+  if (cache_->getPolicy() == CacheManager::Policy::CACHE_GIT_REFS) {
+    cache_->gitUpdateRef();
+  }
+
+  {
+    lock_guard g(mutex_);
+    NodeSet roots(graph_->getRoots().begin(), graph_->getRoots().end());
+    /* No build is attached to the stream server: restore without a
+     * consumer. */
+    LazyCache lazyCache(roots, *cache_, nullptr);
+    lazyCache.fetch();
+  }
+  FALCON_CHECK_GRAPH_CONSISTENCY(graph_.get(), mutex_);
+
+  {
+    std::lock_guard<std::mutex> g(queueMutex_);
+    prefetching_ = false;
+  }
+}
+
+void DaemonInstance::hasCacheEntries(std::vector<bool>& hits,
+                                     const std::vector<std::string>& hashes) {
+  /* Serve from the local store only: a probe must not cascade through a
+   * chain of daemons using each other as remote tiers. */
+  cache_->hasLocalEntries(hashes, &hits);
+}
+
+void DaemonInstance::getCacheEntry(CacheEntryChunk& chunk,
+                                   const std::string& hash,
+                                   int64_t offset, int32_t maxBytes) {
+  chunk.found = false;
+  chunk.eof = true;
+  chunk.compressed = false;
+  if (hash.empty() || offset < 0 || maxBytes <= 0) {
+    return;
+  }
+  chunk.found = cache_->readEntryChunk(hash, static_cast<off_t>(offset),
+                                       static_cast<std::size_t>(maxBytes),
+                                       &chunk.data, &chunk.compressed,
+                                       &chunk.eof);
+  if (!chunk.found) {
+    chunk.data.clear();
+    chunk.eof = true;
+  }
+}
+
+void DaemonInstance::getStats(std::map<std::string, int64_t>& stats) {
+  /* Counters are atomics: no lock to take. */
+  getStatsRegistry().collect(stats);
+}
+
+void DaemonInstance::getBuildProfile(BuildProfile& profile,
+                                     int32_t numSlowRules) {
+  BuildProfiler::Profile last;
+  if (!profiler_.getLastProfile(&last)) {
+    throw NoCompletedBuildError();
+  }
+
+  if (numSlowRules <= 0) {
+    numSlowRules = 10;
+  }
+
+  auto convert = [](BuildProfiler::RuleTiming const& timing) {
+    RuleTiming r;
+    r.output = timing.output;
+    r.queueWaitMs = timing.queueWaitMs;
+    r.executionMs = timing.executionMs;
+    r.cacheHit = timing.cacheHit;
+    return r;
+  };
+
+  profile.buildId = last.buildId;
+  profile.totalTimeMs = last.totalTimeMs;
+  for (auto it = last.criticalPath.begin(); it != last.criticalPath.end();
+       ++it) {
+    profile.criticalPath.push_back(convert(*it));
+  }
+  /* last.rules is sorted by decreasing execution time. */
+  for (auto it = last.rules.begin();
+       it != last.rules.end()
+           && profile.slowestRules.size()
+               < static_cast<std::size_t>(numSlowRules);
+       ++it) {
+    profile.slowestRules.push_back(convert(*it));
+  }
+}
+
 void DaemonInstance::reloadGraph() {
+  /* The reloader re-registers nodes with the watcher: wait for the startup
+   * registration if it is somehow still running. */
+  waitForWatcher();
+
   GraphParser graphParser(config_->getJsonGraphFile());
 
   try {
@@ -352,15 +1131,25 @@ void DaemonInstance::reloadGraph() {
 
   std::unique_ptr<Graph> graphPtr = std::move(graphParser.getGraph());
   try {
-    checkGraphLoop(*graphPtr);
+    /* Incremental validation: edges that respect the maintained topological
+     * order are accepted in O(1), only the region around new or rewired
+     * edges is traversed. See GraphTopoOrder. */
+    topoOrder_.check(*graphPtr);
   } catch (Exception& e) {
     LOG(ERROR) << e.getErrorMessage();
+    /* The rejected reload left the order half-updated: rebuild it from the
+     * live graph, which is untouched and known acyclic. */
+    topoOrder_.init(*graph_);
     return;
   }
 
   sourcesMissing_.clear();
-  GraphReloader reloader(*graph_, *graphPtr, watchmanClient_);
+  GraphReloader reloader(*graph_, *graphPtr, *watcher_);
   reloader.updateGraph();
+
+  /* The graph was rewired wholesale: restart the sampling consistency scan
+   * from scratch instead of trusting stale marks. */
+  consistencySampler_.reset();
 }
 
 } // namespace falcon
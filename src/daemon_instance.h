@@ -7,20 +7,28 @@
 #define FALCON_DAEMON_INSTANCE_H_
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
 
 #include "FalconService.h"
 #include "build_plan.h"
+#include "build_profiler.h"
+#include "build_tracer.h"
 #include "cache_manager.h"
 #include "command_server.h"
+#include "file_watcher.h"
 #include "graph.h"
+#include "graph_consistency_checker.h"
 #include "graph_builder.h"
 #include "graphparser.h"
 #include "options.h"
+#include "remote_executor.h"
 #include "stream_server.h"
-#include "watchman.h"
+#include "util/shared_mutex.h"
 
 namespace falcon {
 
@@ -55,15 +63,69 @@ class DaemonInstance {
   void getInputsOf(std::set<std::string>& inputs, const std::string& target);
   void getOutputsOf(std::set<std::string>& outputs, const std::string& target);
   void getHashOf(std::string& hash, const std::string& target);
+  void getNodesInfo(std::vector<NodeInfo>& infos,
+                    const std::vector<std::string>& paths);
   void setDirty(const std::string& target);
+  void notifyNodesBuilt(const std::set<std::string>& paths);
   void interruptBuild();
   void shutdown();
   void getGraphviz(std::string& str);
+  void getGraphExport(GraphExportChunk& chunk, GraphExportFormat::type format,
+                      int64_t cursor, int32_t maxBytes);
+  void executeRule(RemoteRuleResult& result, const RemoteRuleRequest& request);
+  void prefetchCache();
+  void hasCacheEntries(std::vector<bool>& hits,
+                       const std::vector<std::string>& hashes);
+  void getCacheEntry(CacheEntryChunk& chunk, const std::string& hash,
+                     int64_t offset, int32_t maxBytes);
+  void getStats(std::map<std::string, int64_t>& stats);
+  void getBuildProfile(BuildProfile& profile, int32_t numSlowRules);
 
  private:
 
+  /** A build request waiting for the ongoing build to complete. */
+  struct QueuedBuild {
+    std::set<std::string> targets;
+    int32_t numThreads;
+    bool lazyFetch;
+  };
+
+  /** Actually start a build. The caller must have claimed the starting_
+   * flag and must not hold queueMutex_: destroying the previous builder
+   * joins its thread, which may be in onBuildCompleted. */
+  void doStartBuild(QueuedBuild const& build);
+
+  /** Body of the thread that starts queued builds as soon as the ongoing
+   * one completes. */
+  void buildQueueThread();
+
   void onBuildCompleted(BuildResult res);
 
+  /** Body of the cache warm-up pass, run on prefetchThread_ after a git
+   * ref switch while idle. See prefetchCache. */
+  void doPrefetch();
+
+  /** Body of the thread that applies the dirty marks queued by setDirty in
+   * batches, once a burst of notifications has settled. */
+  void dirtyBatchThread();
+
+  /** Apply every queued dirty mark now. Called before anything that needs
+   * the graph state to reflect all the notifications received so far:
+   * starting a build, reloading the graph, saving the snapshot. */
+  void flushDirty();
+
+  /** Wait until the background watcher registration of start() is done.
+   * The watcher client serializes nothing itself and the registration
+   * walks the node map unlocked, so every path that drives the watcher or
+   * mutates the graph calls this first. Safe from several threads. */
+  void waitForWatcher();
+
+  /** Stat the target and mark it dirty if it really changed. The caller
+   * must hold mutex_ exclusively. */
+  void applyDirty(const std::string& target);
+
+  void applyDirtyBatch(const std::set<std::string>& targets);
+
   /** Wait for the current build to complete. */
   void waitForBuild();
 
@@ -82,13 +144,74 @@ class DaemonInstance {
   std::unique_ptr<BuildPlan> plan_;
   std::unique_ptr<IGraphBuilder> builder_;
 
-  WatchmanClient watchmanClient_;
+  /** Per-rule timings of the ongoing build and the profile of the last
+   * completed one, see build_profiler.h and getBuildProfile. */
+  BuildProfiler profiler_;
+
+  /** Chrome trace of each build, written into the falcon directory when the
+   * "trace" option is set. See build_tracer.h. */
+  BuildTracer tracer_;
+
+  /** Continuous sampling-mode consistency verification, cheap enough to run
+   * in release builds. See graph_consistency_checker.h. */
+  GraphConsistencySampler consistencySampler_;
+
+  /** Maintained topological order of the live graph, so a reload only
+   * re-validates the region it changes instead of re-running the full cycle
+   * check. See GraphTopoOrder in graph.h. */
+  GraphTopoOrder topoOrder_;
+
+  /** File watching backend, selected by the "watcher" option. */
+  std::unique_ptr<FileWatcher> watcher_;
+
+  /** Registers the graph with the file watcher in the background during
+   * startup, so the servers open without waiting for the registration I/O.
+   * Joined through waitForWatcher before anything else drives the watcher
+   * or mutates the graph. */
+  std::thread watchThread_;
+  std::mutex watchJoinMutex_;
 
   std::atomic_bool isBuilding_;
 
-  /* Mutex to protect concurrent access to graph_. */
-  std::mutex mutex_;
-  typedef std::lock_guard<std::mutex> lock_guard;
+  /* Build queue. A startBuild received while a build is ongoing is queued
+   * (merged into a compatible queued request when possible) and started by
+   * buildQueueThread the instant the ongoing build completes. All the fields
+   * below are guarded by queueMutex_. */
+  std::deque<QueuedBuild> buildQueue_;
+  std::mutex queueMutex_;
+  std::condition_variable queueCond_;
+  std::thread queueThread_;
+  /** Claimed by the thread about to call doStartBuild, so that only one
+   * build is started at a time. */
+  bool starting_;
+  bool queueStop_;
+  /** Set while a cache warm-up pass is running, see prefetchCache. */
+  bool prefetching_;
+  std::thread prefetchThread_;
+
+  /* Dirty marks are debounced: a git checkout touching thousands of files
+   * fires one watchman trigger per file, and marking them one by one takes
+   * the graph lock and walks the parent chains once per file. setDirty only
+   * queues the (validated) target here; dirtyBatchThread applies a whole
+   * burst under a single lock acquisition. Guarded by dirtyMutex_. */
+  std::set<std::string> dirtyPending_;
+  std::chrono::steady_clock::time_point dirtyFirstAt_;
+  std::mutex dirtyMutex_;
+  std::condition_variable dirtyCond_;
+  std::thread dirtyThread_;
+  bool dirtyStop_;
+
+  /** How long a burst must stay quiet before it is applied. */
+  static const int kDebounceMs = 5;
+  /** Upper bound on how long a mark can be held back by an ongoing burst. */
+  static const int kMaxDebounceMs = 100;
+
+  /* Mutex to protect concurrent access to graph_. Mutations (building,
+   * depfile insertion, reload, setDirty) take it exclusively; read-only
+   * commands take it shared so they are served while a build is running. */
+  SharedMutex mutex_;
+  typedef std::lock_guard<SharedMutex> lock_guard;
+  typedef SharedLockGuard shared_lock_guard;
 
   StreamServer streamServer_;
 
@@ -97,6 +220,10 @@ class DaemonInstance {
 
   std::unique_ptr<CacheManager> cache_;
 
+  /** Executes rules on peer daemons, see remote_executor.h. Only set when
+   * the remote-peers option is given. */
+  std::unique_ptr<RemoteExecutor> remote_;
+
   /**
    * When watchman notifies us of a file change, we stat it. If the file does
    * not exist and is a source file, we add it here. Each time we build, we
@@ -14,21 +14,21 @@
 #include "exceptions.h"
 #include "graph_hash.h"
 #include "logging.h"
-#include "watchman.h"
+#include "file_watcher.h"
 
 namespace falcon {
 
 Node* Depfile::setRuleDependency(const std::string& dep, Rule* rule,
-                                 WatchmanClient* watchmanClient, Graph& graph)
+                                 Graph& graph, NodeArray* watchBatch)
 {
   Node* target;
 
   /* Find any existing node that matches the path. Create it if it does not
    * exist. */
-  auto itFind = graph.getNodes().find(dep);
+  auto itFind = graph.getNodes().find(getPathTable().intern(dep));
   bool isNewNode = itFind == graph.getNodes().end();
   if (isNewNode) {
-    target = new Node(dep, false);
+    target = graph.createNode(dep, false);
     hash::updateNodeHash(*target, true, true);
   } else {
     target = itFind->second;
@@ -63,22 +63,33 @@ Node* Depfile::setRuleDependency(const std::string& dep, Rule* rule,
     rule->markInputReady();
   }
 
-  /* Watch the target with watchman. */
-  if (watchmanClient) {
-    try {
-      watchmanClient->watchNode(*target);
-    } catch (Exception& e) {
-      LOG(FATAL) << e.getErrorMessage();
-    }
+  /* Queue the new dependency for the batched file watcher registration
+   * issued once the whole depfile is integrated. */
+  if (watchBatch) {
+    watchBatch->push_back(target);
   }
 
   return target;
 }
 
 bool Depfile::load(std::string& buf, Rule *rule,
-                   WatchmanClient* watchmanClient, Graph& graph,
+                   FileWatcher* watcher, Graph& graph,
                    bool logError) {
+  DepfileParser depfile;
+  string depfileErr;
+  if (!depfile.Parse(&buf, &depfileErr)) {
+    if (logError) {
+      LOG(ERROR) << "Error parsing depfile: " << depfileErr;
+    }
+    return false;
+  }
 
+  return integrateParsed(depfile, rule, watcher, graph, logError);
+}
+
+bool Depfile::integrateParsed(DepfileParser& depfile, Rule* rule,
+                              FileWatcher* watcher, Graph& graph,
+                              bool logError) {
   /* Store the existing implcit deps in a set. */
   std::unordered_set<Node*> implicitDepsBefore;
   unsigned int numImplicitDeps = rule->getNumImplicitInputs();
@@ -94,15 +105,6 @@ bool Depfile::load(std::string& buf, Rule *rule,
   inputs.resize(inputs.size() - numImplicitDeps);
   rule->setNumImplicitInputs(0);
 
-  DepfileParser depfile;
-  string depfileErr;
-  if (!depfile.Parse(&buf, &depfileErr)) {
-    if (logError) {
-      LOG(ERROR) << "Error parsing depfile: " << depfileErr;
-    }
-    return false;
-  }
-
   /* Check that the output found in the depfile is the first output of the
    * rule. */
   std::string output = std::string(depfile.out_.str_, depfile.out_.len_);
@@ -115,10 +117,15 @@ bool Depfile::load(std::string& buf, Rule *rule,
     return false;
   }
 
-  /* Add each input as a dependency of the rule. */
+  /* Add each input as a dependency of the rule. The watcher registrations
+   * are collected and issued as a single batch below, instead of one
+   * round trip per dependency under the lock. */
+  NodeArray watchBatch;
+  watchBatch.reserve(depfile.ins_.size());
   for (auto it = depfile.ins_.begin(); it != depfile.ins_.end(); ++it) {
     std::string dep(const_cast<char*>(it->str_), it->len_);
-    Node* node = setRuleDependency(dep, rule, watchmanClient, graph);
+    Node* node = setRuleDependency(dep, rule, graph,
+                                   watcher ? &watchBatch : nullptr);
     implicitDepsBefore.erase(node);
   }
 
@@ -128,10 +135,19 @@ bool Depfile::load(std::string& buf, Rule *rule,
     Node* implicitDep = *it;
     implicitDep->removeParentRule(rule);
     if (implicitDep->getParents().empty() && !implicitDep->getChild()) {
-      graph.getNodes().erase(implicitDep->getPath());
+      graph.getNodes().erase(implicitDep->getPathId());
       graph.getRoots().erase(implicitDep);
       graph.getSources().erase(implicitDep);
-      delete implicitDep;
+      graph.deleteNode(implicitDep);
+    }
+  }
+
+  /* Register the new dependencies with the file watcher, in one batch. */
+  if (watcher && !watchBatch.empty()) {
+    try {
+      watcher->watchNodes(watchBatch);
+    } catch (Exception& e) {
+      LOG(FATAL) << e.getErrorMessage();
     }
   }
 
@@ -139,8 +155,20 @@ bool Depfile::load(std::string& buf, Rule *rule,
 }
 
 Depfile::Res Depfile::loadFromfile(const std::string& depfile, Rule *rule,
-                                   WatchmanClient* watchmanClient,
+                                   FileWatcher* watcher,
                                    Graph& graph, bool logError) {
+  Staged staged;
+  Res res = staged.parse(depfile, logError);
+  if (res != Res::SUCCESS) {
+    return res;
+  }
+
+  return staged.integrate(rule, watcher, graph, logError)
+    ? Res::SUCCESS : Res::ERROR_INVALID_FILE;
+}
+
+Depfile::Res Depfile::Staged::parse(const std::string& depfile,
+                                    bool logError, bool keepContent) {
   std::ifstream ifs(depfile);
   if (!ifs.is_open()) {
     if (logError) {
@@ -149,17 +177,33 @@ Depfile::Res Depfile::loadFromfile(const std::string& depfile, Rule *rule,
     return Res::ERROR_CANNOT_OPEN;
   }
 
-  std::string content((std::istreambuf_iterator<char>(ifs)),
-                      (std::istreambuf_iterator<char>()));
-  if (content.empty()) {
+  content_.assign((std::istreambuf_iterator<char>(ifs)),
+                  (std::istreambuf_iterator<char>()));
+  if (content_.empty()) {
     if (logError) {
       LOG(ERROR) << "Error, depfile " << depfile << " is empty";
     }
     return Res::ERROR_INVALID_FILE;
   }
 
-  return load(content, rule, watchmanClient, graph, logError)
-    ? Res::SUCCESS : Res::ERROR_INVALID_FILE;
+  if (keepContent) {
+    raw_ = content_;
+  }
+
+  string depfileErr;
+  if (!parser_.Parse(&content_, &depfileErr)) {
+    if (logError) {
+      LOG(ERROR) << "Error parsing depfile: " << depfileErr;
+    }
+    return Res::ERROR_INVALID_FILE;
+  }
+
+  return Res::SUCCESS;
+}
+
+bool Depfile::Staged::integrate(Rule* rule, FileWatcher* watcher,
+                                Graph& graph, bool logError) {
+  return integrateParsed(parser_, rule, watcher, graph, logError);
 }
 
 } // namespace falcon
@@ -6,11 +6,12 @@
 #ifndef FALCON_DEPFILE_H_
 # define FALCON_DEPFILE_H_
 
+#include "depfile_parser.h"
 #include "graph.h"
 
 namespace falcon {
 
-class WatchmanClient;
+class FileWatcher;
 
 /**
  * This file contains the routines for updating a graph with new dependencies to
@@ -22,6 +23,59 @@ class Depfile {
 
   enum class Res { SUCCESS, ERROR_CANNOT_OPEN, ERROR_INVALID_FILE };
 
+  /**
+   * A depfile read and parsed ahead of its integration into the graph. The
+   * read and the parse only need the file, so they can run without the graph
+   * lock; only integrate() mutates the graph. The parsed dependencies are
+   * pointers into the buffered content: a Staged depfile must outlive its
+   * integrate() call.
+   */
+  class Staged {
+   public:
+    /**
+     * Read and parse a depfile. Does not touch the graph.
+     *
+     * @param depfile        Depfile that contains the dependencies, in
+     *                       Makefile format.
+     * @param logError       Log an error if the depfile cannot be loaded.
+     * @param keepContent    Keep a pristine copy of the depfile bytes,
+     *                       retrievable with content(). The parse de-escapes
+     *                       in place, so the parse buffer itself cannot be
+     *                       persisted.
+     *
+     * @return        error code indicating a possible error.
+     */
+    Res parse(const std::string& depfile, bool logError,
+              bool keepContent = false);
+
+    /**
+     * The depfile bytes as read from disk, for persisting the entry in
+     * cache without reading the file back. Only filled when parse ran with
+     * keepContent.
+     */
+    const std::string& content() const { return raw_; }
+
+    /**
+     * Update the implicit dependencies of a rule with the parsed
+     * dependencies. The caller must hold the graph write lock.
+     *
+     * @param rule           Rule to be updated with the new implicit
+     *                       dependencies.
+     * @param watcher File watcher, used to watch newly discovered dependency nodes. May be null.
+     * @param graph          Graph that contains the rule.
+     * @param logError       Log an error if the content is invalid.
+     *
+     * @return        True on success, or false on error (invalid format).
+     */
+    bool integrate(Rule* rule, FileWatcher* watcher, Graph& graph,
+                   bool logError);
+
+   private:
+    std::string content_;
+    std::string raw_;
+    DepfileParser parser_;
+  };
+
   /**
    * Update the implicit dependencies of a rule with the dependencies defined by
    * a buffer containing dependencies in Makfile format.
@@ -30,14 +84,14 @@ class Depfile {
    *                       Makefile format.
    * @param rule           Rule to be updated with the new implicit
    *                       dependencies.
-   * @param watchmanClient Watchman client.
+   * @param watcher File watcher, used to watch newly discovered dependency nodes. May be null.
    * @param graph          Graph that contains the rule.
    * @param logError       Log an error if the content is invalid.
    *
    * @return        True on success, or false on error (invalid format).
    */
   static bool load(std::string& buf, Rule* rule,
-                   WatchmanClient* watchmanClient, Graph& graph,
+                   FileWatcher* watcher, Graph& graph,
                    bool logError);
 
   /**
@@ -48,30 +102,49 @@ class Depfile {
    *                       format.
    * @param rule           Rule to be updated with the new implicit
    *                       dependencies.
-   * @param watchmanClient Watchman client.
+   * @param watcher File watcher, used to watch newly discovered dependency nodes. May be null.
    * @param graph          Graph that contains the rule.
    * @param logError       Log an error if cannot load the depfile.
    *
    * @return        error code indicating a possible error.
    */
   static Res loadFromfile(const std::string& depfile, Rule *rule,
-                          WatchmanClient* watchmanClient, Graph& graph,
+                          FileWatcher* watcher, Graph& graph,
                           bool logError);
 
  private:
 
+  /**
+   * Update the implicit dependencies of a rule with an already parsed
+   * depfile. Shared by load and Staged::integrate.
+   *
+   * @param depfile        Parsed depfile.
+   * @param rule           Rule to be updated with the new implicit
+   *                       dependencies.
+   * @param watcher File watcher, used to watch newly discovered dependency nodes. May be null.
+   * @param graph          Graph that contains the rule.
+   * @param logError       Log an error if the content is invalid.
+   *
+   * @return        True on success, or false on error (invalid format).
+   */
+  static bool integrateParsed(DepfileParser& depfile, Rule* rule,
+                              FileWatcher* watcher, Graph& graph,
+                              bool logError);
+
   /**
    * Set a new dependency for the given rule, creating a new target if needed.
    * If the target is already a dependency, this does nothing and returns true.
    *
    * @param dep            Path of the dependency.
    * @param rule           Rule to be updated with the new input.
-   * @param watchmanClient Watchman client.
    * @param graph          Graph that contains the rule.
+   * @param watchBatch     Filled with the nodes to register with the file
+   *                       watcher; the caller issues one batched
+   *                       registration for the whole depfile. May be null.
    * @return Node that is set as a dependency.
    */
   static Node* setRuleDependency(const std::string& dep, Rule* rule,
-                                WatchmanClient* watchmanClient, Graph& graph);
+                                 Graph& graph, NodeArray* watchBatch);
 
 };
 
@@ -15,6 +15,42 @@
 
 #include "depfile_parser.h"
 
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+
+// Skip a run of plain filename characters in 16-byte steps. The character
+// class matches the yybm table of the scanner below: a nibble lookup with
+// pshufb classifies 16 bytes at once, bit h of kLowNibble[l] telling whether
+// the ASCII character (h << 4) | l is a plain filename character. Bytes with
+// the high bit set and NUL classify as special. Returns the first position
+// at or after in that may hold a special character; the byte-at-a-time
+// scanner always re-checks the stopping byte, so stopping early is harmless.
+static inline char* SkipPlainSpan(char* in, char* end) {
+  const __m128i kLowNibble = _mm_setr_epi8(
+      (char)0xB8, (char)0xFC, (char)0xF8, (char)0xF8,
+      (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8,
+      (char)0xFC, (char)0xFC, (char)0xF8, 0x54,
+      0x54, 0x5C, (char)0xD4, 0x74);
+  const __m128i kHighBit = _mm_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i kNibbleMask = _mm_set1_epi8(0x0F);
+  const __m128i kZero = _mm_setzero_si128();
+  while (end - in >= 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)in);
+    // pshufb indexes by the low nibble and yields 0 for bytes >= 0x80.
+    __m128i rows = _mm_shuffle_epi8(kLowNibble, chunk);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(chunk, 4), kNibbleMask);
+    __m128i bits = _mm_shuffle_epi8(kHighBit, high);
+    int special =
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(rows, bits), kZero));
+    if (special)
+      return in + __builtin_ctz(special);
+    in += 16;
+  }
+  return in;
+}
+#endif
+
 // A note on backslashes in Makefiles, from reading the docs:
 // Backslash-newline is the line continuation character.
 // Backslash-# escapes a # (otherwise meaningful as a comment start).
@@ -155,6 +191,9 @@ yy4:
       goto yy3;
 yy5:
       ++in;
+#ifdef __SSSE3__
+      in = SkipPlainSpan(in, end);
+#endif
       yych = *in;
       goto yy11;
 yy6:
@@ -177,6 +216,9 @@ yy9:
       goto yy3;
 yy10:
       ++in;
+#ifdef __SSSE3__
+      in = SkipPlainSpan(in, end);
+#endif
       yych = *in;
 yy11:
       if (yybm[0+yych] & 128) {
@@ -0,0 +1,121 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "duration_cache.h"
+#include "logging.h"
+
+namespace falcon {
+
+/* File format: a small header followed by one record per entry.
+ * Record: u32 path length, path bytes, u64 duration (ms).
+ * Integers are host endian: the file never leaves the machine. */
+static const char kDurationCacheMagic[8] =
+  { 'f', 'l', 'c', 'n', 'd', 'r', '0', '1' };
+
+const std::uint64_t DurationCache::kDefaultDurationMs;
+
+std::uint64_t DurationCache::get(const std::string& output) const {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = durations_.find(output);
+  return it == durations_.end() ? kDefaultDurationMs : it->second;
+}
+
+void DurationCache::record(const std::string& output,
+                           std::uint64_t durationMs) {
+  std::lock_guard<std::mutex> g(mutex_);
+  durations_[output] = durationMs;
+  dirty_ = true;
+}
+
+void DurationCache::load(const std::string& file) {
+  std::lock_guard<std::mutex> g(mutex_);
+
+  std::ifstream ifs(file, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    return;
+  }
+
+  char magic[sizeof(kDurationCacheMagic)];
+  std::uint64_t numEntries = 0;
+  ifs.read(magic, sizeof(magic));
+  ifs.read(reinterpret_cast<char*>(&numEntries), sizeof(numEntries));
+  if (!ifs.good() || memcmp(magic, kDurationCacheMagic, sizeof(magic)) != 0) {
+    LOG(WARNING) << "Ignoring invalid duration cache file " << file;
+    return;
+  }
+
+  std::vector<char> pathBuf;
+  for (std::uint64_t i = 0; i < numEntries; ++i) {
+    std::uint32_t pathLength = 0;
+    std::uint64_t durationMs = 0;
+    ifs.read(reinterpret_cast<char*>(&pathLength), sizeof(pathLength));
+    pathBuf.resize(pathLength);
+    ifs.read(pathBuf.data(), pathLength);
+    ifs.read(reinterpret_cast<char*>(&durationMs), sizeof(durationMs));
+    if (!ifs.good()) {
+      LOG(WARNING) << "Truncated duration cache file " << file
+                   << ", keeping " << i << " of " << numEntries << " entries";
+      break;
+    }
+    durations_[std::string(pathBuf.data(), pathLength)] = durationMs;
+  }
+
+  DLOG(INFO) << "loaded " << durations_.size() << " duration cache entries";
+}
+
+void DurationCache::save(const std::string& file) {
+  std::lock_guard<std::mutex> g(mutex_);
+
+  if (!dirty_) {
+    return;
+  }
+
+  /* Write to a temporary file and rename it into place so that a crash in
+   * the middle of a save can not leave a half written cache behind. */
+  std::string tmpFile = file + ".tmp";
+  {
+    std::ofstream ofs(tmpFile, std::ios::out | std::ios::binary
+                               | std::ios::trunc);
+    if (!ofs.is_open()) {
+      LOG(WARNING) << "Cannot write duration cache file " << tmpFile;
+      return;
+    }
+
+    std::uint64_t numEntries = durations_.size();
+    ofs.write(kDurationCacheMagic, sizeof(kDurationCacheMagic));
+    ofs.write(reinterpret_cast<const char*>(&numEntries), sizeof(numEntries));
+    for (auto it = durations_.begin(); it != durations_.end(); ++it) {
+      std::uint32_t pathLength = it->first.size();
+      ofs.write(reinterpret_cast<const char*>(&pathLength),
+                sizeof(pathLength));
+      ofs.write(it->first.data(), pathLength);
+      ofs.write(reinterpret_cast<const char*>(&it->second),
+                sizeof(it->second));
+    }
+    if (!ofs.good()) {
+      LOG(WARNING) << "Error writing duration cache file " << tmpFile;
+      return;
+    }
+  }
+
+  if (rename(tmpFile.c_str(), file.c_str()) != 0) {
+    LOG(WARNING) << "Cannot rename " << tmpFile << " to " << file;
+    return;
+  }
+
+  dirty_ = false;
+}
+
+DurationCache& getDurationCache() {
+  static DurationCache cache;
+  return cache;
+}
+
+} // namespace falcon
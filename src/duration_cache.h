@@ -0,0 +1,71 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_DURATION_CACHE_H_
+# define FALCON_DURATION_CACHE_H_
+
+# include <cstdint>
+# include <mutex>
+# include <string>
+# include <unordered_map>
+
+namespace falcon {
+
+/**
+ * @class DurationCache
+ * @brief Persistent record of how long each rule takes to build.
+ *
+ * Maps the first output path of a rule to the duration of its last
+ * successful execution, in milliseconds. BuildPlan uses these durations to
+ * compute critical-path priorities so that long-pole rules are started as
+ * early as possible.
+ *
+ * Like the hash cache, the durations live in memory and are serialized to a
+ * single file under the falcon directory (see load/save). A rule that was
+ * never built gets kDefaultDurationMs, which keeps the priorities driven by
+ * graph depth on the first build.
+ *
+ * All the methods are thread safe.
+ */
+class DurationCache {
+ public:
+  /** Duration assumed for a rule that was never seen building. */
+  static const std::uint64_t kDefaultDurationMs = 100;
+
+  DurationCache() {}
+
+  /** Duration of the last recorded execution of the rule producing the given
+   * output, or kDefaultDurationMs if there is none. */
+  std::uint64_t get(const std::string& output) const;
+
+  /** Record the duration of an execution of the rule producing the given
+   * output. */
+  void record(const std::string& output, std::uint64_t durationMs);
+
+  /** Load the cache from the given file. Missing or corrupted files are
+   * treated as an empty cache. */
+  void load(const std::string& file);
+
+  /** Serialize the cache to the given file. Does nothing if no duration was
+   * recorded since the last save. */
+  void save(const std::string& file);
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::uint64_t> durations_;
+
+  /* Set when a duration is recorded, cleared by save. */
+  bool dirty_ = false;
+
+  DurationCache(const DurationCache& other) = delete;
+  DurationCache& operator=(const DurationCache&) = delete;
+};
+
+/** Accessor for the process-wide duration cache. */
+DurationCache& getDurationCache();
+
+} // namespace falcon
+
+#endif // FALCON_DURATION_CACHE_H_
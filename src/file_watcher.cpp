@@ -0,0 +1,45 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include "file_watcher.h"
+
+#include "inotify_watcher.h"
+#include "logging.h"
+#include "watchman.h"
+
+namespace falcon {
+
+FileWatcher::~FileWatcher() { }
+
+void FileWatcher::setCallbacks(std::function<void(const std::string&)>,
+                               std::function<void()>) {
+  /* External backends notify through their own channel. */
+}
+
+void FileWatcher::watchNodes(const NodeArray& nodes) {
+  for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+    watchNode(**it);
+  }
+}
+
+bool FileWatcher::queryChangedSince(std::set<std::string>*) {
+  return false;
+}
+
+void FileWatcher::saveClock() { }
+
+std::unique_ptr<FileWatcher> FileWatcher::create(
+    const std::string& backend, const std::string& workingDirectory) {
+  if (backend == "inotify") {
+    return std::unique_ptr<FileWatcher>(new InotifyWatcher(workingDirectory));
+  }
+  if (backend != "watchman") {
+    LOG(ERROR) << "unknown watcher backend '" << backend
+               << "', falling back to watchman";
+  }
+  return std::unique_ptr<FileWatcher>(new WatchmanClient(workingDirectory));
+}
+
+} // namespace falcon
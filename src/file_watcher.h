@@ -0,0 +1,81 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_FILE_WATCHER_H_
+# define FALCON_FILE_WATCHER_H_
+
+# include <functional>
+# include <memory>
+# include <set>
+# include <string>
+
+# include "graph.h"
+
+namespace falcon {
+
+/**
+ * Interface of the file watching backends.
+ *
+ * The daemon watches every leaf of the graph plus .git/HEAD and reacts to
+ * the changes. Two backends implement this:
+ * - WatchmanClient (src/watchman.h) drives an external watchman process;
+ *   notifications come back from the outside, as "falcon --set-dirty"
+ *   trigger commands hitting the thrift API;
+ * - InotifyWatcher (src/inotify_watcher.h) uses in-process inotify watches;
+ *   notifications are delivered directly through the callbacks below.
+ *
+ * The backend is selected with the "watcher" option, see options.cpp.
+ */
+class FileWatcher {
+ public:
+  virtual ~FileWatcher();
+
+  /** Watch all the leaves of the given graph. */
+  virtual void watchGraph(const Graph& g) = 0;
+
+  /** UnWatch all the leaves of the given graph. */
+  virtual void unwatchGraph(const Graph& g) = 0;
+
+  /** Watch a single node. */
+  virtual void watchNode(const Node& n) = 0;
+
+  /** UnWatch a single node. */
+  virtual void unwatchNode(const Node& n) = 0;
+
+  /** Watch a batch of nodes in one registration. The default forwards to
+   * watchNode one by one; backends that can batch the round trips override
+   * it (see WatchmanClient). */
+  virtual void watchNodes(const NodeArray& nodes);
+
+  /** Watch .git/HEAD so the daemon hears about ref switches while idle,
+   * see DaemonInstance::prefetchCache. */
+  virtual void watchGitHead() = 0;
+
+  /** Register the notification sinks of an in-process backend.
+   * onFileChanged receives the path of a changed watched node, as the graph
+   * knows it; onGitRefChanged fires when .git/HEAD moves. Both may be
+   * invoked from the backend's own thread. Backends that notify externally
+   * (watchman triggers) ignore this. */
+  virtual void setCallbacks(std::function<void(const std::string&)> onFileChanged,
+                            std::function<void()> onGitRefChanged);
+
+  /** Query the files that changed while no daemon was attached, see
+   * WatchmanClient::queryChangedSince. Backends that cannot answer return
+   * false and the caller falls back to a full scan. */
+  virtual bool queryChangedSince(std::set<std::string>* changed);
+
+  /** Persist whatever state queryChangedSince needs on the next startup.
+   * No-op for backends that cannot answer it. */
+  virtual void saveClock();
+
+  /** Instantiate the backend selected by the "watcher" option. An unknown
+   * name is logged and falls back to watchman. */
+  static std::unique_ptr<FileWatcher> create(
+      const std::string& backend, const std::string& workingDirectory);
+};
+
+} // namespace falcon
+
+#endif /* !FALCON_FILE_WATCHER_H_ */
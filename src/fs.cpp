@@ -5,6 +5,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "fs.h"
 #include "exceptions.h"
@@ -62,4 +63,18 @@ bool createPath(const std::string& path) {
   return mkdir(dir);
 }
 
+bool breakHardlink(const std::string& path) {
+  struct stat sb;
+  if (stat(path.c_str(), &sb) != 0 || sb.st_nlink <= 1) {
+    return true;
+  }
+
+  if (unlink(path.c_str()) != 0) {
+    LOG(ERROR) << "Cannot unlink " << path;
+    return false;
+  }
+
+  return true;
+}
+
 } } //namespace falcon::fs
@@ -29,6 +29,17 @@ bool createPath(const std::string& path);
  */
 std::string dirname(const std::string& path);
 
+/**
+ * If the file has more than one hard link, unlink it so that whoever
+ * recreates it writes a fresh inode instead of writing through the link.
+ * Used before running a command whose outputs may be hardlinked into the
+ * cache (see cache_fs.h): without this, a tool truncating its output in
+ * place would corrupt the cache entry.
+ * @return true if the path does not exist, has a single link, or was
+ * unlinked.
+ */
+bool breakHardlink(const std::string& path);
+
 } } //namespace falcon::fs
 
 #endif // FALCON_FS_H_
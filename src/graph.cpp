@@ -12,23 +12,35 @@
 #include "graph.h"
 #include "graph_hash.h"
 #include "logging.h"
+#include "state_journal.h"
 #include "watchman.h"
 
 namespace falcon {
 
+Timestamp timestampNow() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<Timestamp>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
+
 /* ************************************************************************* */
 /*                                Node                                       */
 /* ************************************************************************* */
 
 Node::Node(const std::string& path, bool isExplicitDependency)
-  : path_(path)
+  : Node(getPathTable().intern(path), isExplicitDependency) { }
+
+Node::Node(PathId pathId, bool isExplicitDependency)
+  : pathId_(pathId)
   , hash_()
   , childRule_(nullptr)
   , isExplicitDependency_(isExplicitDependency)
   , state_(State::UP_TO_DATE)
-  , timestamp_(0) { }
+  , timestamp_(0)
+  , graph_(nullptr) { }
 
-const std::string& Node::getPath() const { return path_; }
+const std::string& Node::getPath() const { return getPathTable().str(pathId_); }
+PathId Node::getPathId() const { return pathId_; }
 
 bool Node::isSource() const { return childRule_ == nullptr; }
 const Rule* Node::getChild() const { return childRule_; }
@@ -43,8 +55,8 @@ void Node::setChild(Rule* rule) {
   childRule_ = rule;
 }
 
-const RuleArray& Node::getParents() const { return parentRules_; }
-RuleArray&       Node::getParents()       { return parentRules_; }
+const ParentRuleArray& Node::getParents() const { return parentRules_; }
+ParentRuleArray&       Node::getParents()       { return parentRules_; }
 
 void Node::addParentRule(Rule* rule) { parentRules_.push_back(rule); }
 void Node::removeParentRule(Rule* rule) {
@@ -62,40 +74,97 @@ bool Node::isExplicitDependency() const { return isExplicitDependency_; }
 
 State const& Node::getState() const { return state_; }
 State&       Node::getState()       { return state_; }
-void Node::setState(State state) { state_ = state; isLazyFetched_ = false; }
+void Node::setState(State state) {
+  /* Keep the graph's dirty node set in sync, see Graph::getDirtyNodes. */
+  if (graph_ != nullptr && state != state_) {
+    if (state == State::OUT_OF_DATE) {
+      graph_->dirtyNodes_.insert(this);
+    } else {
+      graph_->dirtyNodes_.erase(this);
+    }
+  }
+  if (state != state_ && getStateJournal().isArmed()) {
+    getStateJournal().onNodeState(pathId_, state);
+  }
+  state_ = state;
+  isLazyFetched_ = false;
+}
 bool Node::isDirty() const { return state_ == State::OUT_OF_DATE; }
 
 void Node::markDirty() {
-  /* Mark all the parent rules dirty and increase their counter of dirty
-   * inputs. */
-  for (auto it = parentRules_.begin(); it != parentRules_.end(); ++it) {
-    (*it)->markDirty();
-    if (!isSource() && !isDirty()) {
-      /* If the node is not a source file, increase the counter of inputs
-       * that are not ready for the rule. */
-      (*it)->markInputDirty();
-    }
+  /* Iterative propagation that stops at already-dirty nodes. When a node
+   * was marked dirty, all its ancestors were marked with it: an
+   * already-dirty node thus has nothing new above it. The old recursive
+   * version kept walking, so in diamond-heavy graphs a single touch
+   * re-traversed the shared upper graph once per path. The node dirty state
+   * itself serves as the visited marker, keeping the work proportional to
+   * the region that actually changes state. */
+  if (isDirty()) {
+    return;
   }
 
-  DLOG(INFO) << "marking " << path_ << " dirty";
-  setState(State::OUT_OF_DATE);
+  NodeArray work;
+  work.push_back(this);
+
+  while (!work.empty()) {
+    Node* node = work.back();
+    work.pop_back();
+    if (node->isDirty()) {
+      /* Pushed through two rules before being processed, or marked by a
+       * previous propagation. */
+      continue;
+    }
+
+    DLOG(INFO) << "marking " << node->getPath() << " dirty";
+    ParentRuleArray& parents = node->getParents();
+    if (!node->isSource()) {
+      /* The node is an input of its parent rules and is no longer ready:
+       * decrease their counter of ready inputs. */
+      for (auto it = parents.begin(); it != parents.end(); ++it) {
+        (*it)->markInputDirty();
+      }
+    }
+    node->setState(State::OUT_OF_DATE);
+
+    for (auto it = parents.begin(); it != parents.end(); ++it) {
+      Rule* rule = *it;
+      /* A dirty rule can still have clean outputs: a lazy fetch restores an
+       * output to UP_TO_DATE while its rule stays dirty (see
+       * LazyCache::onNodeRestored). Always walk the outputs, the node-level
+       * dirty check above is what bounds the traversal. */
+      if (!rule->isDirty()) {
+        rule->setState(State::OUT_OF_DATE);
+      }
+      NodeArray& outputs = rule->getOutputs();
+      for (auto out = outputs.begin(); out != outputs.end(); ++out) {
+        if (!(*out)->isDirty()) {
+          work.push_back(*out);
+        }
+      }
+    }
+  }
 }
 
 Timestamp Node::getTimestamp() const { return timestamp_; }
-void Node::setTimestamp(Timestamp t) { timestamp_ = t; }
+void Node::setTimestamp(Timestamp t) {
+  if (t != timestamp_ && getStateJournal().isArmed()) {
+    getStateJournal().onNodeTimestamp(pathId_, t);
+  }
+  timestamp_ = t;
+}
 
-void Node::setHash(std::string const& hash) { hash_ = hash; }
-std::string const& Node::getHash() const { return hash_; }
-std::string& Node::getHash() { return hash_; }
-void Node::setHashDepfile(std::string const& hash) { hashDepfile_ = hash; }
-std::string const& Node::getHashDepfile() const { return hashDepfile_; }
-std::string& Node::getHashDepfile() { return hashDepfile_; }
+void Node::setHash(HashDigest const& hash) { hash_ = hash; }
+HashDigest const& Node::getHash() const { return hash_; }
+HashDigest& Node::getHash() { return hash_; }
+void Node::setHashDepfile(HashDigest const& hash) { hashDepfile_ = hash; }
+HashDigest const& Node::getHashDepfile() const { return hashDepfile_; }
+HashDigest& Node::getHashDepfile() { return hashDepfile_; }
 
 bool Node::isLazyFetched() const { return isLazyFetched_; }
 void Node::setLazyFetched(bool val) { isLazyFetched_ = val; }
 
-bool Node::operator==(Node const& n) const { return getPath() == n.getPath(); }
-bool Node::operator!=(Node const& n) const { return getPath() != n.getPath(); }
+bool Node::operator==(Node const& n) const { return pathId_ == n.pathId_; }
+bool Node::operator!=(Node const& n) const { return pathId_ != n.pathId_; }
 
 /* ************************************************************************* */
 /*                                Rule                                       */
@@ -105,9 +174,13 @@ Rule::Rule(const NodeArray& inputs, const NodeArray& outputs)
   : inputs_(inputs)
   , outputs_(outputs)
   , numImplicitDeps_(0)
+  , weight_(1)
+  , graph_(nullptr)
+  , depfileId_(getPathTable().intern(std::string()))
   , state_(State::UP_TO_DATE)
   , timestamp_(0)
   , numInputsReady_(0)
+  , sortedInputIdsValid_(false)
 { }
 
 const NodeArray& Rule::getInputs() const { return inputs_; }
@@ -117,14 +190,28 @@ void Rule::setNumImplicitInputs(unsigned int n) { numImplicitDeps_ = n; }
 void Rule::addImplicitInput(Node* node) {
   numImplicitDeps_++;
   inputs_.push_back(node);
+  sortedInputIdsValid_ = false;
 }
 void Rule::addInput(Node* node) {
   /* Explicit inputs should be set up before implicit ones. */
   assert(numImplicitDeps_ == 0);
   inputs_.push_back(node);
+  sortedInputIdsValid_ = false;
 }
 bool Rule::isInput(const Node* node) const {
-  return std::find(inputs_.begin(), inputs_.end(), node) != inputs_.end();
+  /* The size check catches direct push_backs by the friend classes; an
+   * in-place rewrite of inputs_ has to clear the flag itself. */
+  if (!sortedInputIdsValid_ || sortedInputIds_.size() != inputs_.size()) {
+    sortedInputIds_.clear();
+    sortedInputIds_.reserve(inputs_.size());
+    for (auto it = inputs_.begin(); it != inputs_.end(); ++it) {
+      sortedInputIds_.push_back((*it)->getPathId());
+    }
+    std::sort(sortedInputIds_.begin(), sortedInputIds_.end());
+    sortedInputIdsValid_ = true;
+  }
+  return std::binary_search(sortedInputIds_.begin(), sortedInputIds_.end(),
+                            node->getPathId());
 }
 
 const NodeArray& Rule::getOutputs() const { return outputs_; }
@@ -132,42 +219,127 @@ NodeArray&       Rule::getOutputs()       { return outputs_; }
 
 bool Rule::isPhony() const { return command_.empty(); }
 const std::string& Rule::getCommand() const { return command_; }
-void Rule::setCommand(const std::string& cmd) { command_ = cmd; }
 
-const bool Rule::hasDepfile() const { return !depfile_.empty(); }
-const std::string& Rule::getDepfile() const { return depfile_; }
-void Rule::setDepfile(const std::string& depfile) { depfile_ = depfile; }
+void Rule::setCommand(const std::string& cmd) {
+  command_ = cmd;
+  argv_.clear();
+  tokenizeCommand(command_, &argv_);
+}
+
+const std::vector<std::string>& Rule::getArgv() const { return argv_; }
+
+bool Rule::tokenizeCommand(const std::string& command,
+                           std::vector<std::string>* argv) {
+  argv->clear();
+
+  /* Conservative: any character a shell gives meaning to sends the whole
+   * command through /bin/sh -c. The typical compile or link line contains
+   * none of them. */
+  static const char kShellMeta[] = "|&;<>()$`\\\"'*?[]{}~#!\n\r";
+  if (command.find_first_of(kShellMeta) != std::string::npos) {
+    return false;
+  }
+
+  std::string token;
+  for (auto it = command.begin(); it != command.end(); ++it) {
+    if (*it == ' ' || *it == '\t') {
+      if (!token.empty()) {
+        argv->push_back(token);
+        token.clear();
+      }
+    } else {
+      token += *it;
+    }
+  }
+  if (!token.empty()) {
+    argv->push_back(token);
+  }
+
+  /* "FOO=bar cmd" is an environment assignment under a shell, not a
+   * program name. */
+  if (argv->empty() || argv->front().find('=') != std::string::npos) {
+    argv->clear();
+    return false;
+  }
+
+  return true;
+}
+
+std::size_t Rule::getWeight() const { return weight_; }
+void Rule::setWeight(std::size_t weight) { weight_ = weight > 0 ? weight : 1; }
+
+const bool Rule::hasDepfile() const { return !getDepfile().empty(); }
+const std::string& Rule::getDepfile() const {
+  return getPathTable().str(depfileId_);
+}
+PathId Rule::getDepfileId() const { return depfileId_; }
+void Rule::setDepfile(const std::string& depfile) {
+  depfileId_ = getPathTable().intern(depfile);
+}
 
 State const& Rule::getState() const { return state_; }
 State&       Rule::getState()       { return state_; }
 bool Rule::isDirty() const { return state_ == State::OUT_OF_DATE; }
-void Rule::setState(State state) { state_ = state; }
+void Rule::setState(State state) {
+  /* Keep the graph's dirty rule set in sync, see Graph::getDirtyRules. */
+  if (graph_ != nullptr && state != state_) {
+    if (state == State::OUT_OF_DATE) {
+      graph_->dirtyRules_.insert(this);
+    } else {
+      graph_->dirtyRules_.erase(this);
+    }
+  }
+  if (state != state_ && !outputs_.empty() && getStateJournal().isArmed()) {
+    getStateJournal().onRuleState(outputs_[0]->getPathId(), state);
+  }
+  state_ = state;
+}
 
 void Rule::markDirty() {
-  /* Mark all the outputs dirty. */
+  setState(State::OUT_OF_DATE);
+
+  /* Mark all the outputs dirty; each output propagates iteratively and
+   * stops at already-dirty regions, see Node::markDirty. */
   for (auto it = outputs_.begin(); it != outputs_.end(); ++it) {
     (*it)->markDirty();
   }
-
-  setState(State::OUT_OF_DATE);
 }
 
-void Rule::setHash(std::string const& hash) { hash_ = hash; }
-std::string const& Rule::getHash() const { return hash_; }
-std::string& Rule::getHash() { return hash_; }
-void Rule::setHashDepfile(std::string const& hash) { hashDepfile_ = hash; }
-std::string const& Rule::getHashDepfile() const { return hashDepfile_; }
-std::string& Rule::getHashDepfile() { return hashDepfile_; }
+void Rule::setHash(HashDigest const& hash) { hash_ = hash; }
+HashDigest const& Rule::getHash() const { return hash_; }
+HashDigest& Rule::getHash() { return hash_; }
+void Rule::setHashDepfile(HashDigest const& hash) { hashDepfile_ = hash; }
+HashDigest const& Rule::getHashDepfile() const { return hashDepfile_; }
+HashDigest& Rule::getHashDepfile() { return hashDepfile_; }
 
 Timestamp Rule::getTimestamp() const { return timestamp_; }
-void Rule::setTimestamp(Timestamp t) { timestamp_ = t; }
+void Rule::setTimestamp(Timestamp t) {
+  if (t != timestamp_ && !outputs_.empty() && getStateJournal().isArmed()) {
+    getStateJournal().onRuleTimestamp(outputs_[0]->getPathId(), t);
+  }
+  timestamp_ = t;
+}
 
-bool Rule::ready() const { return numInputsReady_ == inputs_.size(); }
-size_t Rule::numReady() const { return numInputsReady_; }
+/* The ready counter is atomic so that several builder threads can mark
+ * inputs ready and poll readiness without holding a lock. */
+bool Rule::ready() const {
+  return numInputsReady_.load(std::memory_order_acquire) == inputs_.size();
+}
+size_t Rule::numReady() const {
+  return numInputsReady_.load(std::memory_order_acquire);
+}
 void Rule::markInputReady() {
-  numInputsReady_++; assert(numInputsReady_ <= inputs_.size());
+  std::size_t previous =
+      numInputsReady_.fetch_add(1, std::memory_order_acq_rel);
+  assert(previous < inputs_.size());
+  (void)previous;
+}
+void Rule::markInputDirty() {
+  std::size_t previous =
+      numInputsReady_.fetch_sub(1, std::memory_order_acq_rel);
+  assert(previous > 0);
+  (void)previous;
 }
-void Rule::markInputDirty() { assert(numInputsReady_ > 0); numInputsReady_--; }
 
 /* ************************************************************************* */
 /*                                Graph                                      */
@@ -175,6 +347,38 @@ void Rule::markInputDirty() { assert(numInputsReady_ > 0); numInputsReady_--; }
 
 Graph::Graph() {}
 
+Node* Graph::createNode(const std::string& path, bool isExplicitDependency) {
+  Node* node = arena_.make<Node>(path, isExplicitDependency);
+  node->graph_ = this;
+  return node;
+}
+
+Node* Graph::createNode(PathId pathId, bool isExplicitDependency) {
+  Node* node = arena_.make<Node>(pathId, isExplicitDependency);
+  node->graph_ = this;
+  return node;
+}
+
+Rule* Graph::createRule(const NodeArray& inputs, const NodeArray& outputs) {
+  Rule* rule = arena_.make<Rule>(inputs, outputs);
+  rule->graph_ = this;
+  return rule;
+}
+
+void Graph::deleteNode(Node* node) {
+  dirtyNodes_.erase(node);
+  node->~Node();
+}
+
+void Graph::deleteRule(Rule* rule) {
+  dirtyRules_.erase(rule);
+  rule->~Rule();
+}
+
+const RuleSet& Graph::getDirtyRules() const { return dirtyRules_; }
+
+const NodeSet& Graph::getDirtyNodes() const { return dirtyNodes_; }
+
 void Graph::addNode(Node* node) {
   if (node->getParents().empty()) {
     roots_.insert(node);
@@ -184,30 +388,31 @@ void Graph::addNode(Node* node) {
     sources_.insert(node);
   }
 
-  if (nodes_.find(node->getPath()) != nodes_.end()) {
+  if (nodes_.find(node->getPathId()) != nodes_.end()) {
     std::string message = "Invalid Graph -> Node '" + node->getPath()
                         + "' is already present";
     THROW_ERROR(EINVAL, message.c_str());
   }
-  nodes_[node->getPath()] = node;
+  nodes_[node->getPathId()] = node;
 }
 
 Graph::~Graph() {
+  /* Nodes and rules are carved out of arena_: only run their destructors
+   * here, the memory itself is released in bulk with the arena. */
   for ( ; !rules_.empty(); rules_.pop_back()) {
-    Rule* it = rules_.back();
-    delete it;
+    deleteRule(rules_.back());
   }
 
   for (auto it = nodes_.begin(); it != nodes_.end(); ++it) {
-    delete it->second;
+    deleteNode(it->second);
   }
 }
 
-const NodeSet& Graph::getRoots() const { return roots_; }
-NodeSet& Graph::getRoots() { return roots_; }
+const NodeFlatSet& Graph::getRoots() const { return roots_; }
+NodeFlatSet& Graph::getRoots() { return roots_; }
 
-const NodeSet& Graph::getSources() const { return sources_; }
-NodeSet& Graph::getSources() { return sources_; }
+const NodeFlatSet& Graph::getSources() const { return sources_; }
+NodeFlatSet& Graph::getSources() { return sources_; }
 
 const NodeMap& Graph::getNodes() const { return nodes_; }
 NodeMap& Graph::getNodes() { return nodes_; }
@@ -6,6 +6,8 @@
 #ifndef FALCON_GRAPH_H_
 # define FALCON_GRAPH_H_
 
+# include <atomic>
+# include <cstdint>
 # include <set>
 # include <string>
 # include <vector>
@@ -13,8 +15,14 @@
 
 /* use for clock and time */
 # include <ctime>
+# include <sys/stat.h>
 
 # include "cache_manager.h"
+# include "hash_digest.h"
+# include "path_table.h"
+# include "util/arena.h"
+# include "util/flat_set.h"
+# include "util/small_vector.h"
 
 /** This file defines the data structure for storing the Graph of Nodes and
  * Rules.
@@ -34,16 +42,39 @@ class Node;
 class Rule;
 class Graph;
 class GraphVisitor;
-class WatchmanClient;
+class FileWatcher;
 class GraphReloader;
+class GraphSnapshot;
 
 typedef std::vector<Node*>                     NodeArray;
 typedef std::set<Node*>                        NodeSet;
-typedef std::unordered_map<std::string, Node*> NodeMap;
+/* Sorted-vector set used for the graph's root and source sets, which are
+ * mutated in bursts (parse, reload) and then iterated in full. */
+typedef FlatSet<Node*>                         NodeFlatSet;
+/* Nodes are keyed by the interned id of their path (see path_table.h), so a
+ * lookup costs an integer hash instead of hashing the whole path. */
+typedef std::unordered_map<PathId, Node*, PathIdHash> NodeMap;
 typedef std::vector<Rule*>                     RuleArray;
+/* The median node is an input of one or two rules: its parent list fits in
+ * the node itself instead of behind a heap pointer. */
+typedef SmallVector<Rule*, 2>                  ParentRuleArray;
 typedef std::set<Rule*>                        RuleSet;
 
-typedef std::time_t                            Timestamp;
+/* Nanoseconds since the epoch. Second granularity (time_t) misclassified
+ * rules that ran within the same second as their inputs: spurious rebuilds
+ * and missed ones, especially on tmpfs where whole incremental builds fit
+ * in one second. */
+typedef std::int64_t                           Timestamp;
+
+/** The mtime of a stat result as a Timestamp, using the full st_mtim
+ * precision. */
+inline Timestamp timestampFromStat(struct stat const& st) {
+  return static_cast<Timestamp>(st.st_mtim.tv_sec) * 1000000000ll
+       + st.st_mtim.tv_nsec;
+}
+
+/** The current wall-clock time as a Timestamp. */
+Timestamp timestampNow();
 
 /** Define the state of a node or rule. */
 enum class State { UP_TO_DATE, OUT_OF_DATE };
@@ -52,8 +83,12 @@ enum class State { UP_TO_DATE, OUT_OF_DATE };
 class Node {
  public:
   explicit Node(const std::string& path, bool isExplicitDependency);
+  /** From an already interned path, so a caller holding the id does not
+   * re-hash the path string. */
+  Node(PathId pathId, bool isExplicitDependency);
 
   const std::string& getPath() const;
+  PathId getPathId() const;
 
   /** Return true if this a source file, ie there is no child rule. */
   bool isSource() const;
@@ -73,8 +108,8 @@ class Node {
   void addParentRule(Rule* rule);
   void removeParentRule(Rule* rule);
   bool hasParent(Rule* rule) const;
-  RuleArray& getParents();
-  const RuleArray& getParents() const;
+  ParentRuleArray& getParents();
+  const ParentRuleArray& getParents() const;
 
   bool isExplicitDependency() const;
 
@@ -93,13 +128,13 @@ class Node {
   Timestamp getTimestamp() const;
   void setTimestamp(Timestamp);
 
-  void setHash(std::string const&);
-  std::string const& getHash() const;
-  std::string& getHash();
+  void setHash(HashDigest const&);
+  HashDigest const& getHash() const;
+  HashDigest& getHash();
 
-  void setHashDepfile(std::string const&);
-  std::string const& getHashDepfile() const;
-  std::string& getHashDepfile();
+  void setHashDepfile(HashDigest const&);
+  HashDigest const& getHashDepfile() const;
+  HashDigest& getHashDepfile();
 
   bool isLazyFetched() const;
   /** Mark the node as lazy fetched. (see isLazyFetched_).
@@ -112,12 +147,14 @@ class Node {
   bool operator!=(Node const& n) const;
 
  private:
-  std::string path_;
+  /* Id of this node's path in the global path table. The path string itself
+   * is stored once in the table, not per node. */
+  PathId pathId_;
 
   /* A hash to represent the current state of a Node */
-  std::string hash_;
+  HashDigest hash_;
 
-  std::string hashDepfile_;
+  HashDigest hashDepfile_;
 
   /* The rule used to construct this Node.
    * If nullptr, this node is a source file (a leaf node). */
@@ -126,7 +163,7 @@ class Node {
   /* The rules that take this node as an input.
   * If empty, this node is a root node because it does not generate any other
   * node. */
-  RuleArray parentRules_;
+  ParentRuleArray parentRules_;
 
   /* Set to true if this node is an explicit dependency of at least one other
    * node.
@@ -144,10 +181,16 @@ class Node {
   State state_;
   Timestamp timestamp_;
 
+  /* Back pointer to the owning graph, set by Graph::createNode.
+   * Node::setState maintains the graph's dirty node set through it. */
+  Graph* graph_;
+
   Node(const Node& other) = delete;
   Node& operator=(const Node&) = delete;
 
+  friend class Graph;
   friend class GraphReloader;
+  friend class GraphSnapshot;
 };
 
 /** Class that represents a rule in the graph.
@@ -167,6 +210,8 @@ class Rule {
   void setNumImplicitInputs(unsigned int n);
   const NodeArray& getInputs() const;
   NodeArray& getInputs();
+  /** Return true if the given node is an input of this rule. Binary search
+   * over the sorted input path ids, see sortedInputIds_. */
   bool isInput(const Node* node) const;
 
   const NodeArray& getOutputs() const;
@@ -176,8 +221,27 @@ class Rule {
   const std::string& getCommand() const;
   void setCommand(const std::string& cmd);
 
+  /** The command tokenized into an argv when it needs no shell features,
+   * empty otherwise. Prepared once when the command is set, so spawning
+   * such a command skips both the tokenization and the /bin/sh
+   * indirection. See PosixSubProcess. */
+  const std::vector<std::string>& getArgv() const;
+
+  /** Split a command into an argv if it uses no shell features (quoting,
+   * redirections, expansions, ...). Leaves argv empty and returns false
+   * when the command needs a shell. */
+  static bool tokenizeCommand(const std::string& command,
+                              std::vector<std::string>* argv);
+
+  /** Scheduling weight of the rule, in job slots. Defaults to 1; a
+   * memory-hungry command (typically a link) can be given a larger weight in
+   * the graph configuration file so the builder counts it as several jobs. */
+  std::size_t getWeight() const;
+  void setWeight(std::size_t weight);
+
   const bool hasDepfile() const;
   const std::string& getDepfile() const;
+  PathId getDepfileId() const;
   void setDepfile(const std::string& depfile);
 
   /* State management */
@@ -189,13 +253,13 @@ class Rule {
   /** Set the state as Dirty and mark all the parents as dirty too. */
   void markDirty();
 
-  void setHash(std::string const&);
-  std::string const& getHash() const;
-  std::string& getHash();
+  void setHash(HashDigest const&);
+  HashDigest const& getHash() const;
+  HashDigest& getHash();
 
-  void setHashDepfile(std::string const&);
-  std::string const& getHashDepfile() const;
-  std::string& getHashDepfile();
+  void setHashDepfile(HashDigest const&);
+  HashDigest const& getHashDepfile() const;
+  HashDigest& getHashDepfile();
 
   Timestamp getTimestamp() const;
   void setTimestamp(Timestamp);
@@ -231,19 +295,30 @@ class Rule {
    * Empty string is this is a phony rule. */
   std::string command_;
 
-  /** Path to the file that contains the implicit dependenciess. */
-  std::string depfile_;
+  /** The command tokenized into an argv, empty when it needs a shell. Kept
+   * in sync with command_ by setCommand. */
+  std::vector<std::string> argv_;
+
+  /** Scheduling weight, see getWeight. Always at least 1. */
+  std::size_t weight_;
+
+  /** Graph owning this rule, set by Graph::createRule. setState uses it to
+   * keep the graph's dirty rule set up to date. */
+  Graph* graph_;
+
+  /** Interned path of the file that contains the implicit dependenciess. */
+  PathId depfileId_;
 
   /* Set to UP_TO_DATE if all outputs are UP_TO_DATE, OUT_OF_DATE otherwise. */
   State state_;
 
   /* A hash to represent the current state of a Node. */
-  std::string hash_;
+  HashDigest hash_;
 
   /* A hash that helps for the retrieval of cached depfiles. This hash does not
    * take into account the contents of the inputs that are implicit
    * dependencies. */
-  std::string hashDepfile_;
+  HashDigest hashDepfile_;
 
   /* The timestamp of a rule is the last time it was built. */
   Timestamp timestamp_;
@@ -253,12 +328,22 @@ class Rule {
    * is dirty).
    * This rule can only be run when all the inputs are ready, ie numInputsReady_
    * equals inputs_.size(). */
-  std::size_t numInputsReady_;
+  std::atomic<std::size_t> numInputsReady_;
+
+  /* The path ids of inputs_, sorted, so that isInput is a binary search
+   * instead of a linear scan: depfile integration calls it once per depfile
+   * entry. Rebuilt lazily by isInput when sortedInputIdsValid_ is unset,
+   * which every mutation of inputs_ must do. */
+  mutable std::vector<PathId> sortedInputIds_;
+  mutable bool sortedInputIdsValid_;
 
   Rule(const Rule& other) = delete;
   Rule& operator=(const Rule&) = delete;
 
   friend class GraphReloader;
+  friend class GraphSnapshot;
+  /* Graph::createRule sets graph_. */
+  friend class Graph;
 };
 
 class GraphParser;
@@ -271,13 +356,36 @@ class Graph {
   Graph();
   ~Graph();
 
+  /**
+   * Construct a Node in the graph's arena. The node is owned by the graph:
+   * its memory is released all at once when the graph is destroyed.
+   */
+  Node* createNode(const std::string& path, bool isExplicitDependency);
+  /** Same, from an already interned path. */
+  Node* createNode(PathId pathId, bool isExplicitDependency);
+
+  /**
+   * Construct a Rule in the graph's arena. The rule is owned by the graph:
+   * its memory is released all at once when the graph is destroyed.
+   */
+  Rule* createRule(const NodeArray& inputs, const NodeArray& outputs);
+
+  /**
+   * Destroy a node created with createNode. Only the destructor is run: the
+   * underlying memory is reclaimed when the graph is destroyed.
+   */
+  void deleteNode(Node* node);
+
+  /** Destroy a rule created with createRule. See deleteNode. */
+  void deleteRule(Rule* rule);
+
   void addNode(Node* node);
 
-  const NodeSet& getRoots() const;
-  NodeSet& getRoots();
+  const NodeFlatSet& getRoots() const;
+  NodeFlatSet& getRoots();
 
-  const NodeSet& getSources() const;
-  NodeSet& getSources();
+  const NodeFlatSet& getSources() const;
+  NodeFlatSet& getSources();
 
   const NodeMap& getNodes() const;
   NodeMap& getNodes();
@@ -285,14 +393,25 @@ class Graph {
   const RuleArray& getRules() const;
   RuleArray& getRules();
 
+  /** Rules that are currently out of date, maintained incrementally by
+   * Rule::setState. Lets the daemon answer a no-op build in O(1) and size
+   * build plans by the number of dirty rules instead of the target
+   * closure. */
+  const RuleSet& getDirtyRules() const;
+
+  /** Nodes that are currently out of date, sources included, maintained
+   * incrementally by Node::setState. Lets the dirty-target queries answer
+   * in O(dirty) instead of walking the whole node map under the lock. */
+  const NodeSet& getDirtyNodes() const;
+
  private:
 
   /* Contains all the root nodes, ie the nodes that are not an input to any
    * Rule. Typically, 'all' is a root node. This is a subset of nodes_. */
-  NodeSet roots_;
+  NodeFlatSet roots_;
 
   /* Contains all the leaf nodes, ie the sources. This is a subset of nodes_. */
-  NodeSet sources_;
+  NodeFlatSet sources_;
 
   /* Contains all the nodes, mapped by their path. */
   NodeMap nodes_;
@@ -300,11 +419,27 @@ class Graph {
   /* Contains all the rules */
   RuleArray rules_;
 
+  /* Subset of rules_ whose state is OUT_OF_DATE, see getDirtyRules. */
+  RuleSet dirtyRules_;
+
+  /* Subset of nodes_ whose state is OUT_OF_DATE, see getDirtyNodes. */
+  NodeSet dirtyNodes_;
+
+  /* Arena out of which all the nodes and rules of this graph are allocated.
+   * Keeping them densely packed gives the traversals (dependency scan, build
+   * plan) much better cache locality, and makes the graph teardown a simple
+   * slab release. */
+  Arena arena_;
+
   Graph(const Graph& other) = delete;
   Graph& operator=(const Graph&) = delete;
 
   friend class GraphParser;
   friend class GraphReloader;
+  friend class GraphSnapshot;
+  /* Rule::setState maintains dirtyRules_, Node::setState dirtyNodes_. */
+  friend class Rule;
+  friend class Node;
 };
 
 } // namespace falcon
@@ -319,6 +454,51 @@ namespace falcon{
  * check if there is a loop in the graph */
 void checkGraphLoop(Graph const& g);
 
+/**
+ * Incremental cycle detection (online topological ordering, Pearce-Kelly
+ * style). checkGraphLoop traverses the whole graph: after a makefile
+ * regeneration that touched three rules, the reload re-validated everything.
+ * GraphTopoOrder instead maintains a topological order of the live graph,
+ * keyed by path id so it survives the reload splice. Validating a reloaded
+ * graph then costs one order comparison per edge: an edge that respects the
+ * maintained order cannot be part of a cycle, and only the order range
+ * affected by a violating (ie new or rewired) edge is traversed and
+ * reordered. The turnaround of a reload no longer depends on the graph
+ * size, only on the size of the change.
+ */
+class GraphTopoOrder {
+public:
+  GraphTopoOrder();
+
+  /** Rebuild the order from a full traversal of the given graph, which must
+   * already be known acyclic (checkGraphLoop, or a snapshot of a validated
+   * graph). O(graph), used at load time and to recover after a rejected
+   * reload. */
+  void init(Graph const& g);
+
+  /** Validate the given (typically freshly reloaded) graph against the
+   * maintained order and bring the order up to date. Throws the same
+   * Exception as checkGraphLoop when a cycle is found; the order is then
+   * stale and must be re-initialized from a known acyclic graph. */
+  void check(Graph const& g);
+
+private:
+  /** The order of the given path id, assigning a fresh maximal order to ids
+   * never seen (nodes created by the reload). */
+  std::uint32_t orderOf(PathId id);
+
+  /** Post-order DFS of init: inputs get lower orders than outputs. */
+  void initNode(Node const& n);
+
+  /** Restore the order invariant for the edge input -> output, whose
+   * current orders conflict. Traverses only the nodes whose order lies
+   * between the two, and throws if the edge closes a cycle. */
+  void insertEdge(Node const* input, Node const* output);
+
+  std::unordered_map<PathId, std::uint32_t> order_;
+  std::uint32_t next_;
+};
+
 /*******************
  * Printer methods *
  *******************/
@@ -327,6 +507,18 @@ void printGraphMakefile(Graph const&, std::ostream&);
 /* Graphviz compatible ouput */
 void printGraphGraphviz(Graph const&, std::ostream&);
 
+/* Incremental printers used by the streaming getGraphExport command: one
+ * call per graph item, so the export never lives in memory at once. */
+void printGraphvizHeader(std::ostream&);
+void printGraphvizFooter(std::ostream&);
+void printNodeGraphviz(Node const&, std::ostream&);
+void printRuleGraphviz(Rule const&, std::ostream&);
+/* Compact binary edge-list output, see GraphExportFormat in the thrift
+ * interface for the layout. */
+void printEdgeListHeader(std::ostream&);
+void printNodeEdgeList(Node const&, std::ostream&);
+void printRuleEdgeList(Rule const&, std::ostream&);
+
 }
 
 #endif // FALCON_GRAPH_H_
@@ -5,11 +5,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <sstream>
 
 #include "graph_consistency_checker.h"
 
 #include "logging.h"
+#include "path_table.h"
+#include "stats.h"
 
 namespace falcon {
 
@@ -32,13 +35,17 @@ namespace falcon {
 /* Graph Consistency checker                                                 */
 /* ************************************************************************* */
 
-GraphConsistencyChecker::GraphConsistencyChecker(Graph* graph)
+GraphConsistencyChecker::GraphConsistencyChecker(Graph* graph, bool localOnly)
   : graph_(graph)
+  , localOnly_(localOnly)
   , nbRootsSeen_(0)
   , nbSourcesSeen_(0)
+  , nbViolations_(0)
   , isConsistent_(true) { }
 
 void GraphConsistencyChecker::check() {
+  assert(!localOnly_);
+
   auto& roots = graph_->getRoots();
 
   for (auto it = roots.begin(); it != roots.end(); it++) {
@@ -55,6 +62,11 @@ void GraphConsistencyChecker::check() {
     << "Invalid number of rules.";
 }
 
+void GraphConsistencyChecker::checkLocal(Node* node) {
+  assert(localOnly_);
+  checkNode(node);
+}
+
 void GraphConsistencyChecker::checkNode(Node* node) {
   if (nodesSeen_.find(node) != nodesSeen_.end()) {
     return;
@@ -66,7 +78,8 @@ void GraphConsistencyChecker::checkNode(Node* node) {
   FCHECK(!node->getHashDepfile().empty()) << "the hash of the rule is empty";
 
   /* Check that the node is in the map. */
-  FCHECK(graph_->getNodes().find(node->getPath()) != graph_->getNodes().end())
+  FCHECK(graph_->getNodes().find(node->getPathId())
+         != graph_->getNodes().end())
     << node->getPath() << " not found in the map.";
 
   if (node->getParents().empty()) {
@@ -155,11 +168,84 @@ void GraphConsistencyChecker::checkRule(Rule* rule) {
       nbReady++;
     }
 
-    checkNode(*it);
+    if (!localOnly_) {
+      checkNode(*it);
+    }
   }
 
   FCHECK_EQ(nbReady, rule->numReady()) << "Invalid number of ready inputs for "
     "rule " << rule;
 }
 
+/* ************************************************************************* */
+/* Sampling-mode consistency verification                                    */
+/* ************************************************************************* */
+
+const std::size_t GraphConsistencySampler::kSliceNodes;
+const int GraphConsistencySampler::kMaxSliceUs;
+
+GraphConsistencySampler::GraphConsistencySampler() : cursor_(0) { }
+
+void GraphConsistencySampler::touch(PathId pathId) {
+  std::lock_guard<std::mutex> g(mutex_);
+  pending_.insert(pathId);
+}
+
+void GraphConsistencySampler::reset() {
+  std::lock_guard<std::mutex> g(mutex_);
+  pending_.clear();
+  cursor_ = 0;
+}
+
+void GraphConsistencySampler::slice(Graph& graph) {
+  auto start = std::chrono::steady_clock::now();
+  auto expired = [&start]() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() >= kMaxSliceUs;
+  };
+
+  GraphConsistencyChecker checker(&graph, true);
+  auto& nodes = graph.getNodes();
+
+  std::lock_guard<std::mutex> g(mutex_);
+  std::size_t budget = kSliceNodes;
+
+  /* The touched regions first: a mark that propagated wrong is caught one
+   * slice after the touch, not a full scan later. A pending id may have no
+   * node anymore if the graph shrank on a reload; the mark is just
+   * discarded. */
+  while (!pending_.empty() && budget > 0 && !expired()) {
+    auto it = pending_.begin();
+    auto found = nodes.find(*it);
+    pending_.erase(it);
+    if (found != nodes.end()) {
+      checker.checkLocal(found->second);
+      budget--;
+    }
+  }
+
+  /* Then keep the background round-robin scan moving, so the whole graph
+   * is eventually re-verified even when nothing is touched. The cursor
+   * walks the path id space, which is dense and survives reloads. */
+  std::size_t numPaths = getPathTable().size();
+  /* Not every interned path is a node: cap the probes too, so a slice over
+   * a sparse id range stays cheap. */
+  std::size_t probes = std::min(numPaths, kSliceNodes * 4);
+  while (probes > 0 && budget > 0 && !expired()) {
+    probes--;
+    auto found = nodes.find(cursor_);
+    cursor_ = static_cast<PathId>((cursor_ + 1) % numPaths);
+    if (found != nodes.end()) {
+      checker.checkLocal(found->second);
+      budget--;
+    }
+  }
+
+  StatsRegistry& stats = getStatsRegistry();
+  stats.consistencyNodesChecked.fetch_add(checker.numNodesChecked(),
+                                          std::memory_order_relaxed);
+  stats.consistencyViolations.fetch_add(checker.numViolations(),
+                                        std::memory_order_relaxed);
+}
+
 } // namespace falcon
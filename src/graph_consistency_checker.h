@@ -7,6 +7,9 @@
 #define FALCON_GRAPH_CONSISTENCY_CHECKER_H_
 
 #include <mutex>
+#include <unordered_set>
+
+#include "util/shared_mutex.h"
 
 #include "graph.h"
 
@@ -21,13 +24,27 @@ namespace falcon {
  */
 class GraphConsistencyChecker {
 public:
-  GraphConsistencyChecker(Graph* g);
+  /** With localOnly set, the checker only verifies the invariants local to
+   * the nodes given to checkLocal (and their child rules) instead of
+   * traversing: this is the bounded mode used by GraphConsistencySampler. */
+  GraphConsistencyChecker(Graph* g, bool localOnly = false);
 
   /* Perform a Depth-First traversal of the graph, starting from the root nodes.
    * Keep track of the number of roots, sources, rules seen and check that it
    * corresponds to the sets maintained by the graph. */
   virtual void check();
 
+  /** Check the invariants of the given node and of its child rule, without
+   * recursing through the rest of the graph. Only valid in localOnly
+   * mode. */
+  void checkLocal(Node* node);
+
+  /** How many distinct nodes this checker looked at. */
+  std::size_t numNodesChecked() const { return nodesSeen_.size(); }
+
+  /** How many invariant violations were logged. */
+  std::size_t numViolations() const { return nbViolations_; }
+
 private:
 
   /**
@@ -39,7 +56,7 @@ private:
   struct Checker : public std::ostringstream {
     bool cond_;
     Checker(bool cond, GraphConsistencyChecker* c) : cond_(cond) {
-      if (!cond) { c->isConsistent_ = false; }
+      if (!cond) { c->isConsistent_ = false; c->nbViolations_++; }
     }
     ~Checker() {
       /* On destruction, log everything if the condition was not met. */
@@ -51,8 +68,12 @@ private:
   virtual void checkRule(Rule *rule);
 
   Graph* graph_;
+  /** See the constructor: suppress the traversal, only check the nodes
+   * given explicitly. */
+  bool localOnly_;
   std::size_t nbRootsSeen_;
   std::size_t nbSourcesSeen_;
+  std::size_t nbViolations_;
 
   NodeSet nodesSeen_;
   RuleSet rulesSeen_;
@@ -62,12 +83,54 @@ private:
   friend struct Checker;
 };
 
+/**
+ * Continuous, amortized consistency verification, cheap enough for release
+ * builds: instead of a full traversal under the global lock (which only
+ * debug builds can afford, see FALCON_CHECK_GRAPH_CONSISTENCY), the sampler
+ * checks the graph one bounded slice at a time. A slice verifies the nodes
+ * touched since the last pass first (dirty-propagation frontier, reloaded
+ * regions), then keeps a round-robin scan of the whole node map moving, and
+ * stops after kSliceNodes nodes or kMaxSliceUs microseconds, whichever
+ * comes first, so the lock is never held long. Violations are logged and
+ * counted in the stats registry ("consistency.violations").
+ */
+class GraphConsistencySampler {
+public:
+  GraphConsistencySampler();
+
+  /** Record that a node was touched and should be re-verified by the next
+   * slice. */
+  void touch(PathId pathId);
+
+  /** The graph was rewired wholesale (reload): forget the pending marks and
+   * restart the round-robin scan from the beginning. */
+  void reset();
+
+  /** Verify one bounded slice of the graph. The caller must hold the graph
+   * lock; shared mode is enough, the checks only read. */
+  void slice(Graph& graph);
+
+private:
+  /** Upper bound on the number of nodes verified per slice. */
+  static const std::size_t kSliceNodes = 256;
+  /** Upper bound on the time spent (and thus on the lock hold) per slice. */
+  static const int kMaxSliceUs = 2000;
+
+  /* Guards pending_ and cursor_: touch, reset and slice can be called from
+   * different threads. */
+  std::mutex mutex_;
+  std::unordered_set<PathId> pending_;
+  /** Where the round-robin scan resumes, in PathId space: path ids are
+   * dense and stable across reloads, unlike node map iterators. */
+  PathId cursor_;
+};
+
 } // namespace falcon
 
 #if defined (DEBUG)
 # define FALCON_CHECK_GRAPH_CONSISTENCY(__graph__, __mutex__) \
 {                                                             \
-  std::lock_guard<std::mutex> lock(__mutex__);                \
+  std::lock_guard<falcon::SharedMutex> lock(__mutex__);       \
   falcon::GraphConsistencyChecker checker(__graph__);         \
   checker.check();                                            \
 }
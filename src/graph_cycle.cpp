@@ -5,8 +5,11 @@
 
 #include "graph.h"
 #include "logging.h"
+#include <algorithm>
 #include <cassert>
 #include <sstream>
+#include <unordered_set>
+#include <vector>
 #include "exceptions.h"
 
 namespace falcon {
@@ -45,7 +48,7 @@ void isCycle(Node const& n, VisitedNodes& stack) {
 }
 
 void checkGraphLoop(Graph const& g) {
-  NodeSet const& roots = g.getRoots();
+  NodeFlatSet const& roots = g.getRoots();
 
   for (auto it = roots.cbegin(); it != roots.cend(); it++) {
     VisitedNodes stack;
@@ -54,5 +57,154 @@ void checkGraphLoop(Graph const& g) {
   }
 }
 
+/* ************************************************************************* */
+/* Incremental cycle detection                                               */
+/* ************************************************************************* */
+
+GraphTopoOrder::GraphTopoOrder() : next_(0) { }
+
+void GraphTopoOrder::init(Graph const& g) {
+  order_.clear();
+  next_ = 0;
+
+  NodeFlatSet const& roots = g.getRoots();
+  for (auto it = roots.cbegin(); it != roots.cend(); it++) {
+    initNode(**it);
+  }
+}
+
+void GraphTopoOrder::initNode(Node const& n) {
+  if (order_.find(n.getPathId()) != order_.end()) {
+    return;
+  }
+
+  /* Post-order: the inputs are numbered before this node. The graph is
+   * known acyclic, so presence in order_ is a sufficient visited mark. */
+  Rule const* child = n.getChild();
+  if (child != nullptr) {
+    NodeArray const& inputs = child->getInputs();
+    for (auto it = inputs.cbegin(); it != inputs.cend(); it++) {
+      initNode(**it);
+    }
+  }
+
+  order_[n.getPathId()] = next_++;
+}
+
+std::uint32_t GraphTopoOrder::orderOf(PathId id) {
+  auto it = order_.find(id);
+  if (it != order_.end()) {
+    return it->second;
+  }
+  /* A node this order has never seen: a fresh maximal order is always
+   * consistent with its incoming edges; its outgoing ones are the violating
+   * edges insertEdge deals with. */
+  std::uint32_t order = next_++;
+  order_[id] = order;
+  return order;
+}
+
+void GraphTopoOrder::check(Graph const& g) {
+  RuleArray const& rules = g.getRules();
+  for (auto rt = rules.cbegin(); rt != rules.cend(); rt++) {
+    NodeArray const& inputs = (*rt)->getInputs();
+    NodeArray const& outputs = (*rt)->getOutputs();
+    for (auto it = inputs.cbegin(); it != inputs.cend(); it++) {
+      std::uint32_t input = orderOf((*it)->getPathId());
+      for (auto ot = outputs.cbegin(); ot != outputs.cend(); ot++) {
+        if (input >= orderOf((*ot)->getPathId())) {
+          insertEdge(*it, *ot);
+        }
+      }
+    }
+  }
+}
+
+void GraphTopoOrder::insertEdge(Node const* input, Node const* output) {
+  std::uint32_t lb = order_[output->getPathId()];
+  std::uint32_t ub = order_[input->getPathId()];
+
+  /* Forward region: everything reachable from the output whose order is at
+   * most ub. Reaching the input means the new edge closes a cycle. */
+  std::vector<Node const*> deltaF;
+  std::unordered_set<Node const*> seen;
+  std::vector<Node const*> stack(1, output);
+  seen.insert(output);
+  while (!stack.empty()) {
+    Node const* n = stack.back();
+    stack.pop_back();
+    if (n == input) {
+      Exception e(__func__, __FILE__, __LINE__, EINVAL,
+                  "LOOP DETECTED IN GRAPH");
+      std::string message = " +-> " + output->getPath() + " .. "
+          + input->getPath() + " -> " + output->getPath();
+      throw Exception(e.getErrorMessage(), __func__, __FILE__, __LINE__,
+                      e.getCode(), message.c_str());
+    }
+    deltaF.push_back(n);
+    ParentRuleArray const& parents = n->getParents();
+    for (auto rt = parents.cbegin(); rt != parents.cend(); rt++) {
+      NodeArray const& outs = (*rt)->getOutputs();
+      for (auto ot = outs.cbegin(); ot != outs.cend(); ot++) {
+        if (seen.find(*ot) == seen.end()
+            && orderOf((*ot)->getPathId()) <= ub) {
+          seen.insert(*ot);
+          stack.push_back(*ot);
+        }
+      }
+    }
+  }
+
+  /* Backward region: everything that reaches the input with an order of at
+   * least lb. */
+  std::vector<Node const*> deltaB;
+  seen.clear();
+  stack.assign(1, input);
+  seen.insert(input);
+  while (!stack.empty()) {
+    Node const* n = stack.back();
+    stack.pop_back();
+    deltaB.push_back(n);
+    Rule const* child = n->getChild();
+    if (child == nullptr) {
+      continue;
+    }
+    NodeArray const& ins = child->getInputs();
+    for (auto it = ins.cbegin(); it != ins.cend(); it++) {
+      if (seen.find(*it) == seen.end()
+          && orderOf((*it)->getPathId()) >= lb) {
+        seen.insert(*it);
+        stack.push_back(*it);
+      }
+    }
+  }
+
+  /* Reorder: the backward region must come entirely before the forward one.
+   * Both regions keep their internal order; the pool of order values they
+   * held is redistributed across the concatenation. */
+  auto byOrder = [this](Node const* a, Node const* b) {
+    return order_[a->getPathId()] < order_[b->getPathId()];
+  };
+  std::sort(deltaB.begin(), deltaB.end(), byOrder);
+  std::sort(deltaF.begin(), deltaF.end(), byOrder);
+
+  std::vector<std::uint32_t> pool;
+  pool.reserve(deltaB.size() + deltaF.size());
+  for (auto it = deltaB.cbegin(); it != deltaB.cend(); it++) {
+    pool.push_back(order_[(*it)->getPathId()]);
+  }
+  for (auto it = deltaF.cbegin(); it != deltaF.cend(); it++) {
+    pool.push_back(order_[(*it)->getPathId()]);
+  }
+  std::sort(pool.begin(), pool.end());
+
+  std::size_t i = 0;
+  for (auto it = deltaB.cbegin(); it != deltaB.cend(); it++) {
+    order_[(*it)->getPathId()] = pool[i++];
+  }
+  for (auto it = deltaF.cbegin(); it != deltaF.cend(); it++) {
+    order_[(*it)->getPathId()] = pool[i++];
+  }
+}
 
 }
@@ -6,7 +6,10 @@
 #include <iostream>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstring>
+#include <thread>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -19,25 +22,240 @@
 
 namespace falcon {
 
-GraphDependencyScan::GraphDependencyScan(Graph& graph, CacheManager* cache)
+/* Apply fn to every item of the given vector, using numThreads threads. The
+ * items are handed out with an atomic cursor so that threads that hit cheap
+ * items (small files, cached stats) keep going without waiting for the
+ * others. fn must only touch the item it is given. */
+template <typename T, typename Fn>
+static void parallelFor(std::vector<T>& items, std::size_t numThreads,
+                        Fn fn) {
+  if (numThreads > items.size()) {
+    numThreads = items.size();
+  }
+  if (numThreads <= 1) {
+    for (auto it = items.begin(); it != items.end(); ++it) {
+      fn(*it);
+    }
+    return;
+  }
+
+  std::atomic<std::size_t> cursor(0);
+  auto worker = [&items, &cursor, &fn]() {
+    std::size_t i;
+    while ((i = cursor.fetch_add(1)) < items.size()) {
+      fn(items[i]);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (std::size_t i = 0; i < numThreads; ++i) {
+    threads.push_back(std::thread(worker));
+  }
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    it->join();
+  }
+}
+
+GraphDependencyScan::GraphDependencyScan(Graph& graph, CacheManager* cache,
+                                         std::size_t numThreads)
     : graph_(graph)
-    , cache_(cache) {}
+    , cache_(cache)
+    , numThreads_(numThreads)
+    , changedFiles_(nullptr) {
+  if (numThreads_ == 0) {
+    numThreads_ = std::thread::hardware_concurrency();
+    if (numThreads_ == 0) {
+      numThreads_ = 1;
+    }
+  }
+}
 
 void GraphDependencyScan::scan() {
-  /* Update the timestamp of every node */
+  /* Phase 1: stat every node, in parallel. */
+  statEverything();
+
+  /* Phase 2: load the depfiles. This can grow the graph with new implicit
+   * dependency nodes, so it runs single threaded. */
+  loadDepfiles();
+
+  /* Phase 3: content-hash the source leaves, in parallel. This is where the
+   * scan spends most of its time on a cold start. */
+  hashSources();
+
+  /* Phase 4: recompute the hashes of rules and derived nodes level by
+   * level. */
+  computeTopologicalOrder();
+  hashWavefront();
+
+  /* Phase 5: mark what is dirty, children first. */
+  propagateDirtiness();
+}
+
+void GraphDependencyScan::restrictTo(std::set<std::string> const& changed) {
+  changedFiles_ = &changed;
+}
+
+bool GraphDependencyScan::mustRescan(std::string const& path) const {
+  assert(changedFiles_);
+  if (path[0] == '/' || path.compare(0, 3, "../") == 0) {
+    /* Outside the working directory: the watchman query did not cover it. */
+    return true;
+  }
+  return changedFiles_->find(path) != changedFiles_->end();
+}
+
+void GraphDependencyScan::statEverything() {
+  NodeArray toStat;
   NodeMap& nodeMap = graph_.getNodes();
+  toStat.reserve(nodeMap.size());
   for (auto it = nodeMap.begin(); it != nodeMap.end(); it++) {
     /* Only stat the node if it is not the output of a phony rule. */
     if (!it->second->getChild() || !it->second->getChild()->isPhony()) {
-      statNode(it->second);
+      /* In restricted mode the snapshot timestamp of an unchanged node is
+       * still valid: don't touch the filesystem for it. */
+      if (changedFiles_ && !mustRescan(it->second->getPath())) {
+        continue;
+      }
+      toStat.push_back(it->second);
     }
   }
 
-  /* Now do a DFS on the whole graph to scan dependencies that need to be
-   * rebuilt and recompute hashes. */
+  parallelFor(toStat, numThreads_, [](Node* n) { statNode(n); });
+}
+
+void GraphDependencyScan::loadDepfiles() {
+  RuleArray& rules = graph_.getRules();
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    if (!(*it)->hasDepfile()) {
+      continue;
+    }
+    /* In restricted mode the implicit dependencies of an untouched depfile
+     * are already part of the snapshot graph: reparsing it would find the
+     * same edges. */
+    if (changedFiles_ && !mustRescan((*it)->getDepfile())) {
+      continue;
+    }
+    if (!ruleLoadDepfile(*it)) {
+      rulesMissingDepfile_.insert(*it);
+    }
+  }
+}
+
+void GraphDependencyScan::hashSources() {
+  NodeArray toHash;
+  NodeFlatSet& sources = graph_.getSources();
+  for (auto it = sources.begin(); it != sources.end(); ++it) {
+    /* A changed source carries a stale snapshot hash: force the rehash. The
+     * hash cache makes this cheap for files whose mtime did not move. */
+    if ((*it)->getHash().empty()
+        || (changedFiles_ && mustRescan((*it)->getPath()))) {
+      toHash.push_back(*it);
+    }
+  }
+
+  parallelFor(toHash, numThreads_,
+              [](Node* n) { hash::updateNodeHash(*n, true, true); });
+}
+
+void GraphDependencyScan::computeTopologicalOrder() {
+  topologicalOrder_.clear();
+  seen_.clear();
   auto& roots = graph_.getRoots();
   for (auto it = roots.begin(); it != roots.end(); ++it) {
-    updateNode(*it);
+    if (!(*it)->isSource()) {
+      visitRule((*it)->getChild());
+    }
+  }
+}
+
+void GraphDependencyScan::visitRule(Rule* r) {
+  if (seen_.find(r) != seen_.end()) {
+    return;
+  }
+  seen_.insert(r);
+
+  auto& inputs = r->getInputs();
+  for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+    if (!(*it)->isSource()) {
+      visitRule((*it)->getChild());
+    }
+  }
+
+  topologicalOrder_.push_back(r);
+}
+
+void GraphDependencyScan::hashWavefront() {
+  /* Compute the topological level of each rule: one more than the deepest
+   * rule it takes an input from. Rules within a level are independent.
+   * topologicalOrder_ has children before parents so one pass is enough. */
+  std::unordered_map<Rule*, std::size_t> level;
+  std::size_t numLevels = 0;
+  for (auto it = topologicalOrder_.begin();
+       it != topologicalOrder_.end(); ++it) {
+    std::size_t l = 0;
+    auto& inputs = (*it)->getInputs();
+    for (auto in = inputs.begin(); in != inputs.end(); ++in) {
+      if (!(*in)->isSource()) {
+        std::size_t inputLevel = level[(*in)->getChild()] + 1;
+        l = std::max(l, inputLevel);
+      }
+    }
+    level[*it] = l;
+    numLevels = std::max(numLevels, l + 1);
+  }
+
+  std::vector<RuleArray> byLevel(numLevels);
+  for (auto it = topologicalOrder_.begin();
+       it != topologicalOrder_.end(); ++it) {
+    byLevel[level[*it]].push_back(*it);
+  }
+
+  for (std::size_t l = 0; l < numLevels; ++l) {
+    parallelFor(byLevel[l], numThreads_, [](Rule* r) {
+      hash::updateRuleHash(*r, true, true);
+      auto& outputs = r->getOutputs();
+      for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+        /* An output node only depends on its child rule, which was hashed
+         * just above, and is never shared with another rule. */
+        if ((*it)->getHash().empty()) {
+          hash::updateNodeHash(**it, true, true);
+        }
+      }
+    });
+  }
+}
+
+void GraphDependencyScan::propagateDirtiness() {
+  for (auto it = topologicalOrder_.begin();
+       it != topologicalOrder_.end(); ++it) {
+    Rule* r = *it;
+    bool isDirty = rulesMissingDepfile_.find(r) != rulesMissingDepfile_.end();
+
+    auto& inputs = r->getInputs();
+    for (auto in = inputs.begin(); in != inputs.end(); ++in) {
+      Node* input = *in;
+      if (!input->isSource()
+          && newlyDirty_.find(input->getChild()) != newlyDirty_.end()) {
+        input->setState(State::OUT_OF_DATE);
+        isDirty = true;
+        /* The input is not a source file: decrease the counter of inputs
+         * that are ready for the rule. */
+        r->markInputDirty();
+      }
+    }
+
+    if (!r->isPhony() && compareInputsWithOutputs(r)) {
+      isDirty = true;
+    }
+
+    if (isDirty) {
+      r->setState(State::OUT_OF_DATE);
+      newlyDirty_.insert(r);
+      auto& outputs = r->getOutputs();
+      for (auto out = outputs.begin(); out != outputs.end(); ++out) {
+        (*out)->setState(State::OUT_OF_DATE);
+      }
+    }
   }
 }
 
@@ -74,25 +292,6 @@ bool GraphDependencyScan::compareInputsWithOutputs(Rule *r) {
   return atLeastOneDirty;
 }
 
-bool GraphDependencyScan::updateNode(Node* n) {
-  bool dirty = false;
-
-  if (!n->isSource()) {
-    /* Traverse the child rule. */
-    dirty = updateRule(n->getChild());
-    /* If the child rule is dirty, this node is dirty. */
-    if (dirty) {
-      n->setState(State::OUT_OF_DATE);
-    }
-  }
-
-  if (n->getHash().empty()) {
-    hash::updateNodeHash(*n, true, true);
-  }
-
-  return dirty;
-}
-
 bool GraphDependencyScan::ruleLoadDepfile(Rule* r) {
   /* First, try to load the depfile. */
   auto res = Depfile::loadFromfile(r->getDepfile(), r, nullptr, graph_,
@@ -112,51 +311,6 @@ bool GraphDependencyScan::ruleLoadDepfile(Rule* r) {
   return res == Depfile::Res::SUCCESS;
 }
 
-/* Compare the oldest output to all of the input.
- * Mark as dirty every inputs which are newer than the oldest ouput. */
-bool GraphDependencyScan::updateRule(Rule* r) {
-  if (seen_.find(r) != seen_.end()) {
-    return r->isDirty();
-  }
-  seen_.insert(r);
-
-  bool isDirty = false;
-
-  /* Traverse all the inputs. */
-  auto& inputs  = r->getInputs();
-  for (auto it = inputs.begin(); it != inputs.end(); it++) {
-    if (updateNode(*it)) {
-      isDirty = true;
-      if (!(*it)->isSource()) {
-        /* If the input is not a source file, increase the counter of inputs
-         * that are not ready for the rule. */
-        r->markInputDirty();
-      }
-    }
-  }
-
-  hash::updateRuleHash(*r, true, true);
-
-  if (r->hasDepfile()) {
-    if (!ruleLoadDepfile(r)) {
-      isDirty = true;
-    } else {
-      hash::updateRuleHash(*r, true, false);
-    }
-  }
-
-  if (!r->isPhony() && compareInputsWithOutputs(r)) {
-    isDirty = true;
-  }
-
-  if (isDirty) {
-    r->setState(State::OUT_OF_DATE);
-    return true;
-  }
-
-  return false;
-}
-
 void statNode(Node* n) {
   struct stat st;
   Timestamp t = 0;
@@ -169,7 +323,7 @@ void statNode(Node* n) {
                     << ") [" << errno << "] " << strerror(errno);
     }
   } else {
-    t = st.st_mtime;
+    t = timestampFromStat(st);
   }
 
   n->setTimestamp(t);
@@ -6,6 +6,9 @@
 #ifndef FALCON_GRAPH_DEPENDENCY_SCAN_H_
 #define FALCON_GRAPH_DEPENDENCY_SCAN_H_
 
+#include <set>
+#include <vector>
+
 #include "graph.h"
 
 namespace falcon {
@@ -21,12 +24,38 @@ class CacheManager;
  *   run-time with watchman, we still need to traverse the entire graph on
  *   startup;
  * - When the graph is reloaded;
- * - When watchman fails: we fall back to using this method. */
+ * - When watchman fails: we fall back to using this method.
+ *
+ * The scan is organized so that the expensive parts run on several threads:
+ * - stat'ing every node and content-hashing every source leaf is
+ *   embarrassingly parallel and is spread over a pool of threads;
+ * - the hashes of rules and derived nodes are recomputed wavefront by
+ *   wavefront: the rules of a given topological level only depend on the
+ *   hashes of lower levels, so each level can be hashed in parallel.
+ * Everything that mutates the graph structure (loading depfiles) or the dirty
+ * flags stays single threaded. */
 class GraphDependencyScan {
  public:
-  GraphDependencyScan(Graph& graph, CacheManager* cache);
+  /**
+   * @param graph Graph to scan.
+   * @param cache Cache manager, used to restore missing depfiles.
+   * @param numThreads Number of threads for the parallel phases. 0 (the
+   *                   default) means one thread per hardware core.
+   */
+  GraphDependencyScan(Graph& graph, CacheManager* cache,
+                      std::size_t numThreads = 0);
   void scan();
 
+  /**
+   * Limit the stat/hash phases to the given files, expressed as paths
+   * relative to the working directory (as reported by a watchman "since"
+   * query). Only sound when the graph was restored from a snapshot: the
+   * timestamps and hashes of every other node are then already known.
+   * Nodes living outside the working directory cannot appear in the set and
+   * are always rescanned. The set must outlive the scan.
+   */
+  void restrictTo(std::set<std::string> const& changedFiles);
+
  private:
 
   /**
@@ -44,19 +73,32 @@ class GraphDependencyScan {
    */
   static bool compareInputsWithOutputs(Rule *r);
 
-  /**
-   * Traverse a Node.
-   * @param node node to traverse.
-   * @return True if the node was marked dirty.
-   */
-  bool updateNode(Node* node);
+  /** Stat every node of the graph on the thread pool. */
+  void statEverything();
 
-  /**
-   * Traverse a Rule.
-   * @param rule rule to traverse.
-   * @return True if the rule was marked dirty.
-   */
-  bool updateRule(Rule* rule);
+  /** Load the depfile of every rule that has one. This mutates the graph (it
+   * can discover new implicit dependency nodes) and thus runs on one thread.
+   * Rules whose depfile can not be loaded are recorded in
+   * rulesMissingDepfile_. */
+  void loadDepfiles();
+
+  /** Content-hash every source leaf that has no hash yet, on the thread
+   * pool. */
+  void hashSources();
+
+  /** Recompute the hashes of rules and derived nodes, one topological level
+   * at a time, each level being processed in parallel. */
+  void hashWavefront();
+
+  /** Mark dirty rules and nodes, walking the rules children first. Reuses the
+   * timestamps collected by statEverything. */
+  void propagateDirtiness();
+
+  /** Fill topologicalOrder_ with all the rules reachable from the roots,
+   * children before parents. Must be called after loadDepfiles so that the
+   * implicit dependency edges are taken into account. */
+  void computeTopologicalOrder();
+  void visitRule(Rule* r);
 
   /**
    * Load the depfile of a rule. This will query the cache for the depfile if
@@ -66,9 +108,30 @@ class GraphDependencyScan {
    */
   bool ruleLoadDepfile(Rule* r);
 
+  /** Whether the given path has to be rescanned in restricted mode: it is
+   * in the changed set, or outside the working directory and thus invisible
+   * to the watchman query. */
+  bool mustRescan(std::string const& path) const;
+
   Graph& graph_;
   RuleSet seen_;
   CacheManager* cache_;
+  std::size_t numThreads_;
+
+  /* Files to limit the scan to, see restrictTo. Null for a full scan. */
+  std::set<std::string> const* changedFiles_;
+
+  /* Rules in topological order, children first. */
+  std::vector<Rule*> topologicalOrder_;
+
+  /* Rules for which the depfile could neither be read nor restored from the
+   * cache. They have to be considered dirty. */
+  RuleSet rulesMissingDepfile_;
+
+  /* Rules that this scan marked dirty. Kept separate from Rule::isDirty so
+   * that rules that were already dirty before the scan do not get their
+   * parents' ready counters decremented a second time. */
+  RuleSet newlyDirty_;
 };
 
 
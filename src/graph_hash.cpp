@@ -5,13 +5,19 @@
 
 #include <iostream>
 
-#include <fstream>
-#include <openssl/sha.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 
 #include "graph.h"
 #include "graph_hash.h"
+#include "hash_cache.h"
+#include "hash_engine.h"
+#include "stats.h"
 
 #include "cache_manager.h"
 #include "depfile.h"
@@ -20,32 +26,183 @@
 
 namespace falcon { namespace hash {
 
+/* Thin wrapper over the compile-time selected engine (see hash_engine.h). */
 class Hasher {
  public:
-  Hasher() {
-    SHA256_Init(&ctx_);
-  }
+  Hasher() {}
 
   Hasher& operator<<(const std::string& data) {
-    SHA256_Update(&ctx_, data.c_str(), data.size());
+    engine_.update(data.c_str(), data.size());
     return *this;
   }
 
-  std::string get() {
-    SHA256_Final(digest_, &ctx_);
-    char mdString[SHA256_DIGEST_LENGTH*2 + 1];
-    memset(mdString, 0, sizeof(mdString));
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-      sprintf(&mdString[i*2], "%02x", (unsigned int)digest_[i]);
-    }
-    return mdString;
+  /* Digests are fed in as their 32 raw bytes, not as hex. */
+  Hasher& operator<<(const HashDigest& digest) {
+    engine_.update(digest.data(), HashDigest::kLength);
+    return *this;
+  }
+
+  void update(const void* data, std::size_t length) {
+    engine_.update(data, length);
+  }
+
+  HashDigest get() {
+    HashDigest digest;
+    engine_.final(&digest);
+    return digest;
   }
 
  private:
-  SHA256_CTX ctx_;
-  unsigned char digest_[SHA256_DIGEST_LENGTH];
+  HashEngine engine_;
 };
 
+/* Size of the hashing window. Huge files are mapped and hashed window by
+ * window so that we never pin more than this amount of address space, and the
+ * read() fallback uses a buffer of the same size. */
+static const size_t kHashChunkSize = 8 << 20;
+
+/* Feed the contents of an open file into the hasher by mmaping it, so the
+ * pages go straight from the page cache into the hash context without an
+ * intermediate heap copy. Falls back on plain read() if the file can not be
+ * mapped (empty file, pipe, network filesystem...). */
+static void hashFileContents(Hasher& hasher, int fd, const struct stat& st) {
+  /* Tell the kernel we are going to read the whole file sequentially. */
+  posix_fadvise(fd, 0, st.st_size, POSIX_FADV_SEQUENTIAL);
+
+  off_t offset = 0;
+  while (offset < st.st_size) {
+    size_t length = std::min(static_cast<off_t>(kHashChunkSize),
+                             st.st_size - offset);
+    void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, offset);
+    if (map == MAP_FAILED) {
+      break;
+    }
+    hasher.update(map, length);
+    munmap(map, length);
+    offset += length;
+  }
+
+  if (offset < st.st_size) {
+    /* mmap failed: fall back on a chunked read loop. */
+    std::vector<char> buffer(kHashChunkSize);
+    ssize_t bytes;
+    while ((bytes = pread(fd, buffer.data(), buffer.size(), offset)) > 0) {
+      hasher.update(buffer.data(), bytes);
+      offset += bytes;
+    }
+  }
+
+  /* The scan only reads each source once: no need to keep the pages cached
+   * at the expense of something else. */
+  posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
+}
+
+/* Compute the hash of a source node, going through the persistent hash cache
+ * so that a file whose mtime and size did not change since a previous run is
+ * not read at all. A missing file hashes as empty content, like the previous
+ * ifstream-based code did. */
+static HashDigest hashSourceNode(const std::string& path) {
+  Hasher hasher;
+  hasher << path;
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return hasher.get();
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return hasher.get();
+  }
+
+  std::uint64_t mtimeNs = static_cast<std::uint64_t>(st.st_mtim.tv_sec)
+                        * 1000000000ull + st.st_mtim.tv_nsec;
+  HashDigest hash;
+  if (getHashCache().lookup(path, mtimeNs, st.st_size, &hash)) {
+    close(fd);
+    return hash;
+  }
+
+  auto hashStart = std::chrono::steady_clock::now();
+  hashFileContents(hasher, fd, st);
+  close(fd);
+
+  hash = hasher.get();
+
+  StatsRegistry& stats = getStatsRegistry();
+  stats.hashFiles.fetch_add(1, std::memory_order_relaxed);
+  stats.hashBytes.fetch_add(st.st_size, std::memory_order_relaxed);
+  stats.hashTimeUs.fetch_add(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - hashStart).count(),
+      std::memory_order_relaxed);
+
+  getHashCache().insert(path, mtimeNs, st.st_size, hash);
+  return hash;
+}
+
+HashDigest hashFile(const std::string& path) {
+  return hashSourceNode(path);
+}
+
+SourceHashPrefetcher::SourceHashPrefetcher(std::size_t numThreads)
+  : done_(false) {
+  for (std::size_t i = 0; i < numThreads; ++i) {
+    workers_.push_back(std::thread(&SourceHashPrefetcher::workerThread,
+                                   this));
+  }
+}
+
+SourceHashPrefetcher::~SourceHashPrefetcher() {
+  finish();
+}
+
+void SourceHashPrefetcher::enqueue(Rule* rule) {
+  NodeArray const& inputs = rule->getInputs();
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+      /* An input whose producer is parsed further down in the file looks
+       * like a source here; warming it up is wasted work but stays correct,
+       * produced nodes are never hashed through the file cache. */
+      if ((*it)->isSource()) {
+        queue_.push_back((*it)->getPath());
+      }
+    }
+  }
+  cond_.notify_all();
+}
+
+void SourceHashPrefetcher::finish() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    done_ = true;
+  }
+  cond_.notify_all();
+  for (auto it = workers_.begin(); it != workers_.end(); ++it) {
+    if (it->joinable()) {
+      it->join();
+    }
+  }
+}
+
+void SourceHashPrefetcher::workerThread() {
+  for (;;) {
+    std::string path;
+    {
+      std::unique_lock<std::mutex> l(mutex_);
+      cond_.wait(l, [this]() { return done_ || !queue_.empty(); });
+      if (queue_.empty()) {
+        return;
+      }
+      path = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    hashSourceNode(path);
+  }
+}
+
 bool updateNodeHash(Node& n,
                     bool recomputeHash,
                     bool recomputeHashDeps) {
@@ -54,14 +211,7 @@ bool updateNodeHash(Node& n,
   bool changed = false;
 
   if (child == nullptr) {
-    std::ifstream ifs;
-    ifs.open(n.getPath(), std::ios::in | std::ios::binary);
-    std::string data((std::istreambuf_iterator<char>(ifs)),
-                     std::istreambuf_iterator<char>());
-    ifs.close();
-    Hasher hasher;
-    hasher << n.getPath() << data;
-    std::string hash = hasher.get();
+    HashDigest hash = hashSourceNode(n.getPath());
     if (recomputeHash) {
       changed |= n.getHash() != hash;
       n.setHash(hash);
@@ -75,7 +225,7 @@ bool updateNodeHash(Node& n,
       assert(!child->getHash().empty());
       Hasher hasher;
       hasher << n.getPath() << child->getHash();
-      std::string hash = hasher.get();
+      HashDigest hash = hasher.get();
       changed |= n.getHash() != hash;
       n.setHash(hash);
     }
@@ -83,7 +233,7 @@ bool updateNodeHash(Node& n,
       assert(!child->getHashDepfile().empty());
       Hasher hasher;
       hasher << n.getPath() << child->getHashDepfile();
-      std::string hash = hasher.get();
+      HashDigest hash = hasher.get();
       changed |= n.getHashDepfile() != hash;
       n.setHashDepfile(hash);
     }
@@ -92,6 +242,23 @@ bool updateNodeHash(Node& n,
   return changed;
 }
 
+/* Hash the command through the same tokenized representation the launch
+ * path executes (see Rule::getArgv): a shell-free command is fed in as its
+ * argv tokens, NUL-separated, so reformatting its whitespace no longer
+ * dirties the rule. A token cannot contain the separator, so distinct
+ * argvs cannot collide. Commands that need a shell are hashed verbatim,
+ * every byte of those is potentially meaningful. */
+static void hashCommand(Hasher& hasher, const Rule& r) {
+  const std::vector<std::string>& argv = r.getArgv();
+  if (argv.empty()) {
+    hasher << r.getCommand();
+    return;
+  }
+  for (auto it = argv.begin(); it != argv.end(); ++it) {
+    hasher.update(it->c_str(), it->size() + 1);
+  }
+}
+
 void updateRuleHash(Rule& r,
                     bool recomputeHash,
                     bool recomputeHashDeps) {
@@ -103,7 +270,7 @@ void updateRuleHash(Rule& r,
       assert(!inputs[i]->getHash().empty());
       hasher << inputs[i]->getHash();
     }
-    hasher << r.getCommand();
+    hashCommand(hasher, r);
     r.setHash(hasher.get());
   }
   if (recomputeHashDeps) {
@@ -114,18 +281,18 @@ void updateRuleHash(Rule& r,
         hasher << inputs[i]->getHashDepfile();
       }
     }
-    hasher << r.getCommand();
+    hashCommand(hasher, r);
     r.setHashDepfile(hasher.get());
   }
 }
 
 void recomputeRuleHash(Rule* rule,
-                       WatchmanClient* watchmanClient,
+                       FileWatcher* watcher,
                        Graph& graph,
                        CacheManager* cache,
                        bool recomputeHash,
                        bool recomputeHashDeps) {
-  std::string tmp = rule->getHashDepfile();
+  HashDigest tmp = rule->getHashDepfile();
 
   updateRuleHash(*rule, true, true);
 
@@ -134,7 +301,7 @@ void recomputeRuleHash(Rule* rule,
    * dependencies. */
   if (rule->hasDepfile() && tmp != rule->getHashDepfile()) {
     if (cache->restoreDepfile(rule)) {
-      Depfile::loadFromfile(rule->getDepfile(), rule, watchmanClient, graph,
+      Depfile::loadFromfile(rule->getDepfile(), rule, watcher, graph,
                             true);
       /* The implicit dependencies may have changed, so recompute the normal
        * hash. We don't compute the deps hash again. */
@@ -144,13 +311,13 @@ void recomputeRuleHash(Rule* rule,
 
   auto& outputs = rule->getOutputs();
   for (auto it = outputs.begin(); it != outputs.end(); ++it) {
-    recomputeNodeHash(*it, watchmanClient, graph, cache,
+    recomputeNodeHash(*it, watcher, graph, cache,
                       recomputeHash, recomputeHashDeps);
   }
 }
 
 bool recomputeNodeHash(Node* node,
-                       WatchmanClient* watchmanClient,
+                       FileWatcher* watcher,
                        Graph& graph,
                        CacheManager* cache,
                        bool recomputeHash,
@@ -163,7 +330,7 @@ bool recomputeNodeHash(Node* node,
 
   auto& parentRules = node->getParents();
   for (auto it = parentRules.begin(); it != parentRules.end(); ++it) {
-    recomputeRuleHash(*it, watchmanClient, graph, cache,
+    recomputeRuleHash(*it, watcher, graph, cache,
                       recomputeHash, recomputeHashDeps);
   }
 
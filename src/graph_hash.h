@@ -6,8 +6,22 @@
 #ifndef FALCON_GRAPH_HASH_H_
 #define FALCON_GRAPH_HASH_H_
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hash_digest.h"
+
 namespace falcon { namespace hash {
 
+/* Hash a file like a source node would be hashed (path plus contents, going
+ * through the persistent hash cache). Used to detect whether the graph file
+ * itself changed. */
+HashDigest hashFile(const std::string& path);
+
 /* Update the Node hash:
  * if it is a leaf, then compute the new hash. Else get the Child's hash.
  * It is expected that the child rule's hash was already computed. */
@@ -22,19 +36,53 @@ void updateRuleHash(Rule& n,
                     bool recomputeHashDeps);
 
 void recomputeRuleHash(Rule* rule,
-                       WatchmanClient* watchmanClient,
+                       FileWatcher* watcher,
                        Graph& graph,
                        CacheManager* cache,
                        bool recomputeHash,
                        bool recomputeHashDeps);
 
 bool recomputeNodeHash(Node* node,
-                       WatchmanClient* watchmanClient,
+                       FileWatcher* watcher,
                        Graph& graph,
                        CacheManager* cache,
                        bool recomputeHash,
                        bool recomputeHashDeps);
 
+/**
+ * @class SourceHashPrefetcher
+ * @brief Warm the hash cache while the graph is still being parsed.
+ *
+ * A small worker pool that hashes source files in the background. Fed from
+ * GraphParser::setOnRuleParsed, it overlaps the source reads (disk) with
+ * the parse (CPU), so the dependency scan that follows mostly hits the hash
+ * cache instead of reading every source after the parse. Safe alongside the
+ * parse: the workers only see copied path strings, the filesystem, and the
+ * internally locked hash cache.
+ */
+class SourceHashPrefetcher {
+ public:
+  explicit SourceHashPrefetcher(std::size_t numThreads);
+  ~SourceHashPrefetcher();
+
+  /** Queue the inputs of a freshly parsed rule. Runs on the parsing thread,
+   * which may keep mutating the nodes afterwards: only the paths are copied
+   * out. */
+  void enqueue(Rule* rule);
+
+  /** Wait until every queued path has been hashed and stop the workers. */
+  void finish();
+
+ private:
+  void workerThread();
+
+  std::deque<std::string> queue_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool done_;
+  std::vector<std::thread> workers_;
+};
+
 } } // namespace falcon::hash
 
 #endif // FALCON_GRAPH_HASH_H_
@@ -3,37 +3,76 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
+#include <cassert>
 #include <iostream>
+#include <unistd.h>
 
 #include "graph_parallel_builder.h"
 #include "depfile.h"
+#include "duration_cache.h"
 #include "fs.h"
 #include "graph_hash.h"
 #include "logging.h"
+#include "stats.h"
+#include "util/async_log.h"
+#include "util/system_resources.h"
 
 namespace falcon {
 
+const std::size_t GraphParallelBuilder::kRulesPerDispatcher;
+const std::size_t GraphParallelBuilder::kMaxDispatchers;
+
 GraphParallelBuilder::GraphParallelBuilder(Graph& graph,
                                            BuildPlan& plan,
                                            CacheManager* cache,
                                            IBuildOutputConsumer* consumer,
-                                           WatchmanClient* watchmanClient,
+                                           FileWatcher* watcher,
                                            std::string const& workingDirectory,
+                                           std::string const& scratchDir,
                                            std::size_t numThreads,
-                                           std::mutex& mutex,
+                                           SharedMutex& mutex,
+                                           RemoteExecutor* remote,
+                                           BuildProfiler* profiler,
+                                           BuildTracer* tracer,
                                            onBuildCompletedFn callback)
     : graph_(graph)
     , plan_(plan)
     , cache_(cache)
     , consumer_(consumer)
-    , manager_(consumer)
-    , watchmanClient_(watchmanClient)
+    , watcher_(watcher)
     , workingDirectory_(workingDirectory)
+    , scratchDir_(scratchDir)
     , numThreads_(numThreads)
     , result_(BuildResult::SUCCEEDED)
-    , lock_(mutex, std::defer_lock)
+    , numRunning_(0)
+    , runningWeight_(0)
+    , budget_(numThreads)
+    , lastBudgetSample_(std::chrono::steady_clock::now())
+    , graphMutex_(mutex)
     , interrupted_(false)
-    , callback_(callback) {}
+    , callback_(callback)
+    , remote_(remote)
+    , profiler_(profiler)
+    , tracer_(tracer)
+    , pendingPost_(0)
+    , postStop_(false) {
+  /* Shard the running subprocesses over several dispatcher threads so that
+   * fork/poll/bookkeeping does not funnel through a single core at high -j
+   * levels. */
+  if (!scratchDir_.empty()) {
+    fs::mkdir(scratchDir_);
+  }
+
+  std::size_t numDispatchers = numThreads_ / kRulesPerDispatcher;
+  numDispatchers = std::max(numDispatchers, static_cast<std::size_t>(1));
+  numDispatchers = std::min(numDispatchers, kMaxDispatchers);
+  shardCapacity_ = (numThreads_ + numDispatchers - 1) / numDispatchers;
+  for (std::size_t i = 0; i < numDispatchers; ++i) {
+    dispatchers_.push_back(
+        std::unique_ptr<Dispatcher>(new Dispatcher(consumer)));
+  }
+}
 
 GraphParallelBuilder::~GraphParallelBuilder() {
   /* Make sure the thread finishes before going out of scope. */
@@ -48,7 +87,9 @@ void GraphParallelBuilder::startBuild() {
 
 void GraphParallelBuilder::interrupt() {
   interrupted_ = true;
-  manager_.interrupt();
+  for (auto it = dispatchers_.begin(); it != dispatchers_.end(); ++it) {
+    (*it)->manager.interrupt();
+  }
 }
 
 void GraphParallelBuilder::wait() {
@@ -58,48 +99,309 @@ void GraphParallelBuilder::wait() {
 }
 
 void GraphParallelBuilder::buildThread() {
-  /* TODO: improve locking mechanism so that the whole graph is not locked while
-   * building. */
-  lock_.lock();
+  /* The graph write lock is only held while dispatching ready rules; the
+   * post-processing of finished commands (depfile parsing, hashing, plan
+   * notification) runs on a small pool of workers so that a slow depfile
+   * never stalls dispatch. */
+  for (std::size_t i = 0; i < kNumPostProcessThreads; ++i) {
+    postThreads_.push_back(
+        std::thread(std::bind(&GraphParallelBuilder::postProcessThread,
+                              this)));
+  }
+
+  if (remote_) {
+    remote_->setCallback(std::bind(&GraphParallelBuilder::onRemoteRuleDone,
+                                   this, std::placeholders::_1,
+                                   std::placeholders::_2));
+  }
+
+  /* Run the dispatcher shards. They all pull from the plan's lock-free
+   * ready queues and only meet on atomic counters, so they scale with the
+   * core count. */
+  for (auto it = dispatchers_.begin(); it != dispatchers_.end(); ++it) {
+    (*it)->thread = std::thread(std::bind(
+        &GraphParallelBuilder::dispatcherThread, this, it->get()));
+  }
+  for (auto it = dispatchers_.begin(); it != dispatchers_.end(); ++it) {
+    (*it)->thread.join();
+  }
+
+  /* Drain and stop the post-processing workers before reporting the
+   * build as completed. */
+  {
+    std::unique_lock<std::mutex> l(postMutex_);
+    dispatchCond_.wait(l, [this]() { return pendingPost_ == 0; });
+    postStop_ = true;
+  }
+  postCond_.notify_all();
+  for (auto it = postThreads_.begin(); it != postThreads_.end(); ++it) {
+    it->join();
+  }
+  postThreads_.clear();
 
-  /* Main build loop. */
+  if (callback_) {
+    callback_(result_);
+  }
+}
+
+void GraphParallelBuilder::dispatcherThread(Dispatcher* dispatcher) {
+  /* Main build loop of one shard. */
   while (result_ == BuildResult::SUCCEEDED
       && !plan_.done() && !interrupted_) {
 
-    /* Try to spawn as many ready commands as possible. */
-    while (plan_.hasWork() && manager_.nbRunning() < numThreads_) {
-      Rule *rule = plan_.findWork();
-      assert(rule);
-      buildRule(rule);
+    {
+      /* Try to spawn as many ready commands as fit in this shard and in the
+       * admission budget. */
+      std::lock_guard<SharedMutex> g(graphMutex_);
+      std::size_t budget = admissionBudget();
+      while (dispatcher->manager.nbRunning() < shardCapacity_) {
+        /* A rule handed back by a dead peer must not be sent remotely
+         * again. */
+        bool allowRemote = true;
+        Rule* rule = dispatcher->deferred;
+        dispatcher->deferred = nullptr;
+        if (rule == nullptr) {
+          std::lock_guard<std::mutex> l(postMutex_);
+          if (!localRetry_.empty()) {
+            rule = localRetry_.front();
+            localRetry_.pop_front();
+            allowRemote = false;
+          }
+        }
+        if (rule == nullptr) {
+          if (!plan_.hasWork()) {
+            break;
+          }
+          rule = plan_.findWork();
+          if (rule == nullptr) {
+            /* Another shard claimed the work between hasWork and
+             * findWork. */
+            break;
+          }
+        }
+        std::size_t running = runningWeight_.load(std::memory_order_acquire);
+        if (running > 0 && running + rule->getWeight() > budget) {
+          /* The rule does not fit in the budget. Hold it until a running
+           * command completes; when nothing is running the rule is always
+           * admitted so the build makes progress. */
+          dispatcher->deferred = rule;
+          break;
+        }
+        buildRule(dispatcher, rule, allowRemote);
+      }
     }
 
-    /* We cannot run any more work. Wait for a command to complete. */
-    if (manager_.nbRunning() > 0) {
-      result_ = waitForNext();
+    if (dispatcher->manager.nbRunning() > 0) {
+      /* This shard cannot run any more work. Wait for one of its commands
+       * to complete. */
+      mergeResult(waitForNext(dispatcher));
+    } else {
+      /* Nothing is running on this shard: the next ready rules, if any,
+       * will come out of the other shards or the post-processing workers. */
+      std::unique_lock<std::mutex> l(postMutex_);
+      if (pendingPost_ == 0 && localRetry_.empty() && !plan_.hasWork()
+          && numRunning_.load(std::memory_order_acquire) == 0
+          && dispatcher->deferred == nullptr) {
+        /* No running command on any shard, no pending result, no ready
+         * rule: nothing can make progress anymore. */
+        break;
+      }
+      /* Sleep until there is work for this shard or nothing is in flight
+       * anymore (the mirror of the break above), not merely until
+       * pendingPost_ drops: commands running on the other shards would
+       * otherwise turn this wait into a spin on the graph write lock.
+       * numRunning_ is not guarded by postMutex_, so a wakeup can slip in
+       * between the check and the wait; the timeout makes sure the
+       * predicate is re-checked, and lets a budget-deferred rule retry
+       * once the admission budget recovers. */
+      dispatchCond_.wait_for(l, std::chrono::milliseconds(100), [this]() {
+        return !localRetry_.empty() || plan_.hasWork()
+            || (pendingPost_ == 0
+                && numRunning_.load(std::memory_order_acquire) == 0);
+      });
     }
   }
 
-  /* Flush the process manager. */
-  while (manager_.nbRunning() > 0) {
-    BuildResult tmp = waitForNext();
-    if (result_ == BuildResult::SUCCEEDED) {
-      result_ = tmp;
+  /* Flush this shard's process manager. */
+  while (dispatcher->manager.nbRunning() > 0) {
+    mergeResult(waitForNext(dispatcher));
+  }
+
+  /* The last completions of this shard may be what lets the other shards
+   * observe the end of the build. */
+  dispatchCond_.notify_all();
+}
+
+void GraphParallelBuilder::postProcessThread() {
+  for (;;) {
+    Rule* rule;
+    {
+      std::unique_lock<std::mutex> l(postMutex_);
+      postCond_.wait(l, [this]() { return postStop_ || !postQueue_.empty(); });
+      if (postQueue_.empty()) {
+        /* Stopped and drained. */
+        return;
+      }
+      rule = postQueue_.front();
+      postQueue_.pop_front();
     }
+
+    postProcessRule(rule);
+
+    {
+      std::lock_guard<std::mutex> l(postMutex_);
+      --pendingPost_;
+    }
+    dispatchCond_.notify_all();
   }
+}
 
-  lock_.unlock();
-  if (callback_) {
-    callback_(result_);
+std::string GraphParallelBuilder::scratchDepfile(const Rule* rule) const {
+  /* The depfile path id is interned, so it is unique within the daemon. */
+  return scratchDir_ + "/dep." + std::to_string(rule->getDepfileId());
+}
+
+void GraphParallelBuilder::postProcessRule(Rule* rule) {
+  /* Read and parse the depfile (if any) before taking the graph write lock:
+   * the parse only needs the file, so the lock is held for the graph
+   * mutation alone and the workers parse depfiles in parallel. */
+  Depfile::Staged staged;
+  bool depfileFromScratch = false;
+  if (rule->hasDepfile()) {
+    auto parseStart = tracer_ ? BuildTracer::now() : BuildTracer::TimePoint();
+    /* In scratch mode the depfile only ever exists in the scratch
+     * directory; keep its bytes so the cache entry is written from memory
+     * once the file is gone. */
+    bool keepContent = cache_ != nullptr && !scratchDir_.empty();
+    Depfile::Res res;
+    if (!scratchDir_.empty()) {
+      std::string scratch = scratchDepfile(rule);
+      res = staged.parse(scratch, false, keepContent);
+      if (res == Depfile::Res::ERROR_CANNOT_OPEN) {
+        /* The command did not write to the scratch location (eg the rule
+         * ran on a remote peer): fall back to the rule's own depfile. */
+        res = staged.parse(rule->getDepfile(), true, keepContent);
+      } else {
+        depfileFromScratch = true;
+        unlink(scratch.c_str());
+      }
+    } else {
+      res = staged.parse(rule->getDepfile(), true, keepContent);
+    }
+    if (tracer_) {
+      tracer_->span("depfile parse", rule, parseStart, BuildTracer::now());
+    }
+    if (res != Depfile::Res::SUCCESS) {
+      mergeResult(BuildResult::FAILED);
+      return;
+    }
   }
+
+  /* Integrating the result mutates the graph (states, depfile dependencies,
+   * hashes): it needs the write lock. */
+  std::lock_guard<SharedMutex> g(graphMutex_);
+
+  if (rule->hasDepfile()) {
+    if (!staged.integrate(rule, watcher_, graph_, true)) {
+      mergeResult(BuildResult::FAILED);
+      return;
+    }
+    /* Since the dependencies might have changed, the hash might have
+     * changed as well. */
+    /* TODO: we should be able to detect that the dependencies did not change
+     * and thus not recompute the hashes. */
+    auto hashStart = tracer_ ? BuildTracer::now() : BuildTracer::TimePoint();
+    hash::recomputeRuleHash(rule, watcher_, graph_, cache_, true, false);
+    if (tracer_) {
+      tracer_->span("hash recompute", rule, hashStart, BuildTracer::now());
+    }
+  }
+
+  if (cache_) {
+    /* Queue the outputs and the implicit dependencies for the background
+     * cache writer; the copies happen off the build path. A depfile
+     * captured from the scratch directory is persisted from memory: the
+     * file is already unlinked. */
+    auto saveStart = tracer_ ? BuildTracer::now() : BuildTracer::TimePoint();
+    if (depfileFromScratch) {
+      cache_->saveRule(rule, staged.content());
+    } else {
+      cache_->saveRule(rule);
+    }
+    if (tracer_) {
+      tracer_->span("cache save", rule, saveStart, BuildTracer::now());
+    }
+  }
+
+  onRuleFinished(rule);
 }
 
-void GraphParallelBuilder::buildRule(Rule* rule) {
+std::size_t GraphParallelBuilder::admissionBudget() {
+  std::unique_lock<std::mutex> l(budgetMutex_, std::try_to_lock);
+  if (!l.owns_lock()) {
+    /* Another shard is refreshing the budget; the current value is fresh
+     * enough. */
+    return budget_;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastBudgetSample_ < std::chrono::seconds(1)) {
+    return budget_;
+  }
+  lastBudgetSample_ = now;
+
+  std::size_t numCores = std::thread::hardware_concurrency();
+  if (numCores == 0) {
+    numCores = 1;
+  }
+
+  double load = system::loadAverage();
+  std::size_t availableMb = system::availableMemoryMb();
+
+  bool overloaded = load >= 0.0 && load > static_cast<double>(numCores) + 1.0;
+  bool lowMemory = availableMb > 0 && availableMb < kMinAvailableMemoryMb;
+
+  if (overloaded || lowMemory) {
+    /* Back off quickly: running commands are not killed, we just stop
+     * admitting new ones until the pressure eases. */
+    budget_ = std::max(budget_ / 2, static_cast<std::size_t>(1));
+    ADLOG(INFO, "admission budget lowered to %zu (load %.2f, %zuMiB "
+          "available)", budget_.load(), load, availableMb);
+  } else if (budget_ < numThreads_) {
+    /* Recover one slot at a time. */
+    ++budget_;
+  }
+
+  return budget_;
+}
+
+void GraphParallelBuilder::mergeResult(BuildResult result) {
+  if (result == BuildResult::SUCCEEDED) {
+    return;
+  }
+  BuildResult expected = BuildResult::SUCCEEDED;
+  result_.compare_exchange_strong(expected, result);
+}
+
+void GraphParallelBuilder::buildRule(Dispatcher* dispatcher, Rule* rule,
+                                     bool allowRemote) {
   if (rule->isPhony()) {
     /* A phony target, nothing to do. */
     onRuleFinished(rule);
+    /* The rules that became ready may be picked up by an idle shard. */
+    dispatchCond_.notify_all();
     return;
   }
 
+  if (profiler_) {
+    /* The cache lookup, remote dispatch or spawn starts now; the time spent
+     * since the rule became ready was queue wait. */
+    profiler_->ruleStarted(rule);
+  }
+  if (tracer_) {
+    tracer_->ruleStarted(rule);
+  }
+
   /* Create all the directories for the outputs. */
   auto& outputs = rule->getOutputs();
   for (auto it = outputs.begin(); it != outputs.end(); ++it) {
@@ -109,20 +411,78 @@ void GraphParallelBuilder::buildRule(Rule* rule) {
     }
   }
 
-  /* Create the directory for the depfile. */
-  if (rule->hasDepfile() && !fs::createPath(rule->getDepfile())) {
+  /* Create the directory for the depfile. With a scratch directory the
+   * depfile is written there instead and never touches the project disk. */
+  if (rule->hasDepfile() && scratchDir_.empty()
+      && !fs::createPath(rule->getDepfile())) {
     LOG(ERROR) << "could not create path " << rule->getDepfile();
   }
 
   if (tryBuildRuleFromCache(rule)) {
     /* We managed to retrieve all the outputs from the cache. */
+    if (profiler_) {
+      profiler_->ruleFinished(rule, true);
+    }
+    if (tracer_) {
+      tracer_->ruleFinished(rule, true);
+    }
     onRuleFinished(rule);
+    dispatchCond_.notify_all();
     return;
   }
 
+  /* The outputs may be hardlinked into the cache by a previous restore; make
+   * sure the command writes fresh inodes instead of through the links. */
+  for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+    fs::breakHardlink((*it)->getPath());
+  }
+  if (rule->hasDepfile() && scratchDir_.empty()) {
+    fs::breakHardlink(rule->getDepfile());
+  }
+
+  if (allowRemote && remote_ != nullptr) {
+    /* Try to ship the rule to an idle peer daemon. Count it as in flight
+     * before dispatching so its completion is never missed. */
+    {
+      std::lock_guard<std::mutex> l(postMutex_);
+      ++pendingPost_;
+    }
+    if (remote_->tryDispatch(rule)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> l(postMutex_);
+      --pendingPost_;
+    }
+  }
+
   /* This is not a phony target, and we could not find all the outputs in cache.
    * Build the rule. */
-  unsigned int id = manager_.addProcess(rule, workingDirectory_);
+  dispatcher->startTimes[rule] = std::chrono::steady_clock::now();
+  runningWeight_.fetch_add(rule->getWeight(), std::memory_order_acq_rel);
+  numRunning_.fetch_add(1, std::memory_order_acq_rel);
+  auto spawnStart = tracer_ ? BuildTracer::now() : BuildTracer::TimePoint();
+  unsigned int id;
+  if (!scratchDir_.empty() && rule->hasDepfile()) {
+    /* Redirect the depfile to the scratch directory by rewriting its path
+     * in the command. If the command does not mention the path the rewrite
+     * is a no-op; post-processing then falls back to the rule's own
+     * depfile location. */
+    std::string command = rule->getCommand();
+    const std::string& from = rule->getDepfile();
+    std::string to = scratchDepfile(rule);
+    std::size_t pos = 0;
+    while ((pos = command.find(from, pos)) != std::string::npos) {
+      command.replace(pos, from.size(), to);
+      pos += to.size();
+    }
+    id = dispatcher->manager.addProcess(rule, command, workingDirectory_);
+  } else {
+    id = dispatcher->manager.addProcess(rule, workingDirectory_);
+  }
+  if (tracer_) {
+    tracer_->span("spawn", rule, spawnStart, BuildTracer::now());
+  }
   consumer_->newCommand(id, rule->getCommand());
 }
 
@@ -132,8 +492,10 @@ bool GraphParallelBuilder::tryBuildRuleFromCache(Rule *rule) {
   }
 
   if (!cache_->restoreRule(rule)) {
+    getStatsRegistry().cacheMisses.fetch_add(1, std::memory_order_relaxed);
     return false;
   }
+  getStatsRegistry().cacheHits.fetch_add(1, std::memory_order_relaxed);
 
   /* Notify the consumer that all the outputs were retrieved from the cache. */
   auto& outputs = rule->getOutputs();
@@ -142,7 +504,7 @@ bool GraphParallelBuilder::tryBuildRuleFromCache(Rule *rule) {
   }
 
   /* Update the timestamp of the rule. */
-  rule->setTimestamp(time(NULL));
+  rule->setTimestamp(timestampNow());
 
   return true;
 }
@@ -159,44 +521,106 @@ void GraphParallelBuilder::markOutputsUpToDate(Rule *rule) {
   }
 }
 
-BuildResult GraphParallelBuilder::waitForNext() {
-  auto res = manager_.waitForNext();
+BuildResult GraphParallelBuilder::waitForNext(Dispatcher* dispatcher) {
+  auto res = dispatcher->manager.waitForNext();
   Rule* rule = res.rule;
   SubProcessExitStatus status = res.status;
 
   consumer_->endCommand(res.cmdId, status);
 
-  /* Update the timestamp of the rule. */
-  rule->setTimestamp(std::time(NULL));
+  assert(runningWeight_.load(std::memory_order_acquire) >= rule->getWeight());
+  runningWeight_.fetch_sub(rule->getWeight(), std::memory_order_acq_rel);
+
+  {
+    /* Update the timestamp of the rule. */
+    std::lock_guard<SharedMutex> g(graphMutex_);
+    rule->setTimestamp(timestampNow());
+  }
 
   if (status != SubProcessExitStatus::SUCCEEDED) {
+    numRunning_.fetch_sub(1, std::memory_order_acq_rel);
+    dispatchCond_.notify_all();
     return status == SubProcessExitStatus::INTERRUPTED ?
         BuildResult::INTERRUPTED : BuildResult::FAILED;
   }
 
-  /* Now that the rule was built, parse its depfile (if any). */
-  if (rule->hasDepfile()) {
-    auto res = Depfile::loadFromfile(rule->getDepfile(), rule,
-        watchmanClient_, graph_, true);
-    if (res != Depfile::Res::SUCCESS) {
-      return BuildResult::FAILED;
-    }
-    /* Since the dependencies might have changed, the hash might have
-     * changed as well. */
-    /* TODO: we should be able to detect that the dependencies did not change
-     * and thus not recompute the hashes. */
-    hash::recomputeRuleHash(rule, watchmanClient_, graph_, cache_, true, false);
+  /* Record how long the rule took: the next build plans use it to schedule
+   * long rules first. */
+  auto itStart = dispatcher->startTimes.find(rule);
+  if (itStart != dispatcher->startTimes.end() && !rule->getOutputs().empty()) {
+    auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - itStart->second).count();
+    getDurationCache().record(rule->getOutputs().front()->getPath(),
+                              durationMs);
+    dispatcher->startTimes.erase(itStart);
   }
 
-  if (cache_) {
-    /* Save the outputs and the implicit dependencies in cache. */
-    cache_->saveRule(rule);
+  if (profiler_) {
+    profiler_->ruleFinished(rule, false);
+  }
+  if (tracer_) {
+    tracer_->ruleFinished(rule, false);
   }
 
-  onRuleFinished(rule);
+  /* Hand the rule to the post-processing workers so that the dispatch loop
+   * can immediately go back to spawning commands. The completion is counted
+   * in pendingPost_ before numRunning_ drops: an idle shard checking for
+   * the end of the build always sees one or the other. */
+  {
+    std::lock_guard<std::mutex> l(postMutex_);
+    postQueue_.push_back(rule);
+    ++pendingPost_;
+  }
+  numRunning_.fetch_sub(1, std::memory_order_acq_rel);
+  postCond_.notify_one();
+
   return BuildResult::SUCCEEDED;
 }
 
+void GraphParallelBuilder::onRemoteRuleDone(Rule* rule,
+                                            RemoteExecutor::Status status) {
+  switch (status) {
+  case RemoteExecutor::Status::SUCCESS:
+    {
+      /* The outputs are on disk; timestamp the rule like a local run. */
+      std::lock_guard<SharedMutex> g(graphMutex_);
+      rule->setTimestamp(timestampNow());
+    }
+    if (profiler_) {
+      profiler_->ruleFinished(rule, false);
+    }
+    if (tracer_) {
+      tracer_->ruleFinished(rule, false);
+    }
+    {
+      /* Already counted in pendingPost_ when the rule was dispatched. */
+      std::lock_guard<std::mutex> l(postMutex_);
+      postQueue_.push_back(rule);
+    }
+    postCond_.notify_one();
+    break;
+
+  case RemoteExecutor::Status::FAILED:
+    mergeResult(BuildResult::FAILED);
+    {
+      std::lock_guard<std::mutex> l(postMutex_);
+      --pendingPost_;
+    }
+    dispatchCond_.notify_all();
+    break;
+
+  case RemoteExecutor::Status::UNAVAILABLE:
+    /* The peer is gone, not the rule: run it locally. */
+    {
+      std::lock_guard<std::mutex> l(postMutex_);
+      localRetry_.push_back(rule);
+      --pendingPost_;
+    }
+    dispatchCond_.notify_all();
+    break;
+  }
+}
+
 void GraphParallelBuilder::onRuleFinished(Rule* rule) {
   /* Mark all the outputs up to date. */
   markOutputsUpToDate(rule);
@@ -7,32 +7,48 @@
 #define FALCON_GRAPH_PARALLEL_BUILDER_H_
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "build_plan.h"
+#include "build_profiler.h"
+#include "build_tracer.h"
 #include "cache_manager.h"
 #include "graph.h"
 #include "graph_builder.h"
 #include "posix_subprocess_manager.h"
+#include "remote_executor.h"
 #include "stream_server.h"
-#include "watchman.h"
+#include "util/shared_mutex.h"
+#include "file_watcher.h"
 
 namespace falcon {
 
 /** GraphParallelBuilder is a class that takes care of building a BuildPlan in
- * parallel. It uses PosixSubProcessManager to manager multiple commands running
- * at the same time. */
+ * parallel. The running subprocesses are sharded over several
+ * dispatcher/reaper threads, each owning a PosixSubProcessManager with its
+ * own poll loop, so that fork/poll/bookkeeping scales with core count
+ * instead of funnelling through a single thread. All the dispatchers pull
+ * from the plan's shared lock-free ready queues. */
 class GraphParallelBuilder : public IGraphBuilder {
  public:
   GraphParallelBuilder(Graph& Graph,
                        BuildPlan& plan,
                        CacheManager* cache,
                        IBuildOutputConsumer* consumer,
-                       WatchmanClient* watchmanClient,
+                       FileWatcher* watcher,
                        std::string const& workingDirectory,
+                       std::string const& scratchDir,
                        std::size_t numThreads,
-                       std::mutex& mutex,
+                       SharedMutex& mutex,
+                       RemoteExecutor* remote,
+                       BuildProfiler* profiler,
+                       BuildTracer* tracer,
                        onBuildCompletedFn callback);
 
   ~GraphParallelBuilder();
@@ -46,27 +62,159 @@ class GraphParallelBuilder : public IGraphBuilder {
   BuildResult getResult() const { return result_; }
 
  private:
+  /** One dispatcher/reaper shard: a slice of the running subprocesses with
+   * its own poll loop and spawn bookkeeping. */
+  struct Dispatcher {
+    PosixSubProcessManager manager;
+
+    /** When each running rule was spawned, to record its duration in the
+     * duration cache once it completes. Only touched by the owning
+     * thread. */
+    std::unordered_map<Rule*, std::chrono::steady_clock::time_point>
+        startTimes;
+
+    /** Ready rule pulled out of the plan but held back because it did not
+     * fit in the admission budget. Run before asking the plan for more
+     * work. */
+    Rule* deferred;
+
+    std::thread thread;
+
+    explicit Dispatcher(IBuildOutputConsumer* consumer)
+        : manager(consumer), deferred(nullptr) {}
+  };
+
   void buildThread();
-  void buildRule(Rule *rule);
+
+  /** Body of one dispatcher shard: spawn ready rules, reap its own
+   * subprocesses, hand completions to the post-processing workers. */
+  void dispatcherThread(Dispatcher* dispatcher);
+
+  void buildRule(Dispatcher* dispatcher, Rule* rule, bool allowRemote);
   bool tryBuildRuleFromCache(Rule *rule);
   void markOutputsUpToDate(Rule *rule);
-  BuildResult waitForNext();
+  BuildResult waitForNext(Dispatcher* dispatcher);
   void onRuleFinished(Rule* rule);
 
+  /** Body of a post-processing worker, see postQueue_. */
+  void postProcessThread();
+
+  /** Depfile parsing, hash recomputation, cache save and plan notification
+   * for one finished rule. Runs on a post-processing worker. */
+  void postProcessRule(Rule* rule);
+
+  /** Record a non-successful result; the first one wins. */
+  void mergeResult(BuildResult result);
+
+  /** Location in the scratch directory where the depfile of the given rule
+   * is redirected. Deterministic, so the spawn and the post-processing side
+   * agree without shared state. Only meaningful when scratchDir_ is set. */
+  std::string scratchDepfile(const Rule* rule) const;
+
+  /** Current number of job slots the builder may fill, refreshed from the
+   * system load average and available memory at most once per second.
+   * Always between 1 and numThreads_. Thread safe: when another shard is
+   * already refreshing, the current value is returned. */
+  std::size_t admissionBudget();
+
+  /** Completion callback of the remote executor, invoked on one of its
+   * worker threads. */
+  void onRemoteRuleDone(Rule* rule, RemoteExecutor::Status status);
+
   Graph& graph_;
   BuildPlan& plan_;
   CacheManager* cache_;
   IBuildOutputConsumer* consumer_;
-  PosixSubProcessManager manager_;
-  WatchmanClient * watchmanClient_;
+  FileWatcher* watcher_;
   std::string workingDirectory_;
+
+  /** Directory (ideally a tmpfs) where compilers are redirected to write
+   * their depfiles, so depfile I/O never touches the project disk. The
+   * depfile is parsed from there, persisted in cache from memory and
+   * unlinked. Empty when the redirection is disabled. */
+  std::string scratchDir_;
+
   std::size_t numThreads_;
-  BuildResult result_;
+  std::atomic<BuildResult> result_;
 
-  std::unique_lock<std::mutex> lock_;
+  /** The dispatcher shards. The objects exist for the lifetime of the
+   * builder (interrupt can come from any thread); their threads run between
+   * startBuild and the end of buildThread. */
+  std::vector<std::unique_ptr<Dispatcher>> dispatchers_;
+
+  /** Number of job slots each shard may fill, numThreads_ spread over the
+   * dispatchers. */
+  std::size_t shardCapacity_;
+
+  /** Number of subprocesses currently running, across all shards. */
+  std::atomic<std::size_t> numRunning_;
+
+  /** Sum of the weights of the running commands, in job slots, across all
+   * shards. A heavy rule counts as several jobs, see Rule::getWeight. */
+  std::atomic<std::size_t> runningWeight_;
+
+  /** Current admission budget and when it was last refreshed, see
+   * admissionBudget. lastBudgetSample_ is guarded by budgetMutex_. */
+  std::atomic<std::size_t> budget_;
+  std::mutex budgetMutex_;
+  std::chrono::steady_clock::time_point lastBudgetSample_;
+
+  /** Below this amount of available memory, the budget shrinks so that new
+   * commands do not push the machine into swap. */
+  static const std::size_t kMinAvailableMemoryMb = 1024;
+
+  /** Rules each dispatcher shard is expected to keep running. Determines
+   * how many shards a given -j level gets. */
+  static const std::size_t kRulesPerDispatcher = 16;
+
+  /** Upper bound on the number of dispatcher shards. */
+  static const std::size_t kMaxDispatchers = 8;
+
+  /** Write lock on the graph. Taken while dispatching ready rules and
+   * integrating finished ones, released while commands run so that
+   * read-only queries are served during the build. */
+  SharedMutex& graphMutex_;
   std::atomic_bool interrupted_;
   onBuildCompletedFn callback_;
   std::thread thread_;
+
+  /** Number of post-processing workers. Completion processing is cheap
+   * compared to running commands, a couple of workers is enough to absorb
+   * the occasional slow depfile. */
+  static const std::size_t kNumPostProcessThreads = 2;
+
+  /** Successfully finished rules waiting for depfile parsing, hashing and
+   * plan notification. Handing them to the workers keeps the dispatchers
+   * free to spawn new commands: a slow depfile no longer stalls dispatch.
+   * Guarded by postMutex_. */
+  std::deque<Rule*> postQueue_;
+  std::mutex postMutex_;
+  /** Wakes the workers when a rule is queued or the pool is stopped. */
+  std::condition_variable postCond_;
+  /** Wakes the dispatchers when a worker finished a rule or new work
+   * appeared. */
+  std::condition_variable dispatchCond_;
+  std::vector<std::thread> postThreads_;
+  /** Executes rules on peer daemons, may be null. See remote_executor.h. */
+  RemoteExecutor* remote_;
+
+  /** Records per-rule timings for the build profile, may be null. See
+   * build_profiler.h. */
+  BuildProfiler* profiler_;
+
+  /** Records a Chrome trace of the build, may be null. See build_tracer.h. */
+  BuildTracer* tracer_;
+
+  /** Rules a dead peer handed back, to be re-dispatched locally. Guarded by
+   * postMutex_. */
+  std::deque<Rule*> localRetry_;
+
+  /** Rules queued or being post-processed, plus rules in flight on a peer.
+   * Guarded by postMutex_. */
+  std::size_t pendingPost_;
+  /** Set to stop the workers once the queue is drained. Guarded by
+   * postMutex_. */
+  bool postStop_;
 };
 
 } // namespace falcon
@@ -0,0 +1,210 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <fstream>
+#include <unordered_set>
+#include <vector>
+
+#include "graph_partition.h"
+
+#include "logging.h"
+
+namespace falcon {
+
+GraphPartitioner::GraphPartitioner(Graph const& graph, std::size_t numShards)
+  : graph_(graph)
+  , numShards_(numShards)
+  , cutEdges_(0) {
+  assert(numShards_ >= 2);
+}
+
+static void visitRule(Rule* rule,
+                      std::unordered_set<Rule*>& visited,
+                      RuleArray& order) {
+  if (!visited.insert(rule).second) {
+    return;
+  }
+  NodeArray const& inputs = rule->getInputs();
+  for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+    Rule* producer = (*it)->getChild();
+    if (producer != nullptr) {
+      visitRule(producer, visited, order);
+    }
+  }
+  order.push_back(rule);
+}
+
+RuleArray GraphPartitioner::topologicalOrder() const {
+  RuleArray order;
+  std::unordered_set<Rule*> visited;
+  RuleArray const& rules = graph_.getRules();
+  order.reserve(rules.size());
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    visitRule(*it, visited, order);
+  }
+  return order;
+}
+
+void GraphPartitioner::partition() {
+  RuleArray order = topologicalOrder();
+
+  std::size_t totalWeight = 0;
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    totalWeight += (*it)->getWeight();
+  }
+
+  /* Balanced share of one shard. Affinity may overfill a shard by an eighth
+   * before a chain gets cut: a slightly uneven split beats an extra
+   * cross-shard edge. */
+  std::size_t capacity = (totalWeight + numShards_ - 1) / numShards_;
+  capacity += capacity / 8;
+
+  std::vector<std::size_t> load(numShards_, 0);
+  std::vector<std::size_t> affinity(numShards_);
+
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    Rule* rule = *it;
+    std::size_t weight = rule->getWeight();
+
+    /* Producers come first in the order, so they are already assigned. */
+    affinity.assign(numShards_, 0);
+    NodeArray const& inputs = rule->getInputs();
+    for (auto in = inputs.begin(); in != inputs.end(); ++in) {
+      Rule* producer = (*in)->getChild();
+      if (producer != nullptr) {
+        affinity[shard_[producer]]++;
+      }
+    }
+
+    /* The non-full shard owning most producers; ties go to the lighter
+     * shard. A source-only rule has no affinity anywhere and simply lands
+     * in the lightest shard. */
+    std::size_t best = numShards_;
+    for (std::size_t s = 0; s < numShards_; ++s) {
+      if (load[s] + weight > capacity) {
+        continue;
+      }
+      if (best == numShards_ || affinity[s] > affinity[best]
+          || (affinity[s] == affinity[best] && load[s] < load[best])) {
+        best = s;
+      }
+    }
+    if (best == numShards_) {
+      /* Every shard is above capacity (pathological weights): fall back on
+       * the lightest one. */
+      best = 0;
+      for (std::size_t s = 1; s < numShards_; ++s) {
+        if (load[s] < load[best]) {
+          best = s;
+        }
+      }
+    }
+
+    shard_[rule] = best;
+    load[best] += weight;
+  }
+
+  cutEdges_ = 0;
+  for (auto it = order.begin(); it != order.end(); ++it) {
+    std::size_t ruleShard = shard_[*it];
+    NodeArray const& inputs = (*it)->getInputs();
+    for (auto in = inputs.begin(); in != inputs.end(); ++in) {
+      Rule* producer = (*in)->getChild();
+      if (producer != nullptr && shard_[producer] != ruleShard) {
+        cutEdges_++;
+      }
+    }
+  }
+}
+
+/* The graph file format is JSON: escape the characters a path or a command
+ * line can reasonably contain. */
+static void writeJsonString(std::ostream& os, std::string const& s) {
+  os << '"';
+  for (auto it = s.begin(); it != s.end(); ++it) {
+    char c = *it;
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      os << buf;
+    } else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+bool GraphPartitioner::writeShardFiles(std::string const& prefix) const {
+  RuleArray const& rules = graph_.getRules();
+
+  for (std::size_t s = 0; s < numShards_; ++s) {
+    std::string path = prefix + std::to_string(s) + ".json";
+    std::ofstream os(path);
+    if (!os) {
+      LOG(ERROR) << "cannot write shard graph file " << path;
+      return false;
+    }
+
+    os << "{\n  \"rules\": [";
+    bool first = true;
+    for (auto it = rules.begin(); it != rules.end(); ++it) {
+      Rule* rule = *it;
+      auto assignment = shard_.find(rule);
+      if (assignment == shard_.end() || assignment->second != s) {
+        continue;
+      }
+      os << (first ? "\n" : ",\n") << "    {\n      \"inputs\": [";
+      first = false;
+
+      /* Implicit inputs came from depfiles: the daemon of this shard will
+       * rediscover them, they do not belong in the graph file. A cross-shard
+       * input is written like any other: with its producer in another file
+       * it parses as a source node here. */
+      NodeArray const& inputs = rule->getInputs();
+      std::size_t numExplicit = inputs.size() - rule->getNumImplicitInputs();
+      for (std::size_t i = 0; i < numExplicit; ++i) {
+        if (i > 0) {
+          os << ", ";
+        }
+        writeJsonString(os, inputs[i]->getPath());
+      }
+      os << "],\n      \"outputs\": [";
+      NodeArray const& outputs = rule->getOutputs();
+      for (std::size_t i = 0; i < outputs.size(); ++i) {
+        if (i > 0) {
+          os << ", ";
+        }
+        writeJsonString(os, outputs[i]->getPath());
+      }
+      os << "]";
+      if (!rule->isPhony()) {
+        os << ",\n      \"cmd\": ";
+        writeJsonString(os, rule->getCommand());
+      }
+      if (rule->hasDepfile()) {
+        os << ",\n      \"depfile\": ";
+        writeJsonString(os, rule->getDepfile());
+      }
+      if (rule->getWeight() != 1) {
+        os << ",\n      \"weight\": " << rule->getWeight();
+      }
+      os << "\n    }";
+    }
+    os << "\n  ]\n}\n";
+
+    if (!os) {
+      LOG(ERROR) << "cannot write shard graph file " << path;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+} // namespace falcon
@@ -0,0 +1,64 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_GRAPH_PARTITION_H_
+# define FALCON_GRAPH_PARTITION_H_
+
+# include <string>
+# include <unordered_map>
+
+# include "graph.h"
+
+namespace falcon {
+
+/**
+ * @class GraphPartitioner
+ * @brief Split a graph into shards owned by separate daemons.
+ *
+ * A graph close to the memory or scan limits of one falcond can be split
+ * into several graph files, each served by its own daemon. Every rule is
+ * assigned to exactly one shard; a cross-shard edge makes the produced node
+ * appear as a plain input in the consuming shard, which treats it as a
+ * source file. Artifacts cross shards through the shared filesystem or the
+ * remote cache tier, and an upstream daemon reports completed boundary
+ * nodes to its consumers with the notifyNodesBuilt thrift command, which
+ * marks them dirty there like a file-watcher notification would.
+ *
+ * Rules are assigned in topological order, greedily placing each rule in
+ * the shard that already owns most of its producers unless that shard is
+ * full (weight above its balanced share): connected chains stay together
+ * and only low-affinity edges are cut.
+ */
+class GraphPartitioner {
+ public:
+  /** numShards must be at least 2. */
+  GraphPartitioner(Graph const& graph, std::size_t numShards);
+
+  /** Compute the assignment. */
+  void partition();
+
+  /** Number of cross-shard edges of the computed assignment. */
+  std::size_t numCutEdges() const { return cutEdges_; }
+
+  /** Write one graph file per shard, named <prefix><shard>.json. The files
+   * are valid falcon graph files. Return false on an io error. */
+  bool writeShardFiles(std::string const& prefix) const;
+
+ private:
+  /** Rules of the graph, producers before consumers. */
+  RuleArray topologicalOrder() const;
+
+  Graph const& graph_;
+  std::size_t numShards_;
+  std::unordered_map<Rule const*, std::size_t> shard_;
+  std::size_t cutEdges_;
+
+  GraphPartitioner(const GraphPartitioner& other) = delete;
+  GraphPartitioner& operator=(const GraphPartitioner&) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_GRAPH_PARTITION_H_
@@ -3,8 +3,11 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <cstdint>
 #include <iostream>
 
+#include <arpa/inet.h>
+
 #include "graph.h"
 #include "logging.h"
 
@@ -44,20 +47,30 @@ void printGraphMakefile(Graph const& g, std::ostream& os) {
 /* Graphviz printer                                                           */
 /* ************************************************************************* */
 
-static void printNodeGraphviz(Node const& n, std::ostream& os) {
+void printGraphvizHeader(std::ostream& os) {
+  os << "digraph Falcon {" << std::endl;
+  os << "rankdir=\"LR\"" << std::endl;
+  os << "edge [fontsize=10, arrowhead=vee]" << std::endl;
+}
+
+void printGraphvizFooter(std::ostream& os) {
+  os << "}" << std::endl;
+}
+
+void printNodeGraphviz(Node const& n, std::ostream& os) {
   std::string color = (n.getState() == State::OUT_OF_DATE)
                     ? "red"
                     : "black";
   std::string fillColor = "white";
 
   os << "node [fontsize=10, shape=box, height=0.25, style=filled]" << std::endl;
-  os << "\"" << n.getHash() << "\" [label=\"" << n.getPath()
+  os << "\"" << n.getHash().toHex() << "\" [label=\"" << n.getPath()
                    << "\"  color=\"" << color
                    << "\"  fillcolor=\"" << fillColor
                    << "\" ]" << std::endl;
 }
 
-static void printRuleGraphviz(Rule const& r, std::ostream& os) {
+void printRuleGraphviz(Rule const& r, std::ostream& os) {
   NodeArray const& inputs = r.getInputs();
   NodeArray const& outputs = r.getOutputs();
 
@@ -74,7 +87,8 @@ static void printRuleGraphviz(Rule const& r, std::ostream& os) {
       << std::endl;
   }
 
-  os << "\"" << r.getHash() << "\" [label=\"" << r.getHash().substr(0, 5)
+  os << "\"" << r.getHash().toHex() << "\" [label=\""
+     << r.getHash().toHex().substr(0, 5)
                    << "\"  color=\"" << color
                    << "\"  fillcolor=\"" << fillColor
                    << "\" ]" << std::endl;
@@ -89,13 +103,15 @@ static void printRuleGraphviz(Rule const& r, std::ostream& os) {
 
     std::string c = inputs[i]->getState() == State::OUT_OF_DATE
       ? "red" : "black";
-    os << "\"" << inputs[i]->getHash() << "\" ->" << "\"" << r.getHash()
+    os << "\"" << inputs[i]->getHash().toHex() << "\" ->"
+       << "\"" << r.getHash().toHex()
        << "\" [ color=\"" << c << "\", style=" << shape << " ]" << std::endl;
   }
 
   for (auto oit = outputs.cbegin(); oit != outputs.cend(); oit++) {
       os << "edge [fontsize=10, arrowhead=vee]" << std::endl;
-      os << "\"" << r.getHash() << "\" ->" << "\"" << (*oit)->getHash()
+      os << "\"" << r.getHash().toHex() << "\" ->"
+         << "\"" << (*oit)->getHash().toHex()
          << "\" [ color=\"" << color << "\", style=solid]" << std::endl;
   }
 }
@@ -104,9 +120,7 @@ void printGraphGraphviz(Graph const& g, std::ostream& os) {
   NodeMap const& nodeMap = g.getNodes();
   RuleArray const& rules = g.getRules();
 
-  os << "digraph Falcon {" << std::endl;
-  os << "rankdir=\"LR\"" << std::endl;
-  os << "edge [fontsize=10, arrowhead=vee]" << std::endl;
+  printGraphvizHeader(os);
 
   /* print all the Nodes */
   for (auto it = nodeMap.cbegin(); it != nodeMap.cend(); it++) {
@@ -118,7 +132,52 @@ void printGraphGraphviz(Graph const& g, std::ostream& os) {
     printRuleGraphviz(*(*it), os);
   }
 
-  os << "}" << std::endl;
+  printGraphvizFooter(os);
+}
+
+/* ************************************************************************* */
+/* Binary edge-list printer                                                  */
+/* ************************************************************************* */
+
+/* Compact export for tools that do not need dot syntax, streamed by the
+ * getGraphExport command. Nodes are referred to by their path table id; see
+ * GraphExportFormat in the thrift interface for the record layout. */
+
+static void writeU32(std::ostream& os, uint32_t v) {
+  v = htonl(v);
+  os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void writeU16(std::ostream& os, uint16_t v) {
+  v = htons(v);
+  os.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void printEdgeListHeader(std::ostream& os) {
+  os.write("FGE1", 4);
+}
+
+void printNodeEdgeList(Node const& n, std::ostream& os) {
+  std::string const& path = n.getPath();
+  os.put('N');
+  writeU32(os, n.getPathId());
+  writeU16(os, static_cast<uint16_t>(path.size()));
+  os.write(path.data(), path.size());
+}
+
+void printRuleEdgeList(Rule const& r, std::ostream& os) {
+  NodeArray const& inputs = r.getInputs();
+  NodeArray const& outputs = r.getOutputs();
+
+  os.put('R');
+  writeU32(os, static_cast<uint32_t>(inputs.size()));
+  writeU32(os, static_cast<uint32_t>(outputs.size()));
+  for (auto it = inputs.cbegin(); it != inputs.cend(); it++) {
+    writeU32(os, (*it)->getPathId());
+  }
+  for (auto it = outputs.cbegin(); it != outputs.cend(); it++) {
+    writeU32(os, (*it)->getPathId());
+  }
 }
 
 }
@@ -16,10 +16,10 @@
 namespace falcon {
 
 GraphReloader::GraphReloader(Graph& original, Graph& newGraph,
-                             WatchmanClient& watchman)
+                             FileWatcher& watcher)
   : original_(original)
   , new_(newGraph)
-  , watchman_(watchman)
+  , watcher_(watcher)
   , originalNodes_()
   , nodesSeen_()
 {
@@ -28,6 +28,11 @@ GraphReloader::GraphReloader(Graph& original, Graph& newGraph,
 void GraphReloader::updateGraph() {
   updateRoots();
   cleanStaleSubgraph();
+
+  /* Register the nodes created during the reload in one batch. */
+  if (!watchBatch_.empty()) {
+    watcher_.watchNodes(watchBatch_);
+  }
 }
 
 std::pair<Node*, bool> GraphReloader::getNode(NodeArray& source, Node* newNode)
@@ -39,7 +44,7 @@ std::pair<Node*, bool> GraphReloader::getNode(NodeArray& source, Node* newNode)
   if (nodeIt != source.end()) {
     Node* node = *nodeIt;
     source.erase(nodeIt);
-    originalNodes_.erase(node->getPath());
+    originalNodes_.erase(node->getPathId());
     return std::make_pair(node, true);
   }
 
@@ -53,19 +58,19 @@ std::pair<Node*, bool> GraphReloader::getNode(NodeArray& source, Node* newNode)
  *                updated graph)
  *  or create it */
 Node* GraphReloader::getNodeFromAll(Node* newNode) {
-  auto it = original_.nodes_.find(newNode->getPath());
+  auto it = original_.nodes_.find(newNode->getPathId());
 
   /* This is a new node. */
   if (it == original_.nodes_.end()) {
-    Node* node = new Node(newNode->getPath(), true);
-    original_.nodes_[node->getPath()] = node;
-    watchman_.watchNode(*node);
+    Node* node = original_.createNode(newNode->getPath(), true);
+    original_.nodes_[node->getPathId()] = node;
+    watchBatch_.push_back(node);
     return node;
   }
 
   /* This node already exists. */
   Node* node = it->second;
-  originalNodes_.erase(node->getPath());
+  originalNodes_.erase(node->getPathId());
   return node;
 }
 
@@ -80,7 +85,7 @@ void GraphReloader::updateRoots() {
     Node* root = getNodeFromAll(*it);
 
     bool ret = updateSubGraph(root, *it);
-    if (ret) {
+    if (ret || root->getHash().empty()) {
       hash::updateNodeHash(*root, true, true);
     }
 
@@ -94,7 +99,7 @@ void GraphReloader::cleanStaleSubgraph() {
     assert(it->second->parentRules_.empty());
 
     /* request watchman stop to wath it */
-    watchman_.unwatchNode(*(it->second));
+    watcher_.unwatchNode(*(it->second));
 
     if (!it->second->isSource()) {
       deleteChildRule(it->second);
@@ -103,17 +108,23 @@ void GraphReloader::cleanStaleSubgraph() {
 
     /* TODO: do we really need to do that since we cleared original_? */
     original_.nodes_.erase(it->first);
-    delete it->second;
+    original_.deleteNode(it->second);
   }
 }
 
 bool GraphReloader::updateSubGraph(Node* node, Node const* newNode) {
   bool r = false;
 
-  if (nodesSeen_.find(node) != nodesSeen_.end()) {
-    return r;
+  auto seen = nodesSeen_.find(node);
+  if (seen != nodesSeen_.end()) {
+    /* Already diffed below another parent: report the same outcome so that
+     * every parent of a shared node sees whether it changed. */
+    return seen->second;
   }
-  nodesSeen_.insert(node);
+  /* The graph passed the cycle check: the false placeholder is only ever
+   * read back by an ancestor while this node's subgraph is on the stack,
+   * which cannot happen. */
+  nodesSeen_[node] = false;
 
   if (node->isSource() && newNode->isSource()) {
     DLOG(INFO) << "  node '" << node->getPath() << "' stays a source file";
@@ -136,7 +147,7 @@ bool GraphReloader::updateSubGraph(Node* node, Node const* newNode) {
     }
     /* Update the sub rule */
     r = updateSubGraph(node->getChild(), newNode->getChild());
-    if (r) {
+    if (r || node->getChild()->getHash().empty()) {
       hash::updateRuleHash(*node->getChild(), true, true);
     }
   }
@@ -145,7 +156,8 @@ bool GraphReloader::updateSubGraph(Node* node, Node const* newNode) {
     node->setState(State::OUT_OF_DATE);
   }
 
-  original_.nodes_[node->getPath()] = node;
+  original_.nodes_[node->getPathId()] = node;
+  nodesSeen_[node] = r;
   return r;
 }
 
@@ -170,11 +182,14 @@ bool GraphReloader::updateRuleInputs(Rule* rule, NodeArray& inputs,
       node->addParentRule(rule);
     }
 
-    /* Update the input subgraph */
-    r |= updateSubGraph(node, *it);
-    if (r) {
-      /* TODO: here we might be re-computing the hash of a source file several
-       * times if this source file is new for several rules... */
+    /* Update the input subgraph. The decision to rehash is per input: one
+     * changed input must not drag its untouched siblings into a rehash (a
+     * source rehash reads the file back), they keep their hashes and
+     * states. A node created during this reload has no hash yet and is
+     * hashed whether its subgraph reports a change or not. */
+    bool subChanged = updateSubGraph(node, *it);
+    r |= subChanged;
+    if (subChanged || node->getHash().empty()) {
       hash::updateNodeHash(*node, true, true);
     }
 
@@ -241,15 +256,15 @@ bool GraphReloader::updateRuleDepfiles(Rule* rule,
      * so: reset the depfile, and clear the implicitDeps */
     rule->setDepfile(newRule->getDepfile());
     Depfile::loadFromfile(rule->getDepfile(), rule,
-                          &watchman_, original_, false);
+                          &watcher_, original_, false);
     return true;
   }
 
   /* The depfile remains the same: re-insert the implicitDeps. */
   for (auto it = implicitDepsBefore.begin(); it != implicitDepsBefore.end(); ++it) {
     rule->inputs_.push_back(*it);
-    originalNodes_.erase((*it)->getPath());
-    original_.nodes_[(*it)->getPath()] = *it;
+    originalNodes_.erase((*it)->getPathId());
+    original_.nodes_[(*it)->getPathId()] = *it;
     if ((*it)->isSource()) {
       original_.sources_.insert(*it);
     }
@@ -270,6 +285,9 @@ bool GraphReloader::updateSubGraph(Rule* rule, Rule const* newRule) {
                                rule->inputs_.end());
 
   rule->inputs_.clear();
+  /* inputs_ is rebuilt in place: drop the sorted-id cache of isInput, the
+   * size heuristic alone would miss a same-size rewire. */
+  rule->sortedInputIdsValid_ = false;
   rule->numInputsReady_ = 0;
   rule->numImplicitDeps_ = 0;
 
@@ -316,7 +334,7 @@ void GraphReloader::deleteChildRule(Node* node) {
       assert(ruleIt != original_.rules_.end());
       original_.rules_.erase(ruleIt);
     }
-    delete rule;
+    original_.deleteRule(rule);
   }
 }
 
@@ -324,7 +342,7 @@ Rule* GraphReloader::createNewRule(Rule const* newRule, Node* output) {
   NodeArray inputs;
   NodeArray outputs;
 
-  Rule* rule = new Rule(inputs, outputs);
+  Rule* rule = original_.createRule(inputs, outputs);
 
   rule->outputs_.push_back(output);
   output->setChild(rule);
@@ -6,8 +6,10 @@
 #ifndef FALCON_GRAPH_RELOADER_H_
 # define FALCON_GRAPH_RELOADER_H_
 
+# include <unordered_map>
+
 # include "graph.h"
-# include "watchman.h"
+# include "file_watcher.h"
 
 namespace falcon {
 
@@ -19,14 +21,14 @@ class CacheManager;
  * information from the previous state. */
 class GraphReloader {
 public:
-  GraphReloader(Graph& original, Graph& newGraph, WatchmanClient& watchman);
+  GraphReloader(Graph& original, Graph& newGraph, FileWatcher& watcher);
 
   void updateGraph();
 
 private:
   Graph& original_;
   Graph& new_;
-  WatchmanClient& watchman_;
+  FileWatcher& watcher_;
 
 private:
   /* Main methods ********************************************************** */
@@ -62,8 +64,13 @@ private:
   /* Keep a map of the original nodes (the nodes before updating the Graph)
    * all the remaining nodes will be deleted at the end */
   NodeMap originalNodes_;
-  /* A set of visited nodes in order to avoid visting more than once a Node */
-  NodeSet nodesSeen_;
+  /* Visited nodes, mapped to whether their subgraph changed. Caching the
+   * result (instead of just marking the node seen) lets every parent of a
+   * shared node observe the same diff outcome. */
+  std::unordered_map<Node*, bool> nodesSeen_;
+  /* Nodes created during the reload, registered with the file watcher in
+   * one batch at the end, see FileWatcher::watchNodes. */
+  NodeArray watchBatch_;
 };
 
 }
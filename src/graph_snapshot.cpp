@@ -0,0 +1,274 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+
+#include "graph_snapshot.h"
+#include "logging.h"
+
+namespace falcon {
+
+/* Snapshot format (all integers host endian, the file never leaves the
+ * machine):
+ *   header:  magic, graph file digest
+ *   nodes:   count, then per node: path, hash, hashDepfile, timestamp,
+ *            state, isExplicitDependency
+ *   rules:   count, then per rule: input node indices, output node indices,
+ *            numImplicitDeps, numInputsReady, command, depfile, weight,
+ *            hash, hashDepfile, timestamp, state
+ * Node indices refer to the order the nodes appear in the snapshot. */
+/* '03': timestamps switched from seconds to nanoseconds; older snapshots
+ * must be discarded, their timestamps would be misread as ancient. */
+static const char kSnapshotMagic[8] = { 'f', 'l', 'c', 'n', 'g', 's', '0', '3' };
+
+namespace {
+
+template <typename T>
+void writePod(std::ofstream& ofs, const T& value) {
+  ofs.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool readPod(std::ifstream& ifs, T* value) {
+  ifs.read(reinterpret_cast<char*>(value), sizeof(*value));
+  return ifs.good();
+}
+
+void writeString(std::ofstream& ofs, const std::string& s) {
+  writePod(ofs, static_cast<std::uint32_t>(s.size()));
+  ofs.write(s.data(), s.size());
+}
+
+bool readString(std::ifstream& ifs, std::string* s) {
+  std::uint32_t length;
+  if (!readPod(ifs, &length)) {
+    return false;
+  }
+  s->resize(length);
+  ifs.read(&(*s)[0], length);
+  return ifs.good();
+}
+
+void writeDigest(std::ofstream& ofs, const HashDigest& digest) {
+  ofs.write(reinterpret_cast<const char*>(digest.data()), HashDigest::kLength);
+}
+
+bool readDigest(std::ifstream& ifs, HashDigest* digest) {
+  ifs.read(reinterpret_cast<char*>(digest->data()), HashDigest::kLength);
+  return ifs.good();
+}
+
+} // anonymous namespace
+
+std::unique_ptr<Graph> GraphSnapshot::load(const std::string& file,
+                                           const HashDigest& graphFileHash) {
+  std::ifstream ifs(file, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    return nullptr;
+  }
+
+  char magic[sizeof(kSnapshotMagic)];
+  HashDigest snapshotHash;
+  ifs.read(magic, sizeof(magic));
+  if (!ifs.good() || memcmp(magic, kSnapshotMagic, sizeof(magic)) != 0
+      || !readDigest(ifs, &snapshotHash)) {
+    LOG(WARNING) << "Ignoring invalid graph snapshot " << file;
+    return nullptr;
+  }
+  if (snapshotHash != graphFileHash) {
+    /* The graph file changed since the snapshot was taken. */
+    DLOG(INFO) << "graph snapshot is stale, falling back to the JSON parser";
+    return nullptr;
+  }
+
+  std::unique_ptr<Graph> graph(new Graph());
+
+  std::uint64_t numNodes;
+  if (!readPod(ifs, &numNodes)) {
+    return nullptr;
+  }
+
+  std::vector<Node*> nodes;
+  nodes.reserve(numNodes);
+  for (std::uint64_t i = 0; i < numNodes; ++i) {
+    std::string path;
+    std::uint8_t state, isExplicit;
+    std::int64_t timestamp;
+    HashDigest hash, hashDepfile;
+    if (!readString(ifs, &path) || !readDigest(ifs, &hash)
+        || !readDigest(ifs, &hashDepfile) || !readPod(ifs, &timestamp)
+        || !readPod(ifs, &state) || !readPod(ifs, &isExplicit)) {
+      LOG(WARNING) << "Truncated graph snapshot " << file;
+      return nullptr;
+    }
+    Node* node = graph->createNode(path, isExplicit != 0);
+    node->hash_ = hash;
+    node->hashDepfile_ = hashDepfile;
+    node->timestamp_ = static_cast<Timestamp>(timestamp);
+    /* Through setState so the graph's dirty node set is rebuilt too. */
+    node->setState(state == 0 ? State::UP_TO_DATE : State::OUT_OF_DATE);
+    graph->nodes_[node->getPathId()] = node;
+    nodes.push_back(node);
+  }
+
+  std::uint64_t numRules;
+  if (!readPod(ifs, &numRules)) {
+    return nullptr;
+  }
+
+  for (std::uint64_t i = 0; i < numRules; ++i) {
+    std::uint32_t numInputs, numOutputs, numImplicit;
+    std::uint64_t numReady;
+    if (!readPod(ifs, &numInputs)) {
+      return nullptr;
+    }
+    NodeArray inputs, outputs;
+    inputs.reserve(numInputs);
+    for (std::uint32_t j = 0; j < numInputs; ++j) {
+      std::uint64_t index;
+      if (!readPod(ifs, &index) || index >= nodes.size()) {
+        return nullptr;
+      }
+      inputs.push_back(nodes[index]);
+    }
+    if (!readPod(ifs, &numOutputs)) {
+      return nullptr;
+    }
+    outputs.reserve(numOutputs);
+    for (std::uint32_t j = 0; j < numOutputs; ++j) {
+      std::uint64_t index;
+      if (!readPod(ifs, &index) || index >= nodes.size()) {
+        return nullptr;
+      }
+      outputs.push_back(nodes[index]);
+    }
+
+    std::string command, depfile;
+    std::uint8_t state;
+    std::int64_t timestamp;
+    std::uint32_t weight;
+    HashDigest hash, hashDepfile;
+    if (!readPod(ifs, &numImplicit) || !readPod(ifs, &numReady)
+        || !readString(ifs, &command) || !readString(ifs, &depfile)
+        || !readPod(ifs, &weight)
+        || !readDigest(ifs, &hash) || !readDigest(ifs, &hashDepfile)
+        || !readPod(ifs, &timestamp) || !readPod(ifs, &state)) {
+      LOG(WARNING) << "Truncated graph snapshot " << file;
+      return nullptr;
+    }
+
+    Rule* rule = graph->createRule(inputs, outputs);
+    rule->numImplicitDeps_ = numImplicit;
+    rule->numInputsReady_ = numReady;
+    rule->setCommand(command);
+    rule->setDepfile(depfile);
+    rule->setWeight(weight);
+    rule->hash_ = hash;
+    rule->hashDepfile_ = hashDepfile;
+    rule->timestamp_ = static_cast<Timestamp>(timestamp);
+    /* Through setState so the graph's dirty rule set is rebuilt too. */
+    rule->setState(state == 0 ? State::UP_TO_DATE : State::OUT_OF_DATE);
+    graph->rules_.push_back(rule);
+
+    for (auto it = inputs.begin(); it != inputs.end(); ++it) {
+      (*it)->addParentRule(rule);
+    }
+    for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+      (*it)->setChild(rule);
+    }
+  }
+
+  /* Rebuild the root and source sets from the edges. */
+  for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+    if ((*it)->getParents().empty()) {
+      graph->roots_.insert(*it);
+    }
+    if ((*it)->isSource()) {
+      graph->sources_.insert(*it);
+    }
+  }
+
+  DLOG(INFO) << "loaded graph snapshot: " << numNodes << " nodes, "
+             << numRules << " rules";
+  return graph;
+}
+
+bool GraphSnapshot::save(const std::string& file, const Graph& graph,
+                         const HashDigest& graphFileHash) {
+  /* Write to a temporary file and rename it into place, like the hash
+   * cache. */
+  std::string tmpFile = file + ".tmp";
+  std::ofstream ofs(tmpFile, std::ios::out | std::ios::binary
+                             | std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(WARNING) << "Cannot write graph snapshot " << tmpFile;
+    return false;
+  }
+
+  ofs.write(kSnapshotMagic, sizeof(kSnapshotMagic));
+  writeDigest(ofs, graphFileHash);
+
+  const NodeMap& nodeMap = graph.getNodes();
+  std::unordered_map<const Node*, std::uint64_t> nodeIndex;
+  nodeIndex.reserve(nodeMap.size());
+
+  writePod(ofs, static_cast<std::uint64_t>(nodeMap.size()));
+  for (auto it = nodeMap.begin(); it != nodeMap.end(); ++it) {
+    const Node* node = it->second;
+    std::uint64_t index = nodeIndex.size();
+    nodeIndex[node] = index;
+    writeString(ofs, node->getPath());
+    writeDigest(ofs, node->getHash());
+    writeDigest(ofs, node->getHashDepfile());
+    writePod(ofs, static_cast<std::int64_t>(node->getTimestamp()));
+    writePod(ofs, static_cast<std::uint8_t>(node->isDirty() ? 1 : 0));
+    writePod(ofs,
+             static_cast<std::uint8_t>(node->isExplicitDependency() ? 1 : 0));
+  }
+
+  const RuleArray& rules = graph.getRules();
+  writePod(ofs, static_cast<std::uint64_t>(rules.size()));
+  for (auto it = rules.begin(); it != rules.end(); ++it) {
+    const Rule* rule = *it;
+    const NodeArray& inputs = rule->getInputs();
+    writePod(ofs, static_cast<std::uint32_t>(inputs.size()));
+    for (auto in = inputs.begin(); in != inputs.end(); ++in) {
+      writePod(ofs, nodeIndex[*in]);
+    }
+    const NodeArray& outputs = rule->getOutputs();
+    writePod(ofs, static_cast<std::uint32_t>(outputs.size()));
+    for (auto out = outputs.begin(); out != outputs.end(); ++out) {
+      writePod(ofs, nodeIndex[*out]);
+    }
+    writePod(ofs, static_cast<std::uint32_t>(rule->getNumImplicitInputs()));
+    writePod(ofs, static_cast<std::uint64_t>(rule->numReady()));
+    writeString(ofs, rule->getCommand());
+    writeString(ofs, rule->getDepfile());
+    writePod(ofs, static_cast<std::uint32_t>(rule->getWeight()));
+    writeDigest(ofs, rule->getHash());
+    writeDigest(ofs, rule->getHashDepfile());
+    writePod(ofs, static_cast<std::int64_t>(rule->getTimestamp()));
+    writePod(ofs, static_cast<std::uint8_t>(rule->isDirty() ? 1 : 0));
+  }
+
+  if (!ofs.good()) {
+    LOG(WARNING) << "Error writing graph snapshot " << tmpFile;
+    return false;
+  }
+  ofs.close();
+
+  if (rename(tmpFile.c_str(), file.c_str()) != 0) {
+    LOG(WARNING) << "Cannot rename " << tmpFile << " to " << file;
+    return false;
+  }
+
+  return true;
+}
+
+} // namespace falcon
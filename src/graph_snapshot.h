@@ -0,0 +1,59 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_GRAPH_SNAPSHOT_H_
+# define FALCON_GRAPH_SNAPSHOT_H_
+
+# include <memory>
+# include <string>
+
+# include "graph.h"
+
+namespace falcon {
+
+/**
+ * @class GraphSnapshot
+ * @brief Versioned binary serialization of a Graph.
+ *
+ * Parsing the JSON graph file dominates the restart time on large graphs.
+ * After a successful load, the daemon serializes the built graph (nodes,
+ * rules, edges, hashes, timestamps, states) into a compact binary snapshot
+ * under the falcon directory. On the next start, if the graph file itself did
+ * not change (its content hash is stored in the snapshot header), the
+ * snapshot is deserialized in one sequential pass instead of re-running the
+ * JSON parser.
+ *
+ * Nodes are referenced by their position in the snapshot, so rebuilding the
+ * edges is pure index arithmetic. Anything unexpected in the file (bad magic,
+ * version or graph hash mismatch, truncation) makes load return nullptr and
+ * the caller falls back to the JSON parser.
+ */
+class GraphSnapshot {
+ public:
+  /**
+   * Load a snapshot.
+   * @param file Snapshot file path.
+   * @param graphFileHash Content hash of the current JSON graph file.
+   * @return The deserialized graph, or nullptr if there is no usable
+   *         snapshot for this graph file.
+   */
+  static std::unique_ptr<Graph> load(const std::string& file,
+                                     const HashDigest& graphFileHash);
+
+  /**
+   * Serialize a graph.
+   * @param file Snapshot file path.
+   * @param graph Graph to serialize.
+   * @param graphFileHash Content hash of the JSON graph file the graph was
+   *        built from.
+   * @return true on success.
+   */
+  static bool save(const std::string& file, const Graph& graph,
+                   const HashDigest& graphFileHash);
+};
+
+} // namespace falcon
+
+#endif // FALCON_GRAPH_SNAPSHOT_H_
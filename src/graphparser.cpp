@@ -5,6 +5,7 @@
 
 #include <fstream>
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 
 #include "exceptions.h"
@@ -15,7 +16,16 @@
 namespace falcon {
 
 GraphParser::GraphParser(std::string const& filepath)
-  : graph_(new Graph())
+  : streamState_(StreamState::TOP)
+  , skipDepth_(0)
+  , sawRules_(false)
+  , streamWeight_(1)
+  , ruleHasInputs_(false)
+  , ruleHasOutputs_(false)
+  , ruleHasCmd_(false)
+  , ruleHasDepfile_(false)
+  , ruleHasWeight_(false)
+  , graph_(new Graph())
   , graphFilePath_(filepath) {}
 
 std::unique_ptr<Graph> GraphParser::getGraph() {
@@ -25,7 +35,7 @@ std::unique_ptr<Graph> GraphParser::getGraph() {
 void GraphParser::processFile()
 {
   assert(graph_);
-  JsonParser parser;
+  JsonStreamParser parser(*this);
 
   {
     std::ifstream ifs;
@@ -40,24 +50,196 @@ void GraphParser::processFile()
         parser.parse(lineCounter++, buffer, ifs.gcount());
       } catch (Exception& e) {
         ifs.close();
+        /* consume() cannot throw through the C parser: it records the error
+         * and aborts the parse instead. Report it over the generic parse
+         * error. */
+        if (!streamError_.empty()) {
+          THROW_ERROR(EINVAL, streamError_.c_str());
+        }
         THROW_FORWARD_ERROR(e);
       }
     }  while(ifs.good ());
     ifs.close();
   }
 
-  JsonVal* dom = parser.getDom();
+  if (!sawRules_) {
+    THROW_ERROR(EINVAL, "No rules in the given JSon File");
+  }
 
-  if (!dom) {
-    THROW_ERROR(EINVAL, "No dom for this json file");
+  generateMandatoryNodes();
+}
+
+int GraphParser::consume(int type, char const* data,
+                         unsigned int const length) {
+  /* Unwind values hanging from keys we do not know about. */
+  if (skipDepth_ > 0) {
+    if (type == JSON_OBJECT_BEGIN || type == JSON_ARRAY_BEGIN) {
+      skipDepth_++;
+    } else if (type == JSON_OBJECT_END || type == JSON_ARRAY_END) {
+      skipDepth_--;
+    }
+    return 0;
   }
-  JsonVal const* rules = dom->getObject("rules");
 
-  if (rules && rules->_type == JSON_ARRAY_BEGIN) {
-    processJson(rules);
-  } else {
-    THROW_ERROR(EINVAL, "No rules in the given JSon File");
+  if (type == JSON_KEY) {
+    pendingKey_.assign(data, length);
+    return 0;
+  }
+
+  switch (streamState_) {
+  case StreamState::TOP:
+    if (type != JSON_OBJECT_BEGIN) {
+      streamError_ = "expecting an object at the top level";
+      return JSON_ERROR_CALLBACK;
+    }
+    streamState_ = StreamState::IN_ROOT_OBJECT;
+    break;
+
+  case StreamState::IN_ROOT_OBJECT:
+    if (type == JSON_OBJECT_END) {
+      streamState_ = StreamState::TOP;
+    } else if (pendingKey_ == "rules" && type == JSON_ARRAY_BEGIN) {
+      streamState_ = StreamState::IN_RULES;
+      sawRules_ = true;
+    } else if (type == JSON_OBJECT_BEGIN || type == JSON_ARRAY_BEGIN) {
+      skipDepth_ = 1;
+    }
+    break;
+
+  case StreamState::IN_RULES:
+    if (type == JSON_OBJECT_BEGIN) {
+      streamState_ = StreamState::IN_RULE;
+      streamInputs_.clear();
+      streamOutputs_.clear();
+      streamCmd_.clear();
+      streamDepfile_.clear();
+      streamWeight_ = 1;
+      ruleHasInputs_ = ruleHasOutputs_ = false;
+      ruleHasCmd_ = ruleHasDepfile_ = ruleHasWeight_ = false;
+    } else if (type == JSON_ARRAY_END) {
+      streamState_ = StreamState::IN_ROOT_OBJECT;
+    } else if (type == JSON_ARRAY_BEGIN) {
+      /* A non-object entry in the rules array is ignored, like in
+       * processJson. */
+      skipDepth_ = 1;
+    }
+    break;
+
+  case StreamState::IN_RULE:
+    if (type == JSON_OBJECT_END) {
+      finishStreamedRule();
+      if (!streamError_.empty()) {
+        return JSON_ERROR_CALLBACK;
+      }
+      streamState_ = StreamState::IN_RULES;
+    } else if (type == JSON_ARRAY_BEGIN && pendingKey_ == "inputs") {
+      streamState_ = StreamState::IN_INPUTS;
+      ruleHasInputs_ = true;
+    } else if (type == JSON_ARRAY_BEGIN && pendingKey_ == "outputs") {
+      streamState_ = StreamState::IN_OUTPUTS;
+      ruleHasOutputs_ = true;
+    } else if (pendingKey_ == "cmd") {
+      if (type != JSON_STRING) {
+        streamError_ = "Expecting STRING value for cmd field";
+        return JSON_ERROR_CALLBACK;
+      }
+      streamCmd_.assign(data, length);
+      ruleHasCmd_ = true;
+    } else if (pendingKey_ == "depfile") {
+      if (type != JSON_STRING) {
+        streamError_ = "Expecting STRING value for depfile field";
+        return JSON_ERROR_CALLBACK;
+      }
+      streamDepfile_.assign(data, length);
+      ruleHasDepfile_ = true;
+    } else if (pendingKey_ == "weight") {
+      if (type != JSON_INT) {
+        streamError_ = "Expecting INT value for weight field";
+        return JSON_ERROR_CALLBACK;
+      }
+      streamWeight_ = strtoul(std::string(data, length).c_str(), NULL, 10);
+      ruleHasWeight_ = true;
+    } else if (type == JSON_OBJECT_BEGIN || type == JSON_ARRAY_BEGIN) {
+      skipDepth_ = 1;
+    }
+    break;
+
+  case StreamState::IN_INPUTS:
+  case StreamState::IN_OUTPUTS:
+    if (type == JSON_ARRAY_END) {
+      streamState_ = StreamState::IN_RULE;
+    } else if (type == JSON_STRING) {
+      /* The path is interned straight from the parse buffer, no transient
+       * std::string. */
+      Node* node = getOrCreateNode(StringPiece(data, length));
+      if (streamState_ == StreamState::IN_INPUTS) {
+        streamInputs_.insert(node);
+      } else {
+        streamOutputs_.insert(node);
+      }
+    } else {
+      streamError_ = "invalid JSON entry: expect a STRING";
+      return JSON_ERROR_CALLBACK;
+    }
+    break;
   }
+
+  return 0;
+}
+
+void GraphParser::finishStreamedRule() {
+  /* Mirror processJson: an entry with neither inputs nor outputs is
+   * silently skipped. */
+  if (!ruleHasInputs_ && !ruleHasOutputs_) {
+    return;
+  }
+
+  NodeArray inputs(streamInputs_.begin(), streamInputs_.end());
+  NodeArray outputs(streamOutputs_.begin(), streamOutputs_.end());
+
+  Rule* rule = graph_->createRule(inputs, outputs);
+
+  if (ruleHasCmd_) {
+    rule->setCommand(streamCmd_);
+  }
+  if (ruleHasDepfile_) {
+    rule->setDepfile(streamDepfile_);
+  }
+  if (ruleHasWeight_) {
+    rule->setWeight(streamWeight_);
+  }
+
+  /* keep the rule in memory */
+  graph_->rules_.push_back(rule);
+
+  for (auto it = inputs.begin(); it != inputs.end(); it++) {
+    (*it)->addParentRule(rule);
+    rule->markInputReady();
+    graph_->roots_.erase(*it);
+  }
+  for (auto it = outputs.begin(); it != outputs.end(); it++) {
+    (*it)->setChild(rule);
+    graph_->sources_.erase(*it);
+  }
+
+  if (onRuleParsed_) {
+    onRuleParsed_(rule);
+  }
+}
+
+void GraphParser::setOnRuleParsed(std::function<void(Rule*)> callback) {
+  onRuleParsed_ = callback;
+}
+
+Node* GraphParser::getOrCreateNode(StringPiece path) {
+  PathId pathId = getPathTable().intern(path);
+  Node*& node = graph_->nodes_[pathId];
+  if (!node) {
+    node = graph_->createNode(pathId, true);
+    graph_->roots_.insert(node);
+    graph_->sources_.insert(node);
+  }
+  return node;
 }
 
 void GraphParser::checkNode(JsonVal const* json, NodeArray& nodeArray) {
@@ -71,15 +253,7 @@ void GraphParser::checkNode(JsonVal const* json, NodeArray& nodeArray) {
       THROW_ERROR(EINVAL, "invalid JSON entry: expect a STRING");
     }
 
-    Node* node = graph_->nodes_[json_string->_data];
-    if (!node) {
-      node = new Node(json_string->_data, true);
-      graph_->nodes_[json_string->_data] = node;
-      graph_->roots_.insert(node);
-      graph_->sources_.insert(node);
-    }
-
-    nodeSet.insert(node);
+    nodeSet.insert(getOrCreateNode(json_string->_data));
   }
 
   nodeArray.assign(nodeSet.begin(), nodeSet.end());
@@ -105,6 +279,7 @@ void GraphParser::processJson(JsonVal const* rules)
     JsonVal const* ruleOutputs = jsonRule->getObject("outputs");
     JsonVal const* ruleCmd     = jsonRule->getObject("cmd");
     JsonVal const* ruleDepfile = jsonRule->getObject("depfile");
+    JsonVal const* ruleWeight  = jsonRule->getObject("weight");
 
     /* TODO: MANAGE ERROR ?
      * should I have to expect to have at least one input and one outputs ? */
@@ -119,7 +294,7 @@ void GraphParser::processJson(JsonVal const* rules)
       THROW_FORWARD_ERROR(e);
     }
 
-    Rule* rule = new Rule(inputs, outputs);
+    Rule* rule = graph_->createRule(inputs, outputs);
 
     if (ruleCmd) {
       if (ruleCmd->_type != JSON_STRING) {
@@ -135,6 +310,13 @@ void GraphParser::processJson(JsonVal const* rules)
       rule->setDepfile(ruleDepfile->_data);
     }
 
+    if (ruleWeight) {
+      if (ruleWeight->_type != JSON_INT) {
+        THROW_ERROR(EINVAL, "Expecting INT value for weight field");
+      }
+      rule->setWeight(strtoul(ruleWeight->_data.c_str(), NULL, 10));
+    }
+
     /* keep the rule in memory */
     graph_->rules_.push_back(rule);
 
@@ -149,6 +331,10 @@ void GraphParser::processJson(JsonVal const* rules)
       (*it)->setChild(rule);
       graph_->sources_.erase(*it);
     }
+
+    if (onRuleParsed_) {
+      onRuleParsed_(rule);
+    }
   }
 
   generateMandatoryNodes();
@@ -158,9 +344,9 @@ void GraphParser::generateMandatoryNodes() {
   {
     /*  Register the graph file in order to manage it like every rule (register
      * to watchman, manage timestamp. */
-    Node* nodeGraphFile = new Node(graphFilePath_, true);
+    Node* nodeGraphFile = graph_->createNode(graphFilePath_, true);
     /*  Insert this node in the array of node */
-    graph_->nodes_[graphFilePath_] = nodeGraphFile;
+    graph_->nodes_[nodeGraphFile->getPathId()] = nodeGraphFile;
     graph_->roots_.insert(nodeGraphFile);
     graph_->sources_.insert(nodeGraphFile);
   }
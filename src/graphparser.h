@@ -6,6 +6,7 @@
 #ifndef FALCON_GRAPHPARSER_H_
 # define FALCON_GRAPHPARSER_H_
 
+# include <functional>
 # include <memory>
 # include "graph.h"
 # include "json/parser.h"
@@ -27,26 +28,88 @@ namespace falcon {
  * gb.processFile("file2");
  * @code
  */
-class GraphParser {
+class GraphParser : public JsonStreamConsumer {
   public:
     GraphParser(std::string const& filepath);
 
     std::unique_ptr<Graph> getGraph();
 
-    /* If the input is a file */
+    /* If the input is a file. The file is parsed in streaming mode: rules are
+     * turned into Nodes and Rules as their closing brace is seen, without
+     * materializing a JsonVal dom of the whole file. */
     void processFile();
     /* In the case we already have a Json object */
     void processJson(JsonVal const* rules);
 
+    /**
+     * Streaming parse callback, see JsonStreamConsumer. Not intended to be
+     * called directly. */
+    int consume(int type, char const* data, unsigned int const length);
+
+    /**
+     * Register a callback invoked on the parsing thread each time a rule has
+     * been fully wired into the graph, inputs and outputs included. Lets the
+     * caller pipeline work over the subgraph parsed so far (eg pre-hashing
+     * its sources) with the rest of the parse. */
+    void setOnRuleParsed(std::function<void(Rule*)> callback);
+
   private:
     void checkNode(JsonVal const* json, NodeArray& nodeArray);
 
+    /**
+     * Find the node for the given path, creating it (as a root and a source)
+     * on first sight. */
+    /* The path can be a slice of the parse buffer: it flows as a view into
+     * the path table, which copies it only on first sight. */
+    Node* getOrCreateNode(StringPiece path);
+
+    /**
+     * Build the Rule for the entry accumulated by consume() and wire it into
+     * the graph. */
+    void finishStreamedRule();
+
     /**
      * Generate mandatory Nodes (node to monitor the graph file) */
     void generateMandatoryNodes();
 
+    /**
+     * Where we stand in the { "rules": [ { ... }, ... ] } document during a
+     * streaming parse. */
+    enum class StreamState {
+      TOP,            /* before the top-level object */
+      IN_ROOT_OBJECT, /* inside the top-level object */
+      IN_RULES,       /* inside the "rules" array */
+      IN_RULE,        /* inside one rule object */
+      IN_INPUTS,      /* inside the "inputs" array of a rule */
+      IN_OUTPUTS      /* inside the "outputs" array of a rule */
+    };
+
+    StreamState streamState_;
+    /** Nesting depth left to unwind while skipping an unknown value. */
+    unsigned int skipDepth_;
+    /** Key whose value is expected next. */
+    std::string pendingKey_;
+    /** Set when consume() aborts the parse; processFile reports it. */
+    std::string streamError_;
+    bool sawRules_;
+
+    /* Accumulators for the rule object being parsed. */
+    NodeSet streamInputs_;
+    NodeSet streamOutputs_;
+    std::string streamCmd_;
+    std::string streamDepfile_;
+    std::size_t streamWeight_;
+    bool ruleHasInputs_;
+    bool ruleHasOutputs_;
+    bool ruleHasCmd_;
+    bool ruleHasDepfile_;
+    bool ruleHasWeight_;
+
     std::unique_ptr<Graph> graph_;
 
+    /** See setOnRuleParsed. May be empty. */
+    std::function<void(Rule*)> onRuleParsed_;
+
     /**
      * Graph file path */
     std::string const& graphFilePath_;
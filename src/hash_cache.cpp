@@ -0,0 +1,133 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "hash_cache.h"
+#include "logging.h"
+
+namespace falcon {
+
+/* File format: a small header followed by one record per entry.
+ * Record: u32 path length, path bytes, u64 mtime (ns), u64 size, raw digest.
+ * Integers are host endian: the file never leaves the machine. */
+static const char kHashCacheMagic[8] = { 'f', 'l', 'c', 'n', 'h', 'c', '0', '1' };
+
+bool HashCache::lookup(const std::string& path, std::uint64_t mtimeNs,
+                       std::uint64_t size, HashDigest* hash) const {
+  std::lock_guard<std::mutex> g(mutex_);
+  auto it = entries_.find(path);
+  if (it == entries_.end()
+      || it->second.mtimeNs != mtimeNs || it->second.size != size) {
+    return false;
+  }
+  *hash = it->second.hash;
+  return true;
+}
+
+void HashCache::insert(const std::string& path, std::uint64_t mtimeNs,
+                       std::uint64_t size, const HashDigest& hash) {
+  std::lock_guard<std::mutex> g(mutex_);
+  Entry& entry = entries_[path];
+  entry.mtimeNs = mtimeNs;
+  entry.size = size;
+  entry.hash = hash;
+  dirty_ = true;
+}
+
+void HashCache::load(const std::string& file) {
+  std::lock_guard<std::mutex> g(mutex_);
+
+  std::ifstream ifs(file, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    return;
+  }
+
+  char magic[sizeof(kHashCacheMagic)];
+  std::uint64_t numEntries = 0;
+  ifs.read(magic, sizeof(magic));
+  ifs.read(reinterpret_cast<char*>(&numEntries), sizeof(numEntries));
+  if (!ifs.good() || memcmp(magic, kHashCacheMagic, sizeof(magic)) != 0) {
+    LOG(WARNING) << "Ignoring invalid hash cache file " << file;
+    return;
+  }
+
+  std::vector<char> pathBuf;
+  for (std::uint64_t i = 0; i < numEntries; ++i) {
+    std::uint32_t pathLength = 0;
+    Entry entry;
+    ifs.read(reinterpret_cast<char*>(&pathLength), sizeof(pathLength));
+    pathBuf.resize(pathLength);
+    ifs.read(pathBuf.data(), pathLength);
+    ifs.read(reinterpret_cast<char*>(&entry.mtimeNs), sizeof(entry.mtimeNs));
+    ifs.read(reinterpret_cast<char*>(&entry.size), sizeof(entry.size));
+    ifs.read(reinterpret_cast<char*>(entry.hash.data()), HashDigest::kLength);
+    if (!ifs.good()) {
+      LOG(WARNING) << "Truncated hash cache file " << file
+                   << ", keeping " << i << " of " << numEntries << " entries";
+      break;
+    }
+    entries_[std::string(pathBuf.data(), pathLength)] = entry;
+  }
+
+  DLOG(INFO) << "loaded " << entries_.size() << " hash cache entries";
+}
+
+void HashCache::save(const std::string& file) {
+  std::lock_guard<std::mutex> g(mutex_);
+
+  if (!dirty_) {
+    return;
+  }
+
+  /* Write to a temporary file and rename it into place so that a crash in
+   * the middle of a save can not leave a half written cache behind. */
+  std::string tmpFile = file + ".tmp";
+  {
+    std::ofstream ofs(tmpFile, std::ios::out | std::ios::binary
+                               | std::ios::trunc);
+    if (!ofs.is_open()) {
+      LOG(WARNING) << "Cannot write hash cache file " << tmpFile;
+      return;
+    }
+
+    std::uint64_t numEntries = entries_.size();
+    ofs.write(kHashCacheMagic, sizeof(kHashCacheMagic));
+    ofs.write(reinterpret_cast<const char*>(&numEntries), sizeof(numEntries));
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+      std::uint32_t pathLength = it->first.size();
+      ofs.write(reinterpret_cast<const char*>(&pathLength),
+                sizeof(pathLength));
+      ofs.write(it->first.data(), pathLength);
+      ofs.write(reinterpret_cast<const char*>(&it->second.mtimeNs),
+                sizeof(it->second.mtimeNs));
+      ofs.write(reinterpret_cast<const char*>(&it->second.size),
+                sizeof(it->second.size));
+      ofs.write(reinterpret_cast<const char*>(it->second.hash.data()),
+                HashDigest::kLength);
+    }
+    if (!ofs.good()) {
+      LOG(WARNING) << "Error writing hash cache file " << tmpFile;
+      return;
+    }
+  }
+
+  if (rename(tmpFile.c_str(), file.c_str()) != 0) {
+    LOG(WARNING) << "Cannot rename " << tmpFile << " to " << file;
+    return;
+  }
+
+  dirty_ = false;
+}
+
+HashCache& getHashCache() {
+  static HashCache cache;
+  return cache;
+}
+
+} // namespace falcon
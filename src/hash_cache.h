@@ -0,0 +1,78 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_HASH_CACHE_H_
+# define FALCON_HASH_CACHE_H_
+
+# include <cstdint>
+# include <mutex>
+# include <string>
+# include <unordered_map>
+
+# include "hash_digest.h"
+
+namespace falcon {
+
+/**
+ * @class HashCache
+ * @brief Persistent cache of source file content hashes.
+ *
+ * Maps (path, mtime in nanoseconds, size) to the content hash of the file.
+ * On a daemon restart over an unchanged tree, updateNodeHash finds all its
+ * answers here and the startup scan skips essentially all content hashing.
+ *
+ * The cache lives in memory and is serialized to a single file under the
+ * falcon directory (see load/save). A lookup whose mtime or size does not
+ * match is a miss: stale entries are simply overwritten by the next insert
+ * for the same path.
+ *
+ * All the methods are thread safe, so the parallel phases of the dependency
+ * scan can query and populate the cache concurrently.
+ */
+class HashCache {
+ public:
+  HashCache() {}
+
+  /** Look up the hash of a path. Only hits if both the mtime and the size
+   * match the recorded ones.
+   * @return true on a hit, in which case *hash is filled in. */
+  bool lookup(const std::string& path, std::uint64_t mtimeNs,
+              std::uint64_t size, HashDigest* hash) const;
+
+  /** Record the hash of a path as of the given mtime and size. */
+  void insert(const std::string& path, std::uint64_t mtimeNs,
+              std::uint64_t size, const HashDigest& hash);
+
+  /** Load the cache from the given file. Missing or corrupted files are
+   * treated as an empty cache. */
+  void load(const std::string& file);
+
+  /** Serialize the cache to the given file. Does nothing if no entry was
+   * added since the last save. */
+  void save(const std::string& file);
+
+ private:
+  struct Entry {
+    std::uint64_t mtimeNs;
+    std::uint64_t size;
+    HashDigest hash;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, Entry> entries_;
+
+  /* Set when an entry is added or updated, cleared by save. */
+  bool dirty_ = false;
+
+  HashCache(const HashCache& other) = delete;
+  HashCache& operator=(const HashCache&) = delete;
+};
+
+/** Accessor for the process-wide hash cache. */
+HashCache& getHashCache();
+
+} // namespace falcon
+
+#endif // FALCON_HASH_CACHE_H_
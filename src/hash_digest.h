@@ -0,0 +1,66 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_HASH_DIGEST_H_
+# define FALCON_HASH_DIGEST_H_
+
+# include <array>
+# include <cstdint>
+# include <cstring>
+# include <string>
+
+namespace falcon {
+
+/**
+ * @class HashDigest
+ * @brief Fixed-size binary sha256 digest.
+ *
+ * Nodes and rules store their digests inline as 32 raw bytes instead of a
+ * heap-allocated hex string: comparing two digests is a memcmp and
+ * recomputing a hash does not allocate. The hex form is only rendered at the
+ * boundaries that need a printable name (cache filenames, thrift queries,
+ * graphviz output) via toHex().
+ *
+ * A default-constructed digest is all zeroes and is treated as "not computed
+ * yet" (see empty()).
+ */
+class HashDigest {
+ public:
+  static const std::size_t kLength = 32;
+
+  HashDigest() { bytes_.fill(0); }
+
+  /** Return true if the digest was never set. */
+  bool empty() const {
+    static const std::array<std::uint8_t, kLength> zeroes{};
+    return std::memcmp(bytes_.data(), zeroes.data(), kLength) == 0;
+  }
+
+  std::uint8_t* data() { return bytes_.data(); }
+  const std::uint8_t* data() const { return bytes_.data(); }
+
+  /** Render the digest as a lowercase hex string. */
+  std::string toHex() const {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * kLength, '0');
+    for (std::size_t i = 0; i < kLength; ++i) {
+      hex[2 * i]     = digits[bytes_[i] >> 4];
+      hex[2 * i + 1] = digits[bytes_[i] & 0xf];
+    }
+    return hex;
+  }
+
+  bool operator==(const HashDigest& o) const {
+    return std::memcmp(bytes_.data(), o.bytes_.data(), kLength) == 0;
+  }
+  bool operator!=(const HashDigest& o) const { return !(*this == o); }
+
+ private:
+  std::array<std::uint8_t, kLength> bytes_;
+};
+
+} // namespace falcon
+
+#endif // FALCON_HASH_DIGEST_H_
@@ -0,0 +1,229 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include "inotify_watcher.h"
+#include "logging.h"
+
+#include <cassert>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace falcon {
+
+/* Events that mean "the content or existence of this file moved". */
+static const uint32_t kWatchMask = IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE
+                                 | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM;
+
+InotifyWatcher::InotifyWatcher(std::string const& workingDirectory)
+  : workingDirectory_(workingDirectory)
+  , gitDirectory_(workingDirectory + "/.git")
+  , inotifyFd_(-1)
+  , stop_(false) {
+  inotifyFd_ = inotify_init1(IN_CLOEXEC);
+  if (inotifyFd_ < 0) {
+    LOG(ERROR) << "inotify_init failed: " << strerror(errno);
+    return;
+  }
+  thread_ = std::thread(&InotifyWatcher::run, this);
+}
+
+InotifyWatcher::~InotifyWatcher() {
+  stop_ = true;
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (inotifyFd_ >= 0) {
+    /* Closing the descriptor drops every watch. */
+    close(inotifyFd_);
+  }
+}
+
+void InotifyWatcher::setCallbacks(
+    std::function<void(const std::string&)> onFileChanged,
+    std::function<void()> onGitRefChanged) {
+  std::lock_guard<std::mutex> g(mutex_);
+  onFileChanged_ = onFileChanged;
+  onGitRefChanged_ = onGitRefChanged;
+}
+
+void InotifyWatcher::watchGraph(const Graph& g) {
+  auto nodeMap = g.getNodes();
+  for (auto it = nodeMap.cbegin(); it != nodeMap.cend(); it++) {
+    assert(it->second);
+    watchNode(*it->second);
+  }
+}
+
+void InotifyWatcher::unwatchGraph(const Graph& g) {
+  auto nodeMap = g.getNodes();
+  for (auto it = nodeMap.cbegin(); it != nodeMap.cend(); it++) {
+    assert(it->second);
+    unwatchNode(*it->second);
+  }
+}
+
+std::string InotifyWatcher::fullPath(std::string const& path) const {
+  if (!path.empty() && path[0] == '/') {
+    return path;
+  }
+  return workingDirectory_ + "/" + path;
+}
+
+bool InotifyWatcher::addDirWatch(std::string const& directory) {
+  auto it = dirs_.find(directory);
+  if (it != dirs_.end()) {
+    it->second.numFiles++;
+    return true;
+  }
+
+  int wd = inotify_add_watch(inotifyFd_, directory.c_str(), kWatchMask);
+  if (wd < 0) {
+    LOG(WARNING) << "inotify_add_watch(" << directory << ") failed: "
+                 << strerror(errno);
+    return false;
+  }
+
+  DirWatch watch;
+  watch.wd = wd;
+  watch.numFiles = 1;
+  dirs_[directory] = watch;
+  byWd_[wd] = directory;
+  return true;
+}
+
+void InotifyWatcher::removeDirWatch(std::string const& directory) {
+  auto it = dirs_.find(directory);
+  if (it == dirs_.end()) {
+    return;
+  }
+  if (--it->second.numFiles > 0) {
+    return;
+  }
+  inotify_rm_watch(inotifyFd_, it->second.wd);
+  byWd_.erase(it->second.wd);
+  dirs_.erase(it);
+}
+
+void InotifyWatcher::watchNode(const Node& n) {
+  if (inotifyFd_ < 0) {
+    return;
+  }
+
+  std::string full = fullPath(n.getPath());
+  std::string::size_type pos = full.find_last_of('/');
+  assert(pos != std::string::npos);
+  std::string directory = full.substr(0, pos);
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (files_.find(full) != files_.end()) {
+    return;
+  }
+  if (addDirWatch(directory)) {
+    files_[full] = n.getPath();
+  }
+}
+
+void InotifyWatcher::unwatchNode(const Node& n) {
+  if (inotifyFd_ < 0) {
+    return;
+  }
+
+  std::string full = fullPath(n.getPath());
+  std::string::size_type pos = full.find_last_of('/');
+  assert(pos != std::string::npos);
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (files_.erase(full) > 0) {
+    removeDirWatch(full.substr(0, pos));
+  }
+}
+
+void InotifyWatcher::watchGitHead() {
+  if (inotifyFd_ < 0) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (addDirWatch(gitDirectory_)) {
+    /* The file the git ref change lands in. git replaces HEAD atomically,
+     * so the interesting events are MOVED_TO/CREATE in .git, not writes. */
+    files_[gitDirectory_ + "/HEAD"] = gitDirectory_ + "/HEAD";
+  }
+}
+
+void InotifyWatcher::run() {
+  char buf[16 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (!stop_) {
+    struct pollfd pfd;
+    pfd.fd = inotifyFd_;
+    pfd.events = POLLIN;
+    int r = poll(&pfd, 1, 100);
+    if (r <= 0) {
+      continue;
+    }
+
+    ssize_t len = read(inotifyFd_, buf, sizeof(buf));
+    if (len <= 0) {
+      if (len < 0 && errno != EAGAIN && errno != EINTR) {
+        LOG(ERROR) << "reading inotify events failed: " << strerror(errno);
+        return;
+      }
+      continue;
+    }
+
+    for (char* p = buf; p < buf + len; ) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      if (event->len > 0) {
+        processEvent(event->wd, event->name);
+      }
+      p += sizeof(struct inotify_event) + event->len;
+    }
+  }
+}
+
+void InotifyWatcher::processEvent(int wd, std::string const& name) {
+  std::function<void(const std::string&)> onFileChanged;
+  std::function<void()> onGitRefChanged;
+  std::string nodePath;
+  bool gitHead = false;
+
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    auto itDir = byWd_.find(wd);
+    if (itDir == byWd_.end()) {
+      return;
+    }
+    std::string full = itDir->second + "/" + name;
+    if (itDir->second == gitDirectory_ && name == "HEAD") {
+      gitHead = true;
+      onGitRefChanged = onGitRefChanged_;
+    } else {
+      auto itFile = files_.find(full);
+      if (itFile == files_.end()) {
+        return;
+      }
+      nodePath = itFile->second;
+      onFileChanged = onFileChanged_;
+    }
+  }
+
+  /* Deliver outside of mutex_: the callbacks reach back into the daemon,
+   * which may be registering new watches at the same time. */
+  if (gitHead) {
+    if (onGitRefChanged) {
+      onGitRefChanged();
+    }
+  } else if (onFileChanged) {
+    DLOG(INFO) << "[INOTIFY] " << nodePath << " changed";
+    onFileChanged(nodePath);
+  }
+}
+
+} // namespace falcon
@@ -0,0 +1,92 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_INOTIFY_WATCHER_H_
+# define FALCON_INOTIFY_WATCHER_H_
+
+# include <map>
+# include <mutex>
+# include <thread>
+# include <unordered_map>
+
+# include "file_watcher.h"
+
+namespace falcon {
+
+/**
+ * In-process file watching backend built on inotify.
+ *
+ * inotify watches directories, so the watcher keeps one watch descriptor
+ * per directory that contains at least one watched node, plus a map from
+ * full file path back to the path the graph knows. A change is thus a
+ * single kernel read away from the daemon: no external process, no JSON
+ * round trip. Notifications are pushed through the callbacks registered
+ * with setCallbacks, from the watcher's own thread.
+ *
+ * Unlike the watchman backend, inotify state dies with the process: the
+ * daemon cannot ask what changed while it was down (queryChangedSince
+ * keeps its default answer) and the startup scan is always full.
+ */
+class InotifyWatcher : public FileWatcher {
+ public:
+  explicit InotifyWatcher(std::string const& workingDirectory);
+  ~InotifyWatcher();
+
+  void watchGraph(const Graph& g);
+  void unwatchGraph(const Graph& g);
+  void watchNode(const Node& n);
+  void unwatchNode(const Node& n);
+  void watchGitHead();
+
+  void setCallbacks(std::function<void(const std::string&)> onFileChanged,
+                    std::function<void()> onGitRefChanged);
+
+ private:
+
+  /* Per-directory bookkeeping: the watch descriptor and how many watched
+   * files live there, so the watch is removed when the last one goes. */
+  struct DirWatch {
+    int wd;
+    std::size_t numFiles;
+  };
+
+  /** Full path of a node: node paths are relative to the working
+   * directory unless absolute. */
+  std::string fullPath(std::string const& path) const;
+
+  /** Make sure the directory holding the given full path is watched and
+   * account one more file in it. Called with mutex_ held. */
+  bool addDirWatch(std::string const& directory);
+  void removeDirWatch(std::string const& directory);
+
+  /** Body of the thread draining the inotify descriptor. */
+  void run();
+
+  /** Handle one inotify event. */
+  void processEvent(int wd, std::string const& name);
+
+  std::string workingDirectory_;
+  std::string gitDirectory_;
+
+  int inotifyFd_;
+  bool stop_;
+  std::thread thread_;
+
+  std::function<void(const std::string&)> onFileChanged_;
+  std::function<void()> onGitRefChanged_;
+
+  /* All the maps below are guarded by mutex_: watchNode is called while a
+   * build integrates new depfile dependencies, concurrently with the event
+   * thread resolving wds. */
+  mutable std::mutex mutex_;
+  std::map<std::string, DirWatch> dirs_;       /* directory -> watch */
+  std::unordered_map<int, std::string> byWd_;  /* wd -> directory */
+  /* full file path -> path as the graph knows it. */
+  std::unordered_map<std::string, std::string> files_;
+};
+
+} // namespace falcon
+
+#endif /* !FALCON_INOTIFY_WATCHER_H_ */
@@ -527,6 +527,92 @@ static int buffer_push_escape(json_parser *parser, unsigned char next)
 	return buffer_push(parser, c);
 }
 
+/* append a run of characters to the buffer in one copy */
+static int buffer_push_run(json_parser *parser, const char *s, uint32_t length)
+{
+	int ret;
+
+	while (parser->buffer_offset + length + 1 >= parser->buffer_size) {
+		ret = buffer_grow(parser);
+		if (ret)
+			return ret;
+	}
+	memcpy(parser->buffer + parser->buffer_offset, s, length);
+	parser->buffer_offset += length;
+	return 0;
+}
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define SCAN_RUN_VECTORIZED 1
+#endif
+
+/* length of the prefix of s made only of plain string characters: printable
+ * ascii except quote and backslash. In STATE__S all of them self-transition
+ * with an append buffer policy, so a whole run can be pushed with
+ * buffer_push_run instead of one table transition per byte. */
+static uint32_t string_run(const char *s, uint32_t length)
+{
+	uint32_t i = 0;
+#ifdef SCAN_RUN_VECTORIZED
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(0x20);
+
+	while (i + 16 <= length) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+		/* the compare is signed: bytes >= 0x80 are negative and get
+		 * flagged along with the control characters, which routes
+		 * utf8 sequences to the byte loop below */
+		__m128i stop = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+				     _mm_cmpeq_epi8(chunk, bslash)),
+			_mm_cmplt_epi8(chunk, space));
+		int mask = _mm_movemask_epi8(stop);
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+#endif
+	for (; i < length; i++) {
+		unsigned char c = s[i];
+		if (c < 0x20 || c >= 0x80 || c == '"' || c == '\\')
+			break;
+	}
+	return i;
+}
+
+/* length of the prefix of s made only of json whitespace */
+static uint32_t whitespace_run(const char *s, uint32_t length)
+{
+	uint32_t i = 0;
+#ifdef SCAN_RUN_VECTORIZED
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	while (i + 16 <= length) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *) (s + i));
+		__m128i ws = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, sp),
+				     _mm_cmpeq_epi8(chunk, nl)),
+			_mm_or_si128(_mm_cmpeq_epi8(chunk, tab),
+				     _mm_cmpeq_epi8(chunk, cr)));
+		int mask = _mm_movemask_epi8(ws) ^ 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+		i += 16;
+	}
+#endif
+	for (; i < length; i++) {
+		char c = s[i];
+		if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+			break;
+	}
+	return i;
+}
+
 #define CHK(f) do { ret = f; if (ret) return ret; } while(0)
 
 static int act_uc(json_parser *parser)
@@ -740,6 +826,30 @@ int json_parser_string(json_parser *parser, const char *s,
 		unsigned char ch = s[i];
 
 		ret = 0;
+
+		/* fast path: consume a homogeneous run of input in one step
+		 * instead of one table transition per character. Inside a
+		 * string every plain character appends and stays in STATE__S;
+		 * in the structural states (GO up to _A) whitespace
+		 * self-transitions without buffering. */
+		if (parser->utf8_multibyte_left == 0) {
+			uint32_t run = 0;
+			if (parser->state == STATE__S) {
+				run = string_run(s + i, length - i);
+				if (run > 0) {
+					ret = buffer_push_run(parser, s + i, run);
+					if (ret)
+						break;
+				}
+			} else if (parser->state <= STATE__A) {
+				run = whitespace_run(s + i, length - i);
+			}
+			if (run > 0) {
+				i += run - 1;
+				continue;
+			}
+		}
+
 		if (parser->utf8_multibyte_left > 0) {
 			if (utf8_continuation_table[ch] != 0) {
 				ret = JSON_ERROR_UTF8;
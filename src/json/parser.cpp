@@ -284,3 +284,63 @@ void JsonParser::parse (unsigned int const line, std::string& s)
 {
   this->parse (line, s.c_str (), s.size ());
 }
+
+
+
+
+
+
+JsonStreamConsumer::~JsonStreamConsumer ()
+{
+}
+
+JsonStreamParser::JsonStreamParser (JsonStreamConsumer& consumer)
+  : _consumer (consumer)
+{
+  json_config config;
+  memset (&config, 0, sizeof (config));
+  config.max_nesting = 0;
+  config.max_data = 0;
+  config.allow_c_comments = 1;
+  config.allow_yaml_comments = 0;
+  json_parser_init (&this->_parser, &config,
+                    JsonStreamParser::callback, &this->_consumer);
+}
+
+JsonStreamParser::~JsonStreamParser ()
+{
+  json_parser_free (&this->_parser);
+}
+
+int JsonStreamParser::callback (void* userdata, int type,
+                                const char* data, uint32_t length)
+{
+  /* The consumer must not throw: this frame is called from the C parser. */
+  return ((JsonStreamConsumer*)userdata)->consume (type, data, length);
+}
+
+void JsonStreamParser::parse (unsigned int const line,
+                              char const* s, unsigned int const size)
+{
+  int ret;
+  unsigned int col = 0;
+
+  ret = json_parser_string (&this->_parser, s, size, &col);
+
+  switch (ret)
+  {
+  case 0:
+  case 3:
+    break;
+  case 7:
+    THROW_ERROR (EINVAL, "yaml-style comment in json not allowed");
+    break;
+  default:
+    char msg[256];
+    memset (msg, 0, sizeof (msg));
+    snprintf (msg, sizeof (msg),
+              "Error line (%u) caracter (%u) line (%s)", line, col, s);
+    THROW_ERROR (EINVAL, msg);
+    break;
+  }
+}
@@ -49,6 +49,39 @@ namespace falcon
       json_parser _parser;
       json_parser_dom _dom;
   };
+
+  /* Receiver for the streaming (SAX) parse mode: consume is called once per
+   * json event (JSON_OBJECT_BEGIN, JSON_KEY, JSON_STRING, ...) in document
+   * order, with data/length set for the data-carrying events.
+   * Return 0 to keep parsing, non zero to abort the parse. */
+  class JsonStreamConsumer
+  {
+    public:
+      virtual ~JsonStreamConsumer ();
+      virtual int consume (int type,
+                           char const* data, unsigned int const length) = 0;
+  };
+
+  /* Event-driven counterpart of JsonParser: instead of materializing a
+   * JsonVal dom, every event is forwarded to the given consumer while the
+   * input is being scanned. Memory usage is bounded by the parser's internal
+   * buffer regardless of the document size. */
+  class JsonStreamParser
+  {
+    public:
+      JsonStreamParser (JsonStreamConsumer& consumer);
+      ~JsonStreamParser ();
+
+      void parse (unsigned int const line,
+                  char const* s, unsigned int const size);
+
+    private:
+      static int callback (void* userdata, int type,
+                           const char* data, uint32_t length);
+
+      json_parser _parser;
+      JsonStreamConsumer& _consumer;
+  };
 }
 
 std::ostream& operator<< (std::ostream& os, falcon::JsonVal const& obj);
@@ -3,6 +3,10 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 #include "lazy_cache.h"
 
 #include "logging.h"
@@ -10,6 +14,8 @@
 
 namespace falcon {
 
+const std::size_t LazyCache::kNumFetchThreads;
+
 LazyCache::LazyCache(NodeSet& targets, CacheManager& cache,
                      IBuildOutputConsumer* consumer)
     : targets_(targets)
@@ -17,12 +23,77 @@ LazyCache::LazyCache(NodeSet& targets, CacheManager& cache,
     , consumer_(consumer) { }
 
 void LazyCache::fetch() {
+  std::vector<Node*> frontier;
   for (auto it = targets_.begin(); it != targets_.end(); ++it) {
-    traverseNode(*it);
+    collectNode(*it, &frontier);
+  }
+
+  while (!frontier.empty()) {
+    /* Probe the whole frontier in one batched query. */
+    std::vector<std::string> hashes;
+    hashes.reserve(frontier.size());
+    for (auto it = frontier.begin(); it != frontier.end(); ++it) {
+      hashes.push_back((*it)->getHash().toHex());
+    }
+    std::vector<bool> hits;
+    cache_.hasEntries(hashes, &hits);
+
+    std::vector<Node*> toRestore;
+    std::vector<Node*> misses;
+    for (std::size_t i = 0; i < frontier.size(); ++i) {
+      if (hits[i]) {
+        toRestore.push_back(frontier[i]);
+      } else {
+        misses.push_back(frontier[i]);
+      }
+    }
+
+    /* Restore the hits with a small worker pool: each restore is an
+     * independent copy out of the store. Not vector<bool>, whose packed
+     * elements cannot be written concurrently. */
+    std::vector<char> restored(toRestore.size(), 0);
+    if (!toRestore.empty()) {
+      std::atomic<std::size_t> next(0);
+      std::size_t numWorkers = std::min(kNumFetchThreads, toRestore.size());
+      std::vector<std::thread> workers;
+      for (std::size_t i = 0; i < numWorkers; ++i) {
+        workers.push_back(std::thread([this, &next, &toRestore, &restored]() {
+          for (;;) {
+            std::size_t i = next.fetch_add(1, std::memory_order_relaxed);
+            if (i >= toRestore.size()) {
+              return;
+            }
+            restored[i] = cache_.restoreNode(toRestore[i]) ? 1 : 0;
+          }
+        }));
+      }
+      for (auto it = workers.begin(); it != workers.end(); ++it) {
+        it->join();
+      }
+    }
+
+    /* Graph updates and frontier expansion happen back on this thread. An
+     * entry that vanished between the probe and the restore is treated as a
+     * miss. */
+    std::vector<Node*> nextFrontier;
+    for (std::size_t i = 0; i < toRestore.size(); ++i) {
+      if (restored[i]) {
+        onNodeRestored(toRestore[i]);
+      } else {
+        collectRule(toRestore[i]->getChild(), &nextFrontier);
+      }
+    }
+    for (auto it = misses.begin(); it != misses.end(); ++it) {
+      collectRule((*it)->getChild(), &nextFrontier);
+    }
+
+    frontier.swap(nextFrontier);
   }
+
+  visited_.clear();
 }
 
-void LazyCache::traverseNode(Node* node) {
+void LazyCache::collectNode(Node* node, std::vector<Node*>* frontier) {
   if (!node->isDirty()) {
     /* This node is up-to-date. */
     return;
@@ -34,35 +105,40 @@ void LazyCache::traverseNode(Node* node) {
     return;
   }
 
-  if (rule->isPhony()) {
-    /* This is the output of a phony rule. */
-    traverseRule(rule);
+  if (!visited_.insert(node).second) {
+    /* Already part of a frontier. */
     return;
   }
 
-  if (cache_.restoreNode(node)) {
-    consumer_->cacheRetrieveAction(node->getPath());
-    node->setState(State::UP_TO_DATE);
-    node->setLazyFetched(true);
-    /* Update the timestamp of the node. This will make sure that we don't mark
-     * it dirty when watchman notifies us it changed. */
-    node->setTimestamp(time(NULL));
-    /* Notify the parents of this output that one of their inputs is ready. */
-    auto parentRules = node->getParents();
-    for (auto it = parentRules.begin(); it != parentRules.end(); ++it) {
-      (*it)->markInputReady();
-    }
-  } else {
-    /* We could not restore the node, go deeper. */
-    traverseRule(rule);
+  if (rule->isPhony()) {
+    /* This is the output of a phony rule. */
+    collectRule(rule, frontier);
+    return;
   }
 
+  frontier->push_back(node);
 }
 
-void LazyCache::traverseRule(Rule* rule) {
+void LazyCache::collectRule(Rule* rule, std::vector<Node*>* frontier) {
   auto& inputs = rule->getInputs();
   for (auto it = inputs.begin(); it != inputs.end(); ++it) {
-    traverseNode(*it);
+    collectNode(*it, frontier);
+  }
+}
+
+void LazyCache::onNodeRestored(Node* node) {
+  if (consumer_) {
+    consumer_->cacheRetrieveAction(node->getPath());
+  }
+  node->setState(State::UP_TO_DATE);
+  node->setLazyFetched(true);
+  /* Update the timestamp of the node. This will make sure that we don't mark
+   * it dirty when watchman notifies us it changed. */
+  node->setTimestamp(timestampNow());
+  /* Notify the parents of this output that one of their inputs is ready. */
+  auto parentRules = node->getParents();
+  for (auto it = parentRules.begin(); it != parentRules.end(); ++it) {
+    (*it)->markInputReady();
   }
 }
 
@@ -6,6 +6,9 @@
 #ifndef FALCON_LAZY_CACHE_H_
 # define FALCON_LAZY_CACHE_H_
 
+#include <unordered_set>
+#include <vector>
+
 #include "cache_manager.h"
 #include "graph.h"
 
@@ -19,22 +22,36 @@ class IBuildOutputConsumer;
  * don't need to fetch any sub-target as well, they will be fetched only when
  * needed.
  *
- * TODO: when distributed caching is implemented, we can think of ways to
- * improve efficiency by retrieving multiple targets in one single query.
+ * The traversal works level by level: the dirty candidates of one level form
+ * a frontier that is probed against the cache in a single batched query, the
+ * hits are restored by a small worker pool, and only the misses are expanded
+ * into the next frontier. This keeps the number of cache round trips
+ * proportional to the depth of the graph instead of its size.
  */
 class LazyCache {
  public:
+  /** consumer may be null when the fetch runs outside of a build, eg for
+   * the background warm-up after a git ref switch. */
   LazyCache(NodeSet& targets, CacheManager& cache,
             IBuildOutputConsumer* consumer);
 
-  /** Start a DFS on each node in "targets". When a node is found in cache,
-   * retrieve it, mark it up-to-date and stop the DFS. */
+  /** Walk down from each node in "targets". When a node is found in cache,
+   * retrieve it, mark it up-to-date and stop going deeper. */
   void fetch();
 
  private:
 
-  void traverseNode(Node* node);
-  void traverseRule(Rule* rule);
+  /** Append node to the frontier if it is a dirty, cacheable candidate.
+   * Phony rules have no cache entry: their inputs are collected instead. */
+  void collectNode(Node* node, std::vector<Node*>* frontier);
+  void collectRule(Rule* rule, std::vector<Node*>* frontier);
+
+  /** Mark a restored node up-to-date and notify its parents. Runs on the
+   * calling thread: the restore workers never mutate the graph. */
+  void onNodeRestored(Node* node);
+
+  /** Number of threads restoring the hits of one frontier. */
+  static const std::size_t kNumFetchThreads = 4;
 
   /** List of targets we are building. */
   NodeSet& targets_;
@@ -42,6 +59,10 @@ class LazyCache {
   CacheManager& cache_;
 
   IBuildOutputConsumer* consumer_;
+
+  /** Nodes already collected in a frontier; a diamond dependency would
+   * otherwise be probed once per parent. */
+  std::unordered_set<Node*> visited_;
 };
 
 } // namespace falcon
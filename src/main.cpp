@@ -4,7 +4,10 @@
  */
 
 #include <iostream>
+#include <cstdio>
 #include <cstdlib>
+#include <set>
+#include <thread>
 
 #include "cache_manager.h"
 #include "build_plan.h"
@@ -15,9 +18,19 @@
 #include "graph_consistency_checker.h"
 #include "graph_dependency_scan.h"
 #include "graph_parallel_builder.h"
+#include "graph_hash.h"
+#include "graph_partition.h"
+#include "graph_snapshot.h"
+#include "state_journal.h"
+#include "duration_cache.h"
+#include "hash_cache.h"
+#include "lazy_cache.h"
 #include "logging.h"
 #include "options.h"
+#include "remote_cache.h"
+#include "file_watcher.h"
 #include "stream_consumer.h"
+#include "util/async_log.h"
 
 static void setOptions(falcon::Options& opt) {
   /* get the default working directory path from then environment variable */
@@ -38,6 +51,18 @@ static void setOptions(falcon::Options& opt) {
   opt.addCLIOption("config,f", /* TODO */
                    po::value<std::string>(),
                    "falcon configuration file");
+  opt.addCLIOption("once",
+                   "build once in the foreground, without the daemon (no "
+                   "file watcher, no servers), and exit with the build "
+                   "result. For ephemeral environments that build exactly "
+                   "once, eg CI containers");
+  opt.addCLIOption("targets,t",
+                   po::value<std::vector<std::string>>()->multitoken(),
+                   "targets to build in --once mode (default: everything)");
+  opt.addCLIOption("jobs,j",
+                   po::value<int>()->default_value(0),
+                   "number of parallel jobs in --once mode; 0 means the "
+                   "number of cpus");
 
   /* *********************************************************************** */
   /* add command line option and configuration file option (this options can be
@@ -57,6 +82,46 @@ static void setOptions(falcon::Options& opt) {
   opt.addCFileOption("log-level",
                      po::value<google::LogSeverity>()->default_value(google::GLOG_WARNING),
                      "define the log level");
+  opt.addCFileOption("remote-cache",
+                     po::value<std::string>(),
+                     "host:port of a peer daemon used as a remote cache "
+                     "tier; local cache misses are pulled from it");
+  opt.addCFileOption("cache-size-mb",
+                     po::value<int>()->default_value(0),
+                     "size budget of the local cache in MiB; least recently "
+                     "used entries are evicted when the daemon is idle. "
+                     "0 disables eviction");
+  opt.addCFileOption("scratch-dir",
+                     po::value<std::string>()->default_value(""),
+                     "directory (ideally on tmpfs, eg /dev/shm/falcon) "
+                     "where compilers are redirected to write their "
+                     "depfiles; depfile I/O then never touches the project "
+                     "disk. Empty disables the redirection");
+  opt.addCFileOption("watcher",
+                     po::value<std::string>()->default_value("watchman"),
+                     "file watching backend: 'watchman' (external process, "
+                     "supports incremental startup rescan) or 'inotify' "
+                     "(in-process, no extra daemon)");
+  opt.addCFileOption("remote-peers",
+                     po::value<std::string>(),
+                     "comma-separated host:port list of peer daemons "
+                     "that can execute rules remotely");
+  opt.addCFileOption("shard-peers",
+                     po::value<std::string>(),
+                     "comma-separated host:port list of the daemons owning "
+                     "the other shards of a partitioned graph; they are "
+                     "notified of the nodes each build produces");
+  opt.addCFileOption("trace",
+                     po::value<bool>()->default_value(false),
+                     "write a Chrome trace-event JSON file per build into "
+                     "the .falcon directory (open it in chrome://tracing "
+                     "to see where the build time went)");
+  opt.addCFileOption("async-logging",
+                     po::value<bool>()->default_value(false),
+                     "log from the build threads through lock-free "
+                     "per-thread ring buffers flushed by a background "
+                     "thread; full rings drop records instead of blocking "
+                     "the build");
   opt.addCFileOption("log-dir",
                      po::value<std::string>(),
                      "write log files in the given directory");
@@ -70,10 +135,30 @@ static int loadModule(falcon::Graph& g, std::string const& s) {
     printGraphGraphviz(g, std::cout);
   } else if (0 == s.compare("make")) {
     printGraphMakefile(g, std::cout);
+  } else if (0 == s.compare(0, 9, "partition")) {
+    /* "partition" or "partition:<N>". */
+    std::size_t numShards = 2;
+    if (s.size() > 10 && s[9] == ':') {
+      numShards = strtoul(s.c_str() + 10, nullptr, 10);
+    }
+    if (numShards < 2) {
+      LOG(ERROR) << "invalid shard count in module '" << s << "'";
+      return 1;
+    }
+    falcon::GraphPartitioner partitioner(g, numShards);
+    partitioner.partition();
+    if (!partitioner.writeShardFiles("falcon-shard-")) {
+      return 1;
+    }
+    std::cout << "wrote " << numShards
+      << " shard graph files (falcon-shard-<n>.json), "
+      << partitioner.numCutEdges() << " cross-shard edges" << std::endl;
   } else if (0 == s.compare("help")) {
     std::cout << "list of available modules: " << std::endl
-      << "  dot    show the graph in DOT format" << std::endl
-      << "  make   show the graph in Makefile format" << std::endl;
+      << "  dot            show the graph in DOT format" << std::endl
+      << "  make           show the graph in Makefile format" << std::endl
+      << "  partition[:N]  split the graph into N (default 2) shard graph"
+      << " files, one per daemon" << std::endl;
   } else {
     LOG(ERROR) << "module '" << s << "' not supported";
     return 1;
@@ -82,6 +167,99 @@ static int loadModule(falcon::Graph& g, std::string const& s) {
   return 0;
 }
 
+/* The one-shot mode has no stream server: the build output goes straight to
+ * the console. */
+class ConsoleBuildOutput : public falcon::IBuildOutputConsumer {
+ public:
+  void newCommand(unsigned int cmdId, const std::string& cmd) {
+    std::cout << cmd << std::endl;
+  }
+  void endCommand(unsigned int cmdId, falcon::SubProcessExitStatus status) {}
+  void cacheRetrieveAction(const std::string& path) {
+    std::cout << "[cached] " << path << std::endl;
+  }
+  void writeStdout(unsigned int cmdId, char* buf, std::size_t len) {
+    fwrite(buf, 1, len, stdout);
+  }
+  void writeStderr(unsigned int cmdId, char* buf, std::size_t len) {
+    fwrite(buf, 1, len, stderr);
+  }
+};
+
+/**
+ * Run one build in the foreground and return a process exit code. The
+ * daemon machinery is skipped entirely; the caches (hashes, artifacts, rule
+ * durations, snapshot) are shared with the daemon mode, so one-shot and
+ * daemon builds warm each other up. See the --once option.
+ */
+static int buildOnce(falcon::GlobalConfig const& config,
+                     falcon::Graph& graph,
+                     falcon::CacheManager* cache,
+                     std::set<std::string> const& targets,
+                     std::size_t numThreads) {
+  falcon::NodeSet targetsToBuild;
+  if (targets.empty()) {
+    auto const& roots = graph.getRoots();
+    targetsToBuild.insert(roots.begin(), roots.end());
+  } else {
+    for (auto it = targets.begin(); it != targets.end(); ++it) {
+      auto itFind = graph.getNodes().find(falcon::getPathTable().find(*it));
+      if (itFind == graph.getNodes().end()) {
+        std::cerr << "unknown target " << *it << std::endl;
+        return 1;
+      }
+      targetsToBuild.insert(itFind->second);
+    }
+  }
+
+  if (graph.getDirtyRules().empty()) {
+    std::cout << "falcon: nothing to do." << std::endl;
+    return 0;
+  }
+
+  ConsoleBuildOutput consumer;
+
+  /* Pull whatever is already in the cache before running anything, like the
+   * lazy fetch of a daemon build. */
+  falcon::LazyCache lazyCache(targetsToBuild, *cache, &consumer);
+  lazyCache.fetch();
+
+  std::unique_ptr<falcon::BuildPlan> plan;
+  if (targets.empty()) {
+    plan.reset(new falcon::BuildPlan(graph.getDirtyRules()));
+  } else {
+    plan.reset(new falcon::BuildPlan(targetsToBuild));
+  }
+
+  falcon::BuildProfiler profiler;
+  falcon::BuildTracer tracer;
+  if (config.isTraceEnabled()) {
+    tracer.setOutputDirectory(config.getFalconDir());
+  }
+  profiler.startBuild(0);
+  tracer.startBuild(0);
+  plan->setProfiler(&profiler);
+  plan->setTracer(&tracer);
+
+  falcon::SharedMutex mutex;
+  falcon::GraphParallelBuilder builder(graph, *plan, cache, &consumer,
+                                       nullptr /* no file watcher */,
+                                       config.getWorkingDirectoryPath(),
+                                       config.getScratchDir(),
+                                       numThreads, mutex,
+                                       nullptr /* no remote executor */,
+                                       &profiler, &tracer,
+                                       [](falcon::BuildResult) {});
+  builder.startBuild();
+  builder.wait();
+  profiler.endBuild();
+  tracer.endBuild();
+
+  falcon::BuildResult res = builder.getResult();
+  std::cout << "falcon: build " << falcon::toString(res) << std::endl;
+  return res == falcon::BuildResult::SUCCEEDED ? 0 : 1;
+}
+
 /**
  * Daemonize the current process.
  */
@@ -96,9 +274,30 @@ static void daemonize(std::unique_ptr<falcon::GlobalConfig> config,
   setsid();
   if (fork()) { return; }
 
+  /* Started only after the forks: the flusher thread would not survive
+   * them. With a log directory the async records go to their own file,
+   * otherwise they share stderr with glog. */
+  if (config->isAsyncLoggingEnabled()) {
+    std::string logFile;
+    if (!config->getLogDirectory().empty()) {
+      logFile = config->getLogDirectory() + "/falcond.async.log";
+    }
+    /* Let everything through at log-level INFO (DLOG records log at INFO
+     * with glog, ADLOG records at DEBUG with the async sink). */
+    falcon::AsyncLogger::Level lvl =
+        config->getLogLevel() <= google::GLOG_INFO
+            ? falcon::AsyncLogger::kALogDEBUG
+            : config->getLogLevel() == google::GLOG_WARNING
+                  ? falcon::AsyncLogger::kALogWARNING
+                  : falcon::AsyncLogger::kALogERROR;
+    falcon::AsyncLogger::start(logFile, lvl);
+  }
+
   falcon::DaemonInstance daemon(std::move(config), std::move(cache));
   daemon.loadConf(std::move(graph));
   daemon.start();
+
+  falcon::AsyncLogger::stop();
 }
 
 int main (int const argc, char const* const* argv) {
@@ -120,40 +319,157 @@ int main (int const argc, char const* const* argv) {
 
   falcon::fs::mkdir(config->getFalconDir());
 
-  /* Analyze the graph given in the configuration file */
-  falcon::GraphParser graphParser(config->getJsonGraphFile());
-  try {
-    graphParser.processFile();
-  } catch (falcon::Exception& e) {
-    LOG(ERROR) << e.getErrorMessage ();
-    return e.getCode();
+  bool once = opt.isOptionSetted("once");
+
+  /* Load the persistent hash cache so that the scan does not rehash files
+   * that did not change since the last run. Loaded before anything hashes:
+   * the graph file hash below already goes through it. */
+  falcon::getHashCache().load(config->getHashCacheFile());
+
+  /* The remaining startup phases use disjoint resources: run the ones that
+   * do not need the graph while it loads. The duration cache (used by
+   * BuildPlan to schedule the longest critical path first) is independent
+   * disk I/O, and the watchman since-query is socket I/O against an
+   * external process. Joined before the scan, which consumes both. */
+  std::set<std::string> changed;
+  bool sinceValid = false;
+  std::thread startupThread([&config, &changed, &sinceValid, once]() {
+    falcon::getDurationCache().load(config->getDurationCacheFile());
+    if (!once) {
+      std::unique_ptr<falcon::FileWatcher> watcher =
+          falcon::FileWatcher::create(config->getWatcherBackend(),
+                                      config->getWorkingDirectoryPath());
+      sinceValid = watcher->queryChangedSince(&changed);
+    }
+  });
+
+  /* Try to restore the graph from the binary snapshot. Only usable if the
+   * graph file itself did not change since the snapshot was taken. */
+  falcon::HashDigest graphFileHash =
+      falcon::hash::hashFile(config->getJsonGraphFile());
+  std::unique_ptr<falcon::Graph> graphPtr =
+      falcon::GraphSnapshot::load(config->getGraphSnapshotFile(),
+                                  graphFileHash);
+  bool fromSnapshot = graphPtr != nullptr;
+
+  if (fromSnapshot) {
+    /* Bring the snapshot up to the states the previous daemon died with:
+     * the snapshot is only rewritten at startup and on a clean shutdown,
+     * the journal holds every transition since. */
+    falcon::StateJournal::replay(config->getStateJournalFile(), *graphPtr);
   }
 
-  std::unique_ptr<falcon::Graph> graphPtr = std::move(graphParser.getGraph());
+  if (!graphPtr) {
+    /* Analyze the graph given in the configuration file */
+    falcon::GraphParser graphParser(config->getJsonGraphFile());
 
-  /* Check the graph for cycles. */
-  try {
-    checkGraphLoop(*graphPtr);
-  } catch (falcon::Exception& e) {
-    LOG(ERROR) << e.getErrorMessage();
-    return e.getCode();
+    /* Hash the sources of the rules parsed so far while the parser streams
+     * the rest of the file: the reads overlap the parse, and the scan below
+     * then finds a warm hash cache. */
+    falcon::hash::SourceHashPrefetcher prefetcher(2);
+    graphParser.setOnRuleParsed([&prefetcher](falcon::Rule* rule) {
+      prefetcher.enqueue(rule);
+    });
+
+    try {
+      graphParser.processFile();
+    } catch (falcon::Exception& e) {
+      prefetcher.finish();
+      startupThread.join();
+      LOG(ERROR) << e.getErrorMessage ();
+      return e.getCode();
+    }
+    prefetcher.finish();
+
+    graphPtr = std::move(graphParser.getGraph());
+
+    /* Check the graph for cycles. The snapshot path skips this: a snapshot
+     * is only ever taken of a graph that passed the check. */
+    try {
+      checkGraphLoop(*graphPtr);
+    } catch (falcon::Exception& e) {
+      startupThread.join();
+      LOG(ERROR) << e.getErrorMessage();
+      return e.getCode();
+    }
   }
 
   std::unique_ptr<falcon::CacheManager> cache(
       new falcon::CacheManager(config->getWorkingDirectoryPath(),
                                config->getFalconDir()));
 
+  if (!config->getRemoteCache().empty()) {
+    std::string const& remoteCache = config->getRemoteCache();
+    auto pos = remoteCache.rfind(':');
+    if (pos == std::string::npos) {
+      LOG(ERROR) << "invalid remote-cache '" << remoteCache
+                 << "', expected host:port";
+    } else {
+      cache->setRemoteCache(std::unique_ptr<falcon::RemoteCache>(
+          new falcon::RemoteCache(remoteCache.substr(0, pos),
+                                  atoi(remoteCache.substr(pos + 1).c_str()))));
+    }
+  }
+
   /* Scan the graph to discover what needs to be rebuilt, and compute the
-   * hashes of all nodes. */
+   * hashes of all nodes. When the graph comes from a snapshot and watchman
+   * kept running while the daemon was down, a "since" query with the
+   * persisted clock tells us exactly which files moved: the scan is then
+   * limited to those instead of stat'ing and rehashing the world. The
+   * one-shot mode never touches a watcher and always scans in full. */
   falcon::GraphDependencyScan scanner(*graphPtr, cache.get());
+  startupThread.join();
+  if (sinceValid && fromSnapshot) {
+    LOG(INFO) << "incremental rescan: " << changed.size()
+              << " files changed since last run";
+    scanner.restrictTo(changed);
+  }
   scanner.scan();
 
+  /* Persist the hashes computed by the scan right away: they stay valid even
+   * if the daemon dies without a clean shutdown. */
+  falcon::getHashCache().save(config->getHashCacheFile());
+  falcon::GraphSnapshot::save(config->getGraphSnapshotFile(), *graphPtr,
+                              graphFileHash);
+
   /* if a module has been requested to execute then load it and return */
   if (opt.isOptionSetted("module")) {
     return loadModule(*graphPtr,
                       opt.vm_["module"].as<std::string>());
   }
 
+  /* The fresh snapshot subsumes any previous journal: start an empty one
+   * and record every transition from here on. The descriptor survives the
+   * daemonization forks. */
+  falcon::getStateJournal().open(config->getStateJournalFile());
+
+  if (once) {
+    std::set<std::string> targets;
+    if (opt.isOptionSetted("targets")) {
+      auto v = opt.vm_["targets"].as<std::vector<std::string>>();
+      targets.insert(v.begin(), v.end());
+    }
+    int jobs = opt.vm_["jobs"].as<int>();
+    if (jobs <= 0) {
+      jobs = std::thread::hardware_concurrency();
+    }
+
+    int ret = buildOnce(*config, *graphPtr, cache.get(), targets, jobs);
+
+    /* Persist what the build learned, exactly like a daemon shutdown: the
+     * next run, one-shot or daemon, starts warm. */
+    falcon::getHashCache().save(config->getHashCacheFile());
+    falcon::getDurationCache().save(config->getDurationCacheFile());
+    cache->waitForPendingSaves();
+    cache->trimToBudget(config->getCacheSizeMb());
+    cache->saveIndex();
+    falcon::GraphSnapshot::save(config->getGraphSnapshotFile(), *graphPtr,
+                                graphFileHash);
+    falcon::getStateJournal().reset();
+    falcon::getStateJournal().close();
+    return ret;
+  }
+
   /* Start the daemon. */
   daemonize(std::move(config), std::move(graphPtr), std::move(cache));
   return 0;
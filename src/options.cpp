@@ -3,6 +3,7 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
+#include "hash_engine.h"
 #include "options.h"
 #include "exceptions.h"
 #include <iostream>
@@ -98,12 +99,52 @@ bool Options::isOptionSetted(std::string const& opt) const {
   return vm_.count(opt);
 }
 
+/* Split a comma-separated host:port list. */
+static void parsePeerList(std::string const& peers,
+                          std::vector<std::string>& out) {
+  std::size_t start = 0;
+  while (start < peers.size()) {
+    std::size_t end = peers.find(',', start);
+    if (end == std::string::npos) {
+      end = peers.size();
+    }
+    if (end > start) {
+      out.push_back(peers.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+}
+
 GlobalConfig::GlobalConfig(Options const& opt) {
   setJsonGraphFile(opt.vm_["graph"].as<std::string>());
   setNetworkAPIPort(opt.vm_["api-port"].as<int>());
   setNetworkStreamPort(opt.vm_["stream-port"].as<int>());
   setWorkingDirectoryPath(opt.vm_["working-directory"].as<std::string>());
 
+  if (opt.isOptionSetted("remote-peers")) {
+    parsePeerList(opt.vm_["remote-peers"].as<std::string>(), remotePeers_);
+  }
+
+  if (opt.isOptionSetted("shard-peers")) {
+    parsePeerList(opt.vm_["shard-peers"].as<std::string>(), shardPeers_);
+  }
+
+  if (opt.isOptionSetted("remote-cache")) {
+    remoteCache_ = opt.vm_["remote-cache"].as<std::string>();
+  }
+
+  cacheSizeMb_ = static_cast<std::size_t>(opt.vm_["cache-size-mb"].as<int>());
+
+  scratchDir_ = opt.vm_["scratch-dir"].as<std::string>();
+
+  watcherBackend_ = opt.vm_["watcher"].as<std::string>();
+
+  traceEnabled_ = opt.vm_["trace"].as<bool>();
+
+  asyncLoggingEnabled_ = opt.vm_["async-logging"].as<bool>();
+
+  logLevel_ = opt.vm_["log-level"].as<google::LogSeverity>();
+
   runDaemonBuilder_ = opt.isOptionSetted("daemon");
   programName_ = opt.getProgramName();
   logDirectory_ = opt.getLogDirectory();
@@ -139,10 +180,61 @@ std::string const& GlobalConfig::getWorkingDirectoryPath() const {
   return workingDirectoryPath_;
 }
 
+std::vector<std::string> const& GlobalConfig::getRemotePeers() const {
+  return remotePeers_;
+}
+
+std::vector<std::string> const& GlobalConfig::getShardPeers() const {
+  return shardPeers_;
+}
+
+std::string const& GlobalConfig::getRemoteCache() const {
+  return remoteCache_;
+}
+
+std::size_t GlobalConfig::getCacheSizeMb() const { return cacheSizeMb_; }
+
+std::string const& GlobalConfig::getScratchDir() const {
+  return scratchDir_;
+}
+
+std::string const& GlobalConfig::getWatcherBackend() const {
+  return watcherBackend_;
+}
+
+bool GlobalConfig::isTraceEnabled() const { return traceEnabled_; }
+
+bool GlobalConfig::isAsyncLoggingEnabled() const {
+  return asyncLoggingEnabled_;
+}
+
+google::LogSeverity GlobalConfig::getLogLevel() const { return logLevel_; }
+
 std::string const& GlobalConfig::getProgramName() const { return programName_; }
 bool GlobalConfig::runDaemonBuilder() const { return runDaemonBuilder_; }
 std::string const& GlobalConfig::getLogDirectory() const {
   return logDirectory_;
 }
 std::string const& GlobalConfig::getFalconDir() const { return falconDir_; }
+std::string GlobalConfig::getGraphSnapshotFile() const {
+  /* Namespaced by engine, like the hash cache: the snapshot embeds digests. */
+  return falconDir_ + "/graph-snapshot-" + HashEngine::name();
+}
+std::string GlobalConfig::getStateJournalFile() const {
+  /* Only replayed on top of a snapshot, so it shares its namespacing. */
+  return falconDir_ + "/state-journal-" + HashEngine::name();
+}
+std::string GlobalConfig::getCommandSocketPath() const {
+  /* In the falcon directory, so a client only reaches the daemon of its own
+   * working directory. */
+  return falconDir_ + "/command.sock";
+}
+std::string GlobalConfig::getHashCacheFile() const {
+  /* Namespaced by engine: a hash cache written with one engine is garbage
+   * for a binary built with another. */
+  return falconDir_ + "/hashcache-" + HashEngine::name();
+}
+std::string GlobalConfig::getDurationCacheFile() const {
+  return falconDir_ + "/durations";
+}
 }
@@ -6,6 +6,8 @@
 #ifndef FALCON_OPTIONS_H_
 # define FALCON_OPTIONS_H_
 
+# include <vector>
+
 # include <boost/program_options.hpp>
 # include "logging.h"
 
@@ -131,6 +133,79 @@ private:
   std::string falconDir_;
 public:
   std::string const& getFalconDir() const;
+  /** Path of the persistent hash cache file (see hash_cache.h). */
+  std::string getHashCacheFile() const;
+
+  std::string getDurationCacheFile() const;
+  /** Path of the binary graph snapshot file (see graph_snapshot.h). */
+  std::string getGraphSnapshotFile() const;
+  /** Path of the state journal file (see state_journal.h). */
+  std::string getStateJournalFile() const;
+  /** Path of the local unix-domain command socket (see command_server.h). */
+  std::string getCommandSocketPath() const;
+
+private:
+  std::vector<std::string> remotePeers_;
+public:
+  /** host:port of the peer daemons rules can be shipped to, possibly empty.
+   * See remote_executor.h. */
+  std::vector<std::string> const& getRemotePeers() const;
+
+private:
+  std::vector<std::string> shardPeers_;
+public:
+  /** host:port of the daemons owning the other shards of a partitioned
+   * graph, possibly empty. See graph_partition.h. */
+  std::vector<std::string> const& getShardPeers() const;
+
+private:
+  std::string remoteCache_;
+public:
+  /** host:port of the daemon used as a remote cache tier, empty when not
+   * configured. See remote_cache.h. */
+  std::string const& getRemoteCache() const;
+
+private:
+  std::size_t cacheSizeMb_;
+public:
+  /** Size budget of the local cache in MiB, 0 meaning unlimited. The cache
+   * is trimmed to this budget when the daemon goes idle, see
+   * CacheManager::trimToBudget. */
+  std::size_t getCacheSizeMb() const;
+
+private:
+  std::string scratchDir_;
+public:
+  /** Directory where depfiles are redirected (ideally a tmpfs), empty when
+   * the redirection is disabled. See GraphParallelBuilder. */
+  std::string const& getScratchDir() const;
+
+private:
+  std::string watcherBackend_;
+public:
+  /** File watching backend: "watchman" (default) or "inotify". See
+   * file_watcher.h. */
+  std::string const& getWatcherBackend() const;
+
+private:
+  bool traceEnabled_;
+public:
+  /** Whether a Chrome trace-event file is written per build into the falcon
+   * directory. See build_tracer.h. */
+  bool isTraceEnabled() const;
+
+private:
+  bool asyncLoggingEnabled_;
+public:
+  /** Whether the hot threads log through the asynchronous ring-buffer sink
+   * instead of glog. See util/async_log.h. */
+  bool isAsyncLoggingEnabled() const;
+
+private:
+  google::LogSeverity logLevel_;
+public:
+  /** The configured minimum log level. */
+  google::LogSeverity getLogLevel() const;
 
 private:
   bool runDaemonBuilder_;
@@ -0,0 +1,15 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include "path_table.h"
+
+namespace falcon {
+
+PathTable& getPathTable() {
+  static PathTable table;
+  return table;
+}
+
+} // namespace falcon
@@ -0,0 +1,107 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_PATH_TABLE_H_
+# define FALCON_PATH_TABLE_H_
+
+# include <cstdint>
+# include <deque>
+# include <limits>
+# include <string>
+# include <unordered_map>
+
+# include "string_piece.h"
+
+namespace falcon {
+
+/** Dense integer id of an interned path. See PathTable. */
+typedef std::uint32_t PathId;
+
+const PathId kInvalidPathId = std::numeric_limits<PathId>::max();
+
+/** Hasher for StringPiece keys. FNV-1a over the bytes: hashing a lookup key
+ * must not copy it into a std::string first. */
+struct StringPieceHash {
+  std::size_t operator()(StringPiece p) const {
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < p.len_; ++i) {
+      h = (h ^ static_cast<unsigned char>(p.str_[i])) * 1099511628211ull;
+    }
+    return static_cast<std::size_t>(h);
+  }
+};
+
+/**
+ * @class PathTable
+ * @brief String-interning table for file paths.
+ *
+ * Every path manipulated by the daemon (node paths, depfile entries, watchman
+ * notifications, thrift queries) is interned once in this table and referred
+ * to by a dense integer id afterwards. This makes path comparison and map
+ * lookups integer operations instead of full string hashes, and stores each
+ * path only once regardless of how many nodes, rules and depfiles mention it.
+ *
+ * There is a single global table, shared by every graph so that ids remain
+ * comparable across a graph reload. Paths are never removed: a stale path
+ * only costs its string storage.
+ */
+class PathTable {
+ public:
+  PathTable() {}
+
+  /** Get the id of a path, interning it if it was never seen before. The
+   * path can be a slice of a parse buffer (StringPiece converts implicitly
+   * from std::string and char*): it is only copied when it was never seen,
+   * into the table's own storage. */
+  PathId intern(StringPiece path) {
+    auto it = ids_.find(path);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    PathId id = static_cast<PathId>(paths_.size());
+    /* The single copy; the map key views the stored string, which a deque
+     * never relocates. */
+    paths_.push_back(path.AsString());
+    ids_[StringPiece(paths_.back())] = id;
+    return id;
+  }
+
+  /** Get the id of a path, or kInvalidPathId if it was never interned.
+   * Unlike intern, this does not grow the table, which makes it suitable for
+   * looking up arbitrary user-provided targets. */
+  PathId find(StringPiece path) const {
+    auto it = ids_.find(path);
+    return it == ids_.end() ? kInvalidPathId : it->second;
+  }
+
+  /** Get the path for an id. References stay valid for the lifetime of the
+   * table. */
+  const std::string& str(PathId id) const { return paths_[id]; }
+
+  std::size_t size() const { return paths_.size(); }
+
+ private:
+  /* Keys are views into paths_, so each path is stored exactly once. */
+  std::unordered_map<StringPiece, PathId, StringPieceHash> ids_;
+
+  /* Path storage, indexed by id. A deque never relocates its elements, so the
+   * references handed out by str() remain stable as the table grows. */
+  std::deque<std::string> paths_;
+
+  PathTable(const PathTable& other) = delete;
+  PathTable& operator=(const PathTable&) = delete;
+};
+
+/** Accessor for the process-wide path table. */
+PathTable& getPathTable();
+
+/** Hasher for PathId keyed maps: the ids are already dense. */
+struct PathIdHash {
+  std::size_t operator()(PathId id) const { return id; }
+};
+
+} // namespace falcon
+
+#endif // FALCON_PATH_TABLE_H_
@@ -6,18 +6,33 @@
 #include <iostream>
 
 #include <cassert>
+#include <chrono>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+/* posix_spawn can only set the working directory of the child with the
+ * glibc 2.29+ addchdir extension. Without it we keep the fork path: the
+ * spawn must not inherit the daemon's own working directory. */
+#if defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+# define FALCON_USE_POSIX_SPAWN 1
+#endif
+
+extern char** environ;
+
 #include "exceptions.h"
 #include "posix_subprocess.h"
 
 #include "logging.h"
+#include "stats.h"
+#include "util/async_log.h"
 
 namespace falcon {
 
@@ -32,17 +47,21 @@ std::string toString(SubProcessExitStatus v) {
 }
 
 PosixSubProcess::PosixSubProcess(const std::string& command,
+                                 const std::vector<std::string>& argv,
                                  const std::string& workingDirectory,
                                  unsigned int id,
                                  IStreamConsumer* consumer)
-  : id_(id), command_(command)
+  : id_(id), command_(command), argv_(argv)
   , workingDirectory_(workingDirectory)
   , stdoutFd_(-1), stderrFd_(-1)
-  , consumer_(consumer), pid_(-1), status_(SubProcessExitStatus::UNKNOWN) { }
+  , consumer_(consumer), pid_(-1), pidFd_(-1), reaped_(false)
+  , status_(SubProcessExitStatus::UNKNOWN) { }
 
 void PosixSubProcess::start() {
 
-  DLOG(INFO) << "New command: ID = " << id_ << ", CMD = " << command_;
+  ADLOG(INFO, "New command: ID = %u, CMD = %s", id_, command_.c_str());
+
+  getStatsRegistry().processesSpawned.fetch_add(1, std::memory_order_relaxed);
 
   /* Create pipe for stdout redirection. */
   int stdout_pipe[2];
@@ -58,6 +77,44 @@ void PosixSubProcess::start() {
   }
   stderrFd_ = stderr_pipe[0];
 
+  /* The read ends are non blocking so that onFdReady can drain everything
+   * available in one wakeup and stop on EAGAIN instead of blocking. */
+  fcntl(stdoutFd_, F_SETFL, fcntl(stdoutFd_, F_GETFL) | O_NONBLOCK);
+  fcntl(stderrFd_, F_SETFL, fcntl(stderrFd_, F_GETFL) | O_NONBLOCK);
+
+#ifdef FALCON_USE_POSIX_SPAWN
+  /* posix_spawn uses vfork semantics: no copy of the daemon's page tables,
+   * so the spawn cost stays flat no matter how large the graph and the
+   * caches have grown. When the command was tokenized at graph load it is
+   * executed directly, skipping the /bin/sh indirection as well. */
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], 1);
+  posix_spawn_file_actions_adddup2(&actions, stderr_pipe[1], 2);
+  posix_spawn_file_actions_addclose(&actions, stdout_pipe[0]);
+  posix_spawn_file_actions_addclose(&actions, stderr_pipe[0]);
+  posix_spawn_file_actions_addchdir_np(&actions, workingDirectory_.c_str());
+
+  std::vector<char*> args;
+  if (!argv_.empty()) {
+    for (auto it = argv_.begin(); it != argv_.end(); ++it) {
+      args.push_back(const_cast<char*>(it->c_str()));
+    }
+  } else {
+    args.push_back(const_cast<char*>("/bin/sh"));
+    args.push_back(const_cast<char*>("-c"));
+    args.push_back(const_cast<char*>(command_.c_str()));
+  }
+  args.push_back(nullptr);
+
+  int err = posix_spawnp(&pid_, args[0], &actions, nullptr, args.data(),
+                         environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    THROW_ERROR(err, "Failed to spawn");
+  }
+#else
   pid_ = fork();
   if (pid_ < 0) {
     THROW_ERROR(errno, "Failed to fork");
@@ -70,10 +127,22 @@ void PosixSubProcess::start() {
     childProcess(stdout_pipe[1], stderr_pipe[1]);
     assert(false);
   }
+#endif
 
   /* Parent process. */
   close(stdout_pipe[1]);
   close(stderr_pipe[1]);
+
+#ifdef SYS_pidfd_open
+  /* Get a pidfd so that the exit of the process can be monitored in the
+   * same epoll loop as its output pipes. On kernels without pidfd_open
+   * (pre 5.3) this fails and waitFinished falls back to a blocking
+   * waitpid once both pipes reached EOF. */
+  pidFd_ = syscall(SYS_pidfd_open, pid_, 0);
+  if (pidFd_ < 0) {
+    pidFd_ = -1;
+  }
+#endif
 }
 
 void PosixSubProcess::interrupt() {
@@ -121,33 +190,86 @@ bool PosixSubProcess::completed() {
   return stdoutFd_ == -1 && stderrFd_ == -1;
 }
 
+void PosixSubProcess::closeStdout() {
+  if (stdoutFd_ != -1) {
+    close(stdoutFd_);
+    stdoutFd_ = -1;
+  }
+}
+
+void PosixSubProcess::closeStderr() {
+  if (stderrFd_ != -1) {
+    close(stderrFd_);
+    stderrFd_ = -1;
+  }
+}
+
 bool PosixSubProcess::onFdReady(int& fd, bool isStdout) {
   assert(fd != -1);
-  char buf[4 << 10];
-  ssize_t len = read(fd, buf, sizeof(buf));
-  if (len > 0) {
-    if (consumer_ != nullptr) {
-      if (isStdout) {
-        consumer_->writeStdout(id_, buf, len);
-      } else {
-        consumer_->writeStderr(id_, buf, len);
+  char buf[64 << 10];
+
+  /* The fd is non blocking: drain everything that is available in this
+   * wakeup rather than reading one chunk per event loop iteration. */
+  while (true) {
+    ssize_t len = read(fd, buf, sizeof(buf));
+    if (len > 0) {
+      if (consumer_ != nullptr) {
+        if (isStdout) {
+          consumer_->writeStdout(id_, buf, len);
+        } else {
+          consumer_->writeStderr(id_, buf, len);
+        }
+      }
+    } else if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* Nothing more to read for now. */
+        return false;
+      } else if (errno == EINTR) {
+        continue;
       }
+      THROW_ERROR(errno, "Read error");
+    } else /* EOF */ {
+      close(fd);
+      fd = -1;
+      return true;
     }
-  } else if (len < 0) {
-    THROW_ERROR(errno, "Read error");
-  } else /* EOF */ {
-    close(fd);
-    fd = -1;
-    return true;
   }
-  return false;
+}
+
+void PosixSubProcess::onExited() {
+  assert(pidFd_ != -1);
+  close(pidFd_);
+  pidFd_ = -1;
+
+  /* The pidfd is readable: the process is a zombie, waitpid cannot
+   * block. */
+  reap(WNOHANG);
 }
 
 void PosixSubProcess::waitFinished() {
+  if (reaped_) {
+    /* The status was already collected when the pidfd fired. */
+    return;
+  }
+  reap(0);
+}
+
+void PosixSubProcess::reap(int options) {
   int status;
-  if (waitpid(pid_, &status, 0) < 0) {
+  auto reapStart = std::chrono::steady_clock::now();
+  pid_t r = waitpid(pid_, &status, options);
+  if (r < 0) {
     THROW_ERROR(errno, "waitpid failed");
   }
+  assert(r == pid_);
+  reaped_ = true;
+
+  StatsRegistry& stats = getStatsRegistry();
+  stats.processesReaped.fetch_add(1, std::memory_order_relaxed);
+  stats.reapTimeUs.fetch_add(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - reapStart).count(),
+      std::memory_order_relaxed);
 
   status_ = SubProcessExitStatus::FAILED;
   if (WIFEXITED(status)) {
@@ -160,8 +282,8 @@ void PosixSubProcess::waitFinished() {
     }
   }
 
-  DLOG(INFO) << "Completed command: ID = " << id_ << ", STATUS = "
-    << toString(status_);
+  ADLOG(INFO, "Completed command: ID = %u, STATUS = %s", id_,
+        toString(status_).c_str());
 }
 
 } // namespace falcon
@@ -28,7 +28,17 @@ std::string toString(SubProcessExitStatus v);
  */
 class PosixSubProcess {
  public:
+  /**
+   * @param command          Command line, run with /bin/sh -c when argv is
+   *                         empty.
+   * @param argv             Pre-tokenized command, empty when the command
+   *                         needs a shell. See Rule::tokenizeCommand.
+   * @param workingDirectory Directory the command runs in.
+   * @param id               Command id, for the output consumer.
+   * @param consumer         Consumer of the output streams. May be null.
+   */
   explicit PosixSubProcess(const std::string& command,
+                           const std::vector<std::string>& argv,
                            const std::string& workingDirectory_,
                            unsigned int id,
                            IStreamConsumer* consumer);
@@ -69,9 +79,16 @@ class PosixSubProcess {
    */
   bool readStderr() { return onFdReady(stderrFd_, false); }
 
+  /**
+   * Called when the pidfd reports that the process exited. Reap the exit
+   * status without blocking and close the pidfd.
+   */
+  void onExited();
+
   /**
    * Wait until a process has finished running.
-   * This will block until the process actually completes.
+   * This will block until the process actually completes. Does nothing if
+   * the exit status was already reaped through the pidfd.
    */
   void waitFinished();
 
@@ -91,11 +108,25 @@ class PosixSubProcess {
 
   pid_t pid() const { return pid_; }
 
+  /** Pidfd of the process, or -1 when the kernel has no pidfd_open. */
+  int pidFd() const { return pidFd_; }
+
+  /** Return true if the exit status was already collected. */
+  bool reaped() const { return reaped_; }
+
+  /** Close the read end of the stdout pipe, if still open. */
+  void closeStdout();
+
+  /** Close the read end of the stderr pipe, if still open. */
+  void closeStderr();
+
   unsigned int id() const { return id_; }
 
   unsigned int id_;
 
   std::string command_;
+  /* Pre-tokenized command, empty when the command needs a shell. */
+  std::vector<std::string> argv_;
   std::string workingDirectory_;
 
   /* File descriptors from which to read the output and error streams.
@@ -107,8 +138,20 @@ class PosixSubProcess {
 
   pid_t pid_;
 
+  /* File descriptor referring to the process (pidfd_open), registered in
+   * the manager's epoll loop so that the exit of the process is an event
+   * like the output. -1 when the kernel does not support it. */
+  int pidFd_;
+
+  /* Set once the exit status was collected with waitpid. */
+  bool reaped_;
+
   /* Exit status of the process. */
   SubProcessExitStatus status_;
+
+ private:
+  /** Collect the exit status with waitpid. @param options waitpid flags. */
+  void reap(int options);
 };
 
 typedef std::unique_ptr<PosixSubProcess> PosixSubProcessPtr;
@@ -3,9 +3,10 @@
  * LICENSE : see accompanying LICENSE file for details.
  */
 
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "posix_subprocess_manager.h"
 
@@ -13,64 +14,101 @@
 
 namespace falcon {
 
+std::atomic<unsigned int> PosixSubProcessManager::nextId_(0);
+
+const int PosixSubProcessManager::kMaxEvents;
+
 PosixSubProcessManager::PosixSubProcessManager(IStreamConsumer *consumer)
-    : id_(0), consumer_(consumer) { }
+    : consumer_(consumer) {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ < 0) {
+    THROW_ERROR(errno, "epoll_create1 failed");
+  }
+}
 
 PosixSubProcessManager::~PosixSubProcessManager() {
   /* The user should wait for all the processes to complete before
    * destroying this object. */
   assert(nbRunning() == 0);
+  close(epollFd_);
 }
 
 unsigned int PosixSubProcessManager::addProcess(Rule *rule,
     const std::string& workingDirectory) {
-  unsigned int id = id_++;
-  const std::string& command = rule->getCommand();
+  return addProcess(rule, rule->getCommand(), workingDirectory);
+}
+
+unsigned int PosixSubProcessManager::addProcess(Rule *rule,
+    const std::string& command, const std::string& workingDirectory) {
+  unsigned int id = nextId_++;
   assert(!command.empty());
-  PosixSubProcessPtr proc(new PosixSubProcess(command, workingDirectory,
+
+  /* Use the argv prepared when the command was set on the rule; a command
+   * rewritten by the builder (scratch depfile) is re-tokenized here. */
+  std::vector<std::string> argv;
+  if (command == rule->getCommand()) {
+    argv = rule->getArgv();
+  } else {
+    Rule::tokenizeCommand(command, &argv);
+  }
+
+  PosixSubProcessPtr proc(new PosixSubProcess(command, argv,
+                                              workingDirectory,
                                               id, consumer_));
   mapToRule_.insert(std::make_pair(proc.get(), rule));
   proc->start();
 
   int stdout = proc->stdoutFd_;
   int stderr = proc->stderrFd_;
+  int pidFd = proc->pidFd();
 
   {
     std::lock_guard<std::mutex> lock(mutex_);
     running_.push_front(std::move(proc));
   }
 
-  short events = POLLIN | POLLPRI;
+  /* Register both pipes with the epoll instance. The kernel maintains the
+   * interest set, so there is nothing to rebuild on each wakeup. */
+  registerFd(stdout, { running_.begin(), FdKind::STDOUT });
+  registerFd(stderr, { running_.begin(), FdKind::STDERR });
 
-  /* Setup the file descriptor for stdout for monitoring. */
-  pollfds_.push_front({ stdout, events, 0 });
-  map_[stdout] = { running_.begin(), pollfds_.begin(), true };
-
-  /* Setup the file descriptor for stderr for monitoring. */
-  pollfds_.push_front({ stderr, events, 0 });
-  map_[stderr] = { running_.begin(), pollfds_.begin(), false };
+  /* The pidfd becomes readable when the process exits, making completion
+   * an event in the same loop as the output. Without pidfd support the
+   * completion is detected by the EOF on the pipes, as before. */
+  if (pidFd != -1) {
+    registerFd(pidFd, { running_.begin(), FdKind::PIDFD });
+  }
 
   return id;
 }
 
+void PosixSubProcessManager::registerFd(int fd, FdInfo info) {
+  map_[fd] = info;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLPRI;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    THROW_ERROR(errno, "epoll_ctl failed");
+  }
+}
+
 void PosixSubProcessManager::run() {
+  struct epoll_event events[kMaxEvents];
   sigset_t set;
-  sigset_t origmask;
   sigemptyset(&set);
 
-  std::vector<pollfd> fds(pollfds_.begin(), pollfds_.end());
-
-  sigprocmask(SIG_SETMASK, &set, &origmask);
-  if (poll(&fds.front(), fds.size(), -1) < 0) {
-    THROW_ERROR(errno, "poll failed");
+  int nfds = epoll_pwait(epollFd_, events, kMaxEvents, -1, &set);
+  if (nfds < 0) {
+    if (errno == EINTR) {
+      return;
+    }
+    THROW_ERROR(errno, "epoll_pwait failed");
   }
-  sigprocmask(SIG_SETMASK, &origmask, NULL);
 
-  /* Try to read data from each fd that is ready. */
-  for (auto it = fds.begin(); it != fds.end(); ++it) {
-    if (it->revents) {
-      readFd(it->fd);
-    }
+  /* Only the fds that are actually ready are reported. */
+  for (int i = 0; i < nfds; ++i) {
+    readFd(events[i].data.fd);
   }
 }
 
@@ -101,30 +139,65 @@ void PosixSubProcessManager::interrupt() {
 
 void PosixSubProcessManager::readFd(int fd) {
   auto itMap = map_.find(fd);
-  assert(itMap != map_.end());
+  if (itMap == map_.end()) {
+    /* Stale event: the fd was torn down earlier in this batch, when the
+     * pidfd of its process fired. */
+    return;
+  }
 
   auto itRunning = itMap->second.itRunning;
   PosixSubProcessPtr& proc = *itRunning;
   assert(proc);
 
-  bool fdDone = itMap->second.isStdout
+  if (itMap->second.kind == FdKind::PIDFD) {
+    /* The process exited. Reap it, collect whatever it wrote before
+     * exiting, then tear the pipes down: a tool that leaks its write ends
+     * to a lingering child must not keep the rule pending forever. */
+    proc->onExited();
+    map_.erase(itMap);
+
+    int stdoutFd = proc->stdoutFd_;
+    if (stdoutFd != -1) {
+      if (!proc->readStdout()) {
+        proc->closeStdout();
+      }
+      map_.erase(stdoutFd);
+    }
+    int stderrFd = proc->stderrFd_;
+    if (stderrFd != -1) {
+      if (!proc->readStderr()) {
+        proc->closeStderr();
+      }
+      map_.erase(stderrFd);
+    }
+
+    moveToFinished(itRunning);
+    return;
+  }
+
+  bool fdDone = itMap->second.kind == FdKind::STDOUT
     ? proc->readStdout() : proc->readStderr();
 
   if (fdDone) {
-    /* This file descriptor is closed, remove the corresponding entries from
-     * map_ and pollfds_. */
-    pollfds_.erase(itMap->second.itFd);
+    /* The subprocess closed the fd on EOF, which removed it from the epoll
+     * interest set as well; only our own bookkeeping is left to drop. */
     map_.erase(itMap);
 
-    if (proc->completed()) {
-      /* Both stdout and stderr fds were closed. The process is complete so we
-       * move it from running_ to finished_. */
-      finished_.push(std::move(proc));
-
-      std::lock_guard<std::mutex> lock(mutex_);
-      running_.erase(itRunning);
+    if (proc->completed() && proc->pidFd() == -1 && !proc->reaped()) {
+      /* Both pipes reached EOF and there is no pidfd to wait for: the
+       * process is complete, waitFinished will block in waitpid. When a
+       * pidfd exists, the process moves to finished_ when it fires. */
+      moveToFinished(itRunning);
     }
   }
 }
 
+void PosixSubProcessManager::moveToFinished(RunningProcesses::iterator
+                                            itRunning) {
+  finished_.push(std::move(*itRunning));
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  running_.erase(itRunning);
+}
+
 } // namespace falcon
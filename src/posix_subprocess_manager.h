@@ -6,6 +6,7 @@
 #ifndef FALCON_POSIX_SUBPROCESS_MANAGER_H_
 #define FALCON_POSIX_SUBPROCESS_MANAGER_H_
 
+#include <atomic>
 #include <cassert>
 #include <string>
 #include <unordered_map>
@@ -35,8 +36,8 @@ class PosixSubProcessManager {
 
   /**
    * Spawn a new subprocess.
-   * Add the stdout and stderr file descriptors of the given process to pollfds_
-   * and map_ so that they can be monitored with ppoll.
+   * Register the stdout and stderr file descriptors of the given process
+   * with epollFd_ so that they can be monitored.
    *
    * @param rule Rule to be built. Must not be a phony rule.
    * @return id of the command that was started.
@@ -44,8 +45,16 @@ class PosixSubProcessManager {
   unsigned int addProcess(Rule *rule, const std::string& workingDirectory);
 
   /**
-   * Use ppoll to monitor the file descriptors of the running processes and read
-   * the output if a file descriptor is ready to be read.
+   * Same, but run the given command instead of the rule's own. Used when the
+   * builder rewrites the command, eg to redirect the depfile to the scratch
+   * directory.
+   */
+  unsigned int addProcess(Rule *rule, const std::string& command,
+                          const std::string& workingDirectory);
+
+  /**
+   * Wait on the epoll instance for the file descriptors of the running
+   * processes and read the output of each one that is ready.
    */
   void run();
 
@@ -66,38 +75,56 @@ class PosixSubProcessManager {
 
   typedef std::list<PosixSubProcessPtr>   RunningProcesses;
   typedef std::queue<PosixSubProcessPtr>  FinishedProcesses;
-  typedef std::list<pollfd>               ListFds;
+
+  /* What a monitored fd is for its subprocess. */
+  enum class FdKind { STDOUT, STDERR, PIDFD };
 
   struct FdInfo {
     /* Position of subprcess in running_. */
     RunningProcesses::iterator itRunning;
-    /* Position of fd in pollfds_. */
-    ListFds::iterator itFd;
-    /* Set to true if the fd is for stdout. Otherwise it is for stderr. */
-    bool isStdout;
+    /* Whether the fd is the stdout pipe, the stderr pipe or the pidfd of
+     * the process. */
+    FdKind kind;
   };
 
+  /** Register a fd with epollFd_ and record its FdInfo in map_. */
+  void registerFd(int fd, FdInfo info);
+
   /**
-   * Read a fd. If we encounter EOF, remove the fd from the list of fds to be
-   * monitored with ppoll. If both the fds for stdout and stderr are closed for
-   * this process, move it from running_ to finished_.
-   * @param fd from which to read.
+   * Process an event on a fd. For an output pipe, drain it; on EOF the fd
+   * is closed, which drops it from the epoll interest set. For a pidfd,
+   * reap the process, drain whatever it wrote before exiting and tear the
+   * pipes down. When a process is both reaped and done with its output,
+   * move it from running_ to finished_.
+   * @param fd the event was reported on.
    */
   void readFd(int fd);
 
-  unsigned int id_;
+  /** Move a process from running_ to finished_. */
+  void moveToFinished(RunningProcesses::iterator itRunning);
+
+  /** Source of command ids. Shared between all the managers: the builder
+   * runs one manager per dispatcher shard and the ids must stay unique for
+   * the output consumer. */
+  static std::atomic<unsigned int> nextId_;
   IStreamConsumer* consumer_;
 
   /** List of processes currently running. */
   RunningProcesses running_;
   /** List of processes that have finished running. */
   FinishedProcesses finished_;
-  /** list of file descriptors being monitored with ppoll. */
-  ListFds pollfds_;
+
+  /** epoll instance the output pipes of the running processes are
+   * registered with: one wakeup processes only the fds that are actually
+   * ready, instead of re-scanning the whole set like poll did. */
+  int epollFd_;
+
+  /** Maximum number of events harvested per epoll_pwait call. */
+  static const int kMaxEvents = 64;
 
   /** When polling a read event from a fd, this map makes it possible to have
-   * information about it, ie the corresponding subprocess, the position of the
-   * fd in pollfds_, if it's stdout or stderr. See FdInfo. */
+   * information about it, ie the corresponding subprocess and whether the fd
+   * is its stdout or stderr. See FdInfo. */
   std::unordered_map<int, FdInfo> map_;
 
   /* Protect concurrent access to running_. */
@@ -0,0 +1,148 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <fstream>
+
+#include <stdio.h>
+
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+
+#include "remote_cache.h"
+
+#include "cache_fs.h"
+#include "logging.h"
+
+using namespace ::apache::thrift;
+using namespace ::apache::thrift::protocol;
+using namespace ::apache::thrift::transport;
+
+namespace falcon {
+
+const int32_t RemoteCache::kChunkBytes;
+
+RemoteCache::RemoteCache(const std::string& host, int port)
+    : host_(host)
+    , port_(port)
+    , down_(false) { }
+
+RemoteCache::~RemoteCache() {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (transport_) {
+    try {
+      transport_->close();
+    } catch (TException& e) {
+      /* Closing a broken connection is not an error worth reporting. */
+    }
+  }
+}
+
+bool RemoteCache::connect() {
+  if (down_) {
+    return false;
+  }
+  if (transport_ && transport_->isOpen()) {
+    return true;
+  }
+
+  try {
+    boost::shared_ptr<TSocket> socket(new TSocket(host_, port_));
+    socket->setConnTimeout(5000);
+    /* The command server is a TNonblockingServer: it speaks the framed
+     * transport. */
+    transport_.reset(new TFramedTransport(socket));
+    boost::shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport_));
+    client_.reset(new FalconServiceClient(protocol));
+    transport_->open();
+  } catch (TException& e) {
+    LOG(WARNING) << "remote cache " << host_ << ":" << port_
+                 << " unavailable: " << e.what();
+    markDown();
+    return false;
+  }
+  return true;
+}
+
+void RemoteCache::markDown() {
+  down_ = true;
+  client_.reset();
+  transport_.reset();
+}
+
+void RemoteCache::hasEntries(const std::vector<std::string>& hashes,
+                             std::vector<bool>* hits) {
+  hits->assign(hashes.size(), false);
+
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!connect()) {
+    return;
+  }
+
+  try {
+    client_->hasCacheEntries(*hits, hashes);
+  } catch (TException& e) {
+    LOG(WARNING) << "remote cache " << host_ << ":" << port_
+                 << " unavailable: " << e.what();
+    markDown();
+    hits->assign(hashes.size(), false);
+  }
+}
+
+bool RemoteCache::fetchEntry(const std::string& hash, CacheFS& store) {
+  std::lock_guard<std::mutex> g(mutex_);
+  if (!connect()) {
+    return false;
+  }
+
+  std::string staged = store.stagingPath(hash);
+  std::ofstream ofs(staged, std::ios::out | std::ios::binary
+                            | std::ios::trunc);
+  if (!ofs.is_open()) {
+    LOG(ERROR) << "could not stage remote cache entry to " << staged;
+    return false;
+  }
+
+  bool compressed = false;
+  int64_t offset = 0;
+  try {
+    for (;;) {
+      CacheEntryChunk chunk;
+      client_->getCacheEntry(chunk, hash, offset, kChunkBytes);
+      if (!chunk.found) {
+        /* The entry vanished between the probe and the fetch. */
+        ofs.close();
+        remove(staged.c_str());
+        return false;
+      }
+      ofs.write(chunk.data.data(), chunk.data.size());
+      offset += chunk.data.size();
+      compressed = chunk.compressed;
+      if (chunk.eof) {
+        break;
+      }
+    }
+  } catch (TException& e) {
+    LOG(WARNING) << "remote cache " << host_ << ":" << port_
+                 << " unavailable: " << e.what();
+    markDown();
+    ofs.close();
+    remove(staged.c_str());
+    return false;
+  }
+
+  ofs.close();
+  if (!ofs.good()) {
+    LOG(ERROR) << "could not stage remote cache entry to " << staged;
+    remove(staged.c_str());
+    return false;
+  }
+
+  DLOG(INFO) << "fetched " << hash << " (" << offset << " bytes) from "
+             << host_ << ":" << port_;
+  return store.installEntry(hash, staged, compressed);
+}
+
+} // namespace falcon
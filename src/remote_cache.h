@@ -0,0 +1,78 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_REMOTE_CACHE_H_
+#define FALCON_REMOTE_CACHE_H_
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <thrift/transport/TTransport.h>
+
+#include "FalconService.h"
+
+namespace falcon {
+
+class CacheFS;
+
+/**
+ * Client of a remote cache tier: another falcond (typically a CI builder)
+ * whose local cache is consulted when an entry is not in ours.
+ *
+ * Probes are batched (one RPC per frontier, see LazyCache::fetch) and entry
+ * contents are transferred in chunks, in the stored form of the serving
+ * daemon: a compressed entry crosses the wire compressed and is installed
+ * as-is, so fetching never recompresses. Fetched entries populate the local
+ * CacheFS, so an entry is pulled at most once.
+ *
+ * All calls are serialized on one persistent connection. Like the peers of
+ * RemoteExecutor, a cache that cannot be reached is marked down for the rest
+ * of the session: a build never waits on connection timeouts twice.
+ */
+class RemoteCache {
+ public:
+  RemoteCache(const std::string& host, int port);
+  ~RemoteCache();
+
+  /** Probe the remote cache for a batch of hashes in one RPC.
+   * Fills one flag per hash, in order; everything misses when the remote
+   * cache is down. */
+  void hasEntries(const std::vector<std::string>& hashes,
+                  std::vector<bool>* hits);
+
+  /** Fetch an entry and install it in the given local store.
+   * @return true if the entry is now available locally. */
+  bool fetchEntry(const std::string& hash, CacheFS& store);
+
+ private:
+  /** Open the connection if needed. Called with mutex_ held. */
+  bool connect();
+  /** Drop the connection and mark the remote cache down. Called with mutex_
+   * held. */
+  void markDown();
+
+  /** Size of the chunks an entry is transferred in. */
+  static const int32_t kChunkBytes = 1 << 20;
+
+  std::string host_;
+  int port_;
+  bool down_;
+
+  /** Serializes the RPCs: fetches come concurrently from the lazy-cache
+   * restore pool and the dispatcher threads. */
+  std::mutex mutex_;
+
+  boost::shared_ptr<apache::thrift::transport::TTransport> transport_;
+  std::unique_ptr<FalconServiceClient> client_;
+
+  RemoteCache(const RemoteCache& other) = delete;
+  RemoteCache& operator=(const RemoteCache& other) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_REMOTE_CACHE_H_
@@ -0,0 +1,179 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TSocket.h>
+
+#include "FalconService.h"
+
+#include "remote_executor.h"
+#include "fs.h"
+#include "logging.h"
+
+using namespace ::apache::thrift;
+using namespace ::apache::thrift::protocol;
+using namespace ::apache::thrift::transport;
+
+namespace falcon {
+
+RemoteExecutor::RemoteExecutor(std::vector<std::string> const& peers,
+                               std::string const& workingDirectory)
+    : workingDirectory_(workingDirectory)
+    , stop_(false) {
+  for (auto it = peers.begin(); it != peers.end(); ++it) {
+    auto pos = it->rfind(':');
+    if (pos == std::string::npos) {
+      LOG(ERROR) << "invalid peer '" << *it << "', expected host:port";
+      continue;
+    }
+    std::unique_ptr<Peer> peer(new Peer());
+    peer->host = it->substr(0, pos);
+    peer->port = atoi(it->substr(pos + 1).c_str());
+    peers_.push_back(std::move(peer));
+  }
+  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
+    Peer* peer = it->get();
+    peer->thread = std::thread(
+        std::bind(&RemoteExecutor::peerThread, this, peer));
+  }
+}
+
+RemoteExecutor::~RemoteExecutor() {
+  {
+    std::lock_guard<std::mutex> g(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
+    if ((*it)->thread.joinable()) {
+      (*it)->thread.join();
+    }
+  }
+}
+
+void RemoteExecutor::setCallback(onRemoteRuleFn callback) {
+  callback_ = callback;
+}
+
+bool RemoteExecutor::tryDispatch(Rule* rule) {
+  assert(callback_);
+  std::lock_guard<std::mutex> g(mutex_);
+  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
+    Peer* peer = it->get();
+    if (!peer->dead && !peer->busy) {
+      peer->pending = rule;
+      peer->busy = true;
+      cond_.notify_all();
+      return true;
+    }
+  }
+  return false;
+}
+
+void RemoteExecutor::peerThread(Peer* peer) {
+  for (;;) {
+    Rule* rule;
+    {
+      std::unique_lock<std::mutex> l(mutex_);
+      cond_.wait(l, [this, peer]() {
+        return stop_ || peer->pending != nullptr;
+      });
+      if (stop_) {
+        return;
+      }
+      rule = peer->pending;
+      peer->pending = nullptr;
+    }
+
+    Status status = executeOnPeer(peer, rule);
+
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      peer->busy = false;
+      if (status == Status::UNAVAILABLE) {
+        peer->dead = true;
+      }
+    }
+
+    callback_(rule, status);
+  }
+}
+
+RemoteExecutor::Status RemoteExecutor::executeOnPeer(Peer* peer, Rule* rule) {
+  RemoteRuleRequest request;
+  request.cmd = rule->getCommand();
+  auto& outputs = rule->getOutputs();
+  for (auto it = outputs.begin(); it != outputs.end(); ++it) {
+    request.outputs.push_back((*it)->getPath());
+  }
+  request.depfile = rule->getDepfile();
+
+  RemoteRuleResult result;
+  try {
+    boost::shared_ptr<TSocket> socket(new TSocket(peer->host, peer->port));
+    socket->setConnTimeout(5000);
+    /* The command server is a TNonblockingServer: it speaks the framed
+     * transport. */
+    boost::shared_ptr<TTransport> transport(new TFramedTransport(socket));
+    boost::shared_ptr<TProtocol> protocol(new TBinaryProtocol(transport));
+    FalconServiceClient client(protocol);
+
+    transport->open();
+    client.executeRule(result, request);
+    transport->close();
+  } catch (TException& e) {
+    LOG(WARNING) << "peer " << peer->host << ":" << peer->port
+                 << " unavailable: " << e.what();
+    return Status::UNAVAILABLE;
+  }
+
+  if (result.exitCode != 0) {
+    LOG(ERROR) << "remote command failed on " << peer->host << ":"
+               << peer->port << " (exit " << result.exitCode << "): "
+               << request.cmd << "\n" << result.output;
+    return Status::FAILED;
+  }
+
+  /* Write the outputs the peer sent back into the local tree. */
+  for (auto it = result.outputFiles.begin();
+       it != result.outputFiles.end(); ++it) {
+    if (!writeOutput(it->first, it->second)) {
+      return Status::FAILED;
+    }
+  }
+  if (!request.depfile.empty()
+      && !writeOutput(request.depfile, result.depfileContent)) {
+    return Status::FAILED;
+  }
+
+  DLOG(INFO) << "rule executed remotely on " << peer->host << ":"
+             << peer->port << ": " << request.cmd;
+  return Status::SUCCESS;
+}
+
+bool RemoteExecutor::writeOutput(std::string const& path,
+                                 std::string const& content) {
+  std::string fullPath =
+      path[0] == '/' ? path : workingDirectory_ + "/" + path;
+  if (!fs::createPath(fullPath)) {
+    LOG(ERROR) << "could not create path " << fullPath;
+    return false;
+  }
+  std::ofstream ofs(fullPath, std::ios::out | std::ios::binary
+                              | std::ios::trunc);
+  ofs.write(content.data(), content.size());
+  if (!ofs.good()) {
+    LOG(ERROR) << "could not write remote output " << fullPath;
+    return false;
+  }
+  return true;
+}
+
+} // namespace falcon
@@ -0,0 +1,94 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_REMOTE_EXECUTOR_H_
+#define FALCON_REMOTE_EXECUTOR_H_
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "graph.h"
+
+namespace falcon {
+
+/**
+ * RemoteExecutor ships rules to peer falcond daemons for execution.
+ *
+ * Each peer (given as host:port, see the remote-peers option) runs a falcond
+ * with the same graph and an up-to-date tree. A dispatched rule is sent over
+ * the existing thrift service: the peer runs the command against its own tree
+ * and returns the content of the outputs, which are written into the local
+ * working directory. One rule is in flight per peer at a time.
+ *
+ * The caller registers a completion callback; it is invoked on an internal
+ * worker thread. A peer that cannot be reached is marked dead for the rest of
+ * the session and its rule is reported UNAVAILABLE so the caller can run it
+ * locally.
+ */
+class RemoteExecutor {
+ public:
+  enum class Status {
+    SUCCESS,     /* The rule was executed remotely, outputs are on disk. */
+    FAILED,      /* The command itself failed; the build should fail. */
+    UNAVAILABLE, /* The peer could not run it; execute the rule locally. */
+  };
+
+  typedef std::function<void(Rule*, Status)> onRemoteRuleFn;
+
+  RemoteExecutor(std::vector<std::string> const& peers,
+                 std::string const& workingDirectory);
+  ~RemoteExecutor();
+
+  /** Set the completion callback. Must be called before dispatching, with no
+   * rule in flight. */
+  void setCallback(onRemoteRuleFn callback);
+
+  /** Try to hand the given rule to an idle peer. Return false if every peer
+   * is busy or dead, in which case the rule is untouched. */
+  bool tryDispatch(Rule* rule);
+
+ private:
+  struct Peer {
+    std::string host;
+    int port;
+    Rule* pending;
+    bool busy;
+    bool dead;
+    std::thread thread;
+
+    Peer() : port(0), pending(nullptr), busy(false), dead(false) {}
+  };
+
+  /** Body of a peer worker: wait for a rule, execute it remotely, report. */
+  void peerThread(Peer* peer);
+
+  /** Run one rule on the given peer. */
+  Status executeOnPeer(Peer* peer, Rule* rule);
+
+  /** Write one file received from a peer into the working directory. */
+  bool writeOutput(std::string const& path, std::string const& content);
+
+  std::string workingDirectory_;
+  onRemoteRuleFn callback_;
+
+  std::vector<std::unique_ptr<Peer>> peers_;
+  /** Guards the pending/busy/dead fields of every peer. */
+  std::mutex mutex_;
+  /** Wakes the peer workers when a rule is dispatched or on shutdown. */
+  std::condition_variable cond_;
+  bool stop_;
+
+  RemoteExecutor(const RemoteExecutor& other) = delete;
+  RemoteExecutor& operator=(const RemoteExecutor&) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_REMOTE_EXECUTOR_H_
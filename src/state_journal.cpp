@@ -0,0 +1,208 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "state_journal.h"
+
+namespace falcon {
+
+static const char kJournalMagic[8] = { 'f', 'l', 'c', 'n', 's', 'j', '0', '1' };
+
+StateJournal::StateJournal() : fd_(-1), armed_(false) { }
+
+StateJournal::~StateJournal() {
+  if (fd_ >= 0) {
+    close();
+  }
+}
+
+void StateJournal::open(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  assert(fd_ < 0);
+
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    LOG(ERROR) << "cannot open state journal " << path
+               << ": " << strerror(errno);
+    return;
+  }
+  if (::write(fd_, kJournalMagic, sizeof(kJournalMagic))
+      != sizeof(kJournalMagic)) {
+    LOG(ERROR) << "cannot write state journal " << path
+               << ": " << strerror(errno);
+    ::close(fd_);
+    fd_ = -1;
+    return;
+  }
+
+  armed_.store(true, std::memory_order_release);
+}
+
+void StateJournal::close() {
+  armed_.store(false, std::memory_order_release);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  writeOut();
+  fsync(fd_);
+  ::close(fd_);
+  fd_ = -1;
+}
+
+void StateJournal::onNodeState(PathId id, State state) {
+  append(kNodeState, id, state == State::OUT_OF_DATE ? 1 : 0);
+}
+
+void StateJournal::onNodeTimestamp(PathId id, Timestamp t) {
+  append(kNodeTimestamp, id, t);
+}
+
+void StateJournal::onRuleState(PathId firstOutputId, State state) {
+  append(kRuleState, firstOutputId, state == State::OUT_OF_DATE ? 1 : 0);
+}
+
+void StateJournal::onRuleTimestamp(PathId firstOutputId, Timestamp t) {
+  append(kRuleTimestamp, firstOutputId, t);
+}
+
+void StateJournal::append(std::uint8_t type, PathId id, std::int64_t value) {
+  if (!isArmed()) {
+    return;
+  }
+
+  /* The record carries the path, not the id: ids are an artifact of this
+   * run's intern order. */
+  const std::string& path = getPathTable().str(id);
+  std::uint32_t length = static_cast<std::uint32_t>(path.size());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  buffer_.append(reinterpret_cast<const char*>(&type), sizeof(type));
+  buffer_.append(reinterpret_cast<const char*>(&length), sizeof(length));
+  buffer_.append(path.data(), path.size());
+  buffer_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+
+  if (buffer_.size() >= kWriteThreshold) {
+    writeOut();
+  }
+}
+
+void StateJournal::writeOut() {
+  if (fd_ < 0 || buffer_.empty()) {
+    return;
+  }
+  if (::write(fd_, buffer_.data(), buffer_.size())
+      != static_cast<ssize_t>(buffer_.size())) {
+    LOG(ERROR) << "cannot write state journal: " << strerror(errno);
+  }
+  buffer_.clear();
+}
+
+void StateJournal::commit() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  writeOut();
+  fsync(fd_);
+}
+
+void StateJournal::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (fd_ < 0) {
+    return;
+  }
+  buffer_.clear();
+  if (ftruncate(fd_, 0) != 0
+      || lseek(fd_, 0, SEEK_SET) != 0
+      || ::write(fd_, kJournalMagic, sizeof(kJournalMagic))
+         != sizeof(kJournalMagic)) {
+    LOG(ERROR) << "cannot reset state journal: " << strerror(errno);
+  }
+  fsync(fd_);
+}
+
+void StateJournal::replay(const std::string& path, Graph& graph) {
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs.is_open()) {
+    return;
+  }
+
+  char magic[sizeof(kJournalMagic)];
+  ifs.read(magic, sizeof(magic));
+  if (!ifs.good() || memcmp(magic, kJournalMagic, sizeof(magic)) != 0) {
+    LOG(WARNING) << "Ignoring invalid state journal " << path;
+    return;
+  }
+
+  std::size_t applied = 0;
+  std::string recordPath;
+  for (;;) {
+    std::uint8_t type;
+    std::uint32_t length;
+    std::int64_t value;
+    ifs.read(reinterpret_cast<char*>(&type), sizeof(type));
+    ifs.read(reinterpret_cast<char*>(&length), sizeof(length));
+    if (!ifs.good()) {
+      break;
+    }
+    recordPath.resize(length);
+    ifs.read(&recordPath[0], length);
+    ifs.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!ifs.good()) {
+      /* The daemon died mid-append: everything up to here is intact. */
+      break;
+    }
+
+    auto it = graph.getNodes().find(getPathTable().find(recordPath));
+    if (it == graph.getNodes().end()) {
+      /* The graph no longer has this path; skip the record. */
+      continue;
+    }
+    Node* node = it->second;
+
+    switch (type) {
+    case kNodeState:
+      node->setState(value != 0 ? State::OUT_OF_DATE : State::UP_TO_DATE);
+      break;
+    case kNodeTimestamp:
+      node->setTimestamp(value);
+      break;
+    case kRuleState:
+      if (node->getChild() != nullptr) {
+        node->getChild()->setState(value != 0 ? State::OUT_OF_DATE
+                                              : State::UP_TO_DATE);
+      }
+      break;
+    case kRuleTimestamp:
+      if (node->getChild() != nullptr) {
+        node->getChild()->setTimestamp(value);
+      }
+      break;
+    default:
+      LOG(WARNING) << "Ignoring tail of state journal " << path
+                   << ": unknown record type";
+      return;
+    }
+    applied++;
+  }
+
+  LOG(INFO) << "replayed " << applied << " state journal records";
+}
+
+StateJournal& getStateJournal() {
+  static StateJournal journal;
+  return journal;
+}
+
+} // namespace falcon
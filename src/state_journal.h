@@ -0,0 +1,99 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_STATE_JOURNAL_H_
+# define FALCON_STATE_JOURNAL_H_
+
+# include <atomic>
+# include <mutex>
+# include <string>
+
+# include "graph.h"
+
+namespace falcon {
+
+/**
+ * @class StateJournal
+ * @brief Write-ahead journal of node and rule state transitions.
+ *
+ * The graph snapshot is only rewritten at startup and on a clean shutdown:
+ * a daemon that is killed mid-day restarts from the morning's states and
+ * conservatively re-evaluates everything built since. The journal closes
+ * that gap: every state and timestamp transition of the live graph is
+ * appended here (buffered, written out in batches, made durable by commit()
+ * when a build completes), and replayed on top of the snapshot at the next
+ * startup. Combined with the watchman since-query, a restarted daemon
+ * reaches the states it died with instead of the states it last saved.
+ *
+ * Records are keyed by path rather than by PathId: ids depend on the intern
+ * order of the run that wrote them. Paths unknown to the replayed graph are
+ * skipped, so a journal written against a graph that has since been
+ * reloaded degrades to a partial replay instead of corrupting anything.
+ */
+class StateJournal {
+ public:
+  StateJournal();
+  ~StateJournal();
+
+  /** Open (truncating: the caller just saved a fresh snapshot that subsumes
+   * any previous records) and start recording. */
+  void open(const std::string& path);
+
+  /** Flush, make durable and stop recording. */
+  void close();
+
+  /** True between open() and close(). The setters in graph.cpp check this
+   * before paying for an append. */
+  bool isArmed() const { return armed_.load(std::memory_order_acquire); }
+
+  /* Transition hooks, called by the Node and Rule setters. A rule is
+   * identified by its first output. */
+  void onNodeState(PathId id, State state);
+  void onNodeTimestamp(PathId id, Timestamp t);
+  void onRuleState(PathId firstOutputId, State state);
+  void onRuleTimestamp(PathId firstOutputId, Timestamp t);
+
+  /** Write out the buffered records and fsync them to disk. */
+  void commit();
+
+  /** Drop every record, keeping the journal open: called after a fresh
+   * snapshot has been saved. */
+  void reset();
+
+  /** Apply the records of a journal file to a graph restored from the
+   * snapshot the journal was written against. Unreadable or trailing
+   * partial records (the daemon died mid-append) stop the replay at the
+   * last intact record. */
+  static void replay(const std::string& path, Graph& graph);
+
+ private:
+  /* Record types. Each record is: type, path length, path bytes, i64
+   * value. */
+  static const std::uint8_t kNodeState = 0;
+  static const std::uint8_t kNodeTimestamp = 1;
+  static const std::uint8_t kRuleState = 2;
+  static const std::uint8_t kRuleTimestamp = 3;
+
+  /** Buffered records this size or bigger are written out (without fsync:
+   * durability is commit's job). */
+  static const std::size_t kWriteThreshold = 1 << 16;
+
+  void append(std::uint8_t type, PathId id, std::int64_t value);
+  /** Write the buffer to the file. Caller holds mutex_. */
+  void writeOut();
+
+  /** Serialized records not yet written to the file. */
+  std::string buffer_;
+  std::mutex mutex_;
+  int fd_;
+  std::atomic<bool> armed_;
+};
+
+/** Accessor for the process-wide journal, armed by the daemon. */
+StateJournal& getStateJournal();
+
+} // namespace falcon
+
+#endif // FALCON_STATE_JOURNAL_H_
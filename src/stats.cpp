@@ -0,0 +1,57 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include "stats.h"
+
+namespace falcon {
+
+StatsRegistry::StatsRegistry()
+    : cacheHits(0)
+    , cacheMisses(0)
+    , cacheEntriesSaved(0)
+    , hashFiles(0)
+    , hashBytes(0)
+    , hashTimeUs(0)
+    , watcherNotifications(0)
+    , processesSpawned(0)
+    , processesReaped(0)
+    , reapTimeUs(0)
+    , buildsCompleted(0)
+    , buildTimeMs(0)
+    , buildQueueWaitMs(0)
+    , consistencyNodesChecked(0)
+    , consistencyViolations(0) {}
+
+void StatsRegistry::collect(std::map<std::string, std::int64_t>& out) const {
+  out["cache.hits"] = cacheHits.load(std::memory_order_relaxed);
+  out["cache.misses"] = cacheMisses.load(std::memory_order_relaxed);
+  out["cache.entries_saved"] =
+      cacheEntriesSaved.load(std::memory_order_relaxed);
+  out["hash.files"] = hashFiles.load(std::memory_order_relaxed);
+  out["hash.bytes"] = hashBytes.load(std::memory_order_relaxed);
+  out["hash.time_us"] = hashTimeUs.load(std::memory_order_relaxed);
+  out["watcher.notifications"] =
+      watcherNotifications.load(std::memory_order_relaxed);
+  out["processes.spawned"] =
+      processesSpawned.load(std::memory_order_relaxed);
+  out["processes.reaped"] = processesReaped.load(std::memory_order_relaxed);
+  out["processes.reap_time_us"] =
+      reapTimeUs.load(std::memory_order_relaxed);
+  out["builds.completed"] = buildsCompleted.load(std::memory_order_relaxed);
+  out["builds.time_ms"] = buildTimeMs.load(std::memory_order_relaxed);
+  out["builds.queue_wait_ms"] =
+      buildQueueWaitMs.load(std::memory_order_relaxed);
+  out["consistency.nodes_checked"] =
+      consistencyNodesChecked.load(std::memory_order_relaxed);
+  out["consistency.violations"] =
+      consistencyViolations.load(std::memory_order_relaxed);
+}
+
+StatsRegistry& getStatsRegistry() {
+  static StatsRegistry registry;
+  return registry;
+}
+
+} // namespace falcon
@@ -0,0 +1,68 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_STATS_H_
+#define FALCON_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+
+namespace falcon {
+
+/**
+ * Process-wide counters of the daemon's hot paths, exposed through the
+ * getStats thrift command so that a metrics scraper can watch the daemon
+ * without attaching a profiler.
+ *
+ * Every counter is a relaxed atomic increment on its hot path: there is no
+ * lock and no map lookup where the work happens. The counters are monotonic
+ * since daemon startup; rates are for the scraper to derive. Keys reported
+ * by collect() are stable across daemon versions, new keys may appear.
+ */
+class StatsRegistry {
+ public:
+  StatsRegistry();
+
+  /* Cache (see cache_manager.h). */
+  std::atomic<std::uint64_t> cacheHits;
+  std::atomic<std::uint64_t> cacheMisses;
+  std::atomic<std::uint64_t> cacheEntriesSaved;
+
+  /* Content hashing (see graph_hash.cpp). */
+  std::atomic<std::uint64_t> hashFiles;
+  std::atomic<std::uint64_t> hashBytes;
+  std::atomic<std::uint64_t> hashTimeUs;
+
+  /* File watcher notifications processed (see DaemonInstance::setDirty). */
+  std::atomic<std::uint64_t> watcherNotifications;
+
+  /* Subprocesses (see posix_subprocess.cpp). */
+  std::atomic<std::uint64_t> processesSpawned;
+  std::atomic<std::uint64_t> processesReaped;
+  std::atomic<std::uint64_t> reapTimeUs;
+
+  /* Completed builds. */
+  std::atomic<std::uint64_t> buildsCompleted;
+  std::atomic<std::uint64_t> buildTimeMs;
+  std::atomic<std::uint64_t> buildQueueWaitMs;
+
+  /* Sampling-mode consistency verification (see
+   * graph_consistency_checker.h). A non-zero violation count means the
+   * graph state is corrupted and the daemon should be restarted. */
+  std::atomic<std::uint64_t> consistencyNodesChecked;
+  std::atomic<std::uint64_t> consistencyViolations;
+
+  /** Dump every counter under its stable key, eg "cache.hits". */
+  void collect(std::map<std::string, std::int64_t>& out) const;
+};
+
+/** Accessor for the process-wide registry. */
+StatsRegistry& getStatsRegistry();
+
+} // namespace falcon
+
+#endif // FALCON_STATS_H_
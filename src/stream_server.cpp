@@ -4,12 +4,17 @@
  */
 
 #include <algorithm>
+#include <arpa/inet.h>
 #include <cassert>
+#include <cstdlib>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "stream_server.h"
@@ -22,12 +27,53 @@
 
 namespace falcon {
 
+/* Magic a client sends right after connecting to opt into the binary
+ * framing, see StreamFrameType. */
+static const char kBinaryMagic[4] = { 'F', 'B', 'S', '1' };
+
 StreamServer::StreamServer()
   : serverSocket_(-1)
   , eventFd_()
-  , stopped_(false) { }
+  , handshakeClients_(0)
+  , pool_(kChunkSize)
+  , stopped_(false) {
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd_ < 0) {
+    THROW_ERROR(errno, "epoll_create1 failed");
+  }
+  addFd(eventFd_.get(), EPOLLIN);
+}
+
+void StreamServer::addFd(int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    THROW_ERROR(errno, "epoll_ctl failed");
+  }
+}
+
+void StreamServer::modFd(int fd, uint32_t events) {
+  struct epoll_event ev;
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+    THROW_ERROR(errno, "epoll_ctl failed");
+  }
+}
+
+void StreamServer::removeFd(int fd) {
+  if (epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr) < 0) {
+    THROW_ERROR(errno, "epoll_ctl failed");
+  }
+}
 
 void StreamServer::openPort(unsigned int port) {
+  /* A client can disappear between two sends; sendfile has no equivalent of
+   * MSG_NOSIGNAL, so a write to a closed socket must report EPIPE instead
+   * of killing the daemon. */
+  signal(SIGPIPE, SIG_IGN);
+
   serverSocket_ = socket(AF_INET, SOCK_STREAM, 0);
   if (serverSocket_ < 0) {
     THROW_ERROR(errno, "Failed to open socket");
@@ -59,6 +105,8 @@ void StreamServer::openPort(unsigned int port) {
     close(serverSocket_);
     THROW_ERROR(errno, "listen");
   }
+
+  addFd(serverSocket_, EPOLLIN);
 }
 
 StreamServer::~StreamServer() {
@@ -73,6 +121,7 @@ StreamServer::~StreamServer() {
 
   /* Only the server socket should remain in fds_. Close it. */
   close(serverSocket_);
+  close(epollFd_);
 }
 
 void StreamServer::run() {
@@ -90,6 +139,12 @@ void StreamServer::stop() {
 void StreamServer::removeBuild(std::list<BuildInfo>::iterator it) {
   assert(it->refcount == 0);
   assert(it->buildCompleted);
+  if (it->json.spillFd != -1) {
+    close(it->json.spillFd);
+  }
+  if (it->bin.spillFd != -1) {
+    close(it->bin.spillFd);
+  }
   builds_.erase(it);
 }
 
@@ -116,6 +171,7 @@ void StreamServer::newBuild(unsigned int buildId) {
   writeBuf(ss.str());
   writeBuf(",\n"
            "  \"cmds\": [\n");
+  writeFrame(StreamFrameType::NEW_BUILD, buildId, nullptr, 0);
   flushWaiting();
 }
 
@@ -131,55 +187,55 @@ void StreamServer::endBuild(BuildResult result) {
   writeBuf(toString(result));
   writeBuf("\"\n"
            "}\n");
+  std::string res = toString(result);
+  writeFrame(StreamFrameType::END_BUILD, 0, res.data(), res.size());
   flushWaiting();
 
   builds_.front().buildCompleted = true;
 }
 
 void StreamServer::processEvents() {
-  std::vector<pollfd> fds;
+  /* The interest set lives in the kernel and epoll_ctl updates it while we
+   * are blocked here, so there is no fd list to rebuild per wakeup and only
+   * the sockets that are actually ready are reported. */
+  struct epoll_event events[kMaxEvents];
+
+  /* Only wake up on a timer when a stalled client could need evicting, ie
+   * some client has pending data. */
+  int timeout;
   {
     std::lock_guard<std::mutex> lock(mutex_);
-    std::for_each(fds_.begin(), fds_.end(),
-        [&fds](const int& fd) {
-          fds.push_back({ fd, POLLOUT });
-        }
-    );
-
-    fds.push_back({ serverSocket_, POLLIN });
-    fds.push_back({ eventFd_.get(), POLLIN });
+    if (handshakeClients_ > 0) {
+      timeout = kHandshakeTimeoutMs;
+    } else {
+      timeout = fds_.empty() ? -1 : kSlowClientTimeoutMs;
+    }
   }
 
-  int r = poll(&fds.front(), fds.size(), -1);
+  int r = epoll_wait(epollFd_, events, kMaxEvents, timeout);
   if (r < 0) {
     if (errno == EINTR) {
       return;
-    } else if (errno == EINVAL) {
-      /* Too many file descriptors. */
-      LOG(ERROR) << "Too many fds for poll";
     }
-    THROW_ERROR(errno, "poll failed");
-  } else if (r == 0) {
-    /* Timeout. */
-    return;
+    THROW_ERROR(errno, "epoll_wait failed");
   }
 
-  /* Try to read data from each fd that is ready. */
-  for (auto it = fds.begin(); it != fds.end(); ++it) {
-    if (it->revents == 0) {
-      continue;
-    }
-    if (it->fd == serverSocket_) {
-      if (it->revents & POLLIN) {
+  evictSlowClients();
+
+  for (int i = 0; i < r; ++i) {
+    int fd = events[i].data.fd;
+    if (fd == serverSocket_) {
+      if (events[i].events & EPOLLIN) {
         acceptClients();
       } else {
-        LOG(ERROR) << "Unexpected poll event " << it->revents;
+        LOG(ERROR) << "Unexpected epoll event " << events[i].events;
       }
-    } else if (it->fd != eventFd_.get()) {
-      if (it->revents & POLLOUT) {
-        processClient(it->fd);
-      } else {
-        LOG(ERROR) << "Unexpected poll event " << it->revents;
+    } else if (fd != eventFd_.get()) {
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        handleClientInput(fd);
+      }
+      if (events[i].events & EPOLLOUT) {
+        processClient(fd);
       }
     } else {
       /* Notified by eventfd. */
@@ -213,46 +269,157 @@ void StreamServer::acceptClients() {
 void StreamServer::createClient(int fd) {
   std::lock_guard<std::mutex> lock(mutex_);
 
-  bool isWaiting = builds_.empty()
-    || builds_.front().buf.size() == 0;
-
-  std::list<int>::iterator itFd;
-  if (isWaiting) {
-    waiting_.push_front(fd);
-    itFd = waiting_.begin();
-  } else {
-    fds_.push_front(fd);
-    itFd = fds_.begin();
-  }
+  /* The client starts in the handshake window, during which nothing is
+   * sent to it: it either announces the binary framing, or falls back to
+   * the json stream when the window expires. */
+  waiting_.push_front(fd);
 
   if (!builds_.empty()) {
     builds_.front().refcount++;
   }
 
-  map_[fd] = ClientInfo{ builds_.begin(), 0, itFd, isWaiting};
+  ClientInfo info;
+  info.itBuild = builds_.begin();
+  info.mode = StreamMode::HANDSHAKE;
+  info.pos = 0;
+  info.lastProgress = std::chrono::steady_clock::now();
+  info.itFd = waiting_.begin();
+  info.isWaiting = true;
+  map_[fd] = info;
+
+  handshakeClients_++;
+  addFd(fd, EPOLLIN);
 }
 
-void StreamServer::processClient(int fd) {
+void StreamServer::handleClientInput(int fd) {
   std::lock_guard<std::mutex> lock(mutex_);
+  auto it = map_.find(fd);
+  if (it == map_.end()) {
+    /* Stale event: the client was closed earlier in this batch. */
+    return;
+  }
+
+  char buf[256];
+  ssize_t r = read(fd, buf, sizeof(buf));
+  if (r < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return;
+    }
+    closeClient(fd);
+    return;
+  }
+  if (r == 0) {
+    /* The client hung up. */
+    closeClient(fd);
+    return;
+  }
+
+  ClientInfo& info = it->second;
+  if (info.mode != StreamMode::HANDSHAKE) {
+    /* Clients have nothing to say once the encoding is settled. */
+    return;
+  }
+
+  info.handshake.append(buf, r);
+  if (info.handshake.size() >= sizeof(kBinaryMagic)) {
+    bool isBinary = memcmp(info.handshake.data(), kBinaryMagic,
+                           sizeof(kBinaryMagic)) == 0;
+    finishHandshake(fd, isBinary ? StreamMode::BINARY : StreamMode::JSON);
+  }
+}
+
+void StreamServer::finishHandshake(int fd, StreamMode mode) {
   auto it = map_.find(fd);
   assert(it != map_.end());
   ClientInfo& info = it->second;
+  assert(info.mode == StreamMode::HANDSHAKE);
+
+  info.mode = mode;
+  info.handshake.clear();
+  assert(handshakeClients_ > 0);
+  handshakeClients_--;
+
+  /* Start sending if the build already has output in this encoding.
+   * Otherwise the client stays in waiting_ and flushWaiting picks it up
+   * with the next data. */
+  if (info.itBuild != builds_.end() && streamFor(info).totalSize > 0) {
+    waiting_.erase(info.itFd);
+    fds_.push_front(fd);
+    info.itFd = fds_.begin();
+    info.isWaiting = false;
+    info.lastProgress = std::chrono::steady_clock::now();
+    modFd(fd, EPOLLIN | EPOLLOUT);
+  }
+}
+
+void StreamServer::processClient(int fd) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = map_.find(fd);
+  if (it == map_.end()) {
+    /* Stale event: the client was evicted earlier in this batch. */
+    return;
+  }
+  ClientInfo& info = it->second;
   auto itBuild = info.itBuild;
 
   /* There should be a build and some data to be read. Otherwise this fd should
    * be in the waiting list. */
   assert(itBuild != builds_.end());
-  assert(info.bufPtr < itBuild->buf.size());
+  assert(info.mode != StreamMode::HANDSHAKE);
+
+  OutputStream& stream = streamFor(info);
+  std::list<BufferPtr>& chunks = stream.chunks;
+  while (info.pos < stream.totalSize) {
+    if (info.pos < stream.chunksStart) {
+      /* The client is behind the in-memory window: serve it from the spill
+       * file, the kernel copies straight from the page cache. */
+      assert(stream.spillFd != -1);
+      off_t offset = info.pos;
+      ssize_t r = sendfile(fd, stream.spillFd, &offset,
+                           stream.chunksStart - info.pos);
+      if (r < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          closeClient(fd);
+        }
+        return;
+      }
+      info.pos += r;
+      info.lastProgress = std::chrono::steady_clock::now();
+      continue;
+    }
 
-  std::string& buf = itBuild->buf;
-  std::size_t bufSize = buf.size() - info.bufPtr;
-  const char* bufPtr = &buf[info.bufPtr];
-  do {
+    /* Gather the unsent chunks in an iovec array. The clients all send from
+     * the same pooled slabs, there is no per-client copy of the output. */
+    struct iovec iov[kMaxIov];
+    int iovCnt = 0;
+    std::size_t skip = info.pos - stream.chunksStart;
+    for (auto itChunk = chunks.begin();
+         itChunk != chunks.end() && iovCnt < kMaxIov; ++itChunk) {
+      std::size_t size = (*itChunk)->size();
+      if (skip >= size) {
+        skip -= size;
+        continue;
+      }
+      iov[iovCnt].iov_base = (*itChunk)->data() + skip;
+      iov[iovCnt].iov_len = size - skip;
+      iovCnt++;
+      skip = 0;
+    }
+
+    if (iovCnt == 0) {
+      /* Everything was sent. */
+      break;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovCnt;
 #ifndef MSG_NOSIGNAL
     #warning "MSG_NOSIGNAL is not defined in your environment: this may have unexpected side effect"
-    int r = send(fd, bufPtr, bufSize, 0);
+    ssize_t r = sendmsg(fd, &msg, 0);
 #else
-    int r = send(fd, bufPtr, bufSize, MSG_NOSIGNAL);
+    ssize_t r = sendmsg(fd, &msg, MSG_NOSIGNAL);
 #endif
     if (r < 0) {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
@@ -260,9 +427,10 @@ void StreamServer::processClient(int fd) {
       }
       return;
     }
-    info.bufPtr += r;
-    bufSize -= r;
-  } while (info.bufPtr < buf.size());
+
+    info.pos += r;
+    info.lastProgress = std::chrono::steady_clock::now();
+  }
 
   /* If we reach here, it means there is nothing left to write for this
    * client. */
@@ -270,7 +438,10 @@ void StreamServer::processClient(int fd) {
   if (itBuild->buildCompleted) {
     closeClient(fd);
   } else {
-    /* There might be more data. Put it in the waiting list. */
+    /* There might be more data. Put it in the waiting list and stop
+     * monitoring writability: a writable idle socket would spin the event
+     * loop. */
+    modFd(fd, EPOLLIN);
     fds_.erase(it->second.itFd);
     waiting_.push_front(fd);
     it->second.isWaiting = true;
@@ -297,7 +468,16 @@ void StreamServer::closeClient(int fd) {
     removeBuild(itBuild);
   }
 
-  fds_.erase(itMap->second.itFd);
+  if (itMap->second.mode == StreamMode::HANDSHAKE) {
+    assert(handshakeClients_ > 0);
+    handshakeClients_--;
+  }
+
+  if (itMap->second.isWaiting) {
+    waiting_.erase(itMap->second.itFd);
+  } else {
+    fds_.erase(itMap->second.itFd);
+  }
   map_.erase(itMap);
   close(fd);
 }
@@ -307,13 +487,24 @@ void StreamServer::flushWaiting() {
    * and thus we should have an ongoing build. */
   assert(!builds_.empty()
       && !builds_.front().buildCompleted
-      && !builds_.front().buf.empty());
+      && builds_.front().json.totalSize != 0);
 
-  for (auto it = waiting_.begin(); it != waiting_.end(); ++it) {
-    /* Move the client fd from waiting_ to fds_. */
-    fds_.push_front(*it);
+  for (auto it = waiting_.begin(); it != waiting_.end();) {
     auto itMap = map_.find(*it);
     assert(itMap != map_.end());
+
+    /* A client still in its handshake window is not sent anything yet; it
+     * leaves the waiting list when its encoding is settled. */
+    if (itMap->second.mode == StreamMode::HANDSHAKE) {
+      ++it;
+      continue;
+    }
+
+    /* Move the client fd from waiting_ to fds_ and resume monitoring it.
+     * epoll_ctl takes effect even while the event loop is blocked in
+     * epoll_wait, no wakeup is needed. */
+    fds_.push_front(*it);
+    modFd(*it, EPOLLIN | EPOLLOUT);
     itMap->second.itFd = fds_.begin();
     itMap->second.isWaiting = false;
 
@@ -328,10 +519,12 @@ void StreamServer::flushWaiting() {
        * have been closed. */
       assert(itMap->second.itBuild == builds_.begin());
     }
-  }
-  waiting_.clear();
 
-  notifyPoll();
+    /* The client has pending data again: restart its eviction clock. */
+    itMap->second.lastProgress = std::chrono::steady_clock::now();
+
+    it = waiting_.erase(it);
+  }
 }
 
 void StreamServer::notifyPoll() {
@@ -340,25 +533,137 @@ void StreamServer::notifyPoll() {
   }
 }
 
-void StreamServer::writeBuf(const std::string& str) {
+void StreamServer::writeBuf(const char* buf, std::size_t len) {
+  assert(!builds_.empty());
+  writeStream(builds_.front().json, buf, len);
+}
+
+void StreamServer::writeFrame(StreamFrameType type, unsigned int cmdId,
+                              const char* payload, std::size_t len) {
   assert(!builds_.empty());
-  builds_.front().buf.append(str);
+
+  uint32_t beLen = htonl(static_cast<uint32_t>(len));
+  uint32_t beCmdId = htonl(cmdId);
+  char header[9];
+  memcpy(header, &beLen, sizeof(beLen));
+  header[4] = static_cast<char>(type);
+  memcpy(header + 5, &beCmdId, sizeof(beCmdId));
+
+  OutputStream& stream = builds_.front().bin;
+  writeStream(stream, header, sizeof(header));
+  if (len > 0) {
+    writeStream(stream, payload, len);
+  }
+}
+
+void StreamServer::writeStream(OutputStream& stream, const char* buf,
+                               std::size_t len) {
+  stream.totalSize += len;
+  while (len > 0) {
+    if (stream.chunks.empty() || stream.chunks.back()->room() == 0) {
+      stream.chunks.push_back(pool_.get());
+    }
+    std::size_t n = stream.chunks.back()->append(buf, len);
+    buf += n;
+    len -= n;
+  }
+
+  if (stream.totalSize - stream.chunksStart > kMaxBufferedBytes) {
+    spillChunks(stream);
+  }
+}
+
+void StreamServer::spillChunks(OutputStream& stream) {
+  if (stream.spillFd == -1) {
+    char path[] = "/tmp/falcon-build-XXXXXX";
+    stream.spillFd = mkstemp(path);
+    if (stream.spillFd < 0) {
+      /* Out of disk or /tmp unwritable: keep the output in memory rather
+       * than losing it. */
+      LOG(ERROR) << "Cannot create spill file: " << strerror(errno);
+      return;
+    }
+    /* The file is anonymous, it goes away with its last fd. */
+    unlink(path);
+  }
+
+  /* Spill the oldest full chunks; the last chunk is still growing and
+   * always stays in memory. */
+  while (stream.totalSize - stream.chunksStart > kMaxBufferedBytes
+      && stream.chunks.size() > 1) {
+    BufferPtr& front = stream.chunks.front();
+    std::size_t written = 0;
+    while (written < front->size()) {
+      ssize_t r = write(stream.spillFd, front->data() + written,
+                        front->size() - written);
+      if (r < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG(ERROR) << "Cannot spill build output: " << strerror(errno);
+        return;
+      }
+      written += r;
+    }
+    stream.chunksStart += front->size();
+    stream.chunks.pop_front();
+  }
+}
+
+StreamServer::OutputStream& StreamServer::streamFor(ClientInfo& info) {
+  assert(info.itBuild != builds_.end());
+  return info.mode == StreamMode::BINARY ? info.itBuild->bin
+                                         : info.itBuild->json;
+}
+
+void StreamServer::evictSlowClients() {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto now = std::chrono::steady_clock::now();
+  for (auto it = map_.begin(); it != map_.end();) {
+    auto next = std::next(it);
+    ClientInfo& info = it->second;
+    if (info.mode == StreamMode::HANDSHAKE) {
+      /* The client did not announce the binary framing in time: it is a
+       * legacy client, serve it the json stream. */
+      if (now - info.lastProgress
+          > std::chrono::milliseconds(kHandshakeTimeoutMs)) {
+        finishHandshake(it->first, StreamMode::JSON);
+      }
+    } else if (!info.isWaiting
+        && now - info.lastProgress
+           > std::chrono::milliseconds(kSlowClientTimeoutMs)) {
+      LOG(INFO) << "Evicting stalled build output client";
+      closeClient(it->first);
+    }
+    it = next;
+  }
 }
 
 void StreamServer::writeBufEscapeJson(const char* buf, std::size_t len) {
   assert(!builds_.empty());
 
+  /* Copy whole runs of plain characters at once; the escaping write into
+   * the shared chunk is the only copy the output goes through. */
+  std::size_t start = 0;
   for (std::size_t i = 0; i < len; i++) {
     char c = buf[i];
-    if (c == '"' || c == '\\') {
-      builds_.front().buf.push_back('\\');
-      builds_.front().buf.push_back(c);
-    } else if (c == '\n') {
-      builds_.front().buf.append("\\n");
-    } else {
-      builds_.front().buf.push_back(c);
+    if (c == '"' || c == '\\' || c == '\n') {
+      if (i > start) {
+        writeBuf(buf + start, i - start);
+      }
+      if (c == '\n') {
+        writeBuf("\\n", 2);
+      } else {
+        writeBuf("\\", 1);
+        writeBuf(&c, 1);
+      }
+      start = i + 1;
     }
   }
+  if (len > start) {
+    writeBuf(buf + start, len - start);
+  }
 }
 
 void StreamServer::writeCmdOutput(unsigned int cmdId, char* buf,
@@ -380,6 +685,10 @@ void StreamServer::writeCmdOutput(unsigned int cmdId, char* buf,
   writeBufEscapeJson(buf, len);
   writeBuf("\" }");
 
+  /* The binary stream carries the compiler output untouched. */
+  writeFrame(isStdout ? StreamFrameType::CMD_STDOUT
+                      : StreamFrameType::CMD_STDERR, cmdId, buf, len);
+
   flushWaiting();
 }
 
@@ -410,6 +719,8 @@ void StreamServer::newCommand(unsigned int cmdId, const std::string& cmd) {
   writeBufEscapeJson(&cmd[0], cmd.size());
   writeBuf("\" }");
 
+  writeFrame(StreamFrameType::NEW_COMMAND, cmdId, cmd.data(), cmd.size());
+
   flushWaiting();
 }
 
@@ -427,6 +738,9 @@ void StreamServer::endCommand(unsigned int cmdId, SubProcessExitStatus status) {
   writeBuf(toString(status));
   writeBuf("\" }");
 
+  std::string st = toString(status);
+  writeFrame(StreamFrameType::END_COMMAND, cmdId, st.data(), st.size());
+
   flushWaiting();
 }
 
@@ -447,6 +761,8 @@ void StreamServer::cacheRetrieveAction(const std::string& path) {
   writeBuf(ss.str());
   writeBuf("\" }");
 
+  writeFrame(StreamFrameType::CACHE_RETRIEVE, 0, path.data(), path.size());
+
   flushWaiting();
 }
 
@@ -7,6 +7,7 @@
 #define FALCON_STREAM_SERVER_H_
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <list>
 #include <mutex>
@@ -14,12 +15,32 @@
 #include <unordered_map>
 
 #include "stream_consumer.h"
+#include "util/buffer_pool.h"
 #include "util/event.h"
 
 namespace falcon {
 
 enum class BuildResult;
 
+/**
+ * Frame types of the binary build output stream. A frame is:
+ *   uint32_t payload length (network order)
+ *   uint8_t  type (one of the values below)
+ *   uint32_t command id (network order, 0 when not applicable)
+ *   payload  raw bytes, not escaped
+ * Clients opt into this framing by sending the magic "FBS1" right after
+ * connecting; otherwise they receive the json stream.
+ */
+enum class StreamFrameType : unsigned char {
+  NEW_BUILD = 0,
+  END_BUILD,
+  NEW_COMMAND,
+  END_COMMAND,
+  CMD_STDOUT,
+  CMD_STDERR,
+  CACHE_RETRIEVE,
+};
+
 /**
  * Interface required by GraphParallelBuilder.
  */
@@ -52,8 +73,10 @@ class IBuildOutputConsumer : public IStreamConsumer {
  * This class maintains a list of 'BuildInfo' structs corresponding to each
  * build that happened in reverse chronological order, ie the front of the list
  * is the last build. Each struct contains:
- * - A buffer containing the output of the build in json format;
- * - A refcount that counts the number of clients to which the buffer is
+ * - A list of pooled buffer chunks containing the output of the build in json
+ *   format. The chunks are shared by every client: each client sends from the
+ *   same slabs with writev, at its own position;
+ * - A refcount that counts the number of clients to which the output is
  *   currently being sent.
  * When a build completes and the refcount reaches 0, the struct is removed from
  * the list.
@@ -62,7 +85,9 @@ class IBuildOutputConsumer : public IStreamConsumer {
  * - waiting_: this is the list of clients' file descriptors that are waiting
  *   for new data to come;
  * - fds_: this is the list of clients' file descriptors for which there is new
- *   data to be sent to. These file descriptors are monitored with poll.
+ *   data to be sent to. These file descriptors are registered in the epoll
+ *   instance, so the event loop never rebuilds the set and only sees the
+ *   sockets that are actually writable.
  * The file descriptors are moved from one list to the other depending on its
  * state (waiting for new data vs ready to read new data).
  *
@@ -72,8 +97,8 @@ class IBuildOutputConsumer : public IStreamConsumer {
  *   fds_ depending on the state of the client;
  * - An iterator to the BuildInfo struct corresponding to the build on which the
  *   client is reading the output;
- * - A pointer to indicate the amount of data that has been read in the internal
- *   buffer of the BuildInfo struct.
+ * - The position of the client in the chunk list of the BuildInfo struct: the
+ *   chunk being sent and the offset inside it.
  *
  * -- Usage:
  *
@@ -157,9 +182,18 @@ class StreamServer : public IBuildOutputConsumer {
 
  private:
 
-  /** This will call poll to process events. */
+  /** Wait on the epoll instance and process the reported events. */
   void processEvents();
 
+  /** Register a fd in the epoll instance. @param events epoll event mask. */
+  void addFd(int fd, uint32_t events);
+
+  /** Change the event mask of a registered fd. */
+  void modFd(int fd, uint32_t events);
+
+  /** Remove a fd from the epoll instance without closing it. */
+  void removeFd(int fd);
+
 
   /** Read 8 bytes from eventFd_. */
   void flushEventFd();
@@ -182,28 +216,70 @@ class StreamServer : public IBuildOutputConsumer {
    */
   void processClient(int fd);
 
+  /**
+   * Called when a client socket has incoming data. During the handshake
+   * this is how a client opts into the binary framing; afterwards incoming
+   * data is drained and an EOF closes the client.
+   */
+  void handleClientInput(int fd);
+
   /**
    * Close the given client. This closes the socket and updates fds_ and map_.
    */
   void closeClient(int fd);
 
   /**
-   * Move all the file descriptors in the waiting_ list to fds_ so that they are
-   * monitored with poll.
+   * Move all the file descriptors in the waiting_ list to fds_ and register
+   * them in the epoll instance, so they are monitored again.
    */
   void flushWaiting();
 
-  /** Write a byte to eventFd_ so that poll is notified and returns.
-   * This is used when we want poll to return because we updated the list of
-   * file descriptors to monitor or because we are shutting down. */
+  /** Write a byte to eventFd_ so that the event loop wakes up. This is only
+   * needed for shutting down: epoll_ctl updates the interest set of a
+   * blocked epoll_wait directly. */
   void notifyPoll();
 
-  void writeBuf(const std::string& str);
+  /** Append data to the json stream of the current build, filling the last
+   * chunk before requesting a new one from the pool, then spill the oldest
+   * chunks to disk if the in-memory window grew past kMaxBufferedBytes. */
+  void writeBuf(const char* buf, std::size_t len);
+  void writeBuf(const std::string& str) { writeBuf(str.data(), str.size()); }
   void writeBufEscapeJson(const char* buf, std::size_t len);
 
+  /** Append a frame to the binary stream of the current build, see
+   * StreamFrameType for the framing. The payload bytes go in untouched. */
+  void writeFrame(StreamFrameType type, unsigned int cmdId,
+                  const char* payload, std::size_t len);
+
+  /**
+   * One encoding of the output of a build. The in-memory tail is a list of
+   * pooled chunks; only the last chunk still grows, the chunks go back to
+   * the pool when the build is removed. When the window exceeds
+   * kMaxBufferedBytes the oldest full chunks are spilled to spillFd, so the
+   * memory pinned by a build is bounded no matter how verbose it is.
+   */
+  struct OutputStream {
+    std::list<BufferPtr> chunks;
+    /* Offset of the first byte of the first in-memory chunk in the whole
+     * output stream. Everything before it lives in spillFd. */
+    std::size_t chunksStart;
+    /* Total size of the output produced so far, spilled or not. */
+    std::size_t totalSize;
+    /* Unlinked temp file holding the spilled head of the output, served to
+     * catching-up clients with sendfile. -1 until the first spill. */
+    int spillFd;
+
+    OutputStream() : chunksStart(0), totalSize(0), spillFd(-1) {}
+  };
+
   struct BuildInfo {
     unsigned int id;
-    std::string buf;
+    /* The output is kept in both encodings: the json stream for the
+     * existing clients and the length-prefixed binary framing for clients
+     * that sent the magic. Raw command output goes into the binary stream
+     * untouched, without the json escaping pass. */
+    OutputStream json;
+    OutputStream bin;
     /* Refcount that counts the number of clients listening to the output stream
      * of this build. When it reaches 0 and the build completed, this structure
      * can be deallocated. */
@@ -220,6 +296,18 @@ class StreamServer : public IBuildOutputConsumer {
   /** Remove a build from the list of builds. */
   void removeBuild(std::list<BuildInfo>::iterator it);
 
+  /** Append data to the given output stream. */
+  void writeStream(OutputStream& stream, const char* buf, std::size_t len);
+
+  /** Spill the oldest full chunks of the given stream to its temp file
+   * until the in-memory window fits in kMaxBufferedBytes. */
+  void spillChunks(OutputStream& stream);
+
+  /** Close the clients that have pending data but made no progress for
+   * kSlowClientTimeoutMs, and switch the clients whose handshake window
+   * expired to the json stream. */
+  void evictSlowClients();
+
   /**
    * Helper function for writing a chunk of data comming from a command.
    * @param cmdId    id of the command;
@@ -236,11 +324,17 @@ class StreamServer : public IBuildOutputConsumer {
   /* File descriptor of the server socket. */
   int serverSocket_;
 
-  /* File descriptor used to notify poll. When data is appended to buf_, we
-   * write to this fd in order to wake-up poll. */
+  /* File descriptor used to wake up the event loop, see notifyPoll. */
   EventNotifier eventFd_;
 
-  /* List of fds monitored with ppoll. */
+  /* epoll instance the server socket, eventFd_ and the client sockets with
+   * pending data are registered with. */
+  int epollFd_;
+
+  /** Maximum number of events harvested per epoll_wait call. */
+  static const int kMaxEvents = 64;
+
+  /* List of fds registered in the epoll instance. */
   std::list<int> fds_;
 
   /* List of fds for which buf_ has been entirely sent. They are put on hold in
@@ -250,13 +344,26 @@ class StreamServer : public IBuildOutputConsumer {
 
   std::mutex mutex_;
 
+  /* Encoding a client receives. A client starts in HANDSHAKE: it either
+   * sends the binary magic, or is switched to JSON when the handshake
+   * window expires (old clients never send anything). */
+  enum class StreamMode { HANDSHAKE, JSON, BINARY };
+
   struct ClientInfo {
     /* Iterator to the BuildInfo structure corresponding to the build the client
      * is listening on. Equals to builds_.end() if there are no builds yet. */
     std::list<BuildInfo>::iterator itBuild;
-    /* Current pointer in itBuild->buf. Everything before this pointer has been
-     * already sent. */
-    std::size_t bufPtr;
+    /* Encoding negotiated with the client, see StreamMode. */
+    StreamMode mode;
+    /* Bytes received so far during the handshake. */
+    std::string handshake;
+    /* Absolute position of the client in the output stream of its build.
+     * Positions before chunksStart are served from the spill file with
+     * sendfile, the rest from the in-memory chunks. */
+    std::size_t pos;
+    /* Last time the client made progress, used to evict stalled clients so
+     * they cannot pin a build's output forever. */
+    std::chrono::steady_clock::time_point lastProgress;
     /* Iterator to the fd entry in fds_ or waiting_, depending on isWaiting. */
     std::list<int>::iterator itFd;
     /* Indicate if the fd is waiting for new data. In this case, it is stored in
@@ -267,10 +374,48 @@ class StreamServer : public IBuildOutputConsumer {
     bool isWaiting;
   };
 
+  /** The output stream of the client's build in its encoding. */
+  OutputStream& streamFor(ClientInfo& info);
+
+  /**
+   * Settle the encoding of a client and, if its build already has output in
+   * that encoding, start sending it. Locking is performed by the caller.
+   */
+  void finishHandshake(int fd, StreamMode mode);
+
   /* Map a fd to some information about the client, such as the current position
    * in the buffer. */
   std::unordered_map<int, ClientInfo> map_;
 
+  /* Number of clients whose handshake window is still open. Keeps the event
+   * loop on a short timeout so legacy clients start receiving json
+   * quickly. */
+  unsigned int handshakeClients_;
+
+  /** Size of the chunks the build output is stored in. */
+  static const std::size_t kChunkSize = 64 << 10;
+
+  /** Maximum number of chunks gathered in a single writev. */
+  static const int kMaxIov = 16;
+
+  /** Maximum amount of output kept in memory per build before the oldest
+   * chunks are spilled to the temp file. */
+  static const std::size_t kMaxBufferedBytes = 4 << 20;
+
+  /** A client that made no progress for this long while data is pending is
+   * evicted, so it cannot pin a build's output. */
+  static const int kSlowClientTimeoutMs = 30000;
+
+  /** How long after connecting a client may still announce the binary
+   * framing. Binary clients send the magic immediately, so this is only
+   * the delay before a legacy client starts receiving json. */
+  static const int kHandshakeTimeoutMs = 100;
+
+  /* Pool the output chunks are drawn from. Slabs are recycled when a build
+   * is removed, so the server does not reallocate (or worse, grow and copy
+   * one contiguous buffer) for every build. */
+  BufferPool pool_;
+
   std::atomic_bool stopped_;
 };
 
@@ -0,0 +1,269 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sys/stat.h>
+#include <unordered_set>
+
+#include "test.h"
+#include "cache_fs.h"
+
+/* Base class: gives each test a fresh cache directory and a workspace for
+ * the files written into and restored from it. The sizes below are chosen
+ * around the packing threshold (16K): "small" entries land in the packfile,
+ * "large" ones get their own file. */
+class CacheFSTest : public falcon::Test {
+public:
+  CacheFSTest(std::string const& comment)
+    : falcon::Test(comment, "no error")
+  {}
+
+  void prepareTest() {
+    char tmpl[] = "/tmp/falcon-cache-XXXXXX";
+    dir_ = mkdtemp(tmpl);
+    cacheDir_ = dir_ + "/cache";
+    mkdir(cacheDir_.c_str(), 0755);
+  }
+  void closeTest() {
+    if (!dir_.empty()) {
+      std::string cmd = "rm -r '" + dir_ + "'";
+      if (system(cmd.c_str()) != 0) {
+        std::cerr << "could not remove " << dir_ << std::endl;
+      }
+    }
+  }
+
+protected:
+  static const std::size_t kSmallSize = 15000;
+  static const std::size_t kLargeSize = 20000;
+
+  /* Deterministic per-seed content so restores can be verified. */
+  static std::string makeContent(char seed, std::size_t size) {
+    std::string content(size, '\0');
+    for (std::size_t i = 0; i < size; ++i) {
+      content[i] = static_cast<char>(seed + i % 200);
+    }
+    return content;
+  }
+
+  std::string writeFile(std::string const& name, std::string const& content) {
+    std::string path = dir_ + "/" + name;
+    std::ofstream ofs(path, std::ios::out | std::ios::binary);
+    ofs.write(content.data(), content.size());
+    return path;
+  }
+
+  std::string readFile(std::string const& path) {
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(ifs),
+                       std::istreambuf_iterator<char>());
+  }
+
+  std::string dir_;
+  std::string cacheDir_;
+};
+
+const std::size_t CacheFSTest::kSmallSize;
+const std::size_t CacheFSTest::kLargeSize;
+
+/* Store and restore entries on both storage paths: a small entry goes to
+ * the packfile, a large one to its own file. */
+class CacheRoundTripTest : public CacheFSTest {
+public:
+  CacheRoundTripTest()
+    : CacheFSTest("CacheFS: write/read round trip, packed and plain")
+  {}
+
+  void runTest() {
+    falcon::CacheFS cache(cacheDir_);
+    std::string small = makeContent('s', kSmallSize);
+    std::string large = makeContent('l', kLargeSize);
+    std::string buffered = makeContent('b', 100);
+
+    if (!cache.writeEntry("small", writeFile("small", small))
+        || !cache.writeEntry("large", writeFile("large", large))
+        || !cache.writeEntryBuffer("buffered", buffered)) {
+      setSuccess(false);
+      setErrorMessage("writeEntry failed");
+      return;
+    }
+    if (!cache.hasEntry("small") || !cache.hasEntry("large")
+        || !cache.hasEntry("buffered") || cache.hasEntry("absent")) {
+      setSuccess(false);
+      setErrorMessage("hasEntry disagrees with what was written");
+      return;
+    }
+
+    if (!cache.readEntry("small", dir_ + "/small.out")
+        || !cache.readEntry("large", dir_ + "/large.out")
+        || !cache.readEntry("buffered", dir_ + "/buffered.out")) {
+      setSuccess(false);
+      setErrorMessage("readEntry failed");
+      return;
+    }
+    if (readFile(dir_ + "/small.out") != small
+        || readFile(dir_ + "/large.out") != large
+        || readFile(dir_ + "/buffered.out") != buffered) {
+      setSuccess(false);
+      setErrorMessage("restored content differs from what was stored");
+      return;
+    }
+
+    if (!cache.delEntry("small") || cache.hasEntry("small")
+        || cache.readEntry("small", dir_ + "/gone")) {
+      setSuccess(false);
+      setErrorMessage("delEntry did not remove the entry");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* The index survives a daemon restart: a fresh CacheFS over the same
+ * directory must serve the same entries, packed ones included. */
+class CacheReloadTest : public CacheFSTest {
+public:
+  CacheReloadTest()
+    : CacheFSTest("CacheFS: entries survive an index reload")
+  {}
+
+  void runTest() {
+    std::string small = makeContent('s', kSmallSize);
+    std::string large = makeContent('l', kLargeSize);
+    {
+      falcon::CacheFS cache(cacheDir_);
+      cache.writeEntry("small", writeFile("small", small));
+      cache.writeEntry("large", writeFile("large", large));
+      cache.saveIndex();
+    }
+
+    falcon::CacheFS reloaded(cacheDir_);
+    if (!reloaded.hasEntry("small") || !reloaded.hasEntry("large")) {
+      setSuccess(false);
+      setErrorMessage("entries disappeared across the reload");
+      return;
+    }
+    if (!reloaded.readEntry("small", dir_ + "/small.out")
+        || !reloaded.readEntry("large", dir_ + "/large.out")
+        || readFile(dir_ + "/small.out") != small
+        || readFile(dir_ + "/large.out") != large) {
+      setSuccess(false);
+      setErrorMessage("restored content differs after the reload");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* Eviction: preferred entries are kept as long as evicting the others is
+ * enough, and a zero budget clears everything. */
+class CacheTrimTest : public CacheFSTest {
+public:
+  CacheTrimTest()
+    : CacheFSTest("CacheFS: trimToBudget spares the preferred set")
+  {}
+
+  void runTest() {
+    falcon::CacheFS cache(cacheDir_);
+    for (int i = 0; i < 4; ++i) {
+      std::string name = "entry" + std::to_string(i);
+      cache.writeEntry(name,
+                       writeFile(name, makeContent('a' + i, kSmallSize)));
+    }
+
+    std::unordered_set<std::string> preferred;
+    preferred.insert("entry2");
+    cache.trimToBudget(kSmallSize, preferred);
+    if (!cache.hasEntry("entry2")) {
+      setSuccess(false);
+      setErrorMessage("a preferred entry was evicted needlessly");
+      return;
+    }
+    if (cache.hasEntry("entry0") && cache.hasEntry("entry1")
+        && cache.hasEntry("entry3")) {
+      setSuccess(false);
+      setErrorMessage("nothing was evicted over budget");
+      return;
+    }
+
+    cache.trimToBudget(0, preferred);
+    if (cache.hasEntry("entry2")) {
+      setSuccess(false);
+      setErrorMessage("a zero budget must evict the preferred set too");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* Packfile compaction: once enough dead bytes accumulate, compactPack
+ * rewrites the pack and the surviving entries must still restore. */
+class CacheCompactTest : public CacheFSTest {
+public:
+  CacheCompactTest()
+    : CacheFSTest("CacheFS: compactPack keeps live entries readable")
+  {}
+
+  void runTest() {
+    falcon::CacheFS cache(cacheDir_);
+    /* 80 packed entries of ~15K: deleting 75 leaves over 1MiB of dead
+     * bytes, enough to cross the compaction threshold. */
+    for (int i = 0; i < 80; ++i) {
+      std::string name = "entry" + std::to_string(i);
+      cache.writeEntry(name,
+                       writeFile(name, makeContent('a' + i % 20, kSmallSize)));
+    }
+    for (int i = 0; i < 75; ++i) {
+      cache.delEntry("entry" + std::to_string(i));
+    }
+
+    cache.compactPack();
+
+    for (int i = 75; i < 80; ++i) {
+      std::string name = "entry" + std::to_string(i);
+      if (!cache.hasEntry(name)
+          || !cache.readEntry(name, dir_ + "/" + name + ".out")
+          || readFile(dir_ + "/" + name + ".out")
+             != makeContent('a' + i % 20, kSmallSize)) {
+        setSuccess(false);
+        setErrorMessage("a live entry was lost by the compaction");
+        return;
+      }
+    }
+    setSuccess(true);
+  }
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Cache filesystem test suite");
+
+  tests.add(new CacheRoundTripTest());
+  tests.add(new CacheReloadTest());
+  tests.add(new CacheTrimTest());
+  tests.add(new CacheCompactTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,205 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "test.h"
+#include "depfile.h"
+#include "graph.h"
+#include "graphparser.h"
+
+/* Base class: builds a one-rule graph (in.c -> out.o, with a depfile) in a
+ * temporary directory. The staged depfiles are parsed from files written
+ * there; no file watcher is involved (integrate accepts null). */
+class DepfileTest : public falcon::Test {
+public:
+  DepfileTest(std::string const& comment)
+    : falcon::Test(comment, "no error")
+  {}
+
+  void prepareTest() {
+    char tmpl[] = "/tmp/falcon-depfile-XXXXXX";
+    dir_ = mkdtemp(tmpl);
+  }
+  void closeTest() {
+    if (!dir_.empty()) {
+      std::string cmd = "rm -r '" + dir_ + "'";
+      if (system(cmd.c_str()) != 0) {
+        std::cerr << "could not remove " << dir_ << std::endl;
+      }
+    }
+  }
+
+protected:
+  std::unique_ptr<falcon::Graph> parseGraph() {
+    std::string path = dir_ + "/graph.json";
+    {
+      std::ofstream ofs(path);
+      ofs << "{\"rules\":[{\"inputs\":[\"in.c\"],\"outputs\":[\"out.o\"],"
+             "\"cmd\":\"cc -c in.c -o out.o\",\"depfile\":\"out.o.d\"}]}";
+    }
+    falcon::GraphParser parser(path);
+    parser.processFile();
+    return parser.getGraph();
+  }
+
+  std::string writeDepfile(std::string const& content) {
+    std::string path = dir_ + "/out.o.d";
+    std::ofstream ofs(path);
+    ofs << content;
+    return path;
+  }
+
+  std::string dir_;
+};
+
+/* Parsing a depfile and integrating it must add the discovered headers as
+ * implicit inputs of the rule and as source nodes of the graph. */
+class DepfileIntegrateTest : public DepfileTest {
+public:
+  DepfileIntegrateTest()
+    : DepfileTest("Depfile: staged parse and integrate")
+  {}
+
+  void runTest() {
+    auto g = parseGraph();
+    falcon::Rule* rule = g->getRules()[0];
+    std::string path = writeDepfile("out.o: in.c hdr.h\n");
+
+    falcon::Depfile::Staged staged;
+    if (staged.parse(path, true) != falcon::Depfile::Res::SUCCESS) {
+      setSuccess(false);
+      setErrorMessage("parse failed");
+      return;
+    }
+    if (!staged.integrate(rule, nullptr, *g, true)) {
+      setSuccess(false);
+      setErrorMessage("integrate failed");
+      return;
+    }
+
+    if (rule->getNumImplicitInputs() != 1
+        || rule->getInputs().back()->getPath() != "hdr.h") {
+      setSuccess(false);
+      setErrorMessage("hdr.h was not added as an implicit input");
+      return;
+    }
+    falcon::Node* header = rule->getInputs().back();
+    if (!header->isSource() || !header->hasParent(rule)) {
+      setSuccess(false);
+      setErrorMessage("hdr.h was not wired as a source of the rule");
+      return;
+    }
+    if (g->getNodes().find(header->getPathId()) == g->getNodes().end()) {
+      setSuccess(false);
+      setErrorMessage("hdr.h was not registered in the graph");
+      return;
+    }
+
+    /* Integrating the same depfile again must not duplicate the input. */
+    falcon::Depfile::Staged again;
+    if (again.parse(path, true) != falcon::Depfile::Res::SUCCESS
+        || !again.integrate(rule, nullptr, *g, true)
+        || rule->getNumImplicitInputs() != 1) {
+      setSuccess(false);
+      setErrorMessage("re-integrating the depfile duplicated the input");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* With keepContent, the staged depfile keeps the pristine bytes: the parse
+ * de-escapes its own buffer in place, this is what the cache persists. */
+class DepfileKeepContentTest : public DepfileTest {
+public:
+  DepfileKeepContentTest()
+    : DepfileTest("Depfile: keepContent keeps the pristine bytes")
+  {}
+
+  void runTest() {
+    parseGraph(); /* For the side effect of creating the directory only. */
+    std::string content = "out.o: in.c \\\n  hdr.h\n";
+    std::string path = writeDepfile(content);
+
+    falcon::Depfile::Staged staged;
+    if (staged.parse(path, true, true) != falcon::Depfile::Res::SUCCESS) {
+      setSuccess(false);
+      setErrorMessage("parse failed");
+      return;
+    }
+    setSuccess(staged.content() == content);
+    if (!success()) {
+      setErrorMessage("content() does not match the bytes on disk");
+    }
+  }
+};
+
+/* Error paths: a missing file and a depfile naming the wrong target. */
+class DepfileErrorTest : public DepfileTest {
+public:
+  DepfileErrorTest()
+    : DepfileTest("Depfile: missing file and wrong target")
+  {}
+
+  void runTest() {
+    auto g = parseGraph();
+    falcon::Rule* rule = g->getRules()[0];
+
+    falcon::Depfile::Staged missing;
+    if (missing.parse(dir_ + "/nonexistent.d", false)
+        != falcon::Depfile::Res::ERROR_CANNOT_OPEN) {
+      setSuccess(false);
+      setErrorMessage("a missing depfile did not report ERROR_CANNOT_OPEN");
+      return;
+    }
+
+    /* The depfile target must be the first output of the rule. */
+    std::string path = writeDepfile("other.o: hdr.h\n");
+    falcon::Depfile::Staged wrongTarget;
+    if (wrongTarget.parse(path, true) != falcon::Depfile::Res::SUCCESS) {
+      setSuccess(false);
+      setErrorMessage("parse failed");
+      return;
+    }
+    if (wrongTarget.integrate(rule, nullptr, *g, false)) {
+      setSuccess(false);
+      setErrorMessage("a depfile for another target was integrated");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Depfile test suite");
+
+  tests.add(new DepfileIntegrateTest());
+  tests.add(new DepfileKeepContentTest());
+  tests.add(new DepfileErrorTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "test.h"
+#include "exceptions.h"
+#include "graph.h"
+#include "graphparser.h"
+
+/* Base class for the topological order tests: writes graph files in a
+ * temporary directory and parses them. The path table is a process-wide
+ * singleton, so the nodes of successive parses share their path ids: this
+ * is exactly the reload situation GraphTopoOrder is built for. */
+class TopoOrderTest : public falcon::Test {
+public:
+  TopoOrderTest(std::string const& comment)
+    : falcon::Test(comment, "no error")
+  {}
+
+  void prepareTest() {
+    char tmpl[] = "/tmp/falcon-cycle-XXXXXX";
+    dir_ = mkdtemp(tmpl);
+  }
+  void closeTest() {
+    if (!dir_.empty()) {
+      std::string cmd = "rm -r '" + dir_ + "'";
+      if (system(cmd.c_str()) != 0) {
+        std::cerr << "could not remove " << dir_ << std::endl;
+      }
+    }
+  }
+
+protected:
+  /* Write and parse a graph file holding the given rules array. */
+  std::unique_ptr<falcon::Graph> parse(std::string const& rules) {
+    std::string path = dir_ + "/graph.json";
+    {
+      std::ofstream ofs(path);
+      ofs << "{\"rules\":[" << rules << "]}";
+    }
+    falcon::GraphParser parser(path);
+    parser.processFile();
+    return parser.getGraph();
+  }
+
+  std::string dir_;
+};
+
+/* A validated graph must keep validating against its own order. */
+class TopoInitCheckTest : public TopoOrderTest {
+public:
+  TopoInitCheckTest()
+    : TopoOrderTest("GraphTopoOrder: init then check an acyclic graph")
+  {}
+
+  void runTest() {
+    auto g = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                   "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]}");
+    falcon::GraphTopoOrder order;
+    order.init(*g);
+    try {
+      order.check(*g);
+    } catch (falcon::Exception& e) {
+      setSuccess(false);
+      setErrorMessage("false cycle reported: " + e.getErrorMessage());
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* A reload that adds edges violating the maintained order (here a new
+ * producer in front of the chain, whose fresh node gets a maximal order)
+ * must trigger the region reordering of insertEdge and still validate,
+ * repeatedly. */
+class TopoInsertEdgeTest : public TopoOrderTest {
+public:
+  TopoInsertEdgeTest()
+    : TopoOrderTest("GraphTopoOrder: reordering on a violating edge")
+  {}
+
+  void runTest() {
+    auto g1 = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                    "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]}");
+    falcon::GraphTopoOrder order;
+    order.init(*g1);
+
+    /* "gen" is new to the order: it gets a maximal order, so its edge into
+     * the front of the chain violates the order of a, b and c and the
+     * whole chain is the forward region to reorder. */
+    auto g2 = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                    "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]},"
+                    "{\"inputs\":[\"gen\"],\"outputs\":[\"a\"]}");
+    try {
+      order.check(*g2);
+      /* The updated order must now accept the same graph as is. */
+      order.check(*g2);
+      /* And survive one more front extension, reusing the updated
+       * orders. */
+      auto g3 = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                      "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]},"
+                      "{\"inputs\":[\"gen\"],\"outputs\":[\"a\"]},"
+                      "{\"inputs\":[\"gen2\"],\"outputs\":[\"gen\"]}");
+      order.check(*g3);
+    } catch (falcon::Exception& e) {
+      setSuccess(false);
+      setErrorMessage("false cycle reported: " + e.getErrorMessage());
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* An edge that closes a cycle must be reported, by the full traversal and
+ * by the incremental check alike. */
+class TopoCycleTest : public TopoOrderTest {
+public:
+  TopoCycleTest()
+    : TopoOrderTest("GraphTopoOrder: a cycle is reported")
+  {}
+
+  void runTest() {
+    auto g1 = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                    "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]}");
+    falcon::GraphTopoOrder order;
+    order.init(*g1);
+
+    /* a -> b -> c -> a, plus c -> d so the cycle stays reachable from a
+     * root (checkGraphLoop walks the graph from its roots). */
+    auto g2 = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                    "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]},"
+                    "{\"inputs\":[\"c\"],\"outputs\":[\"a\"]},"
+                    "{\"inputs\":[\"c\"],\"outputs\":[\"d\"]}");
+    bool caught = false;
+    try {
+      order.check(*g2);
+    } catch (falcon::Exception&) {
+      caught = true;
+    }
+    if (!caught) {
+      setSuccess(false);
+      setErrorMessage("the incremental check missed the cycle");
+      return;
+    }
+
+    caught = false;
+    try {
+      falcon::checkGraphLoop(*g2);
+    } catch (falcon::Exception&) {
+      caught = true;
+    }
+    if (!caught) {
+      setSuccess(false);
+      setErrorMessage("checkGraphLoop missed the cycle");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* After a rejected reload the order is stale; re-initializing it from a
+ * known acyclic graph must bring it back to a working state. */
+class TopoRecoverTest : public TopoOrderTest {
+public:
+  TopoRecoverTest()
+    : TopoOrderTest("GraphTopoOrder: re-init after a rejected graph")
+  {}
+
+  void runTest() {
+    auto good = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                      "{\"inputs\":[\"b\"],\"outputs\":[\"c\"]}");
+    falcon::GraphTopoOrder order;
+    order.init(*good);
+
+    auto bad = parse("{\"inputs\":[\"a\"],\"outputs\":[\"b\"]},"
+                     "{\"inputs\":[\"b\"],\"outputs\":[\"a\"]}");
+    try {
+      order.check(*bad);
+      setSuccess(false);
+      setErrorMessage("the cycle was not reported");
+      return;
+    } catch (falcon::Exception&) {
+      /* Expected; the order is now stale. */
+    }
+
+    order.init(*good);
+    try {
+      order.check(*good);
+    } catch (falcon::Exception& e) {
+      setSuccess(false);
+      setErrorMessage("check failed after re-init: " + e.getErrorMessage());
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Graph cycle detection test suite");
+
+  tests.add(new TopoInitCheckTest());
+  tests.add(new TopoInsertEdgeTest());
+  tests.add(new TopoCycleTest());
+  tests.add(new TopoRecoverTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
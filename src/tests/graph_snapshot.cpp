@@ -0,0 +1,246 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+
+#include "test.h"
+#include "graph.h"
+#include "graph_snapshot.h"
+#include "graphparser.h"
+
+/* Base class: builds a small graph from a JSON file in a temporary
+ * directory and saves/loads snapshots of it. */
+class SnapshotTest : public falcon::Test {
+public:
+  SnapshotTest(std::string const& comment)
+    : falcon::Test(comment, "no error")
+  {}
+
+  void prepareTest() {
+    char tmpl[] = "/tmp/falcon-snapshot-XXXXXX";
+    dir_ = mkdtemp(tmpl);
+  }
+  void closeTest() {
+    if (!dir_.empty()) {
+      std::string cmd = "rm -r '" + dir_ + "'";
+      if (system(cmd.c_str()) != 0) {
+        std::cerr << "could not remove " << dir_ << std::endl;
+      }
+    }
+  }
+
+protected:
+  std::unique_ptr<falcon::Graph> parseGraph() {
+    std::string path = dir_ + "/graph.json";
+    {
+      std::ofstream ofs(path);
+      ofs << "{\"rules\":["
+             "{\"inputs\":[\"in.c\"],\"outputs\":[\"out.o\"],"
+             "\"cmd\":\"cc -c in.c -o out.o\",\"depfile\":\"out.o.d\","
+             "\"weight\":2},"
+             "{\"inputs\":[\"out.o\"],\"outputs\":[\"prog\"],"
+             "\"cmd\":\"cc out.o -o prog\"}"
+             "]}";
+    }
+    falcon::GraphParser parser(path);
+    parser.processFile();
+    return parser.getGraph();
+  }
+
+  static falcon::HashDigest makeDigest(std::uint8_t seed) {
+    falcon::HashDigest digest;
+    for (std::size_t i = 0; i < falcon::HashDigest::kLength; ++i) {
+      digest.data()[i] = static_cast<std::uint8_t>(seed + i);
+    }
+    return digest;
+  }
+
+  static falcon::Node* findNode(falcon::Graph& g, std::string const& path) {
+    auto& nodes = g.getNodes();
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+      if (it->second->getPath() == path) {
+        return it->second;
+      }
+    }
+    return nullptr;
+  }
+
+  std::string dir_;
+};
+
+/* Saving a graph and loading it back must reproduce its shape, the rule
+ * attributes and the dirty states. */
+class SnapshotRoundTripTest : public SnapshotTest {
+public:
+  SnapshotRoundTripTest()
+    : SnapshotTest("GraphSnapshot: save/load round trip")
+  {}
+
+  void runTest() {
+    auto g = parseGraph();
+    /* Dirty one source so the states are not all identical. */
+    findNode(*g, "in.c")->markDirty();
+
+    std::string file = dir_ + "/snapshot";
+    falcon::HashDigest digest = makeDigest(1);
+    if (!falcon::GraphSnapshot::save(file, *g, digest)) {
+      setSuccess(false);
+      setErrorMessage("save failed");
+      return;
+    }
+
+    auto loaded = falcon::GraphSnapshot::load(file, digest);
+    if (!loaded) {
+      setSuccess(false);
+      setErrorMessage("load returned nullptr for a matching snapshot");
+      return;
+    }
+    if (loaded->getNodes().size() != g->getNodes().size()
+        || loaded->getRules().size() != g->getRules().size()) {
+      setSuccess(false);
+      setErrorMessage("node or rule count differs after the round trip");
+      return;
+    }
+    falcon::Rule* compile = loaded->getRules()[0];
+    if (compile->getCommand() != "cc -c in.c -o out.o"
+        || compile->getDepfile() != "out.o.d"
+        || compile->getWeight() != 2) {
+      setSuccess(false);
+      setErrorMessage("rule attributes differ after the round trip");
+      return;
+    }
+    if (compile->getInputs()[0]->getPath() != "in.c"
+        || compile->getOutputs()[0]->getPath() != "out.o") {
+      setSuccess(false);
+      setErrorMessage("rule edges differ after the round trip");
+      return;
+    }
+    falcon::Node* source = findNode(*loaded, "in.c");
+    falcon::Node* binary = findNode(*loaded, "prog");
+    if (source == nullptr || !source->isDirty()
+        || binary == nullptr || !binary->isDirty()) {
+      setSuccess(false);
+      setErrorMessage("dirty states were not preserved");
+      return;
+    }
+    if (loaded->getDirtyRules().size() != g->getDirtyRules().size()) {
+      setSuccess(false);
+      setErrorMessage("the dirty rule set was not rebuilt");
+      return;
+    }
+    if (loaded->getDirtyNodes().size() != g->getDirtyNodes().size()
+        || loaded->getDirtyNodes().count(source) == 0
+        || loaded->getDirtyNodes().count(binary) == 0) {
+      setSuccess(false);
+      setErrorMessage("the dirty node set was not rebuilt");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+/* A snapshot taken from another graph file version must be rejected: the
+ * caller then falls back to the JSON parser. */
+class SnapshotHashMismatchTest : public SnapshotTest {
+public:
+  SnapshotHashMismatchTest()
+    : SnapshotTest("GraphSnapshot: graph file hash mismatch is rejected")
+  {}
+
+  void runTest() {
+    auto g = parseGraph();
+    std::string file = dir_ + "/snapshot";
+    if (!falcon::GraphSnapshot::save(file, *g, makeDigest(1))) {
+      setSuccess(false);
+      setErrorMessage("save failed");
+      return;
+    }
+    setSuccess(falcon::GraphSnapshot::load(file, makeDigest(2)) == nullptr);
+    if (!success()) {
+      setErrorMessage("a stale snapshot was accepted");
+    }
+  }
+};
+
+/* Truncated or garbage files must make load return nullptr, never a
+ * partial graph. */
+class SnapshotCorruptionTest : public SnapshotTest {
+public:
+  SnapshotCorruptionTest()
+    : SnapshotTest("GraphSnapshot: corrupted snapshots are rejected")
+  {}
+
+  void runTest() {
+    auto g = parseGraph();
+    std::string file = dir_ + "/snapshot";
+    falcon::HashDigest digest = makeDigest(1);
+    if (!falcon::GraphSnapshot::save(file, *g, digest)) {
+      setSuccess(false);
+      setErrorMessage("save failed");
+      return;
+    }
+
+    /* Truncate to 60% of the file. */
+    std::string data;
+    {
+      std::ifstream ifs(file, std::ios::in | std::ios::binary);
+      data.assign(std::istreambuf_iterator<char>(ifs),
+                  std::istreambuf_iterator<char>());
+    }
+    std::string truncated = dir_ + "/truncated";
+    {
+      std::ofstream ofs(truncated, std::ios::out | std::ios::binary);
+      ofs.write(data.data(), data.size() * 6 / 10);
+    }
+    if (falcon::GraphSnapshot::load(truncated, digest) != nullptr) {
+      setSuccess(false);
+      setErrorMessage("a truncated snapshot was accepted");
+      return;
+    }
+
+    std::string garbage = dir_ + "/garbage";
+    {
+      std::ofstream ofs(garbage, std::ios::out | std::ios::binary);
+      ofs << "this is not a snapshot";
+    }
+    if (falcon::GraphSnapshot::load(garbage, digest) != nullptr) {
+      setSuccess(false);
+      setErrorMessage("a garbage file was accepted");
+      return;
+    }
+    setSuccess(true);
+  }
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Graph snapshot test suite");
+
+  tests.add(new SnapshotRoundTripTest());
+  tests.add(new SnapshotHashMismatchTest());
+  tests.add(new SnapshotCorruptionTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "test.h"
+#include "util/mpmc_queue.h"
+
+/* Single-threaded contract: FIFO order, tryPush fails when full, tryPop
+ * fails when empty, and the capacity is rounded up to a power of two. */
+class QueueFifoTest : public falcon::Test {
+public:
+  QueueFifoTest()
+    : falcon::Test("MpmcQueue: fifo order and capacity", "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    /* Capacity 5 rounds up to 8. */
+    falcon::MpmcQueue<int> queue(5);
+
+    int value;
+    if (queue.tryPop(&value)) {
+      setSuccess(false);
+      setErrorMessage("tryPop succeeded on an empty queue");
+      return;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+      if (!queue.tryPush(i)) {
+        setSuccess(false);
+        setErrorMessage("tryPush failed below the rounded-up capacity");
+        return;
+      }
+    }
+    if (queue.tryPush(8)) {
+      setSuccess(false);
+      setErrorMessage("tryPush succeeded on a full queue");
+      return;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+      if (!queue.tryPop(&value) || value != i) {
+        setSuccess(false);
+        setErrorMessage("values did not come out in fifo order");
+        return;
+      }
+    }
+    if (queue.tryPop(&value)) {
+      setSuccess(false);
+      setErrorMessage("tryPop succeeded once the queue was drained");
+      return;
+    }
+
+    setSuccess(true);
+  }
+  void closeTest() {}
+};
+
+/* Hammer the queue from several producers and consumers and check that
+ * every value comes out exactly once, in order per producer. */
+class QueueConcurrentTest : public falcon::Test {
+public:
+  QueueConcurrentTest()
+    : falcon::Test("MpmcQueue: multi-producer multi-consumer", "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    static const int kProducers = 4;
+    static const int kConsumers = 4;
+    static const int kPerProducer = 20000;
+
+    falcon::MpmcQueue<int> queue(1024);
+    std::atomic<int> consumed(0);
+    /* Last value seen from each producer, per consumer: values of one
+     * producer must be consumed in the order they were pushed. */
+    std::vector<std::vector<int>> lastSeen(
+        kConsumers, std::vector<int>(kProducers, -1));
+    std::atomic<bool> outOfOrder(false);
+    std::vector<std::atomic<int>*> counts;
+    for (int p = 0; p < kProducers; ++p) {
+      counts.push_back(new std::atomic<int>(0));
+    }
+
+    auto producer = [&](int p) {
+      for (int i = 0; i < kPerProducer; ++i) {
+        while (!queue.tryPush(p * kPerProducer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    };
+    auto consumer = [&](int c) {
+      int value;
+      while (consumed.load(std::memory_order_acquire)
+             < kProducers * kPerProducer) {
+        if (!queue.tryPop(&value)) {
+          std::this_thread::yield();
+          continue;
+        }
+        int p = value / kPerProducer;
+        int i = value % kPerProducer;
+        if (i <= lastSeen[c][p]) {
+          outOfOrder = true;
+        }
+        lastSeen[c][p] = i;
+        counts[p]->fetch_add(1, std::memory_order_relaxed);
+        consumed.fetch_add(1, std::memory_order_acq_rel);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int c = 0; c < kConsumers; ++c) {
+      threads.push_back(std::thread(consumer, c));
+    }
+    for (int p = 0; p < kProducers; ++p) {
+      threads.push_back(std::thread(producer, p));
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+      it->join();
+    }
+
+    bool countsOk = true;
+    for (int p = 0; p < kProducers; ++p) {
+      countsOk = countsOk && counts[p]->load() == kPerProducer;
+      delete counts[p];
+    }
+
+    if (outOfOrder) {
+      setSuccess(false);
+      setErrorMessage("a producer's values were consumed out of order");
+    } else if (!countsOk) {
+      setSuccess(false);
+      setErrorMessage("values were lost or duplicated");
+    } else {
+      setSuccess(true);
+    }
+  }
+  void closeTest() {}
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Mpmc queue test suite");
+
+  tests.add(new QueueFifoTest());
+  tests.add(new QueueConcurrentTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
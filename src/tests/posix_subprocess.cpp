@@ -21,7 +21,9 @@ public:
   {}
 
   void prepareTest() {
-    psp_ = new falcon::PosixSubProcess(cmd_, ".", 0, &consumer_);
+    /* Empty argv: these commands use shell redirections. */
+    psp_ = new falcon::PosixSubProcess(cmd_, std::vector<std::string>(),
+                                       ".", 0, &consumer_);
   }
   void runTest() {
     psp_->start();
@@ -0,0 +1,200 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include "test.h"
+#include "util/shared_mutex.h"
+
+/* The scheduling-dependent tests below use short sleeps to order the
+ * threads; the delays are generous enough for a loaded machine. */
+static void briefSleep() {
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+}
+
+/* Two readers must be able to hold the mutex at the same time. */
+class SharedReadersTest : public falcon::Test {
+public:
+  SharedReadersTest()
+    : falcon::Test("SharedMutex: concurrent readers", "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    falcon::SharedMutex mutex;
+    std::atomic<int> inside(0);
+    std::atomic<bool> overlapped(false);
+
+    auto reader = [&]() {
+      falcon::SharedLockGuard g(mutex);
+      if (++inside == 2) {
+        overlapped = true;
+      }
+      briefSleep();
+      --inside;
+    };
+    std::thread t1(reader);
+    std::thread t2(reader);
+    t1.join();
+    t2.join();
+
+    setSuccess(overlapped);
+    if (!overlapped) {
+      setErrorMessage("the two readers never held the mutex together");
+    }
+  }
+  void closeTest() {}
+};
+
+/* A reader must not get in while a writer holds the mutex. */
+class WriterExclusionTest : public falcon::Test {
+public:
+  WriterExclusionTest()
+    : falcon::Test("SharedMutex: writer excludes readers", "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    falcon::SharedMutex mutex;
+    std::atomic<bool> readerIn(false);
+
+    mutex.lock();
+    std::thread reader([&]() {
+      falcon::SharedLockGuard g(mutex);
+      readerIn = true;
+    });
+    briefSleep();
+    bool enteredWhileWriting = readerIn;
+    mutex.unlock();
+    reader.join();
+
+    if (enteredWhileWriting) {
+      setSuccess(false);
+      setErrorMessage("a reader got in while the writer held the mutex");
+    } else if (!readerIn) {
+      setSuccess(false);
+      setErrorMessage("the reader never got in after the writer released");
+    } else {
+      setSuccess(true);
+    }
+  }
+  void closeTest() {}
+};
+
+/* Once a writer is waiting, a new reader must queue up behind it: this is
+ * what keeps a stream of read-only queries from starving the builder. */
+class WriterPreferenceTest : public falcon::Test {
+public:
+  WriterPreferenceTest()
+    : falcon::Test("SharedMutex: waiting writer blocks new readers",
+                   "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    falcon::SharedMutex mutex;
+    std::atomic<int> turn(0);
+    std::atomic<int> writerTurn(0);
+    std::atomic<int> readerTurn(0);
+
+    mutex.lock_shared();
+    std::thread writer([&]() {
+      mutex.lock();
+      writerTurn = ++turn;
+      mutex.unlock();
+    });
+    briefSleep(); /* Let the writer queue up. */
+    std::thread reader([&]() {
+      falcon::SharedLockGuard g(mutex);
+      readerTurn = ++turn;
+    });
+    briefSleep();
+    if (readerTurn != 0) {
+      setSuccess(false);
+      setErrorMessage("a new reader got in ahead of the waiting writer");
+      mutex.unlock_shared();
+      writer.join();
+      reader.join();
+      return;
+    }
+    mutex.unlock_shared();
+    writer.join();
+    reader.join();
+
+    setSuccess(writerTurn < readerTurn);
+    if (writerTurn >= readerTurn) {
+      setErrorMessage("the writer did not go before the queued reader");
+    }
+  }
+  void closeTest() {}
+};
+
+/* try_lock must fail while the mutex is held in either mode, and succeed
+ * when it is free. */
+class TryLockTest : public falcon::Test {
+public:
+  TryLockTest()
+    : falcon::Test("SharedMutex: try_lock", "no error")
+  {}
+
+  void prepareTest() {}
+  void runTest() {
+    falcon::SharedMutex mutex;
+
+    mutex.lock_shared();
+    if (mutex.try_lock()) {
+      setSuccess(false);
+      setErrorMessage("try_lock succeeded under a reader");
+      return;
+    }
+    mutex.unlock_shared();
+
+    if (!mutex.try_lock()) {
+      setSuccess(false);
+      setErrorMessage("try_lock failed on a free mutex");
+      return;
+    }
+    if (mutex.try_lock()) {
+      setSuccess(false);
+      setErrorMessage("try_lock succeeded twice");
+      return;
+    }
+    mutex.unlock();
+    setSuccess(true);
+  }
+  void closeTest() {}
+};
+
+int main(int const argc, char const* const argv[]) {
+  if (argc != 1 && argc != 2) {
+    std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+    return 1;
+  }
+
+  falcon::TestSuite tests("Shared mutex test suite");
+
+  tests.add(new SharedReadersTest());
+  tests.add(new WriterExclusionTest());
+  tests.add(new WriterPreferenceTest());
+  tests.add(new TryLockTest());
+  tests.run();
+
+  if (argc == 2) {
+    std::string option(argv[1]);
+    if (option.compare("--json") == 0) {
+      tests.printJsonOutput(std::cout);
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--json]" << std::endl;
+      return 1;
+    }
+  } else {
+    tests.printStandardOutput(std::cout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_UTIL_ARENA_H_
+# define FALCON_UTIL_ARENA_H_
+
+# include <cstddef>
+# include <cstdint>
+# include <memory>
+# include <new>
+# include <utility>
+# include <vector>
+
+namespace falcon {
+
+/**
+ * @class Arena
+ * @brief Simple bump allocator.
+ *
+ * Memory is carved out of large contiguous slabs. Individual objects can not
+ * be freed: the whole arena is released at once when it is destroyed. This
+ * makes allocation a pointer bump on the hot path, and keeps objects that are
+ * allocated together densely packed in memory.
+ *
+ * The arena only provides raw memory. It is the responsibility of the caller
+ * to run the destructors of the objects it has constructed (see
+ * Graph::~Graph).
+ */
+class Arena {
+ public:
+  explicit Arena(std::size_t slabSize = kDefaultSlabSize)
+    : slabSize_(slabSize)
+    , ptr_(nullptr)
+    , end_(nullptr) { }
+
+  /** Allocate size bytes with the given alignment. */
+  void* allocate(std::size_t size, std::size_t alignment) {
+    std::size_t misalign = reinterpret_cast<std::uintptr_t>(ptr_) & (alignment - 1);
+    std::size_t padding = misalign == 0 ? 0 : alignment - misalign;
+    if (ptr_ == nullptr
+        || size + padding > static_cast<std::size_t>(end_ - ptr_)) {
+      newSlab(size > slabSize_ ? size : slabSize_);
+      padding = 0;
+    }
+    char* r = ptr_ + padding;
+    ptr_ = r + size;
+    return r;
+  }
+
+  /** Allocate and construct an object of type T. */
+  template <typename T, typename... Args>
+  T* make(Args&&... args) {
+    void* mem = allocate(sizeof(T), alignof(T));
+    return new (mem) T(std::forward<Args>(args)...);
+  }
+
+ private:
+  static const std::size_t kDefaultSlabSize = 1 << 20;
+
+  void newSlab(std::size_t size) {
+    slabs_.push_back(std::unique_ptr<char[]>(new char[size]));
+    ptr_ = slabs_.back().get();
+    end_ = ptr_ + size;
+  }
+
+  std::size_t slabSize_;
+  char* ptr_;
+  char* end_;
+  std::vector<std::unique_ptr<char[]>> slabs_;
+
+  Arena(const Arena& other) = delete;
+  Arena& operator=(const Arena&) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_UTIL_ARENA_H_
@@ -0,0 +1,157 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+
+#include "util/async_log.h"
+
+namespace falcon {
+
+const std::size_t AsyncLogger::Ring::kSlots;
+const int AsyncLogger::kFlushIntervalMs;
+
+std::atomic<AsyncLogger*> AsyncLogger::instance_(nullptr);
+
+thread_local AsyncLogger::Ring* AsyncLogger::tRing_ = nullptr;
+thread_local unsigned int AsyncLogger::tThreadId_ = 0;
+
+void AsyncLogger::start(const std::string& path, Level minLevel) {
+  assert(instance_.load(std::memory_order_acquire) == nullptr);
+  AsyncLogger* logger = new AsyncLogger(path, minLevel);
+  instance_.store(logger, std::memory_order_release);
+}
+
+void AsyncLogger::stop() {
+  AsyncLogger* logger = instance_.load(std::memory_order_acquire);
+  if (logger == nullptr) {
+    return;
+  }
+  /* Unpublish first, so racing call sites fall back to glog instead of
+   * writing records nobody will drain. */
+  instance_.store(nullptr, std::memory_order_release);
+  delete logger;
+}
+
+AsyncLogger::AsyncLogger(const std::string& path, Level minLevel)
+    : out_(stderr), ownsOut_(false), minLevel_(minLevel), stop_(false) {
+  if (!path.empty()) {
+    FILE* f = fopen(path.c_str(), "a");
+    if (f != nullptr) {
+      out_ = f;
+      ownsOut_ = true;
+    } else {
+      LOG(ERROR) << "cannot open " << path
+                 << " for async logging, using stderr";
+    }
+  }
+  thread_ = std::thread(std::bind(&AsyncLogger::flushThread, this));
+}
+
+AsyncLogger::~AsyncLogger() {
+  stop_.store(true, std::memory_order_release);
+  thread_.join();
+  /* The flusher drained everything on its way out. */
+  if (ownsOut_) {
+    fclose(out_);
+  }
+}
+
+AsyncLogger::Ring* AsyncLogger::threadRing() {
+  if (tRing_ == nullptr) {
+    std::lock_guard<std::mutex> g(mutex_);
+    rings_.emplace_back(new Ring());
+    tRing_ = rings_.back().get();
+    tThreadId_ = static_cast<unsigned int>(rings_.size());
+  }
+  return tRing_;
+}
+
+void AsyncLogger::log(Level level, const char* fmt, ...) {
+  if (level < minLevel_) {
+    return;
+  }
+
+  Ring* ring = threadRing();
+  std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+  if (head - ring->tail.load(std::memory_order_acquire) >= Ring::kSlots) {
+    /* Full: shed the record rather than wait for the flusher. */
+    ring->dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  Record& record = ring->slots[head & (Ring::kSlots - 1)];
+  record.level = level;
+  record.timeNs = static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch()).count());
+  record.tid = tThreadId_;
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(record.message, sizeof(record.message), fmt, ap);
+  va_end(ap);
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void AsyncLogger::flushThread() {
+  while (!stop_.load(std::memory_order_acquire)) {
+    drainRings();
+    fflush(out_);
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(kFlushIntervalMs));
+  }
+  /* Final drain, so records written before stop() are not lost. */
+  drainRings();
+  fflush(out_);
+}
+
+void AsyncLogger::drainRings() {
+  static const char kLevelLetter[] = { 'D', 'I', 'W', 'E' };
+
+  std::lock_guard<std::mutex> g(mutex_);
+  for (std::size_t i = 0; i < rings_.size(); ++i) {
+    Ring* ring = rings_[i].get();
+
+    std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    std::uint64_t head = ring->head.load(std::memory_order_acquire);
+    for (; tail != head; ++tail) {
+      Record const& record = ring->slots[tail & (Ring::kSlots - 1)];
+
+      /* Stamp in glog's style: Lmmdd hh:mm:ss.uuuuuu tid] message. */
+      time_t seconds = static_cast<time_t>(record.timeNs / 1000000000ULL);
+      unsigned int micros =
+          static_cast<unsigned int>(record.timeNs % 1000000000ULL) / 1000;
+      struct tm tm;
+      localtime_r(&seconds, &tm);
+      fprintf(out_, "%c%02d%02d %02d:%02d:%02d.%06u %5u] %s\n",
+              kLevelLetter[record.level], tm.tm_mon + 1, tm.tm_mday,
+              tm.tm_hour, tm.tm_min, tm.tm_sec, micros, record.tid,
+              record.message);
+    }
+    ring->tail.store(tail, std::memory_order_release);
+
+    std::uint64_t dropped = ring->dropped.exchange(
+        0, std::memory_order_relaxed);
+    if (dropped != 0) {
+      fprintf(out_, "W async log ring %zu overflowed, %llu records dropped\n",
+              i + 1, static_cast<unsigned long long>(dropped));
+    }
+  }
+}
+
+std::string alogFormat(const char* fmt, ...) {
+  char buffer[232];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, ap);
+  va_end(ap);
+  return std::string(buffer);
+}
+
+} // namespace falcon
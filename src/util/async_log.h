@@ -0,0 +1,146 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef ASYNC_LOG_H_
+# define ASYNC_LOG_H_
+
+# include <atomic>
+# include <cstdarg>
+# include <cstdint>
+# include <memory>
+# include <mutex>
+# include <string>
+# include <thread>
+# include <vector>
+
+# include "logging.h"
+
+namespace falcon {
+
+/**
+ * Asynchronous logging sink for the builder's hot paths.
+ *
+ * glog's sinks are synchronous: every LOG call formats, takes glog's
+ * internal mutex and writes. On the completion path of a busy build the
+ * per-rule log lines serialize the dispatcher shards on that mutex. The
+ * AsyncLogger moves everything off the hot thread: a call site formats a
+ * fixed-size record into a lock-free single-producer ring owned by its
+ * thread, and a background thread drains the rings, stamps the records and
+ * writes them out. When a ring is full the record is dropped and counted
+ * instead of blocking the producer: under overload we shed log lines, not
+ * build throughput.
+ *
+ * Enabled by the "async-logging" option. Call sites use the ALOG/ADLOG
+ * macros below, which fall back to plain glog when the logger is not
+ * started (tests, CLI tools).
+ */
+class AsyncLogger {
+ public:
+  enum Level { kALogDEBUG = 0, kALogINFO, kALogWARNING, kALogERROR };
+
+  /** Start the background flusher, writing to the given file, or to stderr
+   * when the path is empty. Records below minLevel are dropped at the call
+   * site. */
+  static void start(const std::string& path, Level minLevel);
+
+  /** Drain every ring and join the flusher. Safe to call when not
+   * started. */
+  static void stop();
+
+  /** The running logger, or null when async logging is off. Lock free. */
+  static AsyncLogger* get() {
+    return instance_.load(std::memory_order_acquire);
+  }
+
+  /** Format a record into the calling thread's ring. Never blocks: the
+   * record is dropped (and counted) if the ring is full. */
+  void log(Level level, const char* fmt, ...)
+      __attribute__((format(printf, 3, 4)));
+
+ private:
+  /** One preformatted log line, stamped and written by the flusher. */
+  struct Record {
+    Level level;
+    /** Nanoseconds since the epoch, captured at the call site. */
+    std::uint64_t timeNs;
+    unsigned int tid;
+    char message[232];
+  };
+
+  /** Single-producer single-consumer ring: the owning thread writes, the
+   * flusher reads. Power-of-two sized so the indices wrap for free. */
+  struct Ring {
+    static const std::size_t kSlots = 1024;
+
+    Ring() : head(0), tail(0), dropped(0) {}
+
+    std::atomic<std::uint64_t> head;
+    std::atomic<std::uint64_t> tail;
+    /** Records shed because the ring was full, reported by the flusher. */
+    std::atomic<std::uint64_t> dropped;
+    Record slots[kSlots];
+  };
+
+  AsyncLogger(const std::string& path, Level minLevel);
+  ~AsyncLogger();
+
+  /** The calling thread's ring, registered on first use. */
+  Ring* threadRing();
+
+  /** Body of the flusher thread. */
+  void flushThread();
+
+  /** Drain every ring once. */
+  void drainRings();
+
+  FILE* out_;
+  bool ownsOut_;
+  Level minLevel_;
+
+  /* Ring registry. Only taken on thread registration and by the flusher's
+   * iteration, never on the log path. */
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+
+  std::thread thread_;
+  std::atomic<bool> stop_;
+
+  /** How long records wait for the flusher at most. */
+  static const int kFlushIntervalMs = 5;
+
+  static std::atomic<AsyncLogger*> instance_;
+
+  /** The calling thread's ring, cached after the first log call. */
+  static thread_local Ring* tRing_;
+  /** Dense thread id of the records, assigned with the ring. */
+  static thread_local unsigned int tThreadId_;
+};
+
+/** Slow-path formatter for the glog fallback of ALOG. */
+std::string alogFormat(const char* fmt, ...)
+    __attribute__((format(printf, 1, 2)));
+
+} // namespace falcon
+
+/** Log through the async sink when it is running, through glog otherwise.
+ * The format string and arguments are printf style. */
+# define ALOG(severity, ...)                                              \
+  do {                                                                    \
+    falcon::AsyncLogger* alogger__ = falcon::AsyncLogger::get();          \
+    if (alogger__ != nullptr) {                                           \
+      alogger__->log(falcon::AsyncLogger::kALog##severity, __VA_ARGS__);  \
+    } else {                                                              \
+      LOG(severity) << falcon::alogFormat(__VA_ARGS__);                   \
+    }                                                                     \
+  } while (0)
+
+/** Debug flavour, compiled out with NDEBUG like DLOG. */
+# ifdef NDEBUG
+#  define ADLOG(severity, ...) do { } while (0)
+# else
+#  define ADLOG(severity, ...) ALOG(severity, __VA_ARGS__)
+# endif
+
+#endif /* !ASYNC_LOG_H_ */
@@ -0,0 +1,44 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include <cstring>
+
+#include "buffer_pool.h"
+
+namespace falcon {
+
+std::size_t Buffer::append(const char* buf, std::size_t len) {
+  std::size_t n = len < room() ? len : room();
+  memcpy(data_.get() + size_, buf, n);
+  size_ += n;
+  return n;
+}
+
+BufferPtr BufferPool::get() {
+  Buffer* buffer = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      buffer = free_.back().release();
+      free_.pop_back();
+    }
+  }
+
+  if (buffer == nullptr) {
+    buffer = new Buffer(bufferCapacity_);
+  }
+
+  /* The deleter routes the slab back to the pool instead of freeing it. */
+  return BufferPtr(buffer, [this](Buffer* b) { put(b); });
+}
+
+void BufferPool::put(Buffer* buffer) {
+  buffer->clear();
+  std::lock_guard<std::mutex> lock(mutex_);
+  free_.push_back(std::unique_ptr<Buffer>(buffer));
+}
+
+}
@@ -0,0 +1,99 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef BUFFER_POOL_H_
+# define BUFFER_POOL_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace falcon {
+
+/**
+ * @class Buffer
+ * @brief fixed-capacity slab of memory handed out by a BufferPool.
+ *
+ * A buffer is filled with append and read back through data/size. It is
+ * shared by reference (see BufferPtr): several readers can hold on to the
+ * same slab while a writer keeps appending to it, as long as the readers
+ * only look at the first size() bytes they were told about.
+ */
+class Buffer {
+  public:
+    explicit Buffer(std::size_t capacity)
+      : data_(new char[capacity]), capacity_(capacity), size_(0) { }
+
+    char* data() { return data_.get(); }
+    const char* data() const { return data_.get(); }
+
+    std::size_t capacity() const { return capacity_; }
+
+    /** Number of bytes appended so far. */
+    std::size_t size() const { return size_; }
+
+    /** Number of bytes that can still be appended. */
+    std::size_t room() const { return capacity_ - size_; }
+
+    /**
+     * Append at most len bytes at the end of the buffer.
+     * @return Number of bytes actually appended, less than len if the
+     *         buffer is full.
+     */
+    std::size_t append(const char* buf, std::size_t len);
+
+    /** Forget the content so that the slab can be reused. */
+    void clear() { size_ = 0; }
+
+  private:
+    std::unique_ptr<char[]> data_;
+    std::size_t capacity_;
+    std::size_t size_;
+};
+
+/**
+ * A buffer is reference counted: it goes back to its pool when the last
+ * holder drops it.
+ */
+typedef std::shared_ptr<Buffer> BufferPtr;
+
+/**
+ * @class BufferPool
+ * @brief recycles fixed-size buffers instead of reallocating them.
+ *
+ * The pool hands out reference-counted buffers of a fixed capacity. When
+ * the last reference to a buffer is dropped, the slab is cleared and put
+ * back on the free list, so a steady stream of output reuses a handful of
+ * allocations instead of growing and copying one large contiguous buffer.
+ *
+ * get() is thread safe. The pool must outlive every buffer it handed out.
+ */
+class BufferPool {
+  public:
+    explicit BufferPool(std::size_t bufferCapacity)
+      : bufferCapacity_(bufferCapacity) { }
+
+    /**
+     * Get an empty buffer, recycling a free slab if there is one.
+     * @return Buffer of capacity bufferCapacity_.
+     */
+    BufferPtr get();
+
+  private:
+    /** Put a slab back on the free list. Called when the last reference to
+     * a buffer is dropped. */
+    void put(Buffer* buffer);
+
+    std::size_t bufferCapacity_;
+
+    std::mutex mutex_;
+    /** Slabs ready for reuse. */
+    std::vector<std::unique_ptr<Buffer>> free_;
+};
+
+}
+
+#endif /* ! BUFFER_POOL_H_ */
@@ -0,0 +1,145 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FLAT_SET_H_
+# define FLAT_SET_H_
+
+# include <algorithm>
+# include <atomic>
+# include <cstddef>
+# include <mutex>
+# include <vector>
+
+namespace falcon {
+
+/**
+ * @class FlatSet
+ * @brief Sorted-vector set with batched mutations.
+ *
+ * A std::set is a red-black tree: iterating it chases one pointer per
+ * element and each element carries three pointers and a color of overhead.
+ * The passes that consume the graph's root and source sets (dependency scan,
+ * reload, consistency checks) iterate them in full, so they pay the pointer
+ * chasing on every build. FlatSet stores the elements in a sorted vector
+ * instead: iteration is a sequential walk and membership is a binary search.
+ *
+ * Mutating a sorted vector in place would be quadratic for the parser, which
+ * inserts every node and then erases most of them again. Mutations are
+ * therefore appended to a log and folded into the sorted storage in one
+ * O(n + k log k) pass on the next read. The fold takes an internal lock, so
+ * concurrent readers are safe with each other, like they are on a std::set;
+ * mutating concurrently with a reader is not, also like a std::set.
+ */
+template <typename T, typename Compare = std::less<T>>
+class FlatSet {
+ public:
+  typedef typename std::vector<T>::const_iterator iterator;
+  typedef typename std::vector<T>::const_iterator const_iterator;
+
+  FlatSet() : dirty_(false) {}
+
+  void insert(const T& value) { append(value, false); }
+  void erase(const T& value) { append(value, true); }
+
+  void clear() {
+    data_.clear();
+    log_.clear();
+    dirty_.store(false, std::memory_order_release);
+  }
+
+  bool empty() const { consolidate(); return data_.empty(); }
+  std::size_t size() const { consolidate(); return data_.size(); }
+
+  const_iterator begin() const { consolidate(); return data_.begin(); }
+  const_iterator end() const { consolidate(); return data_.end(); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+
+  const_iterator find(const T& value) const {
+    consolidate();
+    auto it = std::lower_bound(data_.begin(), data_.end(), value, Compare());
+    if (it != data_.end() && !Compare()(value, *it)) {
+      return it;
+    }
+    return data_.end();
+  }
+
+ private:
+  /** One logged mutation. seq orders mutations to the same value. */
+  struct Op {
+    T value;
+    std::size_t seq;
+    bool isErase;
+  };
+
+  void append(const T& value, bool isErase) {
+    Op op = { value, log_.size(), isErase };
+    log_.push_back(op);
+    dirty_.store(true, std::memory_order_release);
+  }
+
+  /** Fold the mutation log into the sorted storage. The membership of a
+   * value only depends on the last mutation that named it: a value whose
+   * last mutation is an insert is present, independently of what the
+   * storage held before. */
+  void consolidate() const {
+    if (!dirty_.load(std::memory_order_acquire)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!dirty_.load(std::memory_order_acquire)) {
+      return;
+    }
+
+    /* Sort the log by value, most recent mutation first, and keep only that
+     * most recent mutation per value. */
+    std::sort(log_.begin(), log_.end(), [](Op const& lhs, Op const& rhs) {
+        Compare comp;
+        if (comp(lhs.value, rhs.value)) { return true; }
+        if (comp(rhs.value, lhs.value)) { return false; }
+        return lhs.seq > rhs.seq;
+      });
+    log_.erase(std::unique(log_.begin(), log_.end(),
+                           [](Op const& lhs, Op const& rhs) {
+        Compare comp;
+        return !comp(lhs.value, rhs.value) && !comp(rhs.value, lhs.value);
+      }), log_.end());
+
+    /* Merge the storage with the log: both are sorted by value. */
+    Compare comp;
+    std::vector<T> merged;
+    merged.reserve(data_.size() + log_.size());
+    auto it = data_.begin();
+    for (auto op = log_.begin(); op != log_.end(); ++op) {
+      for (; it != data_.end() && comp(*it, op->value); ++it) {
+        merged.push_back(*it);
+      }
+      if (it != data_.end() && !comp(op->value, *it)) {
+        ++it; /* The mutation overrides the stored value. */
+      }
+      if (!op->isErase) {
+        merged.push_back(op->value);
+      }
+    }
+    merged.insert(merged.end(), it, data_.end());
+
+    data_.swap(merged);
+    log_.clear();
+    dirty_.store(false, std::memory_order_release);
+  }
+
+  /* Mutated by consolidate() behind const accessors. */
+  mutable std::vector<T> data_;
+  mutable std::vector<Op> log_;
+  mutable std::atomic<bool> dirty_;
+  mutable std::mutex mutex_;
+
+  FlatSet(const FlatSet& other) = delete;
+  FlatSet& operator=(const FlatSet&) = delete;
+};
+
+} // namespace falcon
+
+#endif /* !FLAT_SET_H_ */
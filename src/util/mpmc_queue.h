@@ -0,0 +1,129 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_UTIL_MPMC_QUEUE_H_
+# define FALCON_UTIL_MPMC_QUEUE_H_
+
+# include <atomic>
+# include <cassert>
+# include <cstddef>
+# include <memory>
+
+namespace falcon {
+
+/**
+ * @class MpmcQueue
+ * @brief Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * The classic array-based design by Dmitry Vyukov: each cell carries a
+ * sequence number that tells producers and consumers whether the cell is
+ * free, full, or still being worked on by another thread. Push and pop are
+ * a single compare-and-swap on the position counter plus two relaxed/acquire
+ * stores, so threads never block each other.
+ *
+ * The capacity is fixed at construction (rounded up to a power of two).
+ * tryPush fails when the queue is full and tryPop when it is empty; the
+ * caller decides what to do then. T should be cheap to copy, typically a
+ * pointer.
+ */
+template <typename T>
+class MpmcQueue {
+ public:
+  explicit MpmcQueue(std::size_t capacity)
+    : mask_(roundUpPowerOfTwo(capacity) - 1)
+    , cells_(new Cell[mask_ + 1])
+    , enqueuePos_(0)
+    , dequeuePos_(0) {
+    for (std::size_t i = 0; i <= mask_; ++i) {
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /** Append a value. @return false if the queue is full. */
+  bool tryPush(T value) {
+    Cell* cell;
+    std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::intptr_t diff = static_cast<std::intptr_t>(seq)
+                         - static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        /* The cell is free: claim the position. */
+        if (enqueuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        /* The cell still holds a value that was not consumed: full. */
+        return false;
+      } else {
+        /* Another producer claimed this position, retry with the next. */
+        pos = enqueuePos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /** Remove the oldest value. @return false if the queue is empty. */
+  bool tryPop(T* value) {
+    Cell* cell;
+    std::size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+      std::intptr_t diff = static_cast<std::intptr_t>(seq)
+                         - static_cast<std::intptr_t>(pos + 1);
+      if (diff == 0) {
+        /* The cell holds a value: claim the position. */
+        if (dequeuePos_.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        /* The cell was not filled yet: empty. */
+        return false;
+      } else {
+        /* Another consumer claimed this position, retry with the next. */
+        pos = dequeuePos_.load(std::memory_order_relaxed);
+      }
+    }
+    *value = cell->value;
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  static std::size_t roundUpPowerOfTwo(std::size_t v) {
+    std::size_t r = 2;
+    while (r < v) {
+      r <<= 1;
+    }
+    return r;
+  }
+
+  const std::size_t mask_;
+  std::unique_ptr<Cell[]> cells_;
+
+  /* Producers and consumers work on separate counters so an enqueue never
+   * contends with a dequeue on the same cache line. */
+  std::atomic<std::size_t> enqueuePos_;
+  char pad_[64];
+  std::atomic<std::size_t> dequeuePos_;
+
+  MpmcQueue(const MpmcQueue& other) = delete;
+  MpmcQueue& operator=(const MpmcQueue&) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_UTIL_MPMC_QUEUE_H_
@@ -0,0 +1,120 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_UTIL_SHARED_MUTEX_H_
+# define FALCON_UTIL_SHARED_MUTEX_H_
+
+# include <cassert>
+# include <condition_variable>
+# include <mutex>
+
+namespace falcon {
+
+/**
+ * @class SharedMutex
+ * @brief Reader/writer mutex.
+ *
+ * Any number of readers can hold the mutex in shared mode at the same time;
+ * a writer holds it exclusively. Writers are preferred: once a writer is
+ * waiting, new readers queue up behind it, so a steady stream of read-only
+ * queries can not starve the builder.
+ *
+ * The interface follows std::shared_mutex (which requires C++17) so that
+ * std::lock_guard and std::unique_lock work for the exclusive side, and the
+ * implementation can be swapped for the standard one when the project moves
+ * to a newer standard. Use SharedLockGuard for the shared side.
+ */
+class SharedMutex {
+ public:
+  SharedMutex() : numReaders_(0), numWritersWaiting_(0), writing_(false) {}
+
+  /* Exclusive (writer) side. */
+
+  void lock() {
+    std::unique_lock<std::mutex> g(mutex_);
+    ++numWritersWaiting_;
+    writerCond_.wait(g, [this]() { return !writing_ && numReaders_ == 0; });
+    --numWritersWaiting_;
+    writing_ = true;
+  }
+
+  bool try_lock() {
+    std::lock_guard<std::mutex> g(mutex_);
+    if (writing_ || numReaders_ > 0) {
+      return false;
+    }
+    writing_ = true;
+    return true;
+  }
+
+  void unlock() {
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      assert(writing_);
+      writing_ = false;
+    }
+    /* Wake a waiting writer first; the readers only get a chance when no
+     * writer is waiting (see lock_shared). */
+    writerCond_.notify_one();
+    readerCond_.notify_all();
+  }
+
+  /* Shared (reader) side. */
+
+  void lock_shared() {
+    std::unique_lock<std::mutex> g(mutex_);
+    readerCond_.wait(g, [this]() {
+      return !writing_ && numWritersWaiting_ == 0;
+    });
+    ++numReaders_;
+  }
+
+  void unlock_shared() {
+    bool lastReader;
+    {
+      std::lock_guard<std::mutex> g(mutex_);
+      assert(numReaders_ > 0);
+      lastReader = (--numReaders_ == 0);
+    }
+    if (lastReader) {
+      writerCond_.notify_one();
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable readerCond_;
+  std::condition_variable writerCond_;
+
+  std::size_t numReaders_;
+  std::size_t numWritersWaiting_;
+  bool writing_;
+
+  SharedMutex(const SharedMutex& other) = delete;
+  SharedMutex& operator=(const SharedMutex&) = delete;
+};
+
+/**
+ * @class SharedLockGuard
+ * @brief Scoped shared (reader) lock, the lock_guard of the shared side.
+ */
+class SharedLockGuard {
+ public:
+  explicit SharedLockGuard(SharedMutex& mutex) : mutex_(mutex) {
+    mutex_.lock_shared();
+  }
+
+  ~SharedLockGuard() { mutex_.unlock_shared(); }
+
+ private:
+  SharedMutex& mutex_;
+
+  SharedLockGuard(const SharedLockGuard& other) = delete;
+  SharedLockGuard& operator=(const SharedLockGuard&) = delete;
+};
+
+} // namespace falcon
+
+#endif // FALCON_UTIL_SHARED_MUTEX_H_
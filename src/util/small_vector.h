@@ -0,0 +1,133 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef SMALL_VECTOR_H_
+# define SMALL_VECTOR_H_
+
+# include <cassert>
+# include <cstddef>
+# include <cstring>
+# include <type_traits>
+
+namespace falcon {
+
+/**
+ * @class SmallVector
+ * @brief Vector with inline storage for its first N elements.
+ *
+ * A std::vector always puts its elements behind a heap pointer, so reading a
+ * one-element vector costs an extra cache miss and creating it costs an
+ * allocation. For the graph adjacency lists this is the common case: the
+ * median node is an input of one or two rules. SmallVector stores up to N
+ * elements inside the object itself and only falls back to the heap beyond
+ * that, so walking the graph follows one pointer less per node and parse
+ * time allocations drop by one per node.
+ *
+ * Restricted to trivially copyable element types (the graph stores raw
+ * pointers): elements are moved around with memcpy and never destroyed
+ * individually.
+ */
+template <typename T, std::size_t N>
+class SmallVector {
+  static_assert(std::is_trivial<T>::value,
+                "SmallVector only supports trivial element types");
+
+ public:
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  SmallVector() : data_(inline_), size_(0), capacity_(N) {}
+
+  SmallVector(const SmallVector& other)
+    : data_(inline_), size_(0), capacity_(N) {
+    assign(other);
+  }
+
+  SmallVector& operator=(const SmallVector& other) {
+    if (this != &other) {
+      size_ = 0;
+      assign(other);
+    }
+    return *this;
+  }
+
+  ~SmallVector() {
+    if (data_ != inline_) {
+      delete[] data_;
+    }
+  }
+
+  bool empty() const { return size_ == 0; }
+  std::size_t size() const { return size_; }
+
+  iterator begin() { return data_; }
+  iterator end() { return data_ + size_; }
+  const_iterator begin() const { return data_; }
+  const_iterator end() const { return data_ + size_; }
+  const_iterator cbegin() const { return data_; }
+  const_iterator cend() const { return data_ + size_; }
+
+  T& operator[](std::size_t i) { assert(i < size_); return data_[i]; }
+  const T& operator[](std::size_t i) const {
+    assert(i < size_);
+    return data_[i];
+  }
+
+  T& front() { assert(size_ > 0); return data_[0]; }
+  T& back() { assert(size_ > 0); return data_[size_ - 1]; }
+
+  void push_back(const T& value) {
+    if (size_ == capacity_) {
+      grow(capacity_ * 2);
+    }
+    data_[size_++] = value;
+  }
+
+  void pop_back() {
+    assert(size_ > 0);
+    size_--;
+  }
+
+  iterator erase(iterator pos) {
+    assert(pos >= begin() && pos < end());
+    memmove(pos, pos + 1, (end() - pos - 1) * sizeof(T));
+    size_--;
+    return pos;
+  }
+
+  void clear() { size_ = 0; }
+
+  void reserve(std::size_t capacity) {
+    if (capacity > capacity_) {
+      grow(capacity);
+    }
+  }
+
+ private:
+  void grow(std::size_t capacity) {
+    T* data = new T[capacity];
+    memcpy(data, data_, size_ * sizeof(T));
+    if (data_ != inline_) {
+      delete[] data_;
+    }
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void assign(const SmallVector& other) {
+    reserve(other.size_);
+    memcpy(data_, other.data_, other.size_ * sizeof(T));
+    size_ = other.size_;
+  }
+
+  T inline_[N];
+  T* data_;
+  std::size_t size_;
+  std::size_t capacity_;
+};
+
+} // namespace falcon
+
+#endif /* !SMALL_VECTOR_H_ */
@@ -0,0 +1,51 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#include "util/system_resources.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <sys/sysinfo.h>
+
+namespace falcon {
+namespace system {
+
+double loadAverage() {
+  double load[1];
+  if (getloadavg(load, 1) != 1) {
+    return -1.0;
+  }
+  return load[0];
+}
+
+std::size_t availableMemoryMb() {
+  /* MemAvailable is the kernel's own estimate of how much memory can be
+   * claimed without swapping; prefer it when present (linux >= 3.14). */
+  std::ifstream meminfo("/proc/meminfo");
+  std::string line;
+  while (std::getline(meminfo, line)) {
+    if (line.compare(0, 13, "MemAvailable:") == 0) {
+      std::istringstream iss(line.substr(13));
+      std::size_t kb = 0;
+      iss >> kb;
+      return kb / 1024;
+    }
+  }
+
+  /* Fallback: free memory plus buffers, which underestimates by the page
+   * cache but errs on the safe side. */
+  struct sysinfo info;
+  if (sysinfo(&info) != 0) {
+    return 0;
+  }
+  std::size_t bytes = (info.freeram + info.bufferram) * info.mem_unit;
+  return bytes / (1024 * 1024);
+}
+
+} // namespace system
+} // namespace falcon
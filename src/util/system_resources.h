@@ -0,0 +1,30 @@
+/**
+ * Copyright : falcon build system (c) 2014.
+ * LICENSE : see accompanying LICENSE file for details.
+ */
+
+#ifndef FALCON_UTIL_SYSTEM_RESOURCES_H_
+# define FALCON_UTIL_SYSTEM_RESOURCES_H_
+
+# include <cstddef>
+
+namespace falcon {
+namespace system {
+
+/**
+ * 1-minute load average of the machine.
+ * @return the load average, or a negative value if it cannot be sampled.
+ */
+double loadAverage();
+
+/**
+ * Memory available for starting new processes without swapping, in MiB
+ * (MemAvailable from /proc/meminfo, with a free+buffers+cached fallback).
+ * @return the available memory, or 0 if it cannot be sampled.
+ */
+std::size_t availableMemoryMb();
+
+} // namespace system
+} // namespace falcon
+
+#endif // FALCON_UTIL_SYSTEM_RESOURCES_H_
@@ -12,6 +12,7 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <fstream>
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -44,19 +45,11 @@ WatchmanClient::WatchmanClient(std::string const& workingDirectory)
 }
 
 WatchmanClient::~WatchmanClient() {
+  /* Leave watchman running: it keeps recording file changes while no daemon
+   * is attached, which is what makes the incremental rescan on the next
+   * startup possible (see queryChangedSince). The next daemon reuses the
+   * instance through the socket in the working directory. */
   if (watchmanSocket_ >= 0) {
-    char const shutdown[] = "[ \"shutdown-server\" ]\n";
-
-    /* write the shutdown request to watchman */
-    int r = write(watchmanSocket_, shutdown, sizeof(shutdown));
-    if (r != sizeof(shutdown)) {
-      LOG(WARNING) << "Watchman might not be properly shutdown";
-    }
-
-    /* flush the socket before closing */
-    char buff[128];
-    while(0 < read(watchmanSocket_, buff, sizeof(buff)));
-
     close(watchmanSocket_);
   }
 }
@@ -88,7 +81,9 @@ void WatchmanClient::startWatchmanInstance() {
      << " get-pid";
 
   BufferStreamConsumer consumer;
-  PosixSubProcess p(ss.str(), workingDirectory_, 0, &consumer);
+  /* The command quotes its arguments: let the shell tokenize it. */
+  PosixSubProcess p(ss.str(), std::vector<std::string>(),
+                    workingDirectory_, 0, &consumer);
   p.start();
   p.waitFinished();
   auto status = p.status();
@@ -126,30 +121,86 @@ void WatchmanClient::watchGraph(const Graph& g) {
     connectToWatchman();
   }
 
+  /* Register the triggers in pipelined batches: write a block of commands
+   * and only then drain the replies, instead of one write/read round trip
+   * per node. On a large graph the first startup is otherwise dominated by
+   * socket round trips rather than by watchman's own crawl. */
   auto nodeMap = g.getNodes();
-  for (auto it = nodeMap.cbegin(); it != nodeMap.cend(); it++) {
-    assert(it->second);
-    watchNode(*it->second);
+  auto it = nodeMap.cbegin();
+  while (it != nodeMap.cend()) {
+    std::string block;
+    std::size_t n = 0;
+    for (; it != nodeMap.cend() && n < kWatchBatchSize; ++it, ++n) {
+      assert(it->second);
+      block += makeWatchNodeCmd(*it->second);
+    }
+    try {
+      writeCommand(block);
+      readAnswers(n);
+    } catch (Exception& e) {
+      /* We may have lost the connection. Registering a trigger is
+       * idempotent: reconnect and replay the whole block. */
+      connectToWatchman();
+      writeCommand(block);
+      readAnswers(n);
+    }
   }
 }
 
-void WatchmanClient::unwatchGraph(const Graph& g) {
+void WatchmanClient::watchNodes(const NodeArray& nodes) {
   if (!isConnected_) {
     connectToWatchman();
   }
 
-  auto nodeMap = g.getNodes();
-  for (auto it = nodeMap.cbegin(); it != nodeMap.cend(); it++) {
-    assert(it->second);
-    unwatchNode(*it->second);
+  /* Same pipelining as watchGraph. */
+  auto it = nodes.cbegin();
+  while (it != nodes.cend()) {
+    std::string block;
+    std::size_t n = 0;
+    for (; it != nodes.cend() && n < kWatchBatchSize; ++it, ++n) {
+      assert(*it);
+      block += makeWatchNodeCmd(**it);
+    }
+    try {
+      writeCommand(block);
+      readAnswers(n);
+    } catch (Exception& e) {
+      /* Registering a trigger is idempotent: reconnect and replay the
+       * whole block. */
+      connectToWatchman();
+      writeCommand(block);
+      readAnswers(n);
+    }
   }
 }
 
-void WatchmanClient::watchNode(const Node& n) {
+void WatchmanClient::unwatchGraph(const Graph& g) {
   if (!isConnected_) {
     connectToWatchman();
   }
 
+  /* Same batching as watchGraph. */
+  auto nodeMap = g.getNodes();
+  auto it = nodeMap.cbegin();
+  while (it != nodeMap.cend()) {
+    std::string block;
+    std::size_t n = 0;
+    for (; it != nodeMap.cend() && n < kWatchBatchSize; ++it, ++n) {
+      assert(it->second);
+      block += makeUnwatchNodeCmd(*it->second);
+    }
+    try {
+      writeCommand(block);
+      readAnswers(n);
+    } catch (Exception& e) {
+      connectToWatchman();
+      writeCommand(block);
+      readAnswers(n);
+    }
+  }
+}
+
+std::string WatchmanClient::makeWatchNodeCmd(const Node& n) const {
   std::string targetPattern(n.getPath());
   std::string targetDirectory = workingDirectory_;
 
@@ -175,8 +226,32 @@ void WatchmanClient::watchNode(const Node& n) {
   ss << "    \"falcon\", \"--set-dirty\", \"" << n.getPath() << "\"";
   ss << "]}]\n";
 
+  return ss.str();
+}
+
+std::string WatchmanClient::makeUnwatchNodeCmd(const Node& n) const {
+  std::string targetPattern(n.getPath());
+  std::string targetDirectory = workingDirectory_;
+
+  /* Clean the target Pattern and the target directory */
+  updateTargetPath(targetDirectory, targetPattern);
+
+  std::stringstream ss;
+  ss << "[ ";
+  ss << "\"trigger-del\", \"" << targetDirectory << "\", ";
+  ss << "\"" << n.getPath() << "\" ";
+  ss <<"]\n";
+
+  return ss.str();
+}
+
+void WatchmanClient::watchNode(const Node& n) {
+  if (!isConnected_) {
+    connectToWatchman();
+  }
+
   /* Send the command to watchman */
-  std::string cmd = ss.str();
+  std::string cmd = makeWatchNodeCmd(n);
   try {
     writeCommand(cmd);
     readAnswer();
@@ -188,24 +263,42 @@ void WatchmanClient::watchNode(const Node& n) {
   }
 }
 
-void WatchmanClient::unwatchNode(const Node& n) {
+void WatchmanClient::watchGitHead() {
   if (!isConnected_) {
     connectToWatchman();
   }
 
-  std::string targetPattern(n.getPath());
-  std::string targetDirectory = workingDirectory_;
-
-  /* Clean the target Pattern and the target directory */
-  updateTargetPath(targetDirectory, targetPattern);
+  /* See watchNode for the "since" expression. */
+  std::time_t time = std::time(NULL) - 1;
 
   std::stringstream ss;
   ss << "[ ";
-  ss << "\"trigger-del\", \"" << targetDirectory << "\", ";
-  ss << "\"" << n.getPath() << "\" ";
-  ss <<"]\n";
+  ss << "\"trigger\", \"" << workingDirectory_ << "/.git\", { ";
+  ss << "\"name\": \"falcon-git-head\", ";
+  ss << "\"expression\": ";
+  ss << "   [\"allof\", ";
+  ss << "       [\"name\", \"HEAD\", \"wholename\"], ";
+  ss << "       [\"since\", " << time << ", \"mtime\"]], ";
+  ss << "\"command\": [";
+  ss << "    \"falcon\", \"--prefetch\"";
+  ss << "]}]\n";
+
+  std::string cmd = ss.str();
+  try {
+    writeCommand(cmd);
+    readAnswer();
+  } catch (Exception& e) {
+    /* We may have lost the connection, reconnect and try again. */
+    connectToWatchman();
+    writeCommand(cmd);
+    readAnswer();
+  }
+}
+
+void WatchmanClient::watchRoot() {
+  std::stringstream ss;
+  ss << "[ \"watch\", \"" << workingDirectory_ << "\" ]\n";
 
-  /* Send the command to watchman */
   std::string cmd = ss.str();
   try {
     writeCommand(cmd);
@@ -218,6 +311,111 @@ void WatchmanClient::unwatchNode(const Node& n) {
   }
 }
 
+bool WatchmanClient::queryChangedSince(std::set<std::string>* changed) {
+  /* The clock persisted when the previous snapshot was taken. */
+  std::string sinceClock;
+  {
+    std::ifstream ifs(statePath_);
+    if (ifs.is_open()) {
+      std::getline(ifs, sinceClock);
+    }
+  }
+
+  try {
+    if (!isConnected_) {
+      connectToWatchman();
+    }
+    watchRoot();
+
+    /* Persist the clock of this very moment before asking anything: it pairs
+     * with the scan the caller is about to run, and stays on disk even if
+     * the daemon later dies without a clean shutdown. */
+    saveClock();
+
+    if (sinceClock.empty()) {
+      return false;
+    }
+
+    std::stringstream ss;
+    ss << "[ \"query\", \"" << workingDirectory_ << "\", { ";
+    ss << "\"since\": \"" << sinceClock << "\", ";
+    ss << "\"fields\": [\"name\"] ";
+    ss << "} ]\n";
+    writeCommand(ss.str());
+
+    JsonParser parser;
+    JsonVal const* dom = readResponse(parser);
+
+    /* The clock is only meaningful to the watchman instance that issued it.
+     * If watchman was restarted in between, it flags the query as coming
+     * from a fresh instance and the file list covers the whole tree: fall
+     * back to the full scan. */
+    JsonVal const* fresh = dom->getObject("is_fresh_instance");
+    if (fresh && fresh->_type == JSON_TRUE) {
+      return false;
+    }
+
+    JsonVal const* files = dom->getObject("files");
+    if (!files) {
+      return false;
+    }
+    for (auto it = files->_array.cbegin(); it != files->_array.cend(); ++it) {
+      changed->insert((*it)->_data);
+    }
+  } catch (Exception& e) {
+    LOG(WARNING) << "incremental rescan unavailable: "
+                 << e.getErrorMessage();
+    return false;
+  }
+
+  DLOG(INFO) << changed->size() << " files changed since " << sinceClock;
+  return true;
+}
+
+void WatchmanClient::saveClock() {
+  try {
+    if (!isConnected_) {
+      connectToWatchman();
+    }
+    watchRoot();
+
+    std::stringstream ss;
+    ss << "[ \"clock\", \"" << workingDirectory_ << "\" ]\n";
+    writeCommand(ss.str());
+
+    JsonParser parser;
+    JsonVal const* dom = readResponse(parser);
+    JsonVal const* clock = dom->getObject("clock");
+    if (!clock || clock->_data.empty()) {
+      THROW_ERROR(EINVAL, "watchman returned no clock");
+    }
+
+    std::ofstream ofs(statePath_, std::ios::trunc);
+    ofs << clock->_data << std::endl;
+  } catch (Exception& e) {
+    LOG(WARNING) << "could not persist the watchman clock: "
+                 << e.getErrorMessage();
+  }
+}
+
+void WatchmanClient::unwatchNode(const Node& n) {
+  if (!isConnected_) {
+    connectToWatchman();
+  }
+
+  /* Send the command to watchman */
+  std::string cmd = makeUnwatchNodeCmd(n);
+  try {
+    writeCommand(cmd);
+    readAnswer();
+  } catch (Exception& e) {
+    /* We may have lost the connection, reconnect and try again. */
+    connectToWatchman();
+    writeCommand(cmd);
+    readAnswer();
+  }
+}
+
 void WatchmanClient::writeCommand(std::string const& cmd) {
   int r = 0;
   for (unsigned int i = 0; i != cmd.size(); i += r) {
@@ -237,9 +435,53 @@ void WatchmanClient::writeCommand(std::string const& cmd) {
 
 void WatchmanClient::readAnswer() {
   JsonParser parser;
+  readResponse(parser);
+}
+
+void WatchmanClient::readAnswers(std::size_t count) {
+  /* Watchman answers pipelined commands in order, one JSON document per
+   * line: buffer the socket and hand complete lines to their own parser. */
+  std::string pending;
+  char buf[4096];
+  std::size_t parsed = 0;
+
+  while (parsed < count) {
+    ssize_t r = read(watchmanSocket_, buf, sizeof(buf));
+    if (r <= 0) {
+      if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      }
+      close(watchmanSocket_);
+      isConnected_ = false;
+      THROW_ERROR(errno, "unable to read watchman command response");
+    }
+    pending.append(buf, r);
+
+    std::string::size_type pos;
+    while (parsed < count
+        && (pos = pending.find('\n')) != std::string::npos) {
+      JsonParser parser;
+      parser.parse(0, pending.c_str(),
+                   static_cast<unsigned int>(pos + 1));
+      pending.erase(0, pos + 1);
+
+      JsonVal* dom = parser.getDom();
+      if (!dom) {
+        THROW_ERROR(EINVAL, "Error parsing watchman command response");
+      }
+      JsonVal const* error = dom->getObject("error");
+      if (error) {
+        THROW_ERROR(EINVAL, error->_data.c_str());
+      }
+      parsed++;
+    }
+  }
+}
+
+JsonVal const* WatchmanClient::readResponse(JsonParser& parser) {
   JsonVal* dom;
-#define MAX_JSON_STRING_SIZE 1024
-#define MAX_BUF_SIZE         256
+#define MAX_JSON_STRING_SIZE 1048576
+#define MAX_BUF_SIZE         4096
   char buf[MAX_BUF_SIZE];
   int loop = 0; /* a loop counter to avoid reading garbage indefinitely */
 
@@ -250,7 +492,6 @@ void WatchmanClient::readAnswer() {
       close(watchmanSocket_);
       isConnected_ = false;
       THROW_ERROR(errno, "unable to read watchman command response");
-      return;
     }
     parser.parse(0, buf, r);
     dom = parser.getDom();
@@ -264,6 +505,8 @@ void WatchmanClient::readAnswer() {
   if (error) {
     THROW_ERROR(EINVAL, error->_data.c_str());
   }
+
+  return dom;
 }
 
 void WatchmanClient::updateTargetPath(std::string& targetDirectory,
@@ -6,10 +6,16 @@
 #ifndef FALCON_WATCHMAN_H_
 # define FALCON_WATCHMAN_H_
 
+# include <set>
+
+# include "file_watcher.h"
 # include "graph.h"
 
 namespace falcon {
 
+class JsonParser;
+class JsonVal;
+
 /* Watchman Client:
  *
  * Start a watchman dedicated to the working directory.
@@ -27,7 +33,7 @@ namespace falcon {
  * set dirty option)
  */
 
-class WatchmanClient {
+class WatchmanClient : public FileWatcher {
 public:
   WatchmanClient(std::string const& workingDirectory);
   ~WatchmanClient();
@@ -40,6 +46,17 @@ public:
    * @param n node to be watched. */
   void watchNode(const Node& n);
 
+  /** Watch a batch of nodes with pipelined commands, one write and one
+   * drain of the replies per block instead of a round trip per node. Used
+   * when a depfile brings in a batch of new dependencies.
+   * @param nodes nodes to be watched. */
+  void watchNodes(const NodeArray& nodes);
+
+  /** Watch .git/HEAD so the daemon hears about ref switches while idle and
+   * can warm the cache up before the next build is requested. The trigger
+   * runs "falcon --prefetch", see DaemonInstance::prefetchCache. */
+  void watchGitHead();
+
   /** UnWatch all the leaves of the given graph.
    * @param g Graph to be unwatched. */
   void unwatchGraph(const Graph& g);
@@ -48,6 +65,21 @@ public:
    * @param n node to be unwatched */
   void unwatchNode(const Node& n);
 
+  /** Query the files that changed under the working directory since the
+   * clock persisted in the state file, and persist the current clock for
+   * the next startup. The changed paths are relative to the working
+   * directory.
+   * @return false when the query cannot be answered (first run, watchman
+   * restarted since the clock was taken, watchman unavailable): the caller
+   * must then rescan everything. */
+  bool queryChangedSince(std::set<std::string>* changed);
+
+  /** Persist the current watchman clock to the state file. Called whenever
+   * the graph snapshot is saved, so that the snapshot and the clock describe
+   * the same instant. A stale clock is harmless: the next query only returns
+   * a superset of the files that changed. */
+  void saveClock();
+
   static void updateTargetPath(std::string& dir, std::string& file);
 
 private:
@@ -60,8 +92,30 @@ private:
   /* Try to open the UNIX socket to watchman */
   void openWatchmanSocket();
 
+  /* Ask watchman to watch the working directory itself. Triggers establish
+   * their own watches; the clock and since queries need this one. */
+  void watchRoot();
+
+  /* Build the trigger (de)registration command for a node, as sent by
+   * watchNode/unwatchNode. */
+  std::string makeWatchNodeCmd(const Node& n) const;
+  std::string makeUnwatchNodeCmd(const Node& n) const;
+
+  /* Read and check the given number of pipelined responses. Watchman
+   * replies in order, one JSON document per line. Throws on the first
+   * error. */
+  void readAnswers(std::size_t count);
+
+  /** How many commands are pipelined before draining their responses, see
+   * watchGraph. */
+  static const std::size_t kWatchBatchSize = 256;
+
   void writeCommand(std::string const& cmd);
   void readAnswer();
+  /* Read one response into the given parser and return its dom, which stays
+   * owned by the parser. Throws on a malformed response or a watchman
+   * error. */
+  JsonVal const* readResponse(JsonParser& parser);
 
   std::string workingDirectory_;
 
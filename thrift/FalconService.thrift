@@ -6,15 +6,100 @@ enum FalconStatus {
 enum StartBuildResult {
   OK,         /* The build was properly started. */
   ERROR,      /* Cannot start the build because of an error. */
-  BUSY        /* A build is already ongoing. */
+  BUSY,       /* No longer returned: a busy daemon queues the request. */
+  QUEUED      /* A build is ongoing; the request was queued behind it. */
 }
 
 exception InvalidBuildError {
   1:string desc;
 }
 
+/* A rule to be executed on behalf of a peer daemon, see executeRule. */
+struct RemoteRuleRequest {
+  1:string cmd;
+  2:list<string> outputs;
+  3:string depfile;
+}
+
+struct RemoteRuleResult {
+  1:i32 exitCode;
+  /* Content of each output file, keyed by path. Only set on success. */
+  2:map<string, binary> outputFiles;
+  /* Content of the depfile, if the rule has one. */
+  3:binary depfileContent;
+  /* Tail of the combined stdout/stderr of the command, so a remote failure
+   * can be diagnosed from the requesting daemon. */
+  4:binary output;
+}
+
 exception TargetNotFound {}
 
+exception NoCompletedBuildError {}
+
+/* Timing of one rule of a build, identified by its first output. */
+struct RuleTiming {
+  1:string output;
+  /* Time between the rule becoming ready and its command starting. */
+  2:i64 queueWaitMs;
+  /* Time between the command starting and completing. Near zero for a cache
+   * hit. */
+  3:i64 executionMs;
+  /* Set if the outputs were restored from the cache instead of built. */
+  4:bool cacheHit;
+}
+
+/* Where the time of a build went, see getBuildProfile. */
+struct BuildProfile {
+  1:i32 buildId;
+  2:i64 totalTimeMs;
+  /* The chain of rules that determined the wall-clock time of the build,
+   * measured, in execution order. */
+  3:list<RuleTiming> criticalPath;
+  /* The slowest rules of the build, by decreasing execution time. */
+  4:list<RuleTiming> slowestRules;
+}
+
+/* State of one node, see getNodesInfo. */
+struct NodeInfo {
+  1:string path;
+  /* False if the daemon has no node for the requested path; the other
+   * fields are then unset. */
+  2:bool found;
+  3:bool dirty;
+  4:string hash;
+  /* Nanoseconds since the epoch. */
+  5:i64 timestamp;
+}
+
+enum GraphExportFormat {
+  GRAPHVIZ,  /* dot text, same syntax as getGraphviz. */
+  EDGE_LIST  /* Compact binary node table and edge list: the magic "FGE1",
+              * then per node 'N', u32 path id, u16 path length and the path,
+              * and per rule 'R', u32 input count, u32 output count and the
+              * input then output path ids. Integers are big-endian. */
+}
+
+/* One chunk of a streamed graph export, see getGraphExport. */
+struct GraphExportChunk {
+  1:binary data;
+  /* Cursor to pass to the next call. Only meaningful while the graph is
+   * unchanged; restart from 0 after a reload. */
+  2:i64 nextCursor;
+  /* Set on the chunk that ends the export. */
+  3:bool eof;
+}
+
+/* One chunk of a cache entry, see getCacheEntry. */
+struct CacheEntryChunk {
+  /* False if the daemon has no entry for the requested hash. */
+  1:bool found;
+  2:binary data;
+  /* Set on the chunk that ends the entry. */
+  3:bool eof;
+  /* Whether the entry is stored, and thus transferred, zstd-compressed. */
+  4:bool compressed;
+}
+
 service FalconService {
   /* Get the pid of the Falcon daemon. */
   i64 getPid()
@@ -45,12 +130,62 @@ service FalconService {
   /* Get the hash of a target. */
   string getHashOf(1:string target) throws(1:TargetNotFound e)
 
+  /* Bulk query of per-node state: one NodeInfo per requested path, in
+   * request order, for the price of a single round trip and one lock
+   * acquisition. Unknown paths come back with found = false instead of an
+   * exception, so one bad path does not fail the batch. */
+  list<NodeInfo> getNodesInfo(1:list<string> paths)
+
   /* Mark the given target as dirty. */
   void setDirty(1:string target) throws(1:TargetNotFound e)
 
+  /* Sharded builds: a peer daemon owning another partition of the graph
+   * (see the partition module) rebuilt these nodes. Paths that are inputs
+   * of this shard are marked dirty like a file-watcher notification; the
+   * rest are silently ignored, so a producer can broadcast its outputs to
+   * every peer without knowing who consumes what. */
+  void notifyNodesBuilt(1:set<string> paths)
+
   /* Stop the daemon. Will interrupt the current build, if any. */
   void shutdown()
 
-  /* Return a graphviz representation of the graph. */
+  /* Return a graphviz representation of the graph. Deprecated: materializes
+   * the whole text in daemon and client memory; use getGraphExport. */
   string getGraphviz()
+
+  /* Walk the graph incrementally and return the next chunk of its export,
+   * of roughly maxBytes bytes, starting at cursor (0 on the first call).
+   * Neither side ever holds more than one chunk in memory, so arbitrarily
+   * large graphs export in bounded space. */
+  GraphExportChunk getGraphExport(1:GraphExportFormat format, 2:i64 cursor,
+                                  3:i32 maxBytes)
+
+  /* Execute a rule on behalf of a peer daemon holding the same graph: run
+   * the command against the local tree and return the produced outputs. */
+  RemoteRuleResult executeRule(1:RemoteRuleRequest request)
+
+  /* Notify the daemon that the git ref changed (triggered by a watch on
+   * .git/HEAD). If the daemon is idle, it restores the cached targets of
+   * the new ref in the background so the next build starts warm. */
+  void prefetchCache()
+
+  /* Probe the local cache for a batch of entry hashes, for use as a remote
+   * cache tier by a peer daemon. Returns one flag per hash, in order. */
+  list<bool> hasCacheEntries(1:list<string> hashes)
+
+  /* Read up to maxBytes of a local cache entry starting at offset, in its
+   * stored (possibly compressed) form. The caller iterates until eof. */
+  CacheEntryChunk getCacheEntry(1:string hash, 2:i64 offset, 3:i32 maxBytes)
+
+  /* Return the hot-path counters of the daemon (cache hits/misses, hashing
+   * work, spawn counts, build times...) keyed by stable dotted names, eg
+   * "cache.hits". Counters are monotonic since daemon startup, for metrics
+   * scrapers to derive rates from. */
+  map<string, i64> getStats()
+
+  /* Return the profile of the last completed build: realized critical path
+   * and the numSlowRules slowest rules, with queue wait, execution time and
+   * cache hit/miss for each. */
+  BuildProfile getBuildProfile(1:i32 numSlowRules)
+                               throws(1:NoCompletedBuildError e)
 }